@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# Runs every program in bench/ (or the ones given as arguments) and reports
+# wall time plus the VM's own instruction statistics.
+
+STRELA=${STRELA:-Release/strela}
+TIMEFORMAT="%R s"
+
+if [ $# -gt 0 ]; then
+    FILES="$@"
+else
+    FILES=`find bench/ -type f -name '*.strela' | sort`
+fi
+
+for fn in $FILES; do
+    echo ">>> $fn"
+    time ($STRELA --search ./ --stats $STRELA_FLAGS $fn >/dev/null)
+done
@@ -49,6 +49,7 @@ namespace Strela {
         Parser parser(*source, firstToken);
         auto cls = parser.parseClassDecl(parent);
         cls->genericBase = this;
+        cls->isExternal = isExternal;
         // set type arguments
         cls->genericArguments = typeArgs;
         cls->_name += "<";
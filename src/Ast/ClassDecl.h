@@ -28,6 +28,8 @@ namespace Strela {
     public:
         bool isResolved = false;
         bool isExported = false;
+        /** Mirrors a C struct, the compiler keeps its fields in declaration order instead of packing them. */
+        bool isExternal = false;
         std::vector<GenericParam*> genericParams;
         std::vector<TypeDecl*> genericArguments;
         std::vector<FuncDecl*> methods;
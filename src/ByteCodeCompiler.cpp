@@ -10,6 +10,7 @@
 #include "SourceFile.h"
 #include "Ast/PointerType.h"
 
+#include <algorithm>
 #include <sstream>
 #include <cstring>
 
@@ -20,6 +21,37 @@ namespace Strela {
         return offset + alignment - (offset % alignment);
     }
 
+    namespace {
+        /** The form of a field access that takes the object from a frame slot, op itself if there is none. */
+        Opcode varForm(Opcode op) {
+            switch (op) {
+                case Opcode::Ptr64: return Opcode::Ptr64Var;
+                case Opcode::ObjPtr64: return Opcode::ObjPtr64Var;
+                case Opcode::F64Ptr64: return Opcode::F64Ptr64Var;
+                case Opcode::ObjPtrC: return Opcode::ObjPtrCVar;
+                case Opcode::StorePtr64: return Opcode::StorePtr64Var;
+                case Opcode::StorePtrC: return Opcode::StorePtrCVar;
+                default: return op;
+            }
+        }
+    }
+
+    Comparand comparand(BinopExpr& n) {
+        auto ltype = n.left->type;
+        auto rtype = n.right->type;
+        if (auto alias = ltype->as<TypeAliasDecl>()) ltype = alias->typeExpr->typeValue;
+        if (auto alias = rtype->as<TypeAliasDecl>()) rtype = alias->typeExpr->typeValue;
+
+        if ((ltype->as<IntType>() || ltype->as<EnumDecl>()) && (rtype->as<IntType>() || rtype->as<EnumDecl>())) return Comparand::Int;
+        if (ltype != rtype) return Comparand::Generic;
+        if (ltype == &FloatType::f32) return Comparand::F32;
+        if (ltype == &FloatType::f64) return Comparand::F64;
+        if (ltype == &BoolType::instance) return Comparand::Bool;
+        // identity only where both sides are plain references, unions may hold boxed integers
+        if ((ltype->as<ClassDecl>() && rtype->as<ClassDecl>()) || (ltype->as<ArrayType>() && rtype->as<ArrayType>())) return Comparand::Ref;
+        return Comparand::Generic;
+    }
+
     VMType* ByteCodeCompiler::mapType(TypeDecl* type) {
         if (auto alias = type->as<TypeAliasDecl>()) {
             type = alias->typeExpr->typeValue;
@@ -38,11 +70,13 @@ namespace Strela {
         vmtype->isObject = (type->as<ClassDecl>() || type->as<InterfaceDecl>() || type->as<UnionType>());
         vmtype->isArray = type->as<ArrayType>();
         vmtype->isEnum = type->as<EnumDecl>();
+        vmtype->isF64 = type == &FloatType::f64;
+        size_t refSize = chunk.compressedReferences ? 4 : 8;
 
         if (vmtype->isArray) {
             vmtype->objectAlignment = 8;
-            vmtype->size = 8;
-            vmtype->alignment = 8;
+            vmtype->size = refSize;
+            vmtype->alignment = refSize;
             vmtype->arrayType = mapType(type->as<ArrayType>()->baseType);
             vmtype->fields.push_back({
                 "length",
@@ -52,32 +86,62 @@ namespace Strela {
         }
         else if (vmtype->isObject) {
             if (auto cls = type->as<ClassDecl>()) {
-                vmtype->size = 8;
-                vmtype->alignment = 8;;
-                size_t offset = 0;
+                vmtype->size = refSize;
+                vmtype->alignment = refSize;
+                std::vector<VMType*> ftypes;
                 size_t alignment = 1;
                 for (auto&& field: cls->fields) {
                     auto ftype = mapType(field->declType);
                     if (ftype->alignment > alignment) alignment = ftype->alignment;
-                    offset = align(offset, ftype->alignment);
-                    vmtype->fields.push_back({
-                        field->name,
-                        ftype,
-                        offset
-                    });
-                    if (ftype->isArray || ftype->isObject) {
-                        offset += 8;
-                    }
-                    else {
-                        offset += ftype->size;
+                    ftypes.push_back(ftype);
+                }
+
+                // places the fields in the given order, returns the object size
+                std::vector<size_t> offsets(ftypes.size());
+                auto place = [&](const std::vector<size_t>& order) -> size_t {
+                    size_t offset = 0;
+                    for (auto i: order) {
+                        offset = align(offset, ftypes[i]->alignment);
+                        offsets[i] = offset;
+                        if (ftypes[i]->isArray || ftypes[i]->isObject) {
+                            offset += refSize;
+                        }
+                        else {
+                            offset += ftypes[i]->size;
+                        }
                     }
+                    return align(offset, alignment);
+                };
+
+                std::vector<size_t> order(ftypes.size());
+                for (size_t i = 0; i < order.size(); ++i) {
+                    order[i] = i;
+                }
+                auto declaredSize = place(order);
+                if (!cls->isExternal) {
+                    // sizes are multiples of alignments, so largest alignment first leaves no padding between fields.
+                    // references come first among fields of their alignment, the GC finds them next to each other
+                    std::stable_sort(order.begin(), order.end(), [&ftypes](size_t a, size_t b) {
+                        if (ftypes[a]->alignment != ftypes[b]->alignment) {
+                            return ftypes[a]->alignment > ftypes[b]->alignment;
+                        }
+                        return ftypes[a]->isReference() && !ftypes[b]->isReference();
+                    });
                 }
-                vmtype->objectSize = align(offset, alignment);
+                vmtype->objectSize = place(order);
                 vmtype->objectAlignment = alignment;
+                for (size_t i = 0; i < ftypes.size(); ++i) {
+                    vmtype->fields.push_back({
+                        cls->fields[i]->name,
+                        ftypes[i],
+                        offsets[i]
+                    });
+                }
+                chunk.classLayouts[vmtype] = { declaredSize, cls->isExternal };
             }
             else if (auto iface = type->as<InterfaceDecl>()) {
-                vmtype->size = 8;
-                vmtype->alignment = 8;
+                vmtype->size = refSize;
+                vmtype->alignment = refSize;
                 vmtype->objectSize = 8 + (iface->methods.size() + iface->fields.size())* 8;
                 vmtype->objectAlignment = 8;
                 vmtype->fields.push_back({"_ref", mapType(ClassDecl::String), 0});
@@ -89,8 +153,8 @@ namespace Strela {
                 }
             }
             else if (auto un = type->as<UnionType>()) {
-                vmtype->size = 8;
-                vmtype->alignment = 8;
+                vmtype->size = refSize;
+                vmtype->alignment = refSize;
                 vmtype->objectSize = 16;
                 vmtype->objectAlignment = 8;
                 vmtype->fields.push_back({"_tag", mapType(&IntType::u64), 0});
@@ -128,10 +192,60 @@ namespace Strela {
             vmtype->size = 1;
             vmtype->alignment = 1;
         }
-        
+
+        // types referenced here are flagged as objects or arrays already, even while they are still being mapped
+        vmtype->buildReferenceMap();
         return vmtype;
     }
 
+    Opcode ByteCodeCompiler::loadOp(const VMType* type) const {
+        if (type->isReference()) {
+            return chunk.compressedReferences ? Opcode::ObjPtrC : Opcode::ObjPtr64;
+        }
+        switch (type->size) {
+            case 1: return Opcode::Ptr8;
+            case 2: return Opcode::Ptr16;
+            case 4: return Opcode::Ptr32;
+            default: return type->isF64 ? Opcode::F64Ptr64 : Opcode::Ptr64;
+        }
+    }
+
+    Opcode ByteCodeCompiler::storeOp(const VMType* type) const {
+        if (type->isReference()) {
+            return chunk.compressedReferences ? Opcode::StorePtrC : Opcode::StorePtr64;
+        }
+        switch (type->size) {
+            case 1: return Opcode::StorePtr8;
+            case 2: return Opcode::StorePtr16;
+            case 4: return Opcode::StorePtr32;
+            default: return Opcode::StorePtr64;
+        }
+    }
+
+    Opcode ByteCodeCompiler::loadIndOp(const VMType* type) const {
+        if (type->isReference()) {
+            return chunk.compressedReferences ? Opcode::ObjPtrIndC : Opcode::ObjPtrInd64;
+        }
+        switch (type->size) {
+            case 1: return Opcode::PtrInd8;
+            case 2: return Opcode::PtrInd16;
+            case 4: return Opcode::PtrInd32;
+            default: return type->isF64 ? Opcode::F64PtrInd64 : Opcode::PtrInd64;
+        }
+    }
+
+    Opcode ByteCodeCompiler::storeIndOp(const VMType* type) const {
+        if (type->isReference()) {
+            return chunk.compressedReferences ? Opcode::StorePtrIndC : Opcode::StorePtrInd64;
+        }
+        switch (type->size) {
+            case 1: return Opcode::StorePtrInd8;
+            case 2: return Opcode::StorePtrInd16;
+            case 4: return Opcode::StorePtrInd32;
+            default: return Opcode::StorePtrInd64;
+        }
+    }
+
     ByteCodeCompiler::ByteCodeCompiler(ByteCodeChunk& chunk): chunk(chunk) {
     }
 
@@ -201,15 +315,13 @@ namespace Strela {
         _class = oldclass;
     }
 
-    FunctionInfo* fi;
-
     void ByteCodeCompiler::compile(FuncDecl& n) {
         if (n.source) chunk.setLine(n.source, n.line);
         auto oldfunc = function;
         function = &n;
 
         ClassDecl* cls = n.parent ? n.parent->as<ClassDecl>() : nullptr;
-        n.opcodeStart = chunk.opcodes.size();
+        n.opcodeStart = chunk.label();
         std::stringstream sstr;
         if (cls) {
             sstr << cls->getFullName() << ".";
@@ -217,8 +329,9 @@ namespace Strela {
         sstr << n.name << n.declType->getFullName();
 
         FunctionInfo funcInfo;
-        fi = &funcInfo;
+        functionInfo = &funcInfo;
         funcInfo.name = sstr.str();
+        funcInfo.arguments = n.params.size() + (cls ? 1 : 0);
 
         if (cls) {
             funcInfo.variables.push_back({ 0, "this", mapType(cls) });
@@ -228,9 +341,7 @@ namespace Strela {
             funcInfo.variables.push_back({ n.params[i]->index, n.params[i]->name, mapType(n.params[i]->declType) });
         }
 
-        if (n.numVariables > 0 ) {
-            chunk.addOp<uint8_t>(Opcode::Grow, n.numVariables);
-        }
+        enterFunction(n);
 
         for (auto& param: n.params) {
             compile(*param);
@@ -256,18 +367,92 @@ namespace Strela {
             chunk.addOp(Opcode::ReturnVoid);
         }
 
+        leaveFunction(n);
         chunk.addFunction(n.opcodeStart, funcInfo);
         function = oldfunc;
     }
 
+    void ByteCodeCompiler::enterFunction(FuncDecl& n) {
+        if (n.numVariables > 0 ) {
+            chunk.addOp<uint8_t>(Opcode::Grow, n.numVariables);
+        }
+    }
+
+    size_t ByteCodeCompiler::jump(Opcode op, int cond) {
+        switch (addrMode(op)) {
+            case AddrMode::Target: return chunk.addOp<uint32_t>(op, 0xffffffff);
+            case AddrMode::RegTarget: return chunk.addOp<uint8_t, uint32_t>(op, cond, 0xffffffff);
+            default: return chunk.addOp<int32_t>(op, 0);
+        }
+    }
+
+    void ByteCodeCompiler::land(size_t jumpAddress) {
+        auto target = chunk.label();
+        switch (addrMode(chunk.opcodes[jumpAddress])) {
+            case AddrMode::Target: {
+                uint32_t address = target;
+                chunk.write(jumpAddress + 1, &address, sizeof(address));
+                break;
+            }
+            case AddrMode::RegTarget: {
+                uint32_t address = target;
+                chunk.write(jumpAddress + 2, &address, sizeof(address));
+                break;
+            }
+            default: {
+                int32_t offset = target - jumpAddress;
+                chunk.write(jumpAddress + 1, &offset, sizeof(offset));
+                break;
+            }
+        }
+    }
+
+    void ByteCodeCompiler::land(const std::vector<size_t>& jumpAddresses) {
+        for (auto address: jumpAddresses) {
+            land(address);
+        }
+    }
+
+    void ByteCodeCompiler::branch(Expr& condition, bool jumpIf, std::vector<size_t>& jumps) {
+        if (auto binop = condition.as<BinopExpr>()) {
+            if (binop->op == TokenType::AmpAmp || binop->op == TokenType::PipePipe) {
+                // a && b can jump as soon as a is false, a || b as soon as a is true
+                if (jumpIf == (binop->op == TokenType::PipePipe)) {
+                    branch(*binop->left, jumpIf, jumps);
+                    branch(*binop->right, jumpIf, jumps);
+                }
+                else {
+                    std::vector<size_t> skip;
+                    branch(*binop->left, !jumpIf, skip);
+                    branch(*binop->right, jumpIf, jumps);
+                    land(skip);
+                }
+                return;
+            }
+        }
+        else if (auto unary = condition.as<UnaryExpr>()) {
+            if (unary->op == TokenType::ExclamationMark) {
+                branch(*unary->target, !jumpIf, jumps);
+                return;
+            }
+        }
+
+        condition.accept(*this);
+        jumps.push_back(jump(jumpIf ? Opcode::JmpIfRel : Opcode::JmpIfNotRel));
+    }
+
+    int ByteCodeCompiler::slotOf(VarDecl* var) const {
+        return function->params.size() + (_class ? 1 : 0) + var->index;
+    }
+
     void ByteCodeCompiler::visit(VarDecl& n) {
         if (n.source) chunk.setLine(n.source, n.line);
         mapType(n.declType);
         if (n.initializer) {
             n.initializer->accept(*this);
-            chunk.addOp<uint8_t>(Opcode::StoreVar, function->params.size() + (_class ? 1 : 0) + n.index);
+            chunk.addOp<uint8_t>(Opcode::StoreVar, slotOf(&n));
         }
-        fi->variables.push_back({ int(function->params.size() + (_class ? 1 : 0) + n.index), n.name, mapType(n.declType) });
+        functionInfo->variables.push_back({ slotOf(&n), n.name, mapType(n.declType) });
     }
 
     void ByteCodeCompiler::compile(FieldDecl& n) {
@@ -299,20 +484,14 @@ namespace Strela {
             chunk.addOp<uint8_t>(Opcode::Var, param->index);
         }
         else if (auto var = n.node->as<VarDecl>()) {
-            chunk.addOp<uint8_t>(Opcode::Var, function->params.size() + (_class ? 1 : 0) + var->index);
+            chunk.addOp<uint8_t>(Opcode::Var, slotOf(var));
         }
         else if (auto field = n.node->as<FieldDecl>()) {
             auto t = mapType(n.context->type);
             auto ft = mapType(field->declType);
-            Opcode op;
-            switch (ft->size) {
-                case 1: op = Opcode::Ptr8; break;
-                case 2: op = Opcode::Ptr16; break;
-                case 4: op = Opcode::Ptr32; break;
-                case 8: op = Opcode::Ptr64; break;
-            }
-            if (op == Opcode::Ptr64) {
-                chunk.addOp<uint8_t, uint8_t>((ft->isObject || ft->isArray) ? Opcode::ObjPtr64Var : Opcode::Ptr64Var, t->fields[field->index].offset, 0);
+            auto op = loadOp(ft);
+            if (varForm(op) != op) {
+                chunk.addOp<uint8_t, uint8_t>(varForm(op), t->fields[field->index].offset, 0);
             }
             else {
                 visitChild(n.context);
@@ -329,8 +508,34 @@ namespace Strela {
         }
     }
 
+    FuncDecl* ByteCodeCompiler::directCallee(CallExpr& n) {
+        auto fun = n.callTarget->node ? n.callTarget->node->as<FuncDecl>() : nullptr;
+        if (!fun || fun->builtin || fun->isExternal || (!n.callTarget->context && fun->name == "print")) {
+            return nullptr;
+        }
+        return fun;
+    }
+
+    bool ByteCodeCompiler::tailCall(Expr& expr) {
+        auto call = expr.as<CallExpr>();
+        auto fun = call ? directCallee(*call) : nullptr;
+        if (!fun) {
+            return false;
+        }
+        // the arguments replace the current frame, so there is no frame record slot to reserve
+        visitChild(call->callTarget->context);
+        visitChildren(call->arguments);
+        auto ind = chunk.addOp<uint32_t, uint8_t>(Opcode::TailCallImm, 0xffffffff, call->arguments.size() + (call->callTarget->context ? 1 : 0));
+        addFixup(ind, fun, true);
+        return true;
+    }
+
     void ByteCodeCompiler::visit(CallExpr& n) {
         if (n.source) chunk.setLine(n.source, n.line);
+        if (directCallee(n)) {
+            // slot for the callee's frame record
+            chunk.addOp(Opcode::Null);
+        }
         if (n.callTarget->node && n.callTarget->node->as<FuncDecl>() && n.callTarget->context) {
             visitChild(n.callTarget->context);
         }
@@ -382,12 +587,12 @@ namespace Strela {
 					}
                 }
                 else {
+                    // the callee's slot takes its frame record
                     visitChild(n.callTarget);
-                    for (auto& arg: n.arguments) {
-                        visitChild(arg);
-                        chunk.addOp(Opcode::Swap);
-                    }
-                    chunk.addOp<uint8_t>(Opcode::Call, n.callTarget->type->as<FuncType>()->paramTypes.size() + (n.callTarget->context ? 1 : 0));
+                    visitChildren(n.arguments);
+                    auto funcType = n.callTarget->type->as<FuncType>();
+                    // the second operand tells whether the callee leaves a return value on the stack
+                    chunk.addOp<uint8_t, uint8_t>(Opcode::CallInd, funcType->paramTypes.size() + (n.callTarget->context ? 1 : 0), funcType->returnType != &VoidType::instance);
                 }
             }
         }
@@ -395,6 +600,9 @@ namespace Strela {
 
     void ByteCodeCompiler::visit(RetStmt& n) {
         if (n.source) chunk.setLine(n.source, n.line);
+        if (n.expression && tailCall(*n.expression)) {
+            return;
+        }
         if (n.expression) {
             visitChild(n.expression);
             chunk.addOp(Opcode::Return);
@@ -461,7 +669,8 @@ namespace Strela {
         if (n.source) chunk.setLine(n.source, n.line);
         visitChild(n.target);
         if (n.implementation) {
-            chunk.addOp<uint8_t>(Opcode::ObjPtr64, 0);
+            // the interface's _ref
+            chunk.addOp<uint8_t>(loadOp(mapType(n.target->type)->fields[0].type), 0);
             chunk.addOp<uint64_t>(Opcode::CmpType, mapType(n.implementation->_class)->index);
         }
         else {
@@ -503,10 +712,11 @@ namespace Strela {
         auto tofloat = totype->as<FloatType>();
 
         if (fromclass && toiface && n.implementation) {
-            chunk.addOp<uint16_t>(Opcode::New, mapType(toiface)->index);
+            auto ifacetype = mapType(toiface);
+            chunk.addOp<uint16_t>(Opcode::New, ifacetype->index);
             visitChild(n.sourceExpr);
             chunk.addOp<uint8_t>(Opcode::Peek, 1);
-            chunk.addOp<uint8_t>(Opcode::StorePtr64, 0);
+            chunk.addOp<uint8_t>(storeOp(ifacetype->fields[0].type), 0);
             for(size_t i = 0; i < toiface->methods.size(); ++i) {
                 auto index = chunk.addOp<uint16_t>(Opcode::Const, 255);
                 addFixup(index, n.implementation->classMethods[i], false);
@@ -521,7 +731,7 @@ namespace Strela {
             }
         }
         else if (fromiface && toclass) {
-            chunk.addOp<uint8_t>(Opcode::ObjPtr64, 0);
+            chunk.addOp<uint8_t>(loadOp(mapType(fromiface)->fields[0].type), 0);
         }
         else if (tounion) {
             auto tag = tounion->getTypeTag(fromtype);
@@ -532,23 +742,25 @@ namespace Strela {
             chunk.addOp(Opcode::Swap);
             chunk.addOp<uint8_t>(Opcode::StorePtr64, 0);
 
+            // scalars are stored whole, with the bits of the value beyond its size
+            auto fromvmtype = mapType(fromtype);
             chunk.addOp(Opcode::Repeat);
             visitChild(n.sourceExpr);
             chunk.addOp(Opcode::Swap);
-            chunk.addOp<uint8_t>(Opcode::StorePtr64, 8);
+            chunk.addOp<uint8_t>(fromvmtype->isReference() ? storeOp(fromvmtype) : Opcode::StorePtr64, 8);
         }
         else if (fromunion) {
             visitChild(n.sourceExpr);
             auto tt = mapType(totype);
             if (tt->isObject || tt->isArray) {
-                chunk.addOp<uint8_t>(Opcode::ObjPtr64, 8);
+                chunk.addOp<uint8_t>(loadOp(tt), 8);
             }
             else {
                 switch (tt->size) {
                     case 1: chunk.addOp<uint8_t>(Opcode::Ptr8, 8); break;
                     case 2: chunk.addOp<uint8_t>(Opcode::Ptr16, 8); break;
                     case 4: chunk.addOp<uint8_t>(Opcode::Ptr32, 8); break;
-                    case 8: chunk.addOp<uint8_t>(Opcode::Ptr64, 8); break;
+                    case 8: chunk.addOp<uint8_t>(loadOp(tt), 8); break;
                     default: error(n, "Invalid field size.");
                 }
             }
@@ -628,6 +840,9 @@ namespace Strela {
     void ByteCodeCompiler::visit(BinopExpr& n) {
         if (n.source) chunk.setLine(n.source, n.line);
         if (n.function) {
+            if (!n.function->builtin) {
+                chunk.addOp(Opcode::Null);
+            }
             visitChild(n.left);
             visitChild(n.right);
 			if (n.function->builtin) {
@@ -640,31 +855,14 @@ namespace Strela {
             return;
         }
 
-        if (n.op == TokenType::AmpAmp) {
-            visitChild(n.left);
-            auto const1 = chunk.addOp<uint16_t>(Opcode::Const, 0);
-            chunk.addOp(Opcode::JmpIfNot);
+        if (n.op == TokenType::AmpAmp || n.op == TokenType::PipePipe) {
+            std::vector<size_t> isFalse;
+            branch(n, false, isFalse);
             chunk.addOp<uint8_t>(Opcode::U8, 1);
-            visitChild(n.right);
-            chunk.addOp(Opcode::AndL);
-            auto const2 = chunk.addOp<uint16_t>(Opcode::Const, 0);
-            chunk.addOp(Opcode::Jmp);
-            chunk.writeArgument(const1, chunk.addConstant(VMValue((int64_t)chunk.opcodes.size())));
-            chunk.addOp<uint8_t>(Opcode::U8, 0);
-            chunk.writeArgument(const2, chunk.addConstant(VMValue((int64_t)chunk.opcodes.size())));            
-        }
-        else if (n.op == TokenType::PipePipe) {
-            visitChild(n.left);
-            auto const1 = chunk.addOp<uint16_t>(Opcode::Const, 0);
-            chunk.addOp(Opcode::JmpIf);
+            auto end = jump(Opcode::JmpRel);
+            land(isFalse);
             chunk.addOp<uint8_t>(Opcode::U8, 0);
-            visitChild(n.right);
-            chunk.addOp(Opcode::OrL);
-            auto const2 = chunk.addOp<uint16_t>(Opcode::Const, 0);
-            chunk.addOp(Opcode::Jmp);
-            chunk.writeArgument(const1, chunk.addConstant(VMValue((int64_t)chunk.opcodes.size())));
-            chunk.addOp<uint8_t>(Opcode::U8, 1);
-            chunk.writeArgument(const2, chunk.addConstant(VMValue((int64_t)chunk.opcodes.size())));
+            land(end);
         }
         else {
             visitChild(n.left);
@@ -735,12 +933,15 @@ namespace Strela {
                 break;
 
                 case TokenType::EqualsEquals: {
-                    chunk.addOp(Opcode::CmpEQ);
+                    static const Opcode ops[] { Opcode::CmpEQ, Opcode::CmpEQI, Opcode::CmpEQF32, Opcode::CmpEQF64, Opcode::CmpEQB, Opcode::CmpEQRef };
+                    chunk.addOp(ops[(int)comparand(n)]);
                 }
                 break;
 
-                case TokenType::ExclamationMarkEquals:
-                chunk.addOp(Opcode::CmpNE);
+                case TokenType::ExclamationMarkEquals: {
+                    static const Opcode ops[] { Opcode::CmpNE, Opcode::CmpNEI, Opcode::CmpNEF32, Opcode::CmpNEF64, Opcode::CmpNEB, Opcode::CmpNERef };
+                    chunk.addOp(ops[(int)comparand(n)]);
+                }
                 break;
 
                 case TokenType::LessThan:
@@ -758,8 +959,10 @@ namespace Strela {
                 }
                 break;
 
-                case TokenType::LessThanEquals:
-                chunk.addOp(Opcode::CmpLTE);
+                case TokenType::LessThanEquals: {
+                    static const Opcode ops[] { Opcode::CmpLTE, Opcode::CmpLTEI, Opcode::CmpLTEF32, Opcode::CmpLTEF64, Opcode::CmpLTE, Opcode::CmpLTE };
+                    chunk.addOp(ops[(int)comparand(n)]);
+                }
                 break;
 
                 case TokenType::GreaterThan:
@@ -777,8 +980,10 @@ namespace Strela {
                 }
                 break;
 
-                case TokenType::GreaterThanEquals:
-                chunk.addOp(Opcode::CmpGTE);
+                case TokenType::GreaterThanEquals: {
+                    static const Opcode ops[] { Opcode::CmpGTE, Opcode::CmpGTEI, Opcode::CmpGTEF32, Opcode::CmpGTEF64, Opcode::CmpGTE, Opcode::CmpGTE };
+                    chunk.addOp(ops[(int)comparand(n)]);
+                }
                 break;
 
                 default:
@@ -807,57 +1012,39 @@ namespace Strela {
             chunk.addOp(Opcode::Repeat);
             chunk.addOp<uint8_t>(Opcode::Ptr64, 8 + im->index * 8);
             chunk.addOp(Opcode::Swap);
-            chunk.addOp<uint8_t>(Opcode::ObjPtr64, 0);
-            chunk.addOp(Opcode::Swap);
+            chunk.addOp<uint8_t>(loadOp(mapType(n.scopeTarget->type)->fields[0].type), 0);
         }
         else if (auto ifd = n.node->as<InterfaceFieldDecl>()) {
             auto iface = n.scopeTarget->type->as<InterfaceDecl>();
             visitChild(n.scopeTarget);
             chunk.addOp(Opcode::Repeat);
-            chunk.addOp<uint8_t>(Opcode::ObjPtr64, 0);
+            chunk.addOp<uint8_t>(loadOp(mapType(iface)->fields[0].type), 0);
             chunk.addOp(Opcode::Swap);
             size_t offset = 8 + (iface->methods.size() + ifd->index) * 8;
             chunk.addOp<uint8_t>(Opcode::Ptr64, offset);
             chunk.addOp(Opcode::Swap);
-
-            auto fieldtype = mapType(ifd->declType);
-            if (fieldtype->isObject || fieldtype->isArray) {
-                chunk.addOp<uint8_t>(Opcode::ObjPtrInd64, 0);
-            }
-            else {
-                switch (fieldtype->size) {
-                    case 1: chunk.addOp<uint8_t>(Opcode::PtrInd8, 0); break;
-                    case 2: chunk.addOp<uint8_t>(Opcode::PtrInd16, 0); break;
-                    case 4: chunk.addOp<uint8_t>(Opcode::PtrInd32, 0); break;
-                    case 8: chunk.addOp<uint8_t>(Opcode::PtrInd64, 0); break;
-                }
-            }
+            chunk.addOp<uint8_t>(loadIndOp(mapType(ifd->declType)), 0);
         }
         else if (auto field = n.node->as<FieldDecl>()) {
             auto t = mapType(n.scopeTarget->type);
             auto ft = mapType(field->declType);
-            Opcode op;
-            switch (ft->size) {
-                case 1: op = Opcode::Ptr8; break;
-                case 2: op = Opcode::Ptr16; break;
-                case 4: op = Opcode::Ptr32; break;
-                case 8: op = Opcode::Ptr64; break;
-            }
+            auto op = loadOp(ft);
+            auto varOp = varForm(op);
 
-            if (op == Opcode::Ptr64 && n.scopeTarget->as<IdExpr>() && n.scopeTarget->as<IdExpr>()->node->as<VarDecl>()) {
+            if (varOp != op && n.scopeTarget->as<IdExpr>() && n.scopeTarget->as<IdExpr>()->node->as<VarDecl>()) {
                 auto var = n.scopeTarget->as<IdExpr>()->node->as<VarDecl>();
-                chunk.addOp<uint8_t, uint8_t>((ft->isObject || ft->isArray) ? Opcode::ObjPtr64Var : Opcode::Ptr64Var, t->fields[field->index].offset, function->params.size() + (_class ? 1 : 0) + var->index);
+                chunk.addOp<uint8_t, uint8_t>(varOp, t->fields[field->index].offset, slotOf(var));
             }
-            else if (op == Opcode::Ptr64 && n.scopeTarget->as<IdExpr>() && n.scopeTarget->as<IdExpr>()->node->as<Param>()) {
+            else if (varOp != op && n.scopeTarget->as<IdExpr>() && n.scopeTarget->as<IdExpr>()->node->as<Param>()) {
                 auto par = n.scopeTarget->as<IdExpr>()->node->as<Param>();
-                chunk.addOp<uint8_t, uint8_t>((ft->isObject || ft->isArray) ? Opcode::ObjPtr64Var : Opcode::Ptr64Var, t->fields[field->index].offset, par->index);
+                chunk.addOp<uint8_t, uint8_t>(varOp, t->fields[field->index].offset, par->index);
             }
-            else if (op == Opcode::Ptr64 && n.scopeTarget->as<ThisExpr>()) {
-                chunk.addOp<uint8_t, uint8_t>((ft->isObject || ft->isArray) ? Opcode::ObjPtr64Var : Opcode::Ptr64Var, t->fields[field->index].offset, 0);
+            else if (varOp != op && n.scopeTarget->as<ThisExpr>()) {
+                chunk.addOp<uint8_t, uint8_t>(varOp, t->fields[field->index].offset, 0);
             }
             else {
                 visitChild(n.scopeTarget);
-                chunk.addOp<uint8_t>((ft->isObject || ft->isArray) ? Opcode::ObjPtr64 : op, t->fields[field->index].offset);
+                chunk.addOp<uint8_t>(op, t->fields[field->index].offset);
             }
         }
         else if (auto ee = n.node->as<EnumElement>()) {
@@ -872,7 +1059,8 @@ namespace Strela {
         if (n.source) chunk.setLine(n.source, n.line);
 
         chunk.addOp<uint16_t>(Opcode::New, mapType(n.type)->index);
-        chunk.addOp(Opcode::Repeat);
+        chunk.addOp(Opcode::Null);
+        chunk.addOp<uint8_t>(Opcode::Peek, 1);
 
         ArrayLitExpr keys;
         keys.type = n.constructor->params[0]->declType;
@@ -894,7 +1082,8 @@ namespace Strela {
         TypeDecl* arrType = n.type;
         if (n.constructor) {
             chunk.addOp<uint16_t>(Opcode::New, mapType(n.type)->index);
-            chunk.addOp(Opcode::Repeat);
+            chunk.addOp(Opcode::Null);
+            chunk.addOp<uint8_t>(Opcode::Peek, 1);
             arrType = n.constructor->declType->paramTypes.front();
         }
 
@@ -902,13 +1091,7 @@ namespace Strela {
         chunk.addOp<uint64_t>(Opcode::U64, n.elements.size());
         chunk.addOp(Opcode::Array);
         auto t = mapType(arrType->as<ArrayType>()->baseType);
-        Opcode op;
-        switch (t->size) {
-            case 1: op = Opcode::StorePtr8; break;
-            case 2: op = Opcode::StorePtr16; break;
-            case 4: op = Opcode::StorePtr32; break;
-            case 8: op = Opcode::StorePtr64; break;
-        }
+        auto op = storeOp(t);
         size_t i = 8;
         for (auto&& el: n.elements) {
             visitChild(el);
@@ -926,6 +1109,7 @@ namespace Strela {
     void ByteCodeCompiler::visit(SubscriptExpr& n) {
         if (n.source) chunk.setLine(n.source, n.line);
         if (n.subscriptFunction) {
+            chunk.addOp(Opcode::Null);
             visitChild(n.callTarget);
             visitChildren(n.arguments);
             auto index = chunk.addOp<uint32_t, uint8_t>(Opcode::CallImm, 0xffffffff, n.arguments.size() + 1);
@@ -941,39 +1125,25 @@ namespace Strela {
                     chunk.addOp(Opcode::MulI);
                 }
             }
-            Opcode op;
-            switch (fieldSize) {
-                case 1: op = Opcode::PtrInd8; break;
-                case 2: op = Opcode::PtrInd16; break;
-                case 4: op = Opcode::PtrInd32; break;
-                case 8: op = Opcode::PtrInd64; break;
-            }
-
             visitChild(n.callTarget);
-            chunk.addOp<uint8_t>((ft->isObject || ft->isArray) ? Opcode::ObjPtrInd64 : op, 8);
+            chunk.addOp<uint8_t>(loadIndOp(ft), 8);
         }
     }
 
     void ByteCodeCompiler::visit(IfStmt& n) {
         if (n.source) chunk.setLine(n.source, n.line);
-        visitChild(n.condition);
-        auto pos = chunk.addOp<uint16_t>(Opcode::Const, 0);
-        chunk.addOp(Opcode::JmpIfNot);
+        std::vector<size_t> skip;
+        branch(*n.condition, false, skip);
         visitChild(n.trueBranch);
 
-        int pos2;
-        if (n.falseBranch) {
-            pos2 = chunk.addOp<uint16_t>(Opcode::Const, 0);
-            chunk.addOp(Opcode::Jmp);
-        }
-
-        auto index = chunk.addConstant(VMValue(int64_t(chunk.opcodes.size())));
-        chunk.writeArgument(pos, index);
-        
         if (n.falseBranch) {
+            auto end = jump(Opcode::JmpRel);
+            land(skip);
             visitChild(n.falseBranch);
-            auto index2 = chunk.addConstant(VMValue(int64_t(chunk.opcodes.size())));
-            chunk.writeArgument(pos2, index2);
+            land(end);
+        }
+        else {
+            land(skip);
         }
     }
 
@@ -982,7 +1152,9 @@ namespace Strela {
         if (auto clstype = n.type->as<ClassDecl>()) {
             chunk.addOp<uint16_t>(Opcode::New, mapType(clstype)->index);
             if (n.initMethod) {
-                chunk.addOp(Opcode::Repeat);
+                // the object stays below the init call's frame record
+                chunk.addOp(Opcode::Null);
+                chunk.addOp<uint8_t>(Opcode::Peek, 1);
                 visitChildren(n.arguments);
                 auto ind = chunk.addOp<uint32_t, uint8_t>(Opcode::CallImm, 0xffffffff, n.arguments.size() + 1);
                 addFixup(ind, n.initMethod, true);
@@ -1003,24 +1175,18 @@ namespace Strela {
         }
 
         if (n.left->arrayIndex) {
-            auto fieldSize = mapType(n.left->context->type)->arrayType->size;
+            auto elementType = mapType(n.left->context->type)->arrayType;
+            auto fieldSize = elementType->size;
             visitChild(n.left->arrayIndex);
             if (fieldSize != 1) {
                 chunk.addOp<uint8_t>(Opcode::U8, fieldSize);
                 chunk.addOp(Opcode::MulI);
             }
-            Opcode op;
-            switch (fieldSize) {
-                case 1: op = Opcode::StorePtrInd8; break;
-                case 2: op = Opcode::StorePtrInd16; break;
-                case 4: op = Opcode::StorePtrInd32; break;
-                case 8: op = Opcode::StorePtrInd64; break;
-            }
             visitChild(n.left->context);
-            chunk.addOp<uint8_t>(op, 8);
+            chunk.addOp<uint8_t>(storeIndOp(elementType), 8);
         }
         else if (auto var = n.left->node->as<VarDecl>()) {
-                chunk.addOp<uint8_t>(Opcode::StoreVar, function->params.size() + (_class ? 1 : 0) + var->index);
+                chunk.addOp<uint8_t>(Opcode::StoreVar, slotOf(var));
         }
         else if (auto par = n.left->node->as<Param>()) {
             chunk.addOp<uint8_t>(Opcode::StoreVar, par->index);
@@ -1028,24 +1194,19 @@ namespace Strela {
         else if (auto field = n.left->node->as<FieldDecl>()) {
             auto t = mapType(n.left->context->type);
             auto ft = mapType(field->declType);
-            Opcode op;
-            switch (ft->size) {
-                case 1: op = Opcode::StorePtr8; break;
-                case 2: op = Opcode::StorePtr16; break;
-                case 4: op = Opcode::StorePtr32; break;
-                case 8: op = Opcode::StorePtr64; break;
-            }
+            auto op = storeOp(ft);
+            auto varOp = varForm(op);
 
-            if (op == Opcode::StorePtr64 && n.left->context->as<IdExpr>() && n.left->context->as<IdExpr>()->node->as<VarDecl>()) {
+            if (varOp != op && n.left->context->as<IdExpr>() && n.left->context->as<IdExpr>()->node->as<VarDecl>()) {
                 auto var = n.left->context->as<IdExpr>()->node->as<VarDecl>();
-                chunk.addOp<uint8_t, uint8_t>(Opcode::StorePtr64Var, t->fields[field->index].offset, function->params.size() + (_class ? 1 : 0) + var->index);
+                chunk.addOp<uint8_t, uint8_t>(varOp, t->fields[field->index].offset, slotOf(var));
             }
-            else if (op == Opcode::StorePtr64 && n.left->context->as<IdExpr>() && n.left->context->as<IdExpr>()->node->as<Param>()) {
+            else if (varOp != op && n.left->context->as<IdExpr>() && n.left->context->as<IdExpr>()->node->as<Param>()) {
                 auto par = n.left->context->as<IdExpr>()->node->as<Param>();
-                chunk.addOp<uint8_t, uint8_t>(Opcode::StorePtr64Var, t->fields[field->index].offset, par->index);
+                chunk.addOp<uint8_t, uint8_t>(varOp, t->fields[field->index].offset, par->index);
             }
-            else if (op == Opcode::StorePtr64 && n.left->context->as<ThisExpr>()) {
-                chunk.addOp<uint8_t, uint8_t>(Opcode::StorePtr64Var, t->fields[field->index].offset, 0);
+            else if (varOp != op && n.left->context->as<ThisExpr>()) {
+                chunk.addOp<uint8_t, uint8_t>(varOp, t->fields[field->index].offset, 0);
             }
             else {
                 visitChild(n.left->context);
@@ -1056,15 +1217,12 @@ namespace Strela {
 
     void ByteCodeCompiler::visit(WhileStmt& n) {
         if (n.source) chunk.setLine(n.source, n.line);
-        auto startPos = chunk.opcodes.size();
-        visitChild(n.condition);
-        auto pos = chunk.addOp<uint16_t>(Opcode::Const, 0);
-        chunk.addOp(Opcode::JmpIfNot);
+        auto start = chunk.label();
+        std::vector<size_t> exit;
+        branch(*n.condition, false, exit);
         visitChild(n.body);
-        chunk.addOp<uint16_t>(Opcode::Const, chunk.addConstant(VMValue(int64_t(startPos))));
-        chunk.addOp(Opcode::Jmp);
-        auto index = chunk.addConstant(VMValue(int64_t(chunk.opcodes.size())));
-        chunk.writeArgument(pos, index);
+        chunk.addOp<int32_t>(Opcode::JmpRel, int32_t(start) - int32_t(chunk.opcodes.size()));
+        land(exit);
     }
 
     void ByteCodeCompiler::visit(PostfixExpr& n) {
@@ -1106,7 +1264,7 @@ namespace Strela {
         }
 
         if (auto var = n.node->as<VarDecl>()) {
-            chunk.addOp<uint8_t>(Opcode::StoreVar, function->params.size() + (_class ? 1 : 0) + var->index);
+            chunk.addOp<uint8_t>(Opcode::StoreVar, slotOf(var));
         }
         else if (auto par = n.node->as<Param>()) {
             chunk.addOp<uint8_t>(Opcode::StoreVar, par->index);
@@ -7,6 +7,7 @@
 #include "IStmtVisitor.h"
 #include "IExprVisitor.h"
 #include "Pass.h"
+#include "VM/Opcode.h"
 
 #include <string>
 #include <map>
@@ -21,12 +22,23 @@ namespace Strela {
     class FuncDecl;
     class ClassDecl;
     class ModDecl;
+    class VarDecl;
     class FieldDecl;
     class Param;
+    struct FunctionInfo;
+
+    /**
+     * What both operands of a comparison are known to hold at runtime, in the order of the opcode tables in visit(BinopExpr&).
+     * Generic comparisons are left to VMValue, which goes by the runtime type of the left operand.
+     */
+    enum class Comparand { Generic, Int, F32, F64, Bool, Ref };
+
+    Comparand comparand(BinopExpr& n);
 
     class ByteCodeCompiler: public Pass, public IStmtVisitor, public IExprVisitor {
     public:
         ByteCodeCompiler(ByteCodeChunk&);
+        virtual ~ByteCodeCompiler() {}
         void compile(ModDecl&);
         void compile(ClassDecl&);
         void compile(FuncDecl&);
@@ -70,11 +82,36 @@ namespace Strela {
             if (child) child->accept(*this);
         }
 
-    private:
+    protected:
         void addFixup(size_t address, FuncDecl* function, bool immediate);
         VMType* mapType(TypeDecl* type);
+        /** Opcodes reading and writing a field of the given type, which take references in the chunk's form. */
+        Opcode loadOp(const VMType* type) const;
+        Opcode storeOp(const VMType* type) const;
+        /** The same for array elements, whose offset is on the stack. */
+        Opcode loadIndOp(const VMType* type) const;
+        Opcode storeIndOp(const VMType* type) const;
+        /** Frame slot of a local variable */
+        int slotOf(VarDecl* var) const;
+
+        /** Emits a jump whose target is filled in by land(). */
+        size_t jump(Opcode op, int cond = -1);
+        /** Points a jump emitted by jump() at the current address. */
+        void land(size_t jumpAddress);
+        void land(const std::vector<size_t>& jumpAddresses);
+        /** Compiles a condition as control flow that jumps when it evaluates to jumpIf. */
+        void branch(Expr& condition, bool jumpIf, std::vector<size_t>& jumps);
+        /** Function a call goes to with CallImm, null for builtins, foreign functions, print and indirect calls. */
+        static FuncDecl* directCallee(CallExpr& n);
+        /** Compiles a returned expression as TailCallImm if it is a direct call. Returns false if it is not. */
+        bool tailCall(Expr& expr);
+
+        /** Emits the frame setup after a function's entry point. */
+        virtual void enterFunction(FuncDecl& n);
+        /** Called once the body of a function has been compiled. */
+        virtual void leaveFunction(FuncDecl& n) {}
 
-    private:
+    protected:
         struct Fixup {
             size_t address;
             FuncDecl* function;
@@ -82,6 +119,7 @@ namespace Strela {
         };
         std::vector<Fixup> functionFixups;
         FuncDecl* function = nullptr;
+        FunctionInfo* functionInfo = nullptr;
         std::map<TypeDecl*, VMType*> typeMap;
 
     public:
@@ -0,0 +1,1072 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "CEmitter.h"
+#include "VM/ByteCodeChunk.h"
+#include "VM/VMType.h"
+#include "VM/Builtins.h"
+#include "exceptions.h"
+#include "Ast/IntType.h"
+#include "Ast/FloatType.h"
+#include "Ast/PointerType.h"
+#include "Ast/VoidType.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <set>
+#include <sstream>
+
+namespace Strela {
+    namespace {
+        template<typename T> T operand(const Opcode* pos) {
+            T ret;
+            memcpy(&ret, pos, sizeof(T));
+            return ret;
+        }
+
+        std::string slot(int index) {
+            return "s" + std::to_string(index);
+        }
+
+        std::string label(size_t address) {
+            return "L" + std::to_string(address);
+        }
+
+        std::string integer(int64_t value) {
+            if (value == INT64_MIN) {
+                return "INT64_MIN";
+            }
+            return "INT64_C(" + std::to_string(value) + ")";
+        }
+
+        std::string bits(uint64_t value) {
+            std::stringstream sstr;
+            sstr << "(int64_t)UINT64_C(0x" << std::hex << value << ")";
+            return sstr.str();
+        }
+
+        /** C string literal, octal escapes for everything that is not plain ASCII. */
+        std::string quote(const std::string& str) {
+            std::stringstream sstr;
+            sstr << "\"";
+            for (unsigned char c: str) {
+                if (c == '"' || c == '\\') {
+                    sstr << '\\' << c;
+                }
+                else if (c < 32 || c > 126 || c == '?') {
+                    sstr << '\\' << std::oct << std::setw(3) << std::setfill('0') << (int)c << std::dec;
+                }
+                else {
+                    sstr << c;
+                }
+            }
+            sstr << "\"";
+            return sstr.str();
+        }
+
+        std::string comment(std::string str) {
+            size_t pos;
+            while ((pos = str.find("*/")) != std::string::npos) {
+                str.replace(pos, 2, "* /");
+            }
+            return "/* " + str + " */";
+        }
+
+        /** C type of a foreign function parameter or result, matching the ffi types the VM uses. */
+        std::string foreignType(const TypeDecl* type) {
+            if (type == &IntType::u8) return "uint8_t";
+            if (type == &IntType::u16) return "uint16_t";
+            if (type == &IntType::u32) return "uint32_t";
+            if (type == &IntType::u64) return "uint64_t";
+            if (type == &IntType::i8) return "int8_t";
+            if (type == &IntType::i16) return "int16_t";
+            if (type == &IntType::i32) return "int32_t";
+            if (type == &IntType::i64) return "int64_t";
+            if (type == &FloatType::f32) return "float";
+            if (type == &FloatType::f64) return "double";
+            return "void*";
+        }
+
+        /** Value pushed by an integer constant opcode, false for any other opcode. */
+        bool constantInteger(Opcode op, const Opcode* arg, int64_t& value) {
+            switch (op) {
+                case Opcode::I8: value = operand<int8_t>(arg); return true;
+                case Opcode::I16: value = operand<int16_t>(arg); return true;
+                case Opcode::I32: value = operand<int32_t>(arg); return true;
+                case Opcode::I64: value = operand<int64_t>(arg); return true;
+                case Opcode::U8: value = operand<uint8_t>(arg); return true;
+                case Opcode::U16: value = operand<uint16_t>(arg); return true;
+                case Opcode::U32: value = operand<uint32_t>(arg); return true;
+                case Opcode::U64: value = operand<uint64_t>(arg); return true;
+                default: return false;
+            }
+        }
+
+        /** Bytes moved by a memory opcode. */
+        int accessSize(Opcode op) {
+            switch (op) {
+                case Opcode::Ptr8: case Opcode::PtrInd8: case Opcode::StorePtr8: case Opcode::StorePtrInd8: case Opcode::PeekStorePtr8:
+                    return 1;
+                case Opcode::Ptr16: case Opcode::PtrInd16: case Opcode::StorePtr16: case Opcode::StorePtrInd16: case Opcode::PeekStorePtr16:
+                    return 2;
+                case Opcode::Ptr32: case Opcode::PtrInd32: case Opcode::StorePtr32: case Opcode::StorePtrInd32: case Opcode::PeekStorePtr32:
+                    return 4;
+                default:
+                    return 8;
+            }
+        }
+
+        /** Type tag of the value a load opcode pushes. */
+        const char* loadedType(Opcode op) {
+            switch (op) {
+                case Opcode::ObjPtr64: case Opcode::ObjPtr64Var: case Opcode::ObjPtrInd64: return "STRELA_OBJECT";
+                case Opcode::F64Ptr64: case Opcode::F64Ptr64Var: case Opcode::F64PtrInd64: return "STRELA_FLOATING";
+                default: return "STRELA_INTEGER";
+            }
+        }
+    }
+
+    void CEmitter::emit(std::ostream& out) {
+        decode();
+
+        out << "/*\n";
+        out << " * Generated by strela --emit-c. Build with\n";
+        out << " *     cc -O2 -I <strela>/src/VM <this file> <strela>/Release/libstrela.a -lstdc++ -lm -pthread\n";
+        out << " */\n";
+        out << "#include \"Runtime.h\"\n\n";
+
+        emitTypes(out);
+        emitForeignFunctions(out);
+
+        bool hasStrings = false;
+        for (auto&& constant: chunk.constants) {
+            hasStrings |= constant.getType() == VMValue::Type::object;
+        }
+        if (hasStrings) {
+            out << "static StrelaValue program_constants[" << chunk.constants.size() << "];\n\n";
+        }
+
+        for (auto&& function: functions) {
+            out << "static StrelaValue fn_" << function.address << "(StrelaValue* fp);\n";
+        }
+        out << "\n";
+        out << "static StrelaValue program_call(int64_t address, StrelaValue* fp) {\n";
+        out << "    switch (address) {\n";
+        for (auto&& function: functions) {
+            out << "        case " << function.address << ": return fn_" << function.address << "(fp);\n";
+        }
+        out << "    }\n";
+        out << "    strela_invalid_call(address);\n";
+        out << "    return strela_value(0, STRELA_NULL);\n";
+        out << "}\n\n";
+
+        for (auto&& function: functions) {
+            emitFunction(out, function);
+        }
+
+        out << "int main(int argc, char** argv) {\n";
+        if (chunk.types.empty()) {
+            out << "    StrelaValue* stack = strela_start(0, 0, argc, argv);\n";
+        }
+        else {
+            out << "    StrelaValue* stack = strela_start(program_types, " << chunk.types.size() << ", argc, argv);\n";
+        }
+        for (size_t i = 0; i < chunk.constants.size(); ++i) {
+            auto& constant = chunk.constants[i];
+            if (constant.getType() == VMValue::Type::object) {
+                out << "    program_constants[" << i << "] = strela_string(" << quote((const char*)constant.getObject()) << ");\n";
+            }
+        }
+        out << "    return strela_exit(fn_" << chunk.main << "(stack));\n";
+        out << "}\n";
+    }
+
+    void CEmitter::decode() {
+        code.clear();
+        indices.clear();
+        functions.clear();
+        functionAt.clear();
+
+        size_t address = 0;
+        while (address < chunk.opcodes.size()) {
+            auto op = chunk.opcodes[address];
+            if ((unsigned char)op >= numOpcodes) {
+                throw Exception("Invalid opcode at address " + std::to_string(address));
+            }
+            auto width = opcodeInfo[(unsigned char)op].argWidth;
+            if (address + 1 + width > chunk.opcodes.size()) {
+                throw Exception("Truncated opcode at address " + std::to_string(address));
+            }
+            indices[address] = code.size();
+            code.push_back({ address, op, chunk.opcodes.data() + address + 1 });
+            address += 1 + width;
+        }
+
+        for (auto it = chunk.functions.begin(); it != chunk.functions.end(); ++it) {
+            auto begin = indices.find(it->first);
+            if (begin == indices.end()) {
+                throw Exception("Function " + it->second.name + " does not start at an instruction");
+            }
+            auto next = std::next(it);
+            Function function;
+            function.address = it->first;
+            function.info = &it->second;
+            function.begin = begin->second;
+            function.end = next == chunk.functions.end() ? code.size() : indices.at(next->first);
+            function.returns = false;
+            for (size_t i = function.begin; i < function.end; ++i) {
+                function.returns |= code[i].op == Opcode::Return || code[i].op == Opcode::ReturnR;
+            }
+            functionAt[function.address] = functions.size();
+            functions.push_back(function);
+        }
+        // a function that only returns through tail calls returns what its callees return
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto& function: functions) {
+                for (size_t i = function.begin; i < function.end && !function.returns; ++i) {
+                    if (code[i].op == Opcode::TailCallImm && callee(operand<uint32_t>(code[i].arg), i).returns) {
+                        function.returns = changed = true;
+                    }
+                }
+            }
+        }
+
+        if (!functionAt.count(chunk.main)) {
+            throw Exception("No main function");
+        }
+    }
+
+    void CEmitter::emitTypes(std::ostream& out) {
+        if (chunk.types.empty()) {
+            return;
+        }
+
+        auto ref = [](const VMType* type) { return type ? (long)type->index : -1L; };
+
+        for (auto&& type: chunk.types) {
+            if (!type->fields.empty()) {
+                out << "static const StrelaField program_fields_" << type->index << "[] = {\n";
+                for (auto&& field: type->fields) {
+                    out << "    { " << quote(field.name) << ", " << ref(field.type) << ", " << field.offset << " },\n";
+                }
+                out << "};\n";
+            }
+            if (!type->unionTypes.empty()) {
+                out << "static const int32_t program_unions_" << type->index << "[] = {";
+                for (auto&& unionType: type->unionTypes) {
+                    out << " " << ref(unionType) << ",";
+                }
+                out << " };\n";
+            }
+        }
+
+        out << "static const StrelaTypeInfo program_types[] = {\n";
+        for (auto&& type: chunk.types) {
+            out << "    { " << quote(type->name) << ", "
+                << type->isObject << ", " << type->isArray << ", " << type->isEnum << ", "
+                << ref(type->arrayType) << ", "
+                << type->size << ", " << type->alignment << ", " << type->objectSize << ", " << type->objectAlignment << ", ";
+            if (type->fields.empty()) {
+                out << "0, 0, ";
+            }
+            else {
+                out << type->fields.size() << ", program_fields_" << type->index << ", ";
+            }
+            if (type->unionTypes.empty()) {
+                out << "0, 0";
+            }
+            else {
+                out << type->unionTypes.size() << ", program_unions_" << type->index;
+            }
+            out << " },\n";
+        }
+        out << "};\n\n";
+    }
+
+    void CEmitter::emitForeignFunctions(std::ostream& out) {
+        for (size_t i = 0; i < chunk.foreignFunctions.size(); ++i) {
+            auto& ff = chunk.foreignFunctions[i];
+            auto returnsVoid = ff.returnType == &VoidType::instance;
+
+            out << "extern " << (returnsVoid ? "void" : foreignType(ff.returnType)) << " strela_ff" << i << "(";
+            for (size_t p = 0; p < ff.argTypes.size(); ++p) {
+                out << (p ? ", " : "") << foreignType(ff.argTypes[p]);
+            }
+            out << (ff.argTypes.empty() ? "void" : "") << ") STRELA_SYMBOL(" << quote(ff.name) << ");\n";
+
+            // arguments are converted like the VM's NativeCall does before handing them to libffi
+            out << "static StrelaValue foreign_" << i << "(const StrelaValue* args) {\n";
+            std::stringstream call;
+            call << "strela_ff" << i << "(";
+            for (size_t p = 0; p < ff.argTypes.size(); ++p) {
+                auto type = ff.argTypes[p];
+                auto arg = "args[" + std::to_string(p) + "]";
+                auto native = arg + ".type == STRELA_OBJECT ? strela_native_pointer(&" + arg + ") : ";
+                call << (p ? ", " : "");
+                if (type == &PointerType::instance) {
+                    out << "    StrelaValue copy" << p << " = " << arg << ";\n";
+                    call << "(" << native << "(void*)&copy" << p << ".value)";
+                }
+                else if (type == &FloatType::f32) {
+                    call << arg << ".value.f32";
+                }
+                else if (type == &FloatType::f64) {
+                    call << arg << ".value.f64";
+                }
+                else if (type->as<IntType>()) {
+                    call << "(" << foreignType(type) << ")" << arg << ".value.integer";
+                }
+                else {
+                    call << "(" << native << arg << ".value.object)";
+                }
+            }
+            call << ")";
+
+            if (returnsVoid) {
+                out << "    " << call.str() << ";\n";
+                out << "    strela_native_errno(" << quote(ff.name) << ");\n";
+                out << "    return strela_value(0, STRELA_NULL);\n";
+            }
+            else {
+                auto floating = ff.returnType->as<FloatType>() != nullptr;
+                out << "    StrelaValue ret = strela_value(0, " << (floating ? "STRELA_FLOATING" : "STRELA_INTEGER") << ");\n";
+                if (ff.returnType == &FloatType::f32) {
+                    out << "    ret.value.f32 = " << call.str() << ";\n";
+                }
+                else if (ff.returnType == &FloatType::f64) {
+                    out << "    ret.value.f64 = " << call.str() << ";\n";
+                }
+                else if (ff.returnType->as<IntType>()) {
+                    out << "    ret.value.integer = " << call.str() << ";\n";
+                }
+                else {
+                    out << "    ret.value.object = " << call.str() << ";\n";
+                }
+                out << "    strela_native_errno(" << quote(ff.name) << ");\n";
+                out << "    return ret;\n";
+            }
+            out << "}\n\n";
+        }
+    }
+
+    void CEmitter::emitFunction(std::ostream& out, const Function& function) {
+        // stack depth before each reachable instruction
+        std::map<size_t, int> depths;
+        std::set<size_t> labels;
+        std::vector<size_t> work;
+        int numSlots = function.info->arguments;
+        // external function stubs of the register compiler have no return
+        bool fallsOff = false;
+
+        auto visit = [&](size_t from, size_t index, int depth) {
+            if (index < function.begin || index >= function.end) {
+                unsupported(from, "control leaves the function");
+            }
+            auto it = depths.find(index);
+            if (it == depths.end()) {
+                depths[index] = depth;
+                work.push_back(index);
+            }
+            else if (it->second != depth) {
+                unsupported(index, "stack depth differs between paths");
+            }
+        };
+
+        visit(function.begin, function.begin, function.info->arguments);
+        while (!work.empty()) {
+            auto index = work.back();
+            work.pop_back();
+            auto depth = depths[index];
+
+            int pops, pushes;
+            auto next = stackEffect(index, pops, pushes);
+            if (pops > depth) {
+                unsupported(index, "stack underflow");
+            }
+            auto after = depth - pops + pushes;
+            numSlots = std::max(numSlots, std::max(depth, after));
+
+            auto target = jumpTarget(index);
+            if (target >= 0) {
+                labels.insert(target);
+                visit(index, target, after);
+            }
+            if (code[index].op == Opcode::TailCallImm && &callee(operand<uint32_t>(code[index].arg), index) == &function) {
+                labels.insert(function.begin);
+            }
+            if (next && index + 1 == function.end) {
+                fallsOff = true;
+            }
+            else if (next) {
+                visit(index, index + 1, after);
+            }
+        }
+
+        out << comment(function.info->name) << "\n";
+        out << "static StrelaValue fn_" << function.address << "(StrelaValue* fp) {\n";
+        for (int i = 0; i < numSlots; ++i) {
+            out << "    StrelaValue " << slot(i);
+            if (i < (int)function.info->arguments) {
+                out << " = fp[" << i << "]";
+            }
+            out << ";\n";
+        }
+        out << "    if (fp + " << numSlots << " > strela_stack_limit) strela_stack_overflow();\n";
+
+        for (auto&& it: depths) {
+            if (labels.count(it.first)) {
+                out << label(code[it.first].address) << ":;\n";
+            }
+            emitInstruction(out, function, it.first, it.second);
+        }
+        if (fallsOff) {
+            out << "    strela_trap(" << (function.end < code.size() ? code[function.end].address : chunk.opcodes.size()) << ");\n";
+            out << "    return strela_value(0, STRELA_NULL);\n";
+        }
+        out << "}\n\n";
+    }
+
+    void CEmitter::emitInstruction(std::ostream& out, const Function& function, size_t index, int depth) {
+        auto& ins = code[index];
+        auto arg = ins.arg;
+        auto top = slot(depth - 1);
+        auto second = slot(depth - 2);
+        auto third = slot(depth - 3);
+        auto push = slot(depth);
+        auto reg = [&](int n) { return slot(operand<uint8_t>(arg + n)); };
+        auto go = [&]() { return "goto " + label(code[jumpTarget(index)].address) + ";"; };
+        auto spill = [&](int n) {
+            for (int i = 0; i < n; ++i) {
+                out << "    fp[" << i << "] = " << slot(i) << ";\n";
+            }
+        };
+        auto constant = [&](uint16_t constIndex) {
+            if (constIndex >= chunk.constants.size()) {
+                unsupported(index, "invalid constant");
+            }
+            auto& value = chunk.constants[constIndex];
+            if (value.getType() == VMValue::Type::object) {
+                return "program_constants[" + std::to_string(constIndex) + "]";
+            }
+            return literal(value);
+        };
+        auto binary = [&](const char* field, const char* op) {
+            out << "    " << second << ".value." << field << " " << op << "= " << top << ".value." << field << ";\n";
+        };
+        auto binaryR = [&](const char* field, const char* op, const std::string& rhs) {
+            out << "    { StrelaValue l = " << reg(1) << "; l.value." << field << " " << op << "= " << rhs << "; " << reg(0) << " = l; }\n";
+        };
+        auto compare = [&](const char* field, const char* op) {
+            out << "    " << second << ".value.boolean = " << second << ".value." << field << " " << op << " " << top << ".value." << field << ";\n";
+            out << "    " << second << ".type = STRELA_BOOLEAN;\n";
+        };
+        auto compareR = [&](const char* field, const char* op) {
+            out << "    " << reg(0) << " = strela_boolean(" << reg(1) << ".value." << field << " " << op << " " << reg(2) << ".value." << field << ");\n";
+        };
+        auto compareRI = [&](const char* op) {
+            out << "    " << reg(0) << " = strela_boolean(" << reg(1) << ".value.integer " << op << " " << (int)operand<int8_t>(arg + 2) << ");\n";
+        };
+        auto jumpIf = [&](const char* op) {
+            out << "    if (" << second << ".value.integer " << op << " " << top << ".value.integer) " << go() << "\n";
+        };
+        auto address = [&](const std::string& object, const std::string& offset) {
+            return "(char*)" + object + ".value.object + " + offset;
+        };
+
+        switch (ins.op) {
+            case Opcode::Trap:
+                out << "    strela_trap(" << ins.address << ");\n";
+                out << "    return strela_value(0, STRELA_NULL);\n";
+                break;
+            case Opcode::ReturnVoid:
+                out << "    return strela_value(0, STRELA_NULL);\n";
+                break;
+            case Opcode::Return:
+                out << "    return " << top << ";\n";
+                break;
+            case Opcode::ReturnR:
+                out << "    return " << reg(0) << ";\n";
+                break;
+
+            case Opcode::Const:
+                out << "    " << push << " = " << constant(operand<uint16_t>(arg)) << ";\n";
+                break;
+            case Opcode::I8: out << "    " << push << " = strela_value(" << integer(operand<int8_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::I16: out << "    " << push << " = strela_value(" << integer(operand<int16_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::I32: out << "    " << push << " = strela_value(" << integer(operand<int32_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::I64: out << "    " << push << " = strela_value(" << integer(operand<int64_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::U8: out << "    " << push << " = strela_value(" << integer(operand<uint8_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::U16: out << "    " << push << " = strela_value(" << integer(operand<uint16_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::U32: out << "    " << push << " = strela_value(" << integer(operand<uint32_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::U64: out << "    " << push << " = strela_value(" << bits(operand<uint64_t>(arg)) << ", STRELA_INTEGER);\n"; break;
+            case Opcode::F32: {
+                // the VM keeps the upper half of a f32 value zero
+                std::stringstream sstr;
+                sstr << operand<float>(arg);
+                out << "    " << push << " = strela_value(" << bits(operand<uint32_t>(arg)) << ", STRELA_FLOATING); " << comment(sstr.str()) << "\n";
+                break;
+            }
+            case Opcode::F64: {
+                std::stringstream sstr;
+                sstr << operand<double>(arg);
+                out << "    " << push << " = strela_value(" << bits(operand<uint64_t>(arg)) << ", STRELA_FLOATING); " << comment(sstr.str()) << "\n";
+                break;
+            }
+            case Opcode::Null:
+                out << "    " << push << " = strela_value(0, STRELA_NULL);\n";
+                break;
+            case Opcode::Grow:
+                for (int i = 0; i < operand<uint8_t>(arg); ++i) {
+                    out << "    " << slot(depth + i) << " = strela_value(0, STRELA_NULL);\n";
+                }
+                break;
+
+            case Opcode::Var:
+                out << "    " << push << " = " << reg(0) << ";\n";
+                break;
+            case Opcode::StoreVar:
+                out << "    " << reg(0) << " = " << top << ";\n";
+                break;
+            case Opcode::Peek:
+                out << "    " << push << " = " << slot(depth - 1 - operand<uint8_t>(arg)) << ";\n";
+                break;
+            case Opcode::Repeat:
+                out << "    " << push << " = " << top << ";\n";
+                break;
+            case Opcode::Pop:
+                break;
+            case Opcode::Swap:
+                out << "    { StrelaValue t = " << top << "; " << top << " = " << second << "; " << second << " = t; }\n";
+                break;
+            case Opcode::VarVar:
+                out << "    " << push << " = " << reg(0) << ";\n";
+                out << "    " << slot(depth + 1) << " = " << reg(1) << ";\n";
+                break;
+            case Opcode::VarI8:
+                out << "    " << push << " = " << reg(0) << ";\n";
+                out << "    " << slot(depth + 1) << " = strela_value(" << integer(operand<int8_t>(arg + 1)) << ", STRELA_INTEGER);\n";
+                break;
+            case Opcode::AddIVarVar:
+                out << "    " << push << " = " << reg(0) << ";\n";
+                out << "    " << push << ".value.integer += " << reg(1) << ".value.integer;\n";
+                break;
+            case Opcode::AddIVarI8:
+                out << "    " << push << " = " << reg(0) << ";\n";
+                out << "    " << push << ".value.integer += " << (int)operand<int8_t>(arg + 1) << ";\n";
+                break;
+            case Opcode::IncVar:
+                out << "    " << reg(0) << ".value.integer += " << (int)operand<int8_t>(arg + 1) << ";\n";
+                break;
+
+            case Opcode::CallInd: {
+                // the callee sits below its arguments and its slot takes the result
+                auto frame = depth - operand<uint8_t>(arg);
+                spill(depth);
+                out << "    " << (operand<uint8_t>(arg + 1) ? slot(frame - 1) + " = " : "")
+                    << "program_call(" << slot(frame - 1) << ".value.integer, fp + " << frame << ");\n";
+                break;
+            }
+            case Opcode::CallImm: {
+                auto& target = callee(operand<uint32_t>(arg), index);
+                auto frame = depth - operand<uint8_t>(arg + 4);
+                spill(depth);
+                out << "    " << (target.returns ? slot(frame - 1) + " = " : "")
+                    << "fn_" << target.address << "(fp + " << frame << ");\n";
+                break;
+            }
+            case Opcode::TailCallImm: {
+                auto& target = callee(operand<uint32_t>(arg), index);
+                int nargs = operand<uint8_t>(arg + 4);
+                if (&target == &function) {
+                    // self recursion becomes a loop
+                    for (int i = 0; i < nargs; ++i) {
+                        out << "    " << slot(i) << " = " << slot(depth - nargs + i) << ";\n";
+                    }
+                    out << "    goto " << label(code[function.begin].address) << ";\n";
+                    break;
+                }
+                for (int i = 0; i < nargs; ++i) {
+                    out << "    fp[" << i << "] = " << slot(depth - nargs + i) << ";\n";
+                }
+                out << "    return fn_" << target.address << "(fp);\n";
+                break;
+            }
+            case Opcode::NativeCall: {
+                int64_t funcindex;
+                constantInteger(code[index - 1].op, code[index - 1].arg, funcindex);
+                auto& ff = chunk.foreignFunctions[funcindex];
+                int nargs = ff.argTypes.size();
+                auto first = depth - 1 - nargs;
+                out << "    {\n";
+                out << "        StrelaValue args[" << std::max(nargs, 1) << "] = {";
+                for (int i = 0; i < nargs; ++i) {
+                    out << (i ? ", " : " ") << slot(first + i);
+                }
+                out << " };\n";
+                out << "        " << (ff.returnType != &VoidType::instance ? slot(first) + " = " : "") << "foreign_" << funcindex << "(args);\n";
+                out << "    }\n";
+                break;
+            }
+            case Opcode::BuiltinCall: {
+                auto builtin = findBuiltin((BuiltinFunction)operand<uint64_t>(arg));
+                int first = depth - builtin->arguments;
+                out << "    {\n";
+                out << "        StrelaValue args[" << std::max<int>(builtin->arguments, 1) << "] = {";
+                for (int i = 0; i < (int)builtin->arguments; ++i) {
+                    out << (i ? ", " : " ") << slot(first + i);
+                }
+                out << " };\n";
+                out << "        " << (builtin->results ? slot(first) + " = " : "") << "strela_" << builtin->name << "(args);\n";
+                out << "    }\n";
+                break;
+            }
+
+            case Opcode::F32tI64:
+                out << "    " << top << ".value.integer = " << top << ".value.f32;\n";
+                out << "    " << top << ".type = STRELA_INTEGER;\n";
+                break;
+            case Opcode::F64tI64:
+                out << "    " << top << ".value.integer = " << top << ".value.f64;\n";
+                out << "    " << top << ".type = STRELA_INTEGER;\n";
+                break;
+            case Opcode::I64tF32:
+                // same as the VM, which clears the value before converting it
+                out << "    " << top << ".value.integer = 0;\n";
+                out << "    " << top << ".value.f32 = " << top << ".value.integer;\n";
+                out << "    " << top << ".type = STRELA_FLOATING;\n";
+                break;
+            case Opcode::I64tF64:
+                out << "    " << top << ".value.f64 = " << top << ".value.integer;\n";
+                out << "    " << top << ".type = STRELA_FLOATING;\n";
+                break;
+            case Opcode::F64tF32:
+                out << "    " << top << ".value.integer = 0;\n";
+                out << "    " << top << ".value.f32 = " << top << ".value.f64;\n";
+                out << "    " << top << ".type = STRELA_FLOATING;\n";
+                break;
+            case Opcode::F32tF64:
+                out << "    " << top << ".value.f64 = " << top << ".value.f32;\n";
+                out << "    " << top << ".type = STRELA_FLOATING;\n";
+                break;
+
+            case Opcode::CmpEQ:
+                out << "    " << second << ".value.boolean = strela_truthy(strela_eq(" << second << ", " << top << "));\n";
+                out << "    " << second << ".type = STRELA_BOOLEAN;\n";
+                break;
+            case Opcode::CmpNE:
+                out << "    " << second << ".value.boolean = strela_truthy(strela_ne(" << second << ", " << top << "));\n";
+                out << "    " << second << ".type = STRELA_BOOLEAN;\n";
+                break;
+            case Opcode::CmpLTI: compare("integer", "<"); break;
+            case Opcode::CmpLTF32: compare("f32", "<"); break;
+            case Opcode::CmpLTF64: compare("f64", "<"); break;
+            case Opcode::CmpGTI: compare("integer", ">"); break;
+            case Opcode::CmpGTF32: compare("f32", ">"); break;
+            case Opcode::CmpGTF64: compare("f64", ">"); break;
+            case Opcode::CmpEQI: compare("integer", "=="); break;
+            case Opcode::CmpEQF32: compare("f32", "=="); break;
+            case Opcode::CmpEQF64: compare("f64", "=="); break;
+            case Opcode::CmpEQB: compare("boolean", "=="); break;
+            case Opcode::CmpEQRef: compare("object", "=="); break;
+            case Opcode::CmpNEI: compare("integer", "!="); break;
+            case Opcode::CmpNEF32: compare("f32", "!="); break;
+            case Opcode::CmpNEF64: compare("f64", "!="); break;
+            case Opcode::CmpNEB: compare("boolean", "!="); break;
+            case Opcode::CmpNERef: compare("object", "!="); break;
+            case Opcode::CmpLTEI: compare("integer", "<="); break;
+            case Opcode::CmpLTEF32: compare("f32", "<="); break;
+            case Opcode::CmpLTEF64: compare("f64", "<="); break;
+            case Opcode::CmpGTEI: compare("integer", ">="); break;
+            case Opcode::CmpGTEF32: compare("f32", ">="); break;
+            case Opcode::CmpGTEF64: compare("f64", ">="); break;
+            case Opcode::CmpLTE:
+                out << "    " << second << " = strela_le(" << second << ", " << top << ");\n";
+                break;
+            case Opcode::CmpGTE:
+                out << "    " << second << " = strela_ge(" << second << ", " << top << ");\n";
+                break;
+            case Opcode::Not:
+                out << "    " << top << ".value.boolean = !" << top << ".value.boolean;\n";
+                break;
+            case Opcode::AndL:
+                out << "    " << second << ".value.boolean = " << second << ".value.boolean && " << top << ".value.boolean;\n";
+                break;
+            case Opcode::OrL:
+                out << "    " << second << ".value.boolean = " << second << ".value.boolean || " << top << ".value.boolean;\n";
+                break;
+
+            case Opcode::AddI: binary("integer", "+"); break;
+            case Opcode::AddF32: binary("f32", "+"); break;
+            case Opcode::AddF64: binary("f64", "+"); break;
+            case Opcode::SubI: binary("integer", "-"); break;
+            case Opcode::SubF32: binary("f32", "-"); break;
+            case Opcode::SubF64: binary("f64", "-"); break;
+            case Opcode::MulI: binary("integer", "*"); break;
+            case Opcode::MulF32: binary("f32", "*"); break;
+            case Opcode::MulF64: binary("f64", "*"); break;
+            case Opcode::DivI: binary("integer", "/"); break;
+            case Opcode::DivF32: binary("f32", "/"); break;
+            case Opcode::DivF64: binary("f64", "/"); break;
+            case Opcode::ModI: binary("integer", "%"); break;
+
+            case Opcode::New:
+                spill(depth);
+                out << "    " << push << " = strela_new(" << operand<uint16_t>(arg) << ", fp + " << depth << ");\n";
+                break;
+            case Opcode::Array:
+                spill(depth);
+                out << "    " << second << " = strela_array(" << second << ".value.integer, " << top << ".value.integer, fp + " << depth << ");\n";
+                break;
+            case Opcode::CmpType:
+                out << "    " << top << " = strela_boolean(strela_is_type(" << top << ".value.object, " << operand<uint64_t>(arg) << "));\n";
+                break;
+
+            case Opcode::Ptr8:
+            case Opcode::Ptr16:
+            case Opcode::Ptr32:
+            case Opcode::Ptr64:
+            case Opcode::ObjPtr64:
+            case Opcode::F64Ptr64:
+                out << "    " << top << " = strela_load(" << address(top, std::to_string(operand<int8_t>(arg)))
+                    << ", " << accessSize(ins.op) << ", " << loadedType(ins.op) << ");\n";
+                break;
+            case Opcode::Ptr64Var:
+            case Opcode::ObjPtr64Var:
+            case Opcode::F64Ptr64Var:
+                out << "    " << push << " = strela_load(" << address(reg(1), std::to_string(operand<int8_t>(arg)))
+                    << ", 8, " << loadedType(ins.op) << ");\n";
+                break;
+            case Opcode::PtrInd8:
+            case Opcode::PtrInd16:
+            case Opcode::PtrInd32:
+            case Opcode::PtrInd64:
+            case Opcode::ObjPtrInd64:
+            case Opcode::F64PtrInd64:
+                out << "    " << second << " = strela_load(" << address(top, second + ".value.integer + " + std::to_string(operand<int8_t>(arg)))
+                    << ", " << accessSize(ins.op) << ", " << loadedType(ins.op) << ");\n";
+                break;
+            case Opcode::StorePtr8:
+            case Opcode::StorePtr16:
+            case Opcode::StorePtr32:
+            case Opcode::StorePtr64:
+                out << "    strela_store(" << address(top, std::to_string(operand<int8_t>(arg))) << ", &" << second << ", " << accessSize(ins.op) << ");\n";
+                break;
+            case Opcode::StorePtr64Var:
+                out << "    strela_store(" << address(reg(1), std::to_string(operand<int8_t>(arg))) << ", &" << top << ", 8);\n";
+                break;
+            case Opcode::StorePtrInd8:
+            case Opcode::StorePtrInd16:
+            case Opcode::StorePtrInd32:
+            case Opcode::StorePtrInd64:
+                out << "    strela_store(" << address(top, second + ".value.integer + " + std::to_string(operand<int8_t>(arg))) << ", &" << third << ", " << accessSize(ins.op) << ");\n";
+                break;
+            case Opcode::PeekStorePtr8:
+            case Opcode::PeekStorePtr16:
+            case Opcode::PeekStorePtr32:
+            case Opcode::PeekStorePtr64:
+                out << "    strela_store(" << address(second, std::to_string(operand<int8_t>(arg))) << ", &" << top << ", " << accessSize(ins.op) << ");\n";
+                break;
+            case Opcode::InterfaceMethod:
+                out << "    " << push << " = strela_load(" << top << ".value.object, 8, STRELA_OBJECT);\n";
+                out << "    " << top << " = strela_load(" << address(top, std::to_string(operand<int8_t>(arg))) << ", 8, STRELA_INTEGER);\n";
+                break;
+
+            case Opcode::PrintI: out << "    strela_print_integer(" << top << ".value.integer);\n"; break;
+            case Opcode::PrintF32: out << "    strela_print_f32(" << top << ".value.f32);\n"; break;
+            case Opcode::PrintF64: out << "    strela_print_f64(" << top << ".value.f64);\n"; break;
+            case Opcode::PrintS: out << "    strela_print_string(" << top << ".value.object);\n"; break;
+            case Opcode::PrintN: out << "    strela_print_null();\n"; break;
+            case Opcode::PrintO: out << "    strela_print_object();\n"; break;
+            case Opcode::PrintB: out << "    strela_print_boolean(" << top << ".value.boolean);\n"; break;
+
+            case Opcode::JmpRel:
+            case Opcode::JmpImm:
+                out << "    " << go() << "\n";
+                break;
+            case Opcode::JmpIfRel:
+                out << "    if (" << top << ".value.boolean) " << go() << "\n";
+                break;
+            case Opcode::JmpIfNotRel:
+                out << "    if (!" << top << ".value.boolean) " << go() << "\n";
+                break;
+            case Opcode::JmpIfR:
+                out << "    if (" << reg(0) << ".value.boolean) " << go() << "\n";
+                break;
+            case Opcode::JmpIfNotR:
+                out << "    if (!" << reg(0) << ".value.boolean) " << go() << "\n";
+                break;
+            case Opcode::JmpIfLTI: jumpIf("<"); break;
+            case Opcode::JmpIfGEI: jumpIf(">="); break;
+            case Opcode::JmpIfGTI: jumpIf(">"); break;
+            case Opcode::JmpIfLEI: jumpIf("<="); break;
+
+            case Opcode::MovR:
+                out << "    " << reg(0) << " = " << reg(1) << ";\n";
+                break;
+            case Opcode::ConstR:
+                out << "    " << reg(0) << " = " << constant(operand<uint16_t>(arg + 1)) << ";\n";
+                break;
+            case Opcode::NotR:
+                out << "    { StrelaValue l = " << reg(1) << "; l.value.boolean = !l.value.boolean; " << reg(0) << " = l; }\n";
+                break;
+            case Opcode::AddIR: binaryR("integer", "+", reg(2) + ".value.integer"); break;
+            case Opcode::SubIR: binaryR("integer", "-", reg(2) + ".value.integer"); break;
+            case Opcode::MulIR: binaryR("integer", "*", reg(2) + ".value.integer"); break;
+            case Opcode::DivIR: binaryR("integer", "/", reg(2) + ".value.integer"); break;
+            case Opcode::ModIR: binaryR("integer", "%", reg(2) + ".value.integer"); break;
+            case Opcode::AddF32R: binaryR("f32", "+", reg(2) + ".value.f32"); break;
+            case Opcode::SubF32R: binaryR("f32", "-", reg(2) + ".value.f32"); break;
+            case Opcode::MulF32R: binaryR("f32", "*", reg(2) + ".value.f32"); break;
+            case Opcode::DivF32R: binaryR("f32", "/", reg(2) + ".value.f32"); break;
+            case Opcode::AddF64R: binaryR("f64", "+", reg(2) + ".value.f64"); break;
+            case Opcode::SubF64R: binaryR("f64", "-", reg(2) + ".value.f64"); break;
+            case Opcode::MulF64R: binaryR("f64", "*", reg(2) + ".value.f64"); break;
+            case Opcode::DivF64R: binaryR("f64", "/", reg(2) + ".value.f64"); break;
+            case Opcode::AddIRI: binaryR("integer", "+", std::to_string(operand<int8_t>(arg + 2))); break;
+            case Opcode::SubIRI: binaryR("integer", "-", std::to_string(operand<int8_t>(arg + 2))); break;
+            case Opcode::MulIRI: binaryR("integer", "*", std::to_string(operand<int8_t>(arg + 2))); break;
+            case Opcode::CmpEQR:
+                out << "    " << reg(0) << " = strela_boolean(strela_truthy(strela_eq(" << reg(1) << ", " << reg(2) << ")));\n";
+                break;
+            case Opcode::CmpNER:
+                out << "    " << reg(0) << " = strela_boolean(strela_truthy(strela_ne(" << reg(1) << ", " << reg(2) << ")));\n";
+                break;
+            case Opcode::CmpLTIR: compareR("integer", "<"); break;
+            case Opcode::CmpLTF32R: compareR("f32", "<"); break;
+            case Opcode::CmpLTF64R: compareR("f64", "<"); break;
+            case Opcode::CmpGTIR: compareR("integer", ">"); break;
+            case Opcode::CmpGTF32R: compareR("f32", ">"); break;
+            case Opcode::CmpGTF64R: compareR("f64", ">"); break;
+            case Opcode::CmpEQIR: compareR("integer", "=="); break;
+            case Opcode::CmpNEIR: compareR("integer", "!="); break;
+            case Opcode::CmpLTEIR: compareR("integer", "<="); break;
+            case Opcode::CmpGTEIR: compareR("integer", ">="); break;
+            case Opcode::CmpEQF64R: compareR("f64", "=="); break;
+            case Opcode::CmpNEF64R: compareR("f64", "!="); break;
+            case Opcode::CmpLTEF64R: compareR("f64", "<="); break;
+            case Opcode::CmpGTEF64R: compareR("f64", ">="); break;
+            case Opcode::CmpLTER:
+                out << "    " << reg(0) << " = strela_le(" << reg(1) << ", " << reg(2) << ");\n";
+                break;
+            case Opcode::CmpGTER:
+                out << "    " << reg(0) << " = strela_ge(" << reg(1) << ", " << reg(2) << ");\n";
+                break;
+            case Opcode::CmpEQIRI: compareRI("=="); break;
+            case Opcode::CmpNEIRI: compareRI("!="); break;
+            case Opcode::CmpLTIRI: compareRI("<"); break;
+            case Opcode::CmpGTIRI: compareRI(">"); break;
+            case Opcode::CmpLTEIRI: compareRI("<="); break;
+            case Opcode::CmpGTEIRI: compareRI(">="); break;
+
+            default:
+                unsupported(index, opcodeInfo[(unsigned char)ins.op].name);
+        }
+    }
+
+    bool CEmitter::stackEffect(size_t index, int& pops, int& pushes) const {
+        auto& ins = code[index];
+        pops = 0;
+        pushes = 0;
+
+        switch (ins.op) {
+            case Opcode::Trap:
+            case Opcode::ReturnVoid:
+            case Opcode::ReturnR:
+                return false;
+            case Opcode::Return:
+                pops = 1;
+                return false;
+            case Opcode::JmpRel:
+            case Opcode::JmpImm:
+                return false;
+
+            case Opcode::Const:
+            case Opcode::I8: case Opcode::I16: case Opcode::I32: case Opcode::I64:
+            case Opcode::U8: case Opcode::U16: case Opcode::U32: case Opcode::U64:
+            case Opcode::F32: case Opcode::F64:
+            case Opcode::Null:
+            case Opcode::Var:
+            case Opcode::Peek:
+            case Opcode::Repeat:
+            case Opcode::Ptr64Var:
+            case Opcode::ObjPtr64Var:
+            case Opcode::F64Ptr64Var:
+            case Opcode::New:
+            case Opcode::AddIVarVar:
+            case Opcode::AddIVarI8:
+                pushes = 1;
+                if (ins.op == Opcode::Repeat) {
+                    pops = 1;
+                    pushes = 2;
+                }
+                else if (ins.op == Opcode::Peek) {
+                    pops = operand<uint8_t>(ins.arg) + 1;
+                    pushes = pops + 1;
+                }
+                return true;
+            case Opcode::VarVar:
+            case Opcode::VarI8:
+                pushes = 2;
+                return true;
+            case Opcode::Grow:
+                pushes = operand<uint8_t>(ins.arg);
+                return true;
+
+            case Opcode::StoreVar:
+            case Opcode::Pop:
+            case Opcode::PrintI: case Opcode::PrintF32: case Opcode::PrintF64: case Opcode::PrintS:
+            case Opcode::PrintN: case Opcode::PrintO: case Opcode::PrintB:
+            case Opcode::StorePtr64Var:
+            case Opcode::JmpIfRel:
+            case Opcode::JmpIfNotRel:
+                pops = 1;
+                return true;
+
+            case Opcode::CmpEQ: case Opcode::CmpNE:
+            case Opcode::CmpLTI: case Opcode::CmpLTF32: case Opcode::CmpLTF64:
+            case Opcode::CmpGTI: case Opcode::CmpGTF32: case Opcode::CmpGTF64:
+            case Opcode::CmpLTE: case Opcode::CmpGTE:
+            case Opcode::CmpEQI: case Opcode::CmpEQF32: case Opcode::CmpEQF64: case Opcode::CmpEQB: case Opcode::CmpEQRef:
+            case Opcode::CmpNEI: case Opcode::CmpNEF32: case Opcode::CmpNEF64: case Opcode::CmpNEB: case Opcode::CmpNERef:
+            case Opcode::CmpLTEI: case Opcode::CmpLTEF32: case Opcode::CmpLTEF64:
+            case Opcode::CmpGTEI: case Opcode::CmpGTEF32: case Opcode::CmpGTEF64:
+            case Opcode::AddI: case Opcode::AddF32: case Opcode::AddF64:
+            case Opcode::SubI: case Opcode::SubF32: case Opcode::SubF64:
+            case Opcode::MulI: case Opcode::MulF32: case Opcode::MulF64:
+            case Opcode::DivI: case Opcode::DivF32: case Opcode::DivF64:
+            case Opcode::ModI:
+            case Opcode::AndL: case Opcode::OrL:
+            case Opcode::Array:
+            case Opcode::PtrInd8: case Opcode::PtrInd16: case Opcode::PtrInd32: case Opcode::PtrInd64: case Opcode::ObjPtrInd64: case Opcode::F64PtrInd64:
+            case Opcode::PeekStorePtr8: case Opcode::PeekStorePtr16: case Opcode::PeekStorePtr32: case Opcode::PeekStorePtr64:
+                pops = 2;
+                pushes = 1;
+                return true;
+
+            case Opcode::Not:
+            case Opcode::CmpType:
+            case Opcode::F32tI64: case Opcode::F64tI64: case Opcode::I64tF32:
+            case Opcode::I64tF64: case Opcode::F64tF32: case Opcode::F32tF64:
+            case Opcode::Ptr8: case Opcode::Ptr16: case Opcode::Ptr32: case Opcode::Ptr64: case Opcode::ObjPtr64: case Opcode::F64Ptr64:
+                pops = 1;
+                pushes = 1;
+                return true;
+            case Opcode::InterfaceMethod:
+                pops = 1;
+                pushes = 2;
+                return true;
+            case Opcode::Swap:
+                pops = 2;
+                pushes = 2;
+                return true;
+
+            case Opcode::StorePtr8: case Opcode::StorePtr16: case Opcode::StorePtr32: case Opcode::StorePtr64:
+            case Opcode::JmpIfLTI: case Opcode::JmpIfGEI: case Opcode::JmpIfGTI: case Opcode::JmpIfLEI:
+                pops = 2;
+                return true;
+            case Opcode::StorePtrInd8: case Opcode::StorePtrInd16: case Opcode::StorePtrInd32: case Opcode::StorePtrInd64:
+                pops = 3;
+                return true;
+
+            case Opcode::CallInd:
+                pops = operand<uint8_t>(ins.arg) + 1;
+                pushes = operand<uint8_t>(ins.arg + 1);
+                return true;
+            case Opcode::CallImm:
+                // arguments and the frame record slot
+                pops = operand<uint8_t>(ins.arg + 4) + 1;
+                pushes = callee(operand<uint32_t>(ins.arg), index).returns;
+                return true;
+            case Opcode::TailCallImm:
+                pops = operand<uint8_t>(ins.arg + 4);
+                return false;
+            case Opcode::NativeCall: {
+                // the compiler always pushes the foreign function's index right before calling it
+                int64_t funcindex;
+                if (index == 0 || !constantInteger(code[index - 1].op, code[index - 1].arg, funcindex)) {
+                    unsupported(index, "NativeCall without a constant function index");
+                }
+                if (funcindex < 0 || funcindex >= (int64_t)chunk.foreignFunctions.size()) {
+                    unsupported(index, "invalid foreign function");
+                }
+                auto& ff = chunk.foreignFunctions[funcindex];
+                pops = ff.argTypes.size() + 1;
+                pushes = ff.returnType != &VoidType::instance;
+                return true;
+            }
+            case Opcode::BuiltinCall: {
+                auto builtin = findBuiltin((BuiltinFunction)operand<uint64_t>(ins.arg));
+                if (!builtin) {
+                    unsupported(index, "unknown builtin");
+                }
+                pops = builtin->arguments;
+                pushes = builtin->results;
+                return true;
+            }
+
+            case Opcode::IncVar:
+            case Opcode::JmpIfR:
+            case Opcode::JmpIfNotR:
+                return true;
+
+            default:
+                if (addrMode(ins.op) != AddrMode::Stack) {
+                    return true;
+                }
+                unsupported(index, opcodeInfo[(unsigned char)ins.op].name);
+        }
+    }
+
+    long CEmitter::jumpTarget(size_t index) const {
+        auto& ins = code[index];
+        size_t target;
+        switch (addrMode(ins.op)) {
+            case AddrMode::Target:
+                target = operand<uint32_t>(ins.arg);
+                break;
+            case AddrMode::RegTarget:
+                target = operand<uint32_t>(ins.arg + 1);
+                break;
+            case AddrMode::RelTarget:
+                target = ins.address + operand<int32_t>(ins.arg);
+                break;
+            default:
+                return -1;
+        }
+        auto it = indices.find(target);
+        if (it == indices.end()) {
+            unsupported(index, "jump into the middle of an instruction");
+        }
+        return it->second;
+    }
+
+    const CEmitter::Function& CEmitter::callee(size_t address, size_t from) const {
+        auto it = functionAt.find(address);
+        if (it == functionAt.end()) {
+            unsupported(from, "call to an address that is not a function");
+        }
+        return functions[it->second];
+    }
+
+    std::string CEmitter::literal(const VMValue& value) const {
+        switch (value.getType()) {
+            case VMValue::Type::integer:
+                return "strela_value(" + integer(value.getInteger()) + ", STRELA_INTEGER)";
+            case VMValue::Type::floating: {
+                std::stringstream sstr;
+                sstr << value.getF64();
+                return "strela_value(" + bits(value.getInteger()) + ", STRELA_FLOATING) " + comment(sstr.str());
+            }
+            case VMValue::Type::boolean:
+                return std::string("strela_boolean(") + (value.getBoolean() ? "1" : "0") + ")";
+            default:
+                return "strela_value(0, STRELA_NULL)";
+        }
+    }
+
+    void CEmitter::unsupported(size_t index, const std::string& what) const {
+        throw Exception("Can not emit C for address " + std::to_string(code[index].address) + ": " + what);
+    }
+}
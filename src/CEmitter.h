@@ -0,0 +1,72 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_CEmitter_h
+#define Strela_CEmitter_h
+
+#include "VM/Opcode.h"
+
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Strela {
+    class ByteCodeChunk;
+    struct FunctionInfo;
+    struct VMValue;
+
+    /**
+     * Ahead-of-time back end. Translates a ByteCodeChunk to C that is linked against the runtime library
+     * (libstrela.a) into a standalone executable, one C function per Strela function.
+     *
+     * The stack depth is known statically at every instruction, so value stack slots become C locals.
+     * They are written back to the function's frame on the value stack only before calls and allocations,
+     * where callees read their arguments from it and the GC looks for roots.
+     */
+    class CEmitter {
+    public:
+        CEmitter(const ByteCodeChunk& chunk): chunk(chunk) {}
+
+        /** Writes the program as C source. Throws an Exception for bytecode it can not translate. */
+        void emit(std::ostream& out);
+
+    private:
+        struct Instruction {
+            size_t address;
+            Opcode op;
+            const Opcode* arg;
+        };
+
+        struct Function {
+            size_t address;
+            const FunctionInfo* info;
+            size_t begin;
+            size_t end;
+            bool returns;
+        };
+
+        void decode();
+        void emitTypes(std::ostream& out);
+        void emitForeignFunctions(std::ostream& out);
+        void emitFunction(std::ostream& out, const Function& function);
+        void emitInstruction(std::ostream& out, const Function& function, size_t index, int depth);
+        /** Stack slots popped and pushed by the instruction, false if control does not continue after it. */
+        bool stackEffect(size_t index, int& pops, int& pushes) const;
+        /** Index of the instruction an instruction jumps to, or -1. */
+        long jumpTarget(size_t index) const;
+        const Function& callee(size_t address, size_t from) const;
+        std::string literal(const VMValue& value) const;
+        [[noreturn]] void unsupported(size_t index, const std::string& what) const;
+
+    private:
+        const ByteCodeChunk& chunk;
+        std::vector<Instruction> code;
+        std::map<size_t, size_t> indices;
+        std::vector<Function> functions;
+        std::map<size_t, size_t> functionAt;
+    };
+}
+
+#endif
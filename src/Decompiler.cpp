@@ -16,12 +16,13 @@ namespace Strela {
     
     void Decompiler::printValue(const VMValue& c) const {
         std::cout << std::dec;
-        if (c.type == VMValue::Type::integer) std::cout << "int(" << c.value.integer << ")";
-        else if (c.type == VMValue::Type::floating) std::cout << "float(" << c.value.f64 << ")";
-        else if (c.type == VMValue::Type::boolean) std::cout << (c.value.boolean ? "true" : "false");
-        else if (c.type == VMValue::Type::null) std::cout << "null";
-        else if (c.type == VMValue::Type::object) {
-            std::cout << "\"" << escape((const char*)c.value.object) << "\"";
+        auto type = c.getType();
+        if (type == VMValue::Type::integer) std::cout << "int(" << c.getInteger() << ")";
+        else if (type == VMValue::Type::floating) std::cout << "float(" << c.getF64() << ")";
+        else if (type == VMValue::Type::boolean) std::cout << (c.getBoolean() ? "true" : "false");
+        else if (type == VMValue::Type::null) std::cout << "null";
+        else if (type == VMValue::Type::object) {
+            std::cout << "\"" << escape((const char*)c.getObject()) << "\"";
         }
         else std::cout << "???";
     }
@@ -35,6 +36,20 @@ namespace Strela {
             std::cout << "\n";
         }
 
+        std::cout << "\n; Class layouts\n";
+        for (auto type: chunk.types) {
+            auto layout = chunk.classLayouts.find(type);
+            if (layout == chunk.classLayouts.end()) continue;
+            std::cout << std::dec << type->name << ": " << type->objectSize << " bytes";
+            if (layout->second.external) {
+                std::cout << ", external";
+            }
+            else {
+                std::cout << ", " << layout->second.declaredSize << " in declaration order";
+            }
+            std::cout << "\n";
+        }
+
         for (size_t i = 0; i < chunk.opcodes.size(); ++i) {
             auto function = chunk.functions.find(i);
             if (function != chunk.functions.end()) {
@@ -73,11 +88,11 @@ namespace Strela {
                 std::cout << info.name;
             }
 
-            if (op == Opcode::Call || op == Opcode::Jmp || op == Opcode::JmpIf || op == Opcode::JmpIfNot) {
+            if (op == Opcode::CallInd || op == Opcode::Jmp || op == Opcode::JmpIf || op == Opcode::JmpIfNot) {
                 int cpos = i - width - opcodeInfo[(int)Opcode::Const].argWidth;
                 if (cpos >= 0 && (Opcode)chunk.opcodes[cpos] == Opcode::Const) {
                     auto constIndex = getArg(cpos);
-                    auto address = chunk.constants[constIndex].value.integer;
+                    auto address = chunk.constants[constIndex].getInteger();
                     auto it = chunk.functions.find(address);
                     if (it != chunk.functions.end()) {
                         std::cout << it->second.name;
@@ -92,7 +107,7 @@ namespace Strela {
                     std::cout << "(dynamic)";
                 }
             }
-			else if (op == Opcode::CallImm) {
+			else if (op == Opcode::CallImm || op == Opcode::TailCallImm) {
                 arg &= 0xffffffff;
 				auto it = chunk.functions.find(arg);
 				if (it != chunk.functions.end()) {
@@ -109,16 +124,25 @@ namespace Strela {
 					std::cout << chunk.types[arg]->name << " ";
 				}
 			}
-            else if (op == Opcode::ObjPtr64Var) {
+            else if (op == Opcode::ObjPtr64Var || op == Opcode::ObjPtrCVar) {
                 int offset = arg & 0xff;
                 int var = (arg & 0xff00) >> 8;
                 std::cout << std::dec << "(object)var_" << var << "[" << offset << "] ";
             }
-            else if (op == Opcode::Ptr64Var) {
+            else if (op == Opcode::Ptr64Var || op == Opcode::F64Ptr64Var) {
                 int offset = arg & 0xff;
                 int var = (arg & 0xff00) >> 8;
                 std::cout << std::dec << "var_" << var << "[" << offset << "] ";
             }
+            else if (op == Opcode::VarVar || op == Opcode::AddIVarVar) {
+                std::cout << std::dec << "var_" << (arg & 0xff) << ", var_" << ((arg & 0xff00) >> 8);
+            }
+            else if (op == Opcode::VarI8 || op == Opcode::AddIVarI8 || op == Opcode::IncVar) {
+                std::cout << std::dec << "var_" << (arg & 0xff) << ", " << (int)(int8_t)(arg >> 8);
+            }
+            else if (addrMode(op) != AddrMode::Stack) {
+                printRegisterOperands(op, opStart);
+            }
             else if (args.size()) {
                 std::cout << std::dec;
                 if (op == Opcode::Const) {
@@ -146,6 +170,42 @@ namespace Strela {
         }
     }
 
+    void Decompiler::printRegisterOperands(Opcode op, size_t pos) const {
+        auto arg = [&](size_t i) { return (int)(unsigned char)chunk.opcodes[pos + 1 + i]; };
+        auto printTarget = [&](size_t i) {
+            uint32_t address;
+            memcpy(&address, &chunk.opcodes[pos + 1 + i], sizeof(address));
+            int diff = (int)address - (int)pos;
+            std::cout << std::dec << (diff > 0 ? "+" : "") << diff;
+            std::cout << " (0x" << std::setw(8) << std::setfill('0') << std::hex << std::right << address << ")";
+        };
+
+        std::cout << std::dec;
+        switch (addrMode(op)) {
+            case AddrMode::Reg: std::cout << "r" << arg(0); break;
+            case AddrMode::RegReg: std::cout << "r" << arg(0) << ", r" << arg(1); break;
+            case AddrMode::RegConst: {
+                uint16_t index;
+                memcpy(&index, &chunk.opcodes[pos + 2], sizeof(index));
+                std::cout << "r" << arg(0) << ", ";
+                printValue(chunk.constants[index]);
+                break;
+            }
+            case AddrMode::RegRegReg: std::cout << "r" << arg(0) << ", r" << arg(1) << ", r" << arg(2); break;
+            case AddrMode::RegRegImm: std::cout << "r" << arg(0) << ", r" << arg(1) << ", " << (int)(int8_t)chunk.opcodes[pos + 3]; break;
+            case AddrMode::Target: printTarget(0); break;
+            case AddrMode::RegTarget: std::cout << "r" << arg(0) << ", "; printTarget(1); break;
+            case AddrMode::RelTarget: {
+                int32_t offset;
+                memcpy(&offset, &chunk.opcodes[pos + 1], sizeof(offset));
+                std::cout << (offset > 0 ? "+" : "") << offset;
+                std::cout << " (0x" << std::setw(8) << std::setfill('0') << std::hex << std::right << pos + offset << ")";
+                break;
+            }
+            default: break;
+        }
+    }
+
     uint64_t Decompiler::getArg(size_t pos) const {
         auto op = chunk.opcodes[pos];
         auto numargs = opcodeInfo[(int)op].argWidth;
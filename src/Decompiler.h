@@ -4,6 +4,8 @@
 #ifndef Strela_Decompiler_h
 #define Strela_Decompiler_h
 
+#include "VM/Opcode.h"
+
 #include <cstddef>
 #include <cstdint>
 
@@ -20,6 +22,7 @@ namespace Strela {
 
     private:
         void printValue(const VMValue& v) const;
+        void printRegisterOperands(Opcode op, size_t pos) const;
 
     private:
         const ByteCodeChunk& chunk;
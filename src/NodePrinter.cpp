@@ -36,6 +36,9 @@ namespace Strela {
         if (n.isExported) {
             std::cout << "export ";
         }
+        if (n.isExternal) {
+            std::cout << "external ";
+        }
         std::cout << "class " << n._name;
         if (!n.genericParams.empty()) {
             std::cout << "<";
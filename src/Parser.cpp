@@ -112,6 +112,7 @@ namespace Strela {
             else if (match(TokenType::Class)) {
                 auto cls = parseClassDecl(moddecl);
                 if (exportNext) cls->isExported = true;
+                cls->isExternal = externalNext;
                 moddecl->classes.push_back(cls);
             }
             else if (match(TokenType::Interface)) {
@@ -0,0 +1,332 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "RegisterCompiler.h"
+#include "Ast/nodes.h"
+#include "VM/ByteCodeChunk.h"
+#include "VM/Opcode.h"
+
+namespace Strela {
+
+    /**
+     * True if evaluating expr may assign to a local variable.
+     * Used to decide whether a local can be read lazily as a register operand.
+     */
+    bool writesLocals(Expr* expr) {
+        if (!expr) return false;
+        if (expr->as<IdExpr>() || expr->as<LitExpr>() || expr->as<ThisExpr>()) return false;
+        if (expr->as<AssignExpr>() || expr->as<PostfixExpr>()) return true;
+        if (auto binop = expr->as<BinopExpr>()) return writesLocals(binop->left) || writesLocals(binop->right);
+        if (auto unary = expr->as<UnaryExpr>()) return writesLocals(unary->target);
+        if (auto cast = expr->as<CastExpr>()) return writesLocals(cast->sourceExpr);
+        if (auto scope = expr->as<ScopeExpr>()) return writesLocals(scope->scopeTarget);
+        if (auto call = expr->as<CallExpr>()) {
+            if (writesLocals(call->callTarget)) return true;
+            for (auto&& arg: call->arguments) {
+                if (writesLocals(arg)) return true;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Maps a binary operator to its register opcode, or Trap if there is none.
+     */
+    Opcode registerOpcode(BinopExpr& n, bool immediate) {
+        auto type = n.left->type;
+        bool isInt = type->as<IntType>();
+        if (immediate) {
+            if (!isInt) return Opcode::Trap;
+            switch (n.op) {
+                case TokenType::Plus: return Opcode::AddIRI;
+                case TokenType::Minus: return Opcode::SubIRI;
+                case TokenType::Asterisk: return Opcode::MulIRI;
+                case TokenType::EqualsEquals: return Opcode::CmpEQIRI;
+                case TokenType::ExclamationMarkEquals: return Opcode::CmpNEIRI;
+                case TokenType::LessThan: return Opcode::CmpLTIRI;
+                case TokenType::GreaterThan: return Opcode::CmpGTIRI;
+                case TokenType::LessThanEquals: return Opcode::CmpLTEIRI;
+                case TokenType::GreaterThanEquals: return Opcode::CmpGTEIRI;
+                default: return Opcode::Trap;
+            }
+        }
+
+        bool isF32 = type == &FloatType::f32;
+        bool isF64 = type == &FloatType::f64;
+        auto cmp = comparand(n);
+        switch (n.op) {
+            case TokenType::Plus: return isInt ? Opcode::AddIR : isF32 ? Opcode::AddF32R : isF64 ? Opcode::AddF64R : Opcode::Trap;
+            case TokenType::Minus: return isInt ? Opcode::SubIR : isF32 ? Opcode::SubF32R : isF64 ? Opcode::SubF64R : Opcode::Trap;
+            case TokenType::Asterisk: return isInt ? Opcode::MulIR : isF32 ? Opcode::MulF32R : isF64 ? Opcode::MulF64R : Opcode::Trap;
+            case TokenType::Slash: return isInt ? Opcode::DivIR : isF32 ? Opcode::DivF32R : isF64 ? Opcode::DivF64R : Opcode::Trap;
+            case TokenType::Percent: return Opcode::ModIR;
+            // booleans, references and f32 have typed comparisons on the stack only
+            case TokenType::EqualsEquals: return cmp == Comparand::Int ? Opcode::CmpEQIR : cmp == Comparand::F64 ? Opcode::CmpEQF64R : cmp == Comparand::Generic ? Opcode::CmpEQR : Opcode::Trap;
+            case TokenType::ExclamationMarkEquals: return cmp == Comparand::Int ? Opcode::CmpNEIR : cmp == Comparand::F64 ? Opcode::CmpNEF64R : cmp == Comparand::Generic ? Opcode::CmpNER : Opcode::Trap;
+            case TokenType::LessThan: return isInt ? Opcode::CmpLTIR : isF32 ? Opcode::CmpLTF32R : isF64 ? Opcode::CmpLTF64R : Opcode::Trap;
+            case TokenType::GreaterThan: return isInt ? Opcode::CmpGTIR : isF32 ? Opcode::CmpGTF32R : isF64 ? Opcode::CmpGTF64R : Opcode::Trap;
+            case TokenType::LessThanEquals: return isInt ? Opcode::CmpLTEIR : isF64 ? Opcode::CmpLTEF64R : isF32 ? Opcode::Trap : Opcode::CmpLTER;
+            case TokenType::GreaterThanEquals: return isInt ? Opcode::CmpGTEIR : isF64 ? Opcode::CmpGTEF64R : isF32 ? Opcode::Trap : Opcode::CmpGTER;
+            default: return Opcode::Trap;
+        }
+    }
+
+    /**
+     * Small integer literal that fits the immediate operand of a RegRegImm opcode.
+     */
+    bool isImmediate(Expr* expr) {
+        auto lit = expr->as<LitExpr>();
+        if (!lit || !lit->type->as<IntType>()) return false;
+        auto val = lit->token.intVal();
+        return val >= -128 && val <= 127;
+    }
+
+    RegisterCompiler::RegisterCompiler(ByteCodeChunk& chunk): ByteCodeCompiler(chunk) {
+    }
+
+    void RegisterCompiler::enterFunction(FuncDecl& n) {
+        firstTemp = n.params.size() + (_class ? 1 : 0) + n.numVariables;
+        nextTemp = firstTemp;
+        maxTemp = firstTemp;
+        // frame size is patched in leaveFunction once the number of temporaries is known
+        growAddress = chunk.addOp<uint8_t>(Opcode::Grow, n.numVariables);
+    }
+
+    void RegisterCompiler::leaveFunction(FuncDecl& n) {
+        auto frameSize = n.numVariables + maxTemp - firstTemp;
+        if (maxTemp > 256 || frameSize > 255) {
+            error(n, "Function needs more than 256 registers.");
+            return;
+        }
+        chunk.writeArgument(growAddress, frameSize);
+        if (frameSize == 0) {
+            // nothing to reserve, so calls enter behind the Grow
+            n.opcodeStart = growAddress + 1 + sizeof(uint8_t);
+        }
+    }
+
+    int RegisterCompiler::allocTemp() {
+        auto temp = nextTemp++;
+        if (nextTemp > maxTemp) maxTemp = nextTemp;
+        return temp;
+    }
+
+    int RegisterCompiler::localSlot(Expr& expr) {
+        if (expr.as<ThisExpr>()) return 0;
+        if (!expr.as<IdExpr>()) return -1;
+        if (auto param = expr.node->as<Param>()) return param->index;
+        if (auto var = expr.node->as<VarDecl>()) return slotOf(var);
+        return -1;
+    }
+
+    int RegisterCompiler::toRegister(Expr& expr, int dst) {
+        auto slot = localSlot(expr);
+        if (slot >= 0) {
+            if (dst < 0) return slot;
+            if (dst != slot) chunk.addOp<uint8_t, uint8_t>(Opcode::MovR, dst, slot);
+            return dst;
+        }
+
+        if (dst < 0) dst = allocTemp();
+
+        auto lit = expr.as<LitExpr>();
+        auto binop = expr.as<BinopExpr>();
+        if (lit && isRegisterOperand(*lit)) {
+            if (lit->source) chunk.setLine(lit->source, lit->line);
+            VMValue value;
+            if (lit->type->as<IntType>()) value = VMValue(lit->token.intVal());
+            else if (lit->type == &FloatType::f64) value = VMValue(lit->token.floatVal());
+            else if (lit->type == &BoolType::instance) value = VMValue(int64_t(lit->token.boolVal() ? 1 : 0));
+            else value = VMValue((void*)lit->token.value.c_str());
+            chunk.addOp<uint8_t, uint16_t>(Opcode::ConstR, dst, chunk.addConstant(value));
+        }
+        else if (binop && !expr.as<AssignExpr>() && isRegisterBinop(*binop) && (isRegisterOperand(*binop->left) || isRegisterOperand(*binop->right))) {
+            // with neither operand in a register, the stack computes the result with one move instead of one per operand
+            compileBinop(*binop, dst);
+        }
+        else {
+            expr.accept(*this);
+            chunk.addOp<uint8_t>(Opcode::StoreVar, dst);
+        }
+        return dst;
+    }
+
+    bool RegisterCompiler::isRegisterBinop(BinopExpr& n) {
+        if (n.function) return false;
+        if (n.op == TokenType::AmpAmp || n.op == TokenType::PipePipe) return true;
+        return registerOpcode(n, false) != Opcode::Trap;
+    }
+
+    void RegisterCompiler::compileBinop(BinopExpr& n, int dst) {
+        if (n.source) chunk.setLine(n.source, n.line);
+        if (n.op == TokenType::AmpAmp || n.op == TokenType::PipePipe) {
+            compileLogical(n, dst);
+            return;
+        }
+
+        auto mark = nextTemp;
+        auto left = toRegister(*n.left);
+        if (left < firstTemp && writesLocals(n.right)) {
+            // the right operand may reassign the local, so read it now
+            auto temp = allocTemp();
+            chunk.addOp<uint8_t, uint8_t>(Opcode::MovR, temp, left);
+            left = temp;
+        }
+
+        auto immOp = isImmediate(n.right) ? registerOpcode(n, true) : Opcode::Trap;
+        uint8_t operands[3] = { uint8_t(dst), uint8_t(left), 0 };
+        if (immOp != Opcode::Trap) {
+            operands[2] = uint8_t(int8_t(n.right->as<LitExpr>()->token.intVal()));
+            chunk.addOp(immOp, sizeof(operands), operands);
+        }
+        else {
+            operands[2] = toRegister(*n.right);
+            if (n.source) chunk.setLine(n.source, n.line);
+            chunk.addOp(registerOpcode(n, false), sizeof(operands), operands);
+        }
+        nextTemp = mark;
+    }
+
+    void RegisterCompiler::compileLogical(BinopExpr& n, int dst) {
+        auto mark = nextTemp;
+        // a local destination may be read by the right operand, so only write it at the end
+        auto target = dst >= firstTemp ? dst : allocTemp();
+        toRegister(*n.left, target);
+        auto skip = jump(n.op == TokenType::AmpAmp ? Opcode::JmpIfNotR : Opcode::JmpIfR, target);
+        toRegister(*n.right, target);
+        land(skip);
+        if (target != dst) {
+            chunk.addOp<uint8_t, uint8_t>(Opcode::MovR, dst, target);
+        }
+        nextTemp = mark;
+    }
+
+    bool RegisterCompiler::isRegisterOperand(Expr& expr) {
+        if (localSlot(expr) >= 0) return true;
+        if (auto lit = expr.as<LitExpr>()) {
+            return lit->type->as<IntType>() || lit->type == &FloatType::f64 || lit->type == &BoolType::instance || lit->type == ClassDecl::String;
+        }
+        auto binop = expr.as<BinopExpr>();
+        return binop && !expr.as<AssignExpr>() && isRegisterBinop(*binop) && isRegisterOperand(*binop->left) && isRegisterOperand(*binop->right);
+    }
+
+    void RegisterCompiler::visit(BinopExpr& n) {
+        // when the result goes to the stack anyway, the fused stack opcodes (AddIVarI8, AddIVarVar)
+        // compute it in fewer instructions than a register opcode followed by a push
+        bool logical = n.op == TokenType::AmpAmp || n.op == TokenType::PipePipe;
+        if (!isRegisterBinop(n) || !logical) {
+            ByteCodeCompiler::visit(n);
+            return;
+        }
+        auto mark = nextTemp;
+        auto temp = allocTemp();
+        compileBinop(n, temp);
+        chunk.addOp<uint8_t>(Opcode::Var, temp);
+        nextTemp = mark;
+    }
+
+    void RegisterCompiler::visit(AssignExpr& n) {
+        if (n.source) chunk.setLine(n.source, n.line);
+        auto slot = localSlot(*n.left);
+        if (slot < 0 || n.left->arrayIndex || !n.parent->as<ExprStmt>()) {
+            ByteCodeCompiler::visit(n);
+            return;
+        }
+        auto mark = nextTemp;
+        toRegister(*n.right, slot);
+        nextTemp = mark;
+    }
+
+    void RegisterCompiler::visit(PostfixExpr& n) {
+        if (n.source) chunk.setLine(n.source, n.line);
+        auto slot = localSlot(*n.target);
+        if (slot < 0 || !n.target->type->as<IntType>() || !n.parent->as<ExprStmt>()) {
+            ByteCodeCompiler::visit(n);
+            return;
+        }
+        uint8_t operands[3] = { uint8_t(slot), uint8_t(slot), 1 };
+        chunk.addOp(n.op == TokenType::PlusPlus ? Opcode::AddIRI : Opcode::SubIRI, sizeof(operands), operands);
+    }
+
+    void RegisterCompiler::visit(VarDecl& n) {
+        if (n.source) chunk.setLine(n.source, n.line);
+        mapType(n.declType);
+        if (n.initializer) {
+            auto mark = nextTemp;
+            toRegister(*n.initializer, slotOf(&n));
+            nextTemp = mark;
+        }
+        functionInfo->variables.push_back({ slotOf(&n), n.name, mapType(n.declType) });
+    }
+
+    void RegisterCompiler::visit(RetStmt& n) {
+        if (n.source) chunk.setLine(n.source, n.line);
+        if (n.expression && tailCall(*n.expression)) {
+            return;
+        }
+        if (n.expression && !isRegisterOperand(*n.expression)) {
+            // a result computed on the stack is returned from there
+            ByteCodeCompiler::visit(n);
+            return;
+        }
+        if (n.expression) {
+            auto mark = nextTemp;
+            auto result = toRegister(*n.expression);
+            chunk.addOp<uint8_t>(Opcode::ReturnR, result);
+            nextTemp = mark;
+        }
+        else {
+            chunk.addOp(Opcode::ReturnVoid);
+        }
+    }
+
+    bool RegisterCompiler::branchesOnRegister(Expr& condition) {
+        if (localSlot(condition) >= 0) return true;
+        // logical operators and integer ordering fuse into compare-and-jump opcodes on the stack
+        auto binop = condition.as<BinopExpr>();
+        if (!binop || binop->op == TokenType::AmpAmp || binop->op == TokenType::PipePipe) return false;
+        bool ordering = binop->op == TokenType::LessThan || binop->op == TokenType::GreaterThan || binop->op == TokenType::LessThanEquals || binop->op == TokenType::GreaterThanEquals;
+        if (ordering && binop->left->type->as<IntType>()) return false;
+        return isRegisterOperand(condition);
+    }
+
+    void RegisterCompiler::visit(IfStmt& n) {
+        if (!branchesOnRegister(*n.condition)) {
+            ByteCodeCompiler::visit(n);
+            return;
+        }
+        if (n.source) chunk.setLine(n.source, n.line);
+        auto mark = nextTemp;
+        auto cond = toRegister(*n.condition);
+        nextTemp = mark;
+        auto skip = jump(Opcode::JmpIfNotR, cond);
+        visitChild(n.trueBranch);
+
+        if (n.falseBranch) {
+            auto end = jump(Opcode::JmpImm);
+            land(skip);
+            visitChild(n.falseBranch);
+            land(end);
+        }
+        else {
+            land(skip);
+        }
+    }
+
+    void RegisterCompiler::visit(WhileStmt& n) {
+        if (!branchesOnRegister(*n.condition)) {
+            ByteCodeCompiler::visit(n);
+            return;
+        }
+        if (n.source) chunk.setLine(n.source, n.line);
+        uint32_t start = chunk.label();
+        auto mark = nextTemp;
+        auto cond = toRegister(*n.condition);
+        nextTemp = mark;
+        auto exit = jump(Opcode::JmpIfNotR, cond);
+        visitChild(n.body);
+        chunk.addOp<uint32_t>(Opcode::JmpImm, start);
+        land(exit);
+    }
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_RegisterCompiler_h
+#define Strela_RegisterCompiler_h
+
+#include "ByteCodeCompiler.h"
+#include "VM/Opcode.h"
+
+namespace Strela {
+    class BinopExpr;
+
+    /**
+     * Back end for the register instruction set.
+     * Locals, parameters and temporaries are frame slots that register opcodes address directly.
+     * Everything the register set does not cover is compiled by the stack back end and moved
+     * into a slot with StoreVar. Expressions whose result ends up on the stack anyway, like call
+     * arguments, stay on the stack where the fused opcodes need fewer instructions.
+     */
+    class RegisterCompiler: public ByteCodeCompiler {
+    public:
+        RegisterCompiler(ByteCodeChunk&);
+
+        void visit(IfStmt&) override;
+        void visit(RetStmt&) override;
+        void visit(VarDecl&) override;
+        void visit(WhileStmt&) override;
+
+        void visit(AssignExpr&) override;
+        void visit(BinopExpr&) override;
+        void visit(PostfixExpr&) override;
+
+    protected:
+        void enterFunction(FuncDecl& n) override;
+        void leaveFunction(FuncDecl& n) override;
+
+    private:
+        int localSlot(Expr& expr);
+        bool isRegisterOperand(Expr& expr);
+        int allocTemp();
+        int toRegister(Expr& expr, int dst = -1);
+        bool isRegisterBinop(BinopExpr& n);
+        bool branchesOnRegister(Expr& condition);
+        void compileBinop(BinopExpr& n, int dst);
+        void compileLogical(BinopExpr& n, int dst);
+
+    private:
+        size_t growAddress = 0;
+        int firstTemp = 0;
+        int nextTemp = 0;
+        int maxTemp = 0;
+    };
+}
+
+#endif
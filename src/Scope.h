@@ -5,6 +5,7 @@
 #define Strela_Scope_h
 
 #include <map>
+#include <string>
 
 namespace Strela {
     class Node;
@@ -798,6 +798,11 @@ namespace Strela {
             if (!((leftScalar && rightScalar) || (ltype == rtype))) {
                 error(n, "Binary operator '" + getTokenName(op) + "' is not applicable to types '" + ltype->getFullName() + "' and '" + rtype->getFullName() + "'.");
             }
+            if (ltype == rtype) {
+                // unwrap operands narrowed by 'is' so both sides compare as the refined type
+                n.left = addCast(n.left, ltype);
+                n.right = addCast(n.right, rtype);
+            }
             n.type = &BoolType::instance;
         }
         else if (op == TokenType::PipePipe || op == TokenType::AmpAmp) {
@@ -0,0 +1,103 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "Builtins.h"
+#include "Runtime.h"
+#include "VM.h"
+#include "ByteCodeChunk.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace Strela {
+    static const Builtin builtins[] {
+        { "String_eq_String", String_eq_String, 2, 1 },
+        { "String_plus_String", String_plus_String, 2, 1 },
+        { "prefork", prefork, 0, 1 },
+    };
+
+    void String_eq_String(VM& vm) {
+        auto other = vm.pop();
+        auto self = vm.pop();
+        vm.push(stringEquals(self, other));
+    }
+
+    void String_plus_String(VM& vm) {
+        static const VMType* stringType = nullptr;
+        static const VMType* u8Type = nullptr;
+
+        // allocates, the operands on the stack are roots
+        if (vm.gc.collectionDue()) {
+            vm.gc.collect(vm.stack, vm.sp);
+        }
+
+        auto other = vm.pop();
+        auto self = vm.pop();
+
+        if (!stringType) {
+            stringType = findType(vm.chunk.types, "String");
+        }
+        if (!u8Type) {
+            u8Type = findType(vm.chunk.types, "u8[]");
+        }
+
+        vm.push(stringConcat(vm.gc, stringType, u8Type, self, other));
+    }
+
+    void prefork(VM& vm) {
+#ifndef _WIN32
+        if (vm.preforkWorkers) {
+            // garbage left in the heap would be swept by every worker, which writes to its pages
+            vm.gc.collectAll(vm.stack, vm.sp);
+            // the marking threads would not exist in the workers
+            auto threads = vm.gc.threads();
+            vm.gc.setThreads(1);
+            std::cout.flush();
+            fflush(nullptr);
+
+            std::vector<pid_t> workers;
+            for (size_t i = 0; i < vm.preforkWorkers; ++i) {
+                auto pid = fork();
+                if (pid == 0) {
+                    vm.gc.setThreads(threads);
+                    vm.worker = i;
+                    vm.push(VMValue(int64_t(i)));
+                    return;
+                }
+                if (pid < 0) {
+                    std::cerr << "Could not fork worker " << i << ": " << strerror(errno) << "\n";
+                    break;
+                }
+                workers.push_back(pid);
+            }
+
+            bool failed = workers.size() < vm.preforkWorkers;
+            for (auto pid: workers) {
+                int status = 0;
+                while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+                failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            }
+            exit(failed ? 1 : 0);
+        }
+#endif
+        vm.push(VMValue(int64_t(0)));
+    }
+
+    const Builtin* findBuiltin(BuiltinFunction function) {
+        for (auto& builtin: builtins) {
+            if (builtin.function == function) {
+                return &builtin;
+            }
+        }
+        return nullptr;
+    }
+}
@@ -0,0 +1,37 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_VM_Builtins_h
+#define Strela_VM_Builtins_h
+
+#include "../Ast/FuncDecl.h"
+
+#include <cstdint>
+
+namespace Strela {
+    /**
+     * Native function the VM calls through BuiltinCall, with its stack effect.
+     * Code compiled with --emit-c calls the runtime's strela_<name> instead.
+     */
+    struct Builtin {
+        const char* name;
+        BuiltinFunction function;
+        uint32_t arguments;
+        uint32_t results;
+    };
+
+    void String_eq_String(VM& vm);
+    void String_plus_String(VM& vm);
+    /**
+     * Forks vm.preforkWorkers processes that go on from the call and get their number back, starting at 0.
+     * The heap is collected first, so the workers share it with the parent as long as its objects live.
+     * The parent waits for the workers and exits, failing if any of them did. Without workers to fork,
+     * the program goes on alone and gets 0.
+     */
+    void prefork(VM& vm);
+
+    /** Looks up the builtin behind a BuiltinCall operand, null if there is none. */
+    const Builtin* findBuiltin(BuiltinFunction function);
+}
+
+#endif
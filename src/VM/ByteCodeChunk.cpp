@@ -12,9 +12,9 @@ namespace Strela {
     int ByteCodeChunk::addConstant(VMValue c) {
         for (int i = 0; i < constants.size(); ++i) {
             if (
-                c.type == VMValue::Type::object
-                && constants[i].type == VMValue::Type::object
-                && !strcmp((const char*)c.value.object, (const char*)constants[i].value.object)
+                c.getType() == VMValue::Type::object
+                && constants[i].getType() == VMValue::Type::object
+                && !strcmp((const char*)c.getObject(), (const char*)constants[i].getObject())
             ) {
                 return i;
             }
@@ -43,7 +43,7 @@ namespace Strela {
     int ByteCodeChunk::addOp(Opcode code) {
         if (opcodeInfo[(unsigned char)code].argWidth > 0) throw Exception(std::string("Opcode ") + opcodeInfo[(unsigned char)code].name + " requires arguments.");
         opcodes.push_back(code);
-        return opcodes.size() - 1;
+        return fuse(opcodes.size() - 1);
     }
 
     int ByteCodeChunk::addOp(Opcode code, size_t argSize, const void* arg) {
@@ -55,7 +55,7 @@ namespace Strela {
         opcodes.push_back(code);
         opcodes.resize(opcodes.size() + argSize);
         memcpy(&opcodes[opAddr + 1], arg, argSize);
-        return opAddr;
+        return fuse(opAddr);
     }
 
     int ByteCodeChunk::addOp(Opcode code, size_t argSize1, const void* arg1, size_t argSize2, const void* arg2) {
@@ -68,9 +68,108 @@ namespace Strela {
         opcodes.resize(opcodes.size() + argSize1 + argSize2);
         memcpy(&opcodes[opAddr + 1], arg1, argSize1);
         memcpy(&opcodes[opAddr + 1 + argSize1], arg2, argSize2);
+        return fuse(opAddr);
+    }
+
+    size_t ByteCodeChunk::label() {
+        window.clear();
+        return opcodes.size();
+    }
+
+    int ByteCodeChunk::replace(size_t count, Opcode code, size_t argSize, const void* arg) {
+        auto opAddr = window[window.size() - count];
+        window.resize(window.size() - count);
+        window.push_back(opAddr);
+        opcodes.resize(opAddr + 1 + argSize);
+        opcodes[opAddr] = code;
+        memcpy(&opcodes[opAddr + 1], arg, argSize);
         return opAddr;
     }
 
+    /**
+     * Peephole pass, run on every emitted opcode. Rewrites the tail of the opcode stream into
+     * superinstructions for sequences that show up at the top of --opcode-pairs profiles.
+     * Rules only look at the newest opcode and what was fused before it, so longer sequences
+     * are built up one opcode at a time.
+     */
+    int ByteCodeChunk::fuse(size_t address) {
+        window.push_back(address);
+        if (window.size() > 5) {
+            window.erase(window.begin());
+        }
+
+        auto n = window.size();
+        auto op = [&](size_t i) { return opcodes[window[n - 1 - i]]; };
+        auto arg = [&](size_t i, size_t offset) { return (uint8_t)opcodes[window[n - 1 - i] + 1 + offset]; };
+        auto last = op(0);
+
+        if (n < 2) {
+            return address;
+        }
+
+        // Var a, Var b
+        if (last == Opcode::Var && op(1) == Opcode::Var) {
+            uint8_t args[] { arg(1, 0), arg(0, 0) };
+            return replace(2, Opcode::VarVar, 2, args);
+        }
+        // Var a, U8 k / I8 k
+        if (((last == Opcode::U8 && arg(0, 0) < 0x80) || last == Opcode::I8) && op(1) == Opcode::Var) {
+            uint8_t args[] { arg(1, 0), arg(0, 0) };
+            return replace(2, Opcode::VarI8, 2, args);
+        }
+        // Var a, Var b, AddI
+        if (last == Opcode::AddI && op(1) == Opcode::VarVar) {
+            uint8_t args[] { arg(1, 0), arg(1, 1) };
+            return replace(2, Opcode::AddIVarVar, 2, args);
+        }
+        // Var a, I8 k, AddI / SubI
+        if ((last == Opcode::AddI || (last == Opcode::SubI && arg(1, 1) != 0x80)) && op(1) == Opcode::VarI8) {
+            int8_t k = arg(1, 1);
+            uint8_t args[] { arg(1, 0), uint8_t(last == Opcode::AddI ? k : -k) };
+            return replace(2, Opcode::AddIVarI8, 2, args);
+        }
+        // Var a, I8 k, AddI, StoreVar a (PostfixExpr, a += k)
+        if (last == Opcode::StoreVar && op(1) == Opcode::AddIVarI8 && arg(0, 0) == arg(1, 0)) {
+            uint8_t args[] { arg(1, 0), arg(1, 1) };
+            return replace(2, Opcode::IncVar, 2, args);
+        }
+        // Peek 1, StorePtrN (ArrayLitExpr, interface construction)
+        if (last >= Opcode::StorePtr8 && last <= Opcode::StorePtr64 && op(1) == Opcode::Peek && arg(1, 0) == 1) {
+            static_assert((int)Opcode::StorePtr64 - (int)Opcode::StorePtr8 == (int)Opcode::PeekStorePtr64 - (int)Opcode::PeekStorePtr8, "StorePtr and PeekStorePtr opcodes must line up");
+            uint8_t offset = arg(0, 0);
+            return replace(2, Opcode((int)Opcode::PeekStorePtr8 + (int)last - (int)Opcode::StorePtr8), 1, &offset);
+        }
+        if (last == Opcode::StorePtrC && op(1) == Opcode::Peek && arg(1, 0) == 1) {
+            uint8_t offset = arg(0, 0);
+            return replace(2, Opcode::PeekStorePtrC, 1, &offset);
+        }
+        // CmpLTI / CmpGTI / CmpLTEI / CmpGTEI, JmpIfRel / JmpIfNotRel
+        if ((last == Opcode::JmpIfRel || last == Opcode::JmpIfNotRel) && (op(1) == Opcode::CmpLTI || op(1) == Opcode::CmpGTI || op(1) == Opcode::CmpLTEI || op(1) == Opcode::CmpGTEI)) {
+            auto when = last == Opcode::JmpIfRel;
+            Opcode fused;
+            switch (op(1)) {
+                case Opcode::CmpLTI: fused = when ? Opcode::JmpIfLTI : Opcode::JmpIfGEI; break;
+                case Opcode::CmpGTI: fused = when ? Opcode::JmpIfGTI : Opcode::JmpIfLEI; break;
+                case Opcode::CmpLTEI: fused = when ? Opcode::JmpIfLEI : Opcode::JmpIfGTI; break;
+                default: fused = when ? Opcode::JmpIfGEI : Opcode::JmpIfLTI; break;
+            }
+            int32_t offset;
+            memcpy(&offset, &opcodes[address + 1], sizeof(offset));
+            // the fused jump starts where the compare did
+            offset += address - window[n - 2];
+            return replace(2, fused, sizeof(offset), &offset);
+        }
+        // Repeat, Ptr64 k, Swap, ObjPtr64 0 / ObjPtrC 0 (interface method lookup)
+        if (
+            n >= 4 && (last == Opcode::ObjPtr64 || last == Opcode::ObjPtrC) && arg(0, 0) == 0 && op(1) == Opcode::Swap
+            && op(2) == Opcode::Ptr64 && op(3) == Opcode::Repeat
+        ) {
+            uint8_t offset = arg(2, 0);
+            return replace(4, last == Opcode::ObjPtrC ? Opcode::InterfaceMethodC : Opcode::InterfaceMethod, 1, &offset);
+        }
+        return address;
+    }
+
     void ByteCodeChunk::addFunction(size_t address, const FunctionInfo& func) {
         functions.insert(std::make_pair(address, func));
     }
@@ -181,11 +280,11 @@ namespace Strela {
                 if (!lines.empty() && lines.back().file == i && lines.back().line == line) {
                     return;
                 }
-                lines.push_back({ opcodes.size(), i, line });
+                lines.push_back({ label(), i, line });
                 return;
             }
         }
         files.push_back(file);
-        lines.push_back({ opcodes.size(), files.size() - 1, line });
+        lines.push_back({ label(), files.size() - 1, line });
     }
 }
\ No newline at end of file
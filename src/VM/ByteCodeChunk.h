@@ -55,6 +55,15 @@ namespace Strela {
     struct FunctionInfo {
         std::string name;
         std::vector<VarInfo> variables;
+        /** Number of argument slots the caller passes, including this. */
+        size_t arguments;
+    };
+
+    struct ClassLayout {
+        /** Object size the class would have with its fields in declaration order. */
+        size_t declaredSize;
+        /** Declared external, so the fields are in declaration order. */
+        bool external;
     };
 
     class ByteCodeChunk {
@@ -67,6 +76,10 @@ namespace Strela {
         size_t main;
         std::vector<const SourceFile*> files;
         std::vector<SourceLine> lines;
+        /** Object fields and array elements hold compressed references, the VM has to allocate its heap to match. */
+        bool compressedReferences = false;
+        /** How the compiler laid out each class, for --dump. */
+        std::map<const VMType*, ClassLayout> classLayouts;
 
 		const SourceLine* getLine(size_t address) const;
         void setLine(const SourceFile* file, size_t line);
@@ -85,6 +98,16 @@ namespace Strela {
         }
         void writeArgument(size_t pos, uint64_t arg);
         void write(size_t pos, void* data, size_t size);
+        /** Address of the next opcode as a jump target. Instructions are never fused across a label. */
+        size_t label();
+
+    private:
+        int fuse(size_t address);
+        int replace(size_t count, Opcode code, size_t argSize, const void* arg);
+
+    private:
+        /** Start addresses of the most recent opcodes since the last label, for the peephole pass. */
+        std::vector<size_t> window;
     };
 
     std::ostream& operator<<(std::ostream& str, const ByteCodeChunk& chunk);
@@ -133,7 +133,7 @@ namespace Strela {
 		else if (type.name == "String") {
 			write("class\n");
 			if (*(char**)val) {
-				write("\"" + escape(**((char***)val) + 8) + "\"\n");
+				write("\"" + escape((char*)loadReference(*(void**)val) + 8) + "\"\n");
 			}
 			else {
 				write("String (null)\n");
@@ -180,6 +180,16 @@ namespace Strela {
 		}
 	}
 
+	void Debugger::writeSlot(const VMType& type, const void* slot) {
+		if (type.isReference()) {
+			auto ref = loadReference(slot);
+			write(type, &ref);
+		}
+		else {
+			write(type, slot);
+		}
+	}
+
 	int Debugger::run() {
 		do {
 			int num;
@@ -294,12 +304,13 @@ namespace Strela {
 						commands.pop_front();
 						write("ACK_VARIABLES\n");
 
-						if (memref <= vm.callStack.size() + 1) {
+						auto callStack = vm.callStack();
+						if (memref <= callStack.size() + 1) {
 							size_t bp = vm.bp;
-							size_t ip = vm.ip;
-							if (memref > 1 && memref < vm.callStack.size() + 2) {
-								bp = vm.callStack[vm.callStack.size() + 1 - memref].bp;
-								ip = vm.callStack[vm.callStack.size() + 1 - memref].ip;
+							size_t ip = vm.addressOf(vm.ip);
+							if (memref > 1 && memref < callStack.size() + 2) {
+								bp = callStack[callStack.size() + 1 - memref].bp;
+								ip = vm.addressOf(callStack[callStack.size() + 1 - memref].ip);
 							}
 
 							FunctionInfo* fi = nullptr;
@@ -317,19 +328,20 @@ namespace Strela {
 							else {
 								int numVars = 0;
 								for (auto& var : fi->variables) {
-									if (bp + var.offset >= vm.stack.size()) {
+									if (bp + var.offset >= vm.stackDepth()) {
 										continue;
 									}
 									numVars++;
 								}
 								write(std::to_string(numVars) + "\n");
 								for (auto& var : fi->variables) {
-									if (bp + var.offset >= vm.stack.size()) {
+									if (bp + var.offset >= vm.stackDepth()) {
 										continue;
 									}
 
 									write(var.name + "\n");
-									write(*var.type, &vm.stack[bp + var.offset]);
+									auto bits = vm.stack[bp + var.offset].bits();
+									write(*var.type, &bits);
 								}
 							}
 						}
@@ -337,7 +349,7 @@ namespace Strela {
 							auto obj = (VMObject*)memref;
 							obj--;
 
-							if (obj->type->isArray) {
+							if (obj->type()->isArray) {
 								uint64_t len = *(uint64_t*)memref;
 								write(std::to_string(len + 1) + "\n");
 								write("length\n");
@@ -348,13 +360,13 @@ namespace Strela {
 								char* data = (char*)memref + 8;
 								for (uint64_t i = 0; i < len; ++i) {
 									write(std::to_string(i) + "\n");
-									write(*obj->type->arrayType, data);
-									data += obj->type->arrayType->size;
+									writeSlot(*obj->type()->arrayType, data);
+									data += obj->type()->arrayType->size;
 								}
 							}
 							else {
-								if (obj->type->unionTypes.size()) {
-									VMType* type = obj->type->unionTypes[*(uint64_t*)memref];
+								if (obj->type()->unionTypes.size()) {
+									VMType* type = obj->type()->unionTypes[*(uint64_t*)memref];
 									write("2\n");
 									
 									write("_tag\n");
@@ -365,13 +377,13 @@ namespace Strela {
 									
 									write("_ref\n");
 									auto ref = (void*)(memref + 8);
-									write(*type, ref);
+									writeSlot(*type, ref);
 								}
 								else {
-									write(std::to_string(obj->type->fields.size()) + "\n");
-									for (auto& field : obj->type->fields) {
+									write(std::to_string(obj->type()->fields.size()) + "\n");
+									for (auto& field : obj->type()->fields) {
 										write(field.name + "\n");
-										write(*field.type, (char*)memref + field.offset);
+										writeSlot(*field.type, (char*)memref + field.offset);
 									}
 								}
 							}
@@ -383,26 +395,26 @@ namespace Strela {
 
 					write("ACK_STEP\n");
 
-					auto line = vm.chunk.getLine(vm.ip);
+					auto line = vm.chunk.getLine(vm.addressOf(vm.ip));
 
 					do {
-						auto op = vm.chunk.opcodes[vm.ip];
+						auto op = vm.code[vm.ip].op;
 
 						if (op == Opcode::Trap) {
-							auto it = breakpoints.find(vm.ip);
+							auto it = breakpoints.find(vm.addressOf(vm.ip));
 							if (it != breakpoints.end()) {
 								op = it->second.originalOpcode;
 							}
 						}
 
-						if (op == Opcode::Call) {
-							addBreakpoint(vm.ip + 2, true);
+						if (op == Opcode::CallInd || op == Opcode::CallIndQ) {
+							addBreakpoint(vm.addressOf(vm.ip + 1), true);
 							step();
 							vm.status = VM::RUNNING;
 							break;
 						}
 						else if (op == Opcode::CallImm) {
-							addBreakpoint(vm.ip + 6, true);
+							addBreakpoint(vm.addressOf(vm.ip + 1), true);
 							step();
 							vm.status = VM::RUNNING;
 							break;
@@ -410,7 +422,7 @@ namespace Strela {
 
 						step();
 
-						auto line2 = vm.chunk.getLine(vm.ip);
+						auto line2 = vm.chunk.getLine(vm.addressOf(vm.ip));
 						if (!line || !line2 || line->line != line2->line) {
 							write("HIT\n");
 							vm.status = VM::STOPPED;
@@ -423,19 +435,19 @@ namespace Strela {
 
 					write("ACK_STEPIN\n");
 
-					auto line = vm.chunk.getLine(vm.ip);
+					auto line = vm.chunk.getLine(vm.addressOf(vm.ip));
 
 					do {
-						auto op = vm.chunk.opcodes[vm.ip];
+						auto op = vm.code[vm.ip].op;
 
 						if (op == Opcode::Trap) {
-							auto it = breakpoints.find(vm.ip);
+							auto it = breakpoints.find(vm.addressOf(vm.ip));
 							if (it != breakpoints.end()) {
 								op = it->second.originalOpcode;
 							}
 						}
 
-						if (op == Opcode::Call || op == Opcode::CallImm) {
+						if (op == Opcode::CallInd || op == Opcode::CallIndQ || op == Opcode::CallImm) {
 							step();
 							write("HIT\n");
 							vm.status = VM::STOPPED;
@@ -444,7 +456,7 @@ namespace Strela {
 
 						step();
 
-						auto line2 = vm.chunk.getLine(vm.ip);
+						auto line2 = vm.chunk.getLine(vm.addressOf(vm.ip));
 						if (!line || !line2 || line->line != line2->line) {
 							write("HIT\n");
 							vm.status = VM::STOPPED;
@@ -458,10 +470,10 @@ namespace Strela {
 					write("ACK_STEPOUT\n");
 
 					do {
-						auto op = vm.chunk.opcodes[vm.ip];
+						auto op = vm.code[vm.ip].op;
 
 						if (op == Opcode::Trap) {
-							auto it = breakpoints.find(vm.ip);
+							auto it = breakpoints.find(vm.addressOf(vm.ip));
 							if (it != breakpoints.end()) {
 								op = it->second.originalOpcode;
 							}
@@ -498,7 +510,7 @@ namespace Strela {
 			}
 		} while (vm.status != VM::FINISHED);
 
-		return vm.exitCode.value.integer;
+		return vm.exitCode.getInteger();
 	}
 
 	void Debugger::write(const std::string& str) {
@@ -510,12 +522,13 @@ namespace Strela {
 	}
 
 	void Debugger::addBreakpoint(size_t address, bool once) {
-		if (vm.chunk.opcodes[address] == Opcode::Trap) {
+		auto index = vm.indexOf(address);
+		if (vm.code[index].op == Opcode::Trap) {
 			return;
 		}
 
-		breakpoints.insert(std::make_pair(address, Breakpoint{ address, vm.chunk.opcodes[address], once }));
-		vm.chunk.opcodes[address] = Opcode::Trap;
+		breakpoints.insert(std::make_pair(address, Breakpoint{ address, vm.code[index].op, once }));
+		vm.patch(index, Opcode::Trap);
 	}
 
 	void Debugger::addBreakpoint(const std::string& file, size_t line, bool once) {
@@ -532,7 +545,7 @@ namespace Strela {
 			if (pathEquals(vm.chunk.files[codeline.file]->filename, file) && codeline.line == line) {
 				auto it = breakpoints.find(codeline.address);
 				if (it != breakpoints.end()) {
-					vm.chunk.opcodes[codeline.address] = it->second.originalOpcode;
+					vm.patch(vm.indexOf(codeline.address), it->second.originalOpcode);
 					breakpoints.erase(it);
 					write("Removed breakpoint\n");
 					return;
@@ -545,7 +558,7 @@ namespace Strela {
 		for (auto it = breakpoints.begin(); it != breakpoints.end(); ) {
 			if (auto source = vm.chunk.getLine(it->second.address)) {
 				if (pathEquals(vm.chunk.files[source->file]->filename, file)) {
-					vm.chunk.opcodes[source->address] = it->second.originalOpcode;
+					vm.patch(vm.indexOf(it->second.address), it->second.originalOpcode);
 					it = breakpoints.erase(it);
 				}
 				else {
@@ -559,26 +572,27 @@ namespace Strela {
 	}
 
 	void Debugger::step() {
-		if (vm.chunk.opcodes[vm.ip] != Opcode::Trap) {
+		if (vm.code[vm.ip].op != Opcode::Trap) {
 			vm.step(1);
 			return;
 		}
 
-		auto it = breakpoints.find(vm.ip);
+		auto it = breakpoints.find(vm.addressOf(vm.ip));
 		if (it == breakpoints.end()) {
 			// No breakpoint found, treat 'Trap' as NOP
 			vm.ip++;
 			return;
 		}
 
-		vm.chunk.opcodes[vm.ip] = it->second.originalOpcode;
+		auto index = vm.ip;
+		vm.patch(index, it->second.originalOpcode);
 		vm.step(1);
 
 		if (it->second.once) {
 			breakpoints.erase(it);
 		}
 		else {
-			vm.chunk.opcodes[it->second.address] = Opcode::Trap;
+			vm.patch(index, Opcode::Trap);
 		}
 	}
 }
\ No newline at end of file
@@ -33,6 +33,8 @@ namespace Strela {
     private:
         void write(const std::string& text);
         void write(const VMType& type, const void* val);
+        /** Writes the value in an object field or array element, where references may be compressed. */
+        void writeSlot(const VMType& type, const void* slot);
 
         int socket = -1;
         VM& vm;
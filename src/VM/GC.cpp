@@ -5,100 +5,661 @@
 #include "VMType.h"
 
 #include <memory.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
 
 namespace Strela {
+    namespace {
+        size_t sizeOf(const VMObject* object) {
+            auto type = object->type();
+            if (type->isArray) {
+                uint64_t length;
+                memcpy(&length, object->data, sizeof(length));
+                return sizeof(VMObject) + sizeof(uint64_t) + type->arrayType->size * length;
+            }
+            return sizeof(VMObject) + type->objectSize;
+        }
+
+        /** Room a nursery object takes, which includes room for the forwarding pointer. */
+        size_t youngSize(size_t size) {
+            return (std::max(size, sizeof(VMObject) + sizeof(VMObject*)) + 7) & ~size_t(7);
+        }
+
+        unsigned lowestBit(uint64_t bits) {
+#if defined(__GNUC__)
+            return __builtin_ctzll(bits);
+#else
+            unsigned n = 0;
+            while (!(bits & 1)) {
+                bits >>= 1;
+                n++;
+            }
+            return n;
+#endif
+        }
+
+        /** Reference slots as they are without compression. */
+        struct PlainSlots {
+            static const size_t size = 8;
+            static void* load(const char* slot) { return *(void* const*)slot; }
+        };
+
+        /** Reference slots holding compressed references, see compressedBase. */
+        struct CompressedSlots {
+            static const size_t size = 4;
+            static void* load(const char* slot) { return decompressReference(*(const uint32_t*)slot); }
+        };
+
+        template<typename Slots, typename F> void forEachReferenceIn(VMObject* object, F& f) {
+            auto type = object->type();
+            auto visit = [&f](char* slot) {
+                if (auto ref = Slots::load(slot)) {
+                    f(slot, ref);
+                }
+            };
+            if (type->isArray) {
+                if (type->noReferences) return;
+                char* ptr = object->data;
+                uint64_t length;
+                memcpy(&length, ptr, 8);
+                ptr += 8;
+                while (length--) {
+                    visit(ptr);
+                    ptr += Slots::size;
+                }
+            }
+            else if (type->unionTypes.empty()) {
+                for (auto bits = type->referenceBits; bits; bits &= bits - 1) {
+                    visit(&object->data[Slots::size * lowestBit(bits)]);
+                }
+                for (auto offset: type->referenceOffsets) {
+                    visit(&object->data[offset]);
+                }
+            }
+            else {
+                uint64_t tag = *(uint64_t*)object->data;
+                if (tag < 64 ? (type->referenceTags >> tag) & 1 : type->unionTypes[tag]->isReference()) {
+                    visit(&object->data[8]);
+                }
+            }
+        }
+
+        /**
+         * Calls f with every reference in the object that is not null, and the slot it is in. The loops are
+         * instantiated per reference size, so they do not check for compression at every slot.
+         */
+        template<typename F> void forEachReference(VMObject* object, F f) {
+            if (compressedBase) {
+                forEachReferenceIn<CompressedSlots>(object, f);
+            }
+            else {
+                forEachReferenceIn<PlainSlots>(object, f);
+            }
+        }
+
+        /** Index of the first mark stack entry in the upper half, so the entries below can be handed to another worker. */
+        size_t splitPoint(const std::vector<uintptr_t>& entries) {
+            size_t i = 0;
+            while (i < entries.size() / 2) {
+                i += (entries[i] & 3) == 2 ? 2 : 1;
+            }
+            return i;
+        }
+    }
+
+    void GCStats::print(std::ostream& out) const {
+        out << "gc: " << (fullCollections + minorCollections) << " collections (" << fullCollections << " full, " << minorCollections << " minor), ";
+        if (slices) {
+            out << slices << " incremental steps, ";
+        }
+        if (compactions) {
+            out << compactions << " compactions moving " << moved << " bytes, ";
+        }
+        out << "pauses " << totalPauseUs / 1000 << " ms total, " << maxPauseUs / 1000 << " ms max\n";
+        out << "gc: " << allocated << " bytes allocated, " << freed << " freed, " << promoted << " promoted, ";
+        out << live << " live, " << peakHeap << " peak heap\n";
+    }
+
+    GC::GC() {
+        markWorkers.emplace_back(new MarkWorker);
+    }
+
+    GC::~GC() {
+        if (nursery) {
+            Heap::freeMemory(nursery, nurseryBytes);
+        }
+    }
+
+    void GC::setThreads(size_t count) {
+        count = std::max<size_t>(count, 1);
+        pool.reset(count > 1 ? new WorkerPool(count) : nullptr);
+        markWorkers.clear();
+        for (size_t i = 0; i < count; ++i) {
+            markWorkers.emplace_back(new MarkWorker);
+        }
+    }
+
     void* GC::allocObject(const VMType* type) {
-        auto obj = (VMObject*)calloc(sizeof(VMObject) + type->objectSize, 1);
-        obj->type = type;
-        objects.push_back(obj);
-        //std::cout << "Alloc object " << type->name << "\n";
+        auto size = sizeof(VMObject) + type->objectSize;
+        auto obj = allocYoung(size);
+        if (!obj) {
+            obj = heap.allocate(size);
+            oldBytes += size;
+        }
+        statistics.allocated += size;
+        if (phase != Phase::idle) {
+            allocatedIncrementally(obj, size);
+        }
+        obj->typeId = type->id;
         return obj + 1;
     }
 
     void* GC::allocArray(const VMType* type, uint64_t length) {
-        auto obj = (VMObject*)calloc(sizeof(VMObject) + sizeof(uint64_t) + type->arrayType->size * length, 1);
-        obj->type = type;
+        auto size = sizeof(VMObject) + sizeof(uint64_t) + type->arrayType->size * length;
+        auto obj = allocYoung(size);
+        if (!obj) {
+            obj = heap.allocate(size);
+            oldBytes += size;
+        }
+        statistics.allocated += size;
+        if (phase != Phase::idle) {
+            allocatedIncrementally(obj, size);
+        }
+        obj->typeId = type->id;
         memcpy(obj->data, &length, sizeof(length));
-        objects.push_back(obj);
-        //std::cout << "Alloc array " << type->name << "\n";
         return obj + 1;
     }
 
-    void GC::collect(std::vector<VMValue>& stack) {
-        if (objects.empty()) return;
+    void GC::collect(VMValue* begin, VMValue* end) {
+        auto start = std::chrono::steady_clock::now();
+
+        if (incremental()) {
+            collectIncrementally(begin, end);
+        }
+        else {
+            if (generational()) {
+                promoteAll = fullCollectionDue(0);
+                collectMinor(begin, end);
+            }
+            if (!generational() || promoteAll) {
+                collectFull(begin, end);
+            }
+        }
+
+        statistics.live = liveBytes + oldBytes + lastSurvivorBytes;
+        auto us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        statistics.totalPauseUs += us;
+        statistics.maxPauseUs = std::max(statistics.maxPauseUs, us);
+    }
+
+    void GC::collectAll(VMValue* begin, VMValue* end) {
+        if (phase == Phase::marking) {
+            finishMarking(begin, end);
+        }
+        phase = Phase::idle;
+        if (generational()) {
+            promoteAll = true;
+            collectMinor(begin, end);
+        }
+        collectFull(begin, end);
+        heap.finishSweep(pool.get());
+        statistics.live = liveBytes + oldBytes + lastSurvivorBytes;
+    }
+
+    bool GC::fullCollectionDue(size_t bytes) const {
+        auto limit = std::max(minHeap, size_t(liveBytes * growth));
+        if (maxHeap && limit > maxHeap) {
+            limit = maxHeap;
+        }
+        return liveBytes + oldBytes + bytes >= limit;
+    }
+
+    void GC::collectFull(VMValue* begin, VMValue* end) {
+        auto before = liveBytes + oldBytes;
+        heap.finishSweep(pool.get());
 
-        for (auto&& val: stack) {
-            if (val.type == VMValue::Type::object && val.value.object) {
-                mark((VMObject*)val.value.object - 1);
+        // roots are dealt out to the workers, stealing evens out the rest
+        size_t next = 0;
+        auto root = [this, &next](VMObject* obj) {
+            mark(*markWorkers[next], obj);
+            next = (next + 1) % markWorkers.size();
+        };
+        for (auto val = begin; val < end; ++val) {
+            if (auto ref = val->getReference()) {
+                root((VMObject*)ref - 1);
             }
         }
-        
         for (auto&& obj: lockList) {
-            mark(obj);
+            root(obj);
+        }
+
+        if (pool) {
+            idleWorkers = 0;
+            pool->run([this](size_t index) { markInParallel(index); });
+        }
+        else {
+            drainMarkStack(*markWorkers[0]);
         }
-        
-        auto it = objects.begin();
-        while (it != objects.end()) {
-            auto obj = *it;
-            if (obj->marked) {
-                obj->marked = false;
-                ++it;
+        if (compaction) {
+            compact(begin, end);
+        }
+        sweep(before);
+    }
+
+    bool GC::compact(VMValue* begin, VMValue* end) {
+        Heap::Occupancy before;
+        if (!heap.planCompaction(compactThreshold, before)) {
+            return false;
+        }
+
+        auto forward = [this](void* ref) -> void* {
+            auto obj = (VMObject*)ref - 1;
+            return obj->permanent ? ref : heap.forwardingAddress(obj) + 1;
+        };
+        for (auto val = begin; val < end; ++val) {
+            if (auto ref = val->getReference()) {
+                val->setReference(forward(ref));
+            }
+        }
+        heap.forEachMarked([&forward](VMObject* object) {
+            forEachReference(object, [&forward](char* slot, void* ref) {
+                storeReference(slot, forward(ref));
+            });
+        });
+        auto moved = heap.compact();
+
+        auto after = before;
+        after.pages = heap.pages();
+        statistics.compactions++;
+        statistics.moved += moved;
+        if (log) {
+            *log << "gc: compacted " << before.pages << " pages into " << after.pages << ", moved " << moved << " bytes, ";
+            *log << "fragmentation " << before.fragmentation() * 100 << "% -> " << after.fragmentation() * 100 << "%\n";
+        }
+        return true;
+    }
+
+    void GC::collectIncrementally(VMValue* begin, VMValue* end) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(maxPauseUs);
+        auto& worker = *markWorkers[0];
+        sliceAllocated = 0;
+        statistics.slices++;
+
+        if (phase == Phase::idle) {
+            phase = Phase::sweeping;
+        }
+        if (phase == Phase::sweeping) {
+            while (!heap.sweepSome(sweepChunk)) {
+                if (std::chrono::steady_clock::now() >= deadline) return;
+            }
+            for (auto val = begin; val < end; ++val) {
+                if (auto ref = val->getReference()) {
+                    mark(worker, (VMObject*)ref - 1);
+                }
+            }
+            for (auto&& obj: lockList) {
+                mark(worker, obj);
+            }
+            phase = Phase::marking;
+        }
+
+        while (!drainMarkStack(worker, sliceChunk)) {
+            if (std::chrono::steady_clock::now() >= deadline) return;
+        }
+        finishMarking(begin, end);
+    }
+
+    void GC::finishMarking(VMValue* begin, VMValue* end) {
+        // the stack has no barrier, it may hold references the heap no longer does
+        auto& worker = *markWorkers[0];
+        for (auto val = begin; val < end; ++val) {
+            if (auto ref = val->getReference()) {
+                shade(ref);
+            }
+        }
+        for (auto&& obj: lockList) {
+            shade(obj + 1);
+        }
+        drainMarkStack(worker);
+
+        phase = Phase::idle;
+        sweep(liveBytes + oldBytes);
+    }
+
+    void GC::shade(void* ref) {
+        if (!ref) return;
+        auto obj = (VMObject*)ref - 1;
+        if (!obj->permanent && !Heap::isMarked(obj)) {
+            mark(*markWorkers[0], obj);
+        }
+    }
+
+    void GC::allocatedIncrementally(VMObject* obj, size_t size) {
+        sliceAllocated += size;
+        // allocated black, marking never has to visit it
+        if (phase == Phase::marking && Heap::mark(obj, false)) {
+            markWorkers[0]->liveBytes += size;
+        }
+    }
+
+    void GC::sweep(size_t before) {
+        statistics.peakHeap = std::max<uint64_t>(statistics.peakHeap, before);
+        liveBytes = 0;
+        for (auto&& worker: markWorkers) {
+            liveBytes += worker->liveBytes;
+            worker->liveBytes = 0;
+        }
+
+        heap.sweep();
+        oldBytes = 0;
+        statistics.fullCollections++;
+        if (before > liveBytes) {
+            statistics.freed += before - liveBytes;
+        }
+
+        if (maxHeap && liveBytes > maxHeap) {
+            std::cerr << "Out of memory: " << liveBytes << " bytes are alive, the heap is limited to " << maxHeap << " bytes\n";
+            exit(1);
+        }
+    }
+
+    void GC::mark(MarkWorker& worker, VMObject* object) {
+        worker.stack.push_back(uintptr_t(object));
+    }
+
+    bool GC::drainMarkStack(MarkWorker& worker, size_t budget) {
+        // objects go from the stack through a short queue and are prefetched on the way in,
+        // so their headers are likely cached by the time they are scanned
+        VMObject* queue[prefetchDistance];
+        size_t head = 0;
+        size_t queued = 0;
+        bool parallel = pool != nullptr && !incremental();
+        auto& stack = worker.stack;
+
+        while (true) {
+            if (budget == 0) {
+                // what is still queued is left for the next call
+                for (; queued; queued--) {
+                    stack.push_back(uintptr_t(queue[head]));
+                    head = (head + 1) % prefetchDistance;
+                }
+                return false;
+            }
+
+            VMObject* object;
+            if (queued < prefetchDistance && !stack.empty()) {
+                auto entry = stack.back();
+                stack.pop_back();
+                if (entry & 1) {
+                    auto start = stack.back() >> 2;
+                    stack.pop_back();
+                    scanArray(worker, (VMObject*)(entry & ~uintptr_t(1)), start);
+                    budget--;
+                    continue;
+                }
+                if (queued || !stack.empty()) {
+#if defined(__GNUC__)
+                    __builtin_prefetch((void*)entry);
+#endif
+                    queue[(head + queued) % prefetchDistance] = (VMObject*)entry;
+                    queued++;
+                    continue;
+                }
+                // nothing else to do while it loads, like when following a list
+                object = (VMObject*)entry;
+            }
+            else if (queued) {
+                object = queue[head];
+                head = (head + 1) % prefetchDistance;
+                queued--;
+            }
+            else {
+                return true;
+            }
+
+            if (object->permanent) continue;
+            if (!object->typeId) continue;
+            if (!Heap::mark(object, parallel)) continue;
+
+            worker.liveBytes += sizeOf(object);
+            if (object->type()->isArray) {
+                scanArray(worker, object, 0);
             }
             else {
-                //std::cout << "Free " << obj->type->name << "\n";
-                free(obj);
-                it = objects.erase(it);
+                forEachReference(object, [this, &worker](char*, void* ref) {
+                    mark(worker, (VMObject*)ref - 1);
+                });
             }
+
+            if (parallel && ++worker.scanned % shareInterval == 0 && idleWorkers.load(std::memory_order_relaxed)) {
+                shareWork(worker);
+            }
+            budget--;
         }
     }
 
-    void GC::mark(VMObject* object) {
-        if (object == nullptr) return;
-        if (object->marked) return;
-        if (object->type == nullptr) return;
+    void GC::scanArray(MarkWorker& worker, VMObject* array, uint64_t start) {
+        if (array->type()->noReferences) return;
 
-        const auto& type = object->type;
-        
-        object->marked = true;
+        uint64_t length;
+        memcpy(&length, array->data, sizeof(length));
+        auto end = length;
+        if (end - start > markChunk) {
+            end = start + markChunk;
+            worker.stack.push_back(end << 2 | 2);
+            worker.stack.push_back(uintptr_t(array) | 1);
+        }
 
-        if (type->isArray) {
-            if (type->arrayType->isArray || type->arrayType->isObject) {
-                char* ptr = object->data;
-                uint64_t length;
-                memcpy(&length, ptr, 8);
-                ptr += 8;
-                while (length--) {
-                    if (*(void**)ptr) {
-                        mark(*(VMObject**)ptr - 1);
-                    }
-                    ptr += 8;
+        // pushed back to front, so they come off the stack in memory order
+        if (compressedBase) {
+            auto elements = (uint32_t*)(array->data + sizeof(length));
+            for (auto i = end; i-- > start;) {
+                if (elements[i]) {
+                    mark(worker, (VMObject*)decompressReference(elements[i]) - 1);
                 }
             }
+            return;
         }
-        else if (type->unionTypes.size()) {
-            uint64_t tag = *(uint64_t*)object->data;
-            void* ref = *(void**)&object->data[8];
-            VMType* refType = type->unionTypes[tag];
-            if (ref && (refType->isObject || refType->isArray)) {
-                mark((VMObject*)ref - 1);
+        auto elements = (void**)(array->data + sizeof(length));
+        for (auto i = end; i-- > start;) {
+            if (elements[i]) {
+                mark(worker, (VMObject*)elements[i] - 1);
             }
         }
-        else {
-            for (auto&& field: type->fields) {
-                if (field.type == nullptr || !(field.type->isArray || field.type->isObject)) continue;
-                if (*(void**)&object->data[field.offset]) {
-                    mark(*(VMObject**)&object->data[field.offset] - 1);
+    }
+
+    void GC::markInParallel(size_t index) {
+        auto& worker = *markWorkers[index];
+        while (true) {
+            drainMarkStack(worker);
+            if (stealWork(index)) continue;
+
+            // nothing left here or anywhere else, done once all workers are
+            idleWorkers++;
+            while (true) {
+                if (idleWorkers == markWorkers.size()) return;
+                if (workShared()) {
+                    idleWorkers--;
+                    break;
                 }
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void GC::shareWork(MarkWorker& worker) {
+        auto& stack = worker.stack;
+        auto split = splitPoint(stack);
+        if (split == 0 || split == stack.size()) return;
+
+        std::lock_guard<std::mutex> lock(worker.sharedLock);
+        worker.shared.insert(worker.shared.end(), stack.begin(), stack.begin() + split);
+        worker.hasShared = true;
+        stack.erase(stack.begin(), stack.begin() + split);
+    }
+
+    bool GC::stealWork(size_t index) {
+        auto& thief = *markWorkers[index];
+        for (size_t i = 0; i < markWorkers.size(); ++i) {
+            auto& victim = *markWorkers[(index + i) % markWorkers.size()];
+            if (!victim.hasShared) continue;
+
+            std::lock_guard<std::mutex> lock(victim.sharedLock);
+            auto& shared = victim.shared;
+            if (shared.empty()) continue;
+            auto split = splitPoint(shared);
+            if (split == shared.size() || &victim == &thief) {
+                split = 0;
             }
+            thief.stack.insert(thief.stack.end(), shared.begin() + split, shared.end());
+            shared.resize(split);
+            victim.hasShared = !shared.empty();
+            return true;
         }
+        return false;
+    }
+
+    bool GC::workShared() const {
+        for (auto&& worker: markWorkers) {
+            if (worker->hasShared) return true;
+        }
+        return false;
     }
 
-    
     void GC::lock(void* obj) {
-        lockList.insert((VMObject*)obj - 1);
+        if (lockList.insert((VMObject*)obj - 1).second) {
+            pin(obj);
+        }
     }
 
     void GC::unlock(void* obj) {
-        lockList.erase((VMObject*)obj - 1);
+        if (lockList.erase((VMObject*)obj - 1)) {
+            unpin(obj);
+        }
+    }
+
+    void GC::enableGenerations(size_t nurserySize) {
+        if (nursery) return;
+        nurserySize = (nurserySize + 7) & ~size_t(7);
+        survivorSize = (nurserySize / 8 + 7) & ~size_t(7);
+        nurseryBytes = nurserySize + 2 * survivorSize;
+        nursery = (char*)Heap::allocateMemory(nurseryBytes);
+        if (!nursery) {
+            std::cerr << "Could not allocate a nursery of " << nurseryBytes << " bytes\n";
+            exit(1);
+        }
+        edenTop = nursery;
+        edenEnd = nursery + nurserySize;
+        fromSpace = edenEnd;
+        toSpace = fromSpace + survivorSize;
+    }
+
+    void GC::collectMinor(VMValue* begin, VMValue* end) {
+        toTop = toSpace;
+        evacuatedBytes = 0;
+        auto nurseryBytesUsed = size_t(edenTop - nursery) + lastSurvivorBytes;
+
+        for (auto val = begin; val < end; ++val) {
+            auto ref = val->getReference();
+            if (isYoung(ref)) {
+                val->setReference(evacuate(ref));
+            }
+        }
+
+        std::vector<VMObject*> roots;
+        roots.swap(remembered);
+        for (auto&& obj: roots) {
+            obj->remembered = false;
+        }
+        for (auto&& obj: roots) {
+            if (scavenge(obj)) {
+                remember(obj);
+            }
+        }
+
+        while (!grey.empty()) {
+            auto obj = grey.back();
+            grey.pop_back();
+            if (scavenge(obj) && !isYoung(obj)) {
+                remember(obj);
+            }
+        }
+
+        std::swap(fromSpace, toSpace);
+        edenTop = nursery;
+        overflowed = false;
+
+        statistics.minorCollections++;
+        if (nurseryBytesUsed > evacuatedBytes) {
+            statistics.freed += nurseryBytesUsed - evacuatedBytes;
+        }
+        lastSurvivorBytes = toTop - fromSpace;
+    }
+
+    void* GC::evacuate(void* ref) {
+        auto obj = (VMObject*)ref - 1;
+        if (obj->forwarded) {
+            return obj->forward() + 1;
+        }
+
+        auto size = sizeOf(obj);
+        auto rounded = youngSize(size);
+        uint8_t age = obj->age + 1;
+        VMObject* copy;
+        if (!promoteAll && age < promotionAge && toTop + rounded <= toSpace + survivorSize) {
+            copy = (VMObject*)toTop;
+            toTop += rounded;
+        }
+        else {
+            copy = heap.allocate(size);
+            oldBytes += size;
+            statistics.promoted += size;
+        }
+        evacuatedBytes += rounded;
+        memcpy(copy, obj, size);
+        copy->age = age;
+        copy->remembered = false;
+
+        obj->forwarded = true;
+        obj->forward() = copy;
+        grey.push_back(copy);
+        return copy + 1;
+    }
+
+    bool GC::scavenge(VMObject* object) {
+        bool young = false;
+        forEachReference(object, [this, &young](char* slot, void* ref) {
+            if (isYoung(ref)) {
+                ref = evacuate(ref);
+                storeReference(slot, ref);
+                young = young || isYoung(ref);
+            }
+        });
+        return young;
+    }
+
+    void GC::remember(VMObject* object) {
+        if (!object->remembered) {
+            object->remembered = true;
+            remembered.push_back(object);
+        }
+    }
+
+    VMObject* GC::allocYoung(size_t size) {
+        size = youngSize(size);
+        if (!generational() || overflowed || size > Heap::maxCellSize) {
+            return nullptr;
+        }
+        if (edenEnd - edenTop < ptrdiff_t(size)) {
+            overflowed = true;
+            return nullptr;
+        }
+        auto obj = (VMObject*)edenTop;
+        edenTop += size;
+        memset(obj, 0, size);
+        return obj;
     }
-}
\ No newline at end of file
+}
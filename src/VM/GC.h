@@ -4,35 +4,260 @@
 #ifndef Strela_VM_GC_h
 #define Strela_VM_GC_h
 
+#include "Heap.h"
 #include "VMValue.h"
 #include "VMObject.h"
 #include "VMType.h"
+#include "WorkerPool.h"
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <list>
 #include <set>
+#include <ostream>
 
 namespace Strela {
+    /** What the GC did so far, sizes are in bytes. */
+    struct GCStats {
+        uint64_t fullCollections = 0;
+        uint64_t minorCollections = 0;
+        uint64_t allocated = 0;
+        uint64_t freed = 0;
+        uint64_t promoted = 0;
+        /** Heap and nursery in use after the last collection. */
+        uint64_t live = 0;
+        /** Most the heap held when a collection started. */
+        uint64_t peakHeap = 0;
+        /** Incremental marking steps, each of them counts as a pause. */
+        uint64_t slices = 0;
+        uint64_t compactions = 0;
+        /** Bytes compactions moved. */
+        uint64_t moved = 0;
+        double totalPauseUs = 0;
+        double maxPauseUs = 0;
+
+        void print(std::ostream& out) const;
+    };
+
     /**
-     * Naive mark-and-sweep collector
+     * Mark-and-sweep collector. Marking works through an explicit stack, so deep object graphs cannot overflow
+     * the native one. Sweeping is left to the Heap, which does it lazily while allocating.
+     *
+     * With more than one thread, marking runs on all of them. Every worker has a mark stack of its own and
+     * moves half of it to a shared deque whenever another worker is idle, which idle workers steal from.
+     * Marking is over once all workers are idle with nothing left to steal. The sweeping left over from the
+     * previous collection is spread over the workers as well.
+     *
+     * A collection is due once the heap grew to growth times what was live after the previous full collection,
+     * but not below minHeap and not above maxHeap. More than maxHeap live bytes are a fatal error.
+     *
+     * With generations enabled, small objects are bump allocated in a nursery instead. A minor collection
+     * copies the nursery's survivors into a survivor space, and objects that survived promotionAge minor
+     * collections into the heap. Its roots are the stack and the remembered set of old objects that were
+     * given a reference into the nursery, which writeBarrier() maintains. Full collections evacuate the
+     * whole nursery first and then mark and sweep the heap.
+     * Moving objects needs every reference to be on the value stack when collect() is called, so
+     * generations are for the interpreter only.
+     *
+     * With maxPauseUs set, full collections are incremental instead. Once one is due, collect() only does
+     * as much of the leftover sweeping and then of the marking as fits into maxPauseUs, and is due again
+     * after the program allocated sliceBytes more. Objects allocated meanwhile are marked right away, and
+     * writeBarrier() marks objects stored into the heap, so no reachable object is left unmarked when
+     * the program moves references around between steps. The last step marks from the stack once more
+     * and sweeps. Incremental collections do not combine with generations.
+     *
+     * With compaction on, a full collection that leaves the heap's pages fragmented slides the live objects
+     * together instead of sweeping, see Heap, and updates every reference on the stack and in the heap.
+     * Like generations, this needs every reference to be on the stack, and it does not combine with
+     * incremental collections. Locked and pinned objects never move.
      */
     class GC {
     public:
+        GC();
+        ~GC();
+
+        GC(const GC&) = delete;
+        GC& operator=(const GC&) = delete;
+
         void* allocObject(const VMType* type);
         void* allocArray(const VMType* type, uint64_t length);
-        
-        void collect(std::vector<VMValue>& stack);
 
+        /** True if allocating bytes more should be preceded by a collect(). */
+        bool collectionDue(size_t bytes = 0) const {
+            if (phase != Phase::idle) {
+                return sliceAllocated + bytes >= sliceBytes;
+            }
+            return nurseryFull() || fullCollectionDue(bytes);
+        }
+
+        /** Values between begin and end are the roots. Collections that move objects update them. */
+        void collect(VMValue* begin, VMValue* end);
+        /** Collects the nursery and the heap at once, whatever is due, and sweeps all of the heap. */
+        void collectAll(VMValue* begin, VMValue* end);
+        const GCStats& stats() const { return statistics; }
+
+        /** Locked objects are roots. They never move, so lock only objects allocated before generations were enabled. */
         void lock(void* obj);
         void unlock(void* obj);
-    
+
+        /** Keeps compaction from moving the object until it is unpinned as often. */
+        static void pin(void* obj) {
+            ((VMObject*)obj - 1)->pins++;
+        }
+
+        static void unpin(void* obj) {
+            ((VMObject*)obj - 1)->pins--;
+        }
+
+        /** Marks with count threads from the next collection on. */
+        void setThreads(size_t count);
+        size_t threads() const { return markWorkers.size(); }
+
+        /** Allocates from a nursery of nurserySize bytes from now on. */
+        void enableGenerations(size_t nurserySize = defaultNurserySize);
+        bool generational() const { return nursery != nullptr; }
+        /** True once the nursery is about to run out, the next collect() should come soon. */
+        bool nurseryFull() const { return generational() && edenEnd - edenTop < ptrdiff_t(Heap::maxCellSize); }
+
+        bool incremental() const { return maxPauseUs != 0; }
+
+        /** Has to be called after storing value into a field or element of object. */
+        void writeBarrier(void* object, const VMValue& value) {
+            if (isYoung((void*)value.bits()) && !isYoung(object)) {
+                remember((VMObject*)object - 1);
+            }
+            if (phase == Phase::marking) {
+                shade(value.getReference());
+            }
+        }
+
+    public:
+        static const size_t defaultNurserySize = 4 * 1024 * 1024;
+        /** Minor collections an object has to survive before it is promoted into the heap. */
+        static const uint8_t promotionAge = 2;
+        static const size_t defaultMinHeap = 1024 * 1024;
+
+        size_t minHeap = defaultMinHeap;
+        double growth = 2.0;
+        /** 0 for no limit. */
+        size_t maxHeap = 0;
+        /** Longest a full collection may stop the program at once, 0 to collect without interruptions. */
+        size_t maxPauseUs = 0;
+        /** Compacts after full collections if that frees at least compactThreshold of the pages still in use. */
+        bool compaction = false;
+        double compactThreshold = 0.25;
+        /** Gets a line about every compaction if set. */
+        std::ostream* log = nullptr;
+
     private:
-        void mark(VMObject* object);
+        bool fullCollectionDue(size_t bytes) const;
+        void collectFull(VMValue* begin, VMValue* end);
+        /** One step of an incremental full collection. */
+        void collectIncrementally(VMValue* begin, VMValue* end);
+        /** Ends incremental marking in one go and sweeps. */
+        void finishMarking(VMValue* begin, VMValue* end);
+        /** Pushes what a write stored during incremental marking, unless it is marked already. */
+        void shade(void* ref);
+        void allocatedIncrementally(VMObject* obj, size_t size);
+        /** Slides the marked objects together if it is worth it and updates the references to them. */
+        bool compact(VMValue* begin, VMValue* end);
+        /** Frees what marking left unmarked. before is what the heap held when the collection started. */
+        void sweep(size_t before);
+        struct MarkWorker;
+
+        /** Pushes an object for drainMarkStack() to mark. */
+        void mark(MarkWorker& worker, VMObject* object);
+        /** Marks everything reachable from the objects on the worker's stack, or stops after scanning budget objects. True if the stack is empty. */
+        bool drainMarkStack(MarkWorker& worker, size_t budget = SIZE_MAX);
+        /** Pushes up to markChunk elements of a reference array from start on, and the rest as a continuation. */
+        void scanArray(MarkWorker& worker, VMObject* array, uint64_t start);
+        /** What a thread of the pool does while marking in parallel. */
+        void markInParallel(size_t index);
+        /** Moves the bottom half of the worker's stack to its shared deque. */
+        void shareWork(MarkWorker& worker);
+        /** Takes half of some worker's shared deque, false if all were empty. */
+        bool stealWork(size_t index);
+        bool workShared() const;
+        /** Empties eden, promoteAll empties the survivor space as well. */
+        void collectMinor(VMValue* begin, VMValue* end);
+        /** Copies a nursery object out of eden or the from space, returns the copy's data. */
+        void* evacuate(void* ref);
+        /** Evacuates the nursery objects the object references. True if it still points into the nursery afterwards. */
+        bool scavenge(VMObject* object);
+        void remember(VMObject* object);
+        VMObject* allocYoung(size_t size);
+
+        bool isYoung(const void* ptr) const {
+            return uintptr_t(ptr) - uintptr_t(nursery) < nurseryBytes;
+        }
+
+        /** Objects taken off the mark stack ahead of being scanned, so their headers can be prefetched. */
+        static const size_t prefetchDistance = 16;
+        /** Elements of a reference array pushed at once. */
+        static const uint64_t markChunk = 256;
+        /** Objects a worker scans between looking for idle workers to share with. */
+        static const size_t shareInterval = 64;
+        /** Bytes the program allocates between incremental steps. */
+        static const size_t sliceBytes = 64 * 1024;
+        /** Objects an incremental step marks or pages it sweeps between looking at the clock. */
+        static const size_t sliceChunk = 256;
+        static const size_t sweepChunk = 4;
+
+        enum class Phase {
+            idle,
+            /** Sweeping what is left from the previous collection before marking can start. */
+            sweeping,
+            marking,
+        };
+
+        struct MarkWorker {
+            /**
+             * Objects still to be marked. An array with elements left to scan is pushed after the index to
+             * continue at, which is shifted left by two and tagged with 2, with the array tagged with 1.
+             */
+            std::vector<uintptr_t> stack;
+            /** Entries other workers may steal, in the same format. */
+            std::vector<uintptr_t> shared;
+            std::mutex sharedLock;
+            std::atomic<bool> hasShared{false};
+            size_t liveBytes = 0;
+            size_t scanned = 0;
+        };
 
     private:
-        std::list<VMObject*> objects;
+        Heap heap;
         std::set<VMObject*> lockList;
+
+        char* nursery = nullptr;
+        size_t nurseryBytes = 0;
+        char* edenTop = nullptr;
+        char* edenEnd = nullptr;
+        size_t survivorSize = 0;
+        char* fromSpace = nullptr;
+        char* toSpace = nullptr;
+        char* toTop = nullptr;
+        /** Set when eden could not take an object, everything goes to the heap until the next collection. */
+        bool overflowed = false;
+        bool promoteAll = false;
+        /** Bytes that went into the heap since the last full collection. */
+        size_t oldBytes = 0;
+        /** Bytes the last full collection found alive. */
+        size_t liveBytes = 0;
+        /** Bytes the current minor collection copied out of the nursery, and bytes the last one left in the from space. */
+        size_t evacuatedBytes = 0;
+        size_t lastSurvivorBytes = 0;
+        GCStats statistics;
+        std::vector<VMObject*> remembered;
+        std::vector<VMObject*> grey;
+        std::vector<std::unique_ptr<MarkWorker>> markWorkers;
+        /** Only there with more than one thread. */
+        std::unique_ptr<WorkerPool> pool;
+        std::atomic<size_t> idleWorkers{0};
+        Phase phase = Phase::idle;
+        /** Bytes allocated since the last incremental step. */
+        size_t sliceAllocated = 0;
     };
 }
 
-#endif
\ No newline at end of file
+#endif
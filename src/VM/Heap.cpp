@@ -0,0 +1,544 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "Heap.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <unordered_set>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace Strela {
+    char* compressedBase = nullptr;
+
+    namespace {
+        /** Empty pages kept around for reuse instead of being returned to the system. */
+        const size_t maxEmptyPages = 16;
+        /** Size class of the record of a large object. */
+        const uint32_t largeObjectClass = UINT32_MAX;
+        /** Bytes compressed references reach, and the least worth reserving if the system will not give that much. */
+        const size_t compressedRange = size_t(8) << 32;
+        const size_t minCompressedRange = size_t(1) << 30;
+
+        /**
+         * The range compressed references point into. Memory is handed out in whole pages, from the lowest run
+         * given back that fits, or else from the part of the range never used so far.
+         */
+        struct Arena {
+            char* top = nullptr;
+            char* end = nullptr;
+            /** Runs given back, by address. Neighbouring runs are merged. */
+            std::map<char*, size_t> free;
+        } arena;
+
+        size_t wholePages(size_t size) {
+            return (size + Heap::pageSize - 1) & ~(Heap::pageSize - 1);
+        }
+    }
+
+    void Heap::compressReferences() {
+        if (compressedBase) return;
+#ifndef _WIN32
+        // only reserved, pages become accessible as they are handed out
+        for (auto size = compressedRange; size >= minCompressedRange; size /= 2) {
+            auto mem = mmap(nullptr, size + pageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mem == MAP_FAILED) continue;
+            compressedBase = (char*)((uintptr_t(mem) + pageSize - 1) & ~uintptr_t(pageSize - 1));
+            arena.top = compressedBase;
+            arena.end = compressedBase + size;
+            return;
+        }
+#endif
+        std::cerr << "Could not reserve address space for compressed references\n";
+        exit(1);
+    }
+
+    void* Heap::allocateMemory(size_t size) {
+        if (!compressedBase) {
+#ifdef _WIN32
+            return _aligned_malloc(size, pageSize);
+#else
+            void* mem = nullptr;
+            return posix_memalign(&mem, pageSize, size) ? nullptr : mem;
+#endif
+        }
+#ifndef _WIN32
+        size = wholePages(size);
+        for (auto it = arena.free.begin(); it != arena.free.end(); ++it) {
+            if (it->second >= size) {
+                auto mem = it->first;
+                if (it->second > size) {
+                    arena.free.insert(std::make_pair(mem + size, it->second - size));
+                }
+                arena.free.erase(it);
+                return mem;
+            }
+        }
+        if (size_t(arena.end - arena.top) < size || mprotect(arena.top, size, PROT_READ | PROT_WRITE)) {
+            return nullptr;
+        }
+        auto mem = arena.top;
+        arena.top += size;
+        return mem;
+#else
+        return nullptr;
+#endif
+    }
+
+    void Heap::freeMemory(void* mem, size_t size) {
+        if (!compressedBase) {
+#ifdef _WIN32
+            _aligned_free(mem);
+#else
+            free(mem);
+#endif
+            return;
+        }
+#ifndef _WIN32
+        auto start = (char*)mem;
+        size = wholePages(size);
+        // stays reserved, but the system gets the pages back
+        madvise(start, size, MADV_DONTNEED);
+        auto next = arena.free.lower_bound(start);
+        if (next != arena.free.end() && start + size == next->first) {
+            size += next->second;
+            next = arena.free.erase(next);
+        }
+        if (next != arena.free.begin()) {
+            auto prev = std::prev(next);
+            if (prev->first + prev->second == start) {
+                prev->second += size;
+                return;
+            }
+        }
+        arena.free.insert(next, std::make_pair(start, size));
+#endif
+    }
+
+    Heap::Heap(): classIndex(maxCellSize / 8 + 1) {
+        static_assert(sizeof(Page*) <= pageHeaderSize && sizeof(Page*) <= largeHeaderSize, "Page pointer does not fit");
+
+        // 8 byte steps up to 128 bytes, then four classes per doubling
+        std::vector<uint32_t> sizes;
+        for (uint32_t size = minCellSize; size <= 128; size += 8) {
+            sizes.push_back(size);
+        }
+        for (uint32_t base = 128; base < maxCellSize; base *= 2) {
+            for (uint32_t i = 1; i <= 4; ++i) {
+                sizes.push_back(base + i * base / 4);
+            }
+        }
+
+        for (auto size: sizes) {
+            classes.push_back({ size, {}, nullptr, 0, {} });
+        }
+
+        size_t cls = 0;
+        for (size_t i = 0; i < classIndex.size(); ++i) {
+            while (sizes[cls] < i * 8) ++cls;
+            classIndex[i] = cls;
+        }
+    }
+
+    Heap::~Heap() {
+        for (auto&& cls: classes) {
+            for (auto&& page: cls.pages) {
+                freePage(page);
+            }
+        }
+        for (auto&& page: emptyPages) {
+            freePage(page);
+        }
+        for (auto&& obj: largeObjects) {
+            freePage(pageOf(obj));
+        }
+    }
+
+    VMObject* Heap::allocate(size_t size) {
+        if (size > maxCellSize) {
+            // aligned like a page, so the mark bit is found the same way
+            auto mem = (char*)allocateMemory(largeHeaderSize + size);
+            // the object's mark bit is in the first word of the bitmap, the rest of the record is left out
+            auto page = (Page*)malloc(offsetof(Page, marks) + sizeof(uint64_t));
+            if (!page || !mem) {
+                std::cerr << "Out of memory allocating " << size << " bytes\n";
+                exit(1);
+            }
+            auto obj = (VMObject*)(mem + largeHeaderSize);
+            *(Page**)mem = page;
+            page->memory = mem;
+            page->sizeClass = largeObjectClass;
+            page->cellSize = 0;
+            page->cells = (char*)obj;
+            page->end = mem + largeHeaderSize + size;
+            page->marks[0].store(0, std::memory_order_relaxed);
+            memset(obj, 0, size);
+            largeObjects.push_back(obj);
+            return obj;
+        }
+
+        auto sizeClass = classIndex[(size + 7) / 8];
+        auto& cls = classes[sizeClass];
+        auto page = cls.current;
+        if (!page || (!page->freeList && page->bump + cls.cellSize > page->end)) {
+            page = refill(sizeClass);
+        }
+
+        VMObject* obj;
+        if (page->freeList) {
+            obj = (VMObject*)((char*)page->freeList - sizeof(VMObject));
+            page->freeList = page->freeList->next;
+        }
+        else {
+            obj = (VMObject*)page->bump;
+            page->bump += cls.cellSize;
+        }
+        memset(obj, 0, size);
+        return obj;
+    }
+
+    size_t Heap::pages() const {
+        size_t count = 0;
+        for (auto&& cls: classes) {
+            count += cls.pages.size();
+        }
+        return count;
+    }
+
+    bool Heap::empty() const {
+        if (!largeObjects.empty()) return false;
+        for (auto&& cls: classes) {
+            if (!cls.pages.empty()) return false;
+        }
+        return true;
+    }
+
+    void Heap::finishSweep(WorkerPool* pool) {
+        if (pool && pool->size() > 1) {
+            std::vector<Page*> pending;
+            for (auto&& cls: classes) {
+                for (size_t i = cls.sweepCursor; i < cls.pages.size(); ++i) {
+                    if (cls.pages[i]->sweepEpoch != epoch) {
+                        pending.push_back(cls.pages[i]);
+                    }
+                }
+            }
+
+            // pages are independent of each other, only giving back the empty ones has to wait
+            std::vector<char> live(pending.size());
+            std::atomic<size_t> next(0);
+            pool->run([&](size_t) {
+                for (size_t i = next++; i < pending.size(); i = next++) {
+                    live[i] = sweepPage(pending[i]);
+                }
+            });
+
+            std::unordered_set<Page*> empty;
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (!live[i]) {
+                    empty.insert(pending[i]);
+                }
+            }
+            if (empty.empty()) return;
+            for (auto&& cls: classes) {
+                size_t i = cls.sweepCursor;
+                while (i < cls.pages.size()) {
+                    auto page = cls.pages[i];
+                    if (empty.count(page)) {
+                        cls.pages[i] = cls.pages.back();
+                        cls.pages.pop_back();
+                        releasePage(page);
+                    }
+                    else {
+                        ++i;
+                    }
+                }
+            }
+            return;
+        }
+
+        sweepSome(SIZE_MAX);
+    }
+
+    bool Heap::sweepSome(size_t pages) {
+        for (auto&& cls: classes) {
+            size_t i = cls.sweepCursor;
+            while (i < cls.pages.size()) {
+                auto page = cls.pages[i];
+                if (page->sweepEpoch == epoch) {
+                    ++i;
+                    continue;
+                }
+                if (!pages--) return false;
+                if (!sweepPage(page)) {
+                    cls.pages[i] = cls.pages.back();
+                    cls.pages.pop_back();
+                    releasePage(page);
+                }
+                else {
+                    ++i;
+                }
+            }
+        }
+        return true;
+    }
+
+    void Heap::sweep() {
+        size_t i = 0;
+        while (i < largeObjects.size()) {
+            auto obj = largeObjects[i];
+            auto& mark = pageOf(obj)->marks[0];
+            if (mark.load(std::memory_order_relaxed)) {
+                mark.store(0, std::memory_order_relaxed);
+                ++i;
+            }
+            else {
+                freePage(pageOf(obj));
+                largeObjects[i] = largeObjects.back();
+                largeObjects.pop_back();
+            }
+        }
+
+        ++epoch;
+        for (auto&& cls: classes) {
+            cls.current = nullptr;
+            cls.sweepCursor = 0;
+        }
+    }
+
+    bool Heap::planCompaction(double threshold, Occupancy& before) {
+        before = Occupancy();
+        size_t pagesAfter = 0;
+        for (auto&& cls: classes) {
+            cls.moving.clear();
+            size_t perPage = (pageSize - pageHeaderSize) / cls.cellSize;
+            uint64_t live = 0;
+            for (auto&& page: cls.pages) {
+                page->moving = true;
+                page->liveBefore = live;
+                uint64_t count = 0;
+                size_t word = 0;
+                for (auto cell = page->cells; cell < page->bump; cell += page->cellSize) {
+                    auto obj = (VMObject*)cell;
+                    if (!obj->typeId || !isMarked(obj)) continue;
+                    for (auto index = markIndex(obj); word <= index / 64; ++word) {
+                        page->liveBeforeWord[word] = count;
+                    }
+                    if (obj->pins) {
+                        page->moving = false;
+                    }
+                    count++;
+                }
+                for (; word < markWords; ++word) {
+                    page->liveBeforeWord[word] = count;
+                }
+
+                // sweeping would free empty pages as well, only the others count
+                if (count) {
+                    before.pages++;
+                    before.liveBytes += count * cls.cellSize;
+                }
+                if (page->moving) {
+                    cls.moving.push_back(page);
+                    live += count;
+                }
+                else {
+                    pagesAfter++;
+                }
+            }
+            pagesAfter += (live + perPage - 1) / perPage;
+        }
+        return pagesAfter < before.pages && before.pages - pagesAfter >= threshold * before.pages;
+    }
+
+    VMObject* Heap::forwardingAddress(VMObject* obj) const {
+        auto page = pageOf(obj);
+        if (page->sizeClass == largeObjectClass || !page->moving) {
+            return obj;
+        }
+
+        auto index = markIndex(obj);
+        auto below = page->marks[index / 64].load(std::memory_order_relaxed) & ((uint64_t(1) << (index % 64)) - 1);
+        auto rank = page->liveBefore + page->liveBeforeWord[index / 64] + std::bitset<64>(below).count();
+        auto& cls = classes[page->sizeClass];
+        auto perPage = (pageSize - pageHeaderSize) / cls.cellSize;
+        return (VMObject*)(cls.moving[rank / perPage]->cells + rank % perPage * cls.cellSize);
+    }
+
+    size_t Heap::compact() {
+        size_t movedBytes = 0;
+        for (auto&& cls: classes) {
+            size_t perPage = (pageSize - pageHeaderSize) / cls.cellSize;
+
+            // a cell is only written once every object in front of it moved, the bitmaps stay intact until the end
+            uint64_t next = 0;
+            for (auto&& page: cls.moving) {
+                for (auto cell = page->cells; cell < page->bump; cell += cls.cellSize) {
+                    auto obj = (VMObject*)cell;
+                    if (!obj->typeId || !isMarked(obj)) continue;
+                    auto dest = cls.moving[next / perPage]->cells + next % perPage * cls.cellSize;
+                    if (dest != cell) {
+                        memmove(dest, cell, cls.cellSize);
+                        movedBytes += cls.cellSize;
+                    }
+                    next++;
+                }
+            }
+
+            std::unordered_set<Page*> emptied;
+            for (size_t i = 0; i < cls.moving.size(); ++i) {
+                auto page = cls.moving[i];
+                if (i * perPage >= next) {
+                    emptied.insert(page);
+                    continue;
+                }
+                auto count = std::min<uint64_t>(perPage, next - i * perPage);
+                page->bump = page->cells + count * cls.cellSize;
+                page->freeList = nullptr;
+                // counts as swept by the sweep() that follows
+                page->sweepEpoch = epoch + 1;
+                for (auto&& word: page->marks) {
+                    word.store(0, std::memory_order_relaxed);
+                }
+            }
+            cls.moving.clear();
+
+            if (!emptied.empty()) {
+                size_t kept = 0;
+                for (auto&& page: cls.pages) {
+                    if (emptied.count(page)) {
+                        releasePage(page);
+                    }
+                    else {
+                        cls.pages[kept++] = page;
+                    }
+                }
+                cls.pages.resize(kept);
+            }
+        }
+        return movedBytes;
+    }
+
+    Heap::Page* Heap::newPage(uint32_t sizeClass) {
+        Page* page;
+        if (!emptyPages.empty()) {
+            page = emptyPages.back();
+            emptyPages.pop_back();
+        }
+        else {
+            auto mem = (char*)allocateMemory(pageSize);
+            page = (Page*)malloc(sizeof(Page));
+            if (!page || !mem) {
+                std::cerr << "Out of memory allocating a heap page\n";
+                exit(1);
+            }
+            *(Page**)mem = page;
+            page->memory = mem;
+        }
+
+        auto cellSize = classes[sizeClass].cellSize;
+        page->sizeClass = sizeClass;
+        page->cellSize = cellSize;
+        page->sweepEpoch = epoch;
+        page->cells = page->memory + pageHeaderSize;
+        page->bump = page->cells;
+        page->end = page->cells + (pageSize - pageHeaderSize) / cellSize * cellSize;
+        page->freeList = nullptr;
+        for (auto&& word: page->marks) {
+            word.store(0, std::memory_order_relaxed);
+        }
+        return page;
+    }
+
+    bool Heap::sweepPage(Page* page) {
+        page->sweepEpoch = epoch;
+
+        // rebuilt in address order, so allocation keeps walking the page upwards. Cells that were free
+        // before mostly keep their links, which are only written where they change, so sweeping a page
+        // without new garbage leaves it untouched
+        FreeCell* head = nullptr;
+        FreeCell** tail = &head;
+        bool live = false;
+        for (auto cell = page->cells; cell < page->bump; cell += page->cellSize) {
+            auto obj = (VMObject*)cell;
+            if (obj->typeId && isMarked(obj)) {
+                live = true;
+            }
+            else {
+                if (obj->typeId) {
+                    obj->typeId = 0;
+                }
+                auto free = (FreeCell*)(cell + sizeof(VMObject));
+                if (*tail != free) {
+                    *tail = free;
+                }
+                tail = &free->next;
+            }
+        }
+        for (auto&& word: page->marks) {
+            word.store(0, std::memory_order_relaxed);
+        }
+        if (*tail) {
+            *tail = nullptr;
+        }
+        page->freeList = head;
+        return live;
+    }
+
+    Heap::Page* Heap::refill(uint32_t sizeClass) {
+        auto& cls = classes[sizeClass];
+        while (cls.sweepCursor < cls.pages.size()) {
+            auto page = cls.pages[cls.sweepCursor];
+            if (page->sweepEpoch != epoch && !sweepPage(page)) {
+                cls.pages[cls.sweepCursor] = cls.pages.back();
+                cls.pages.pop_back();
+                releasePage(page);
+                continue;
+            }
+            ++cls.sweepCursor;
+            if (page->freeList || page->bump + cls.cellSize <= page->end) {
+                cls.current = page;
+                return page;
+            }
+        }
+
+        auto page = newPage(sizeClass);
+        cls.pages.push_back(page);
+        cls.sweepCursor = cls.pages.size();
+        cls.current = page;
+        return page;
+    }
+
+    void Heap::releasePage(Page* page) {
+        if (emptyPages.size() < maxEmptyPages) {
+            emptyPages.push_back(page);
+        }
+        else {
+#ifdef MADV_DONTNEED
+            // free() would likely keep the memory in the process, the compressed range gives it back itself
+            if (!compressedBase) {
+                madvise(page->memory, pageSize, MADV_DONTNEED);
+            }
+#endif
+            freePage(page);
+        }
+    }
+
+    void Heap::freePage(Page* page) {
+        freeMemory(page->memory, page->sizeClass == largeObjectClass ? page->end - page->memory : pageSize);
+        free(page);
+    }
+}
@@ -0,0 +1,208 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_VM_Heap_h
+#define Strela_VM_Heap_h
+
+#include "VMObject.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Strela {
+    class WorkerPool;
+
+    /**
+     * Memory the GC allocates objects from.
+     *
+     * Small objects live in aligned pages, each page holding cells of one size class. A size class allocates
+     * from its current page's free list, then by bumping a pointer through the page's unused tail.
+     * Objects too big for the largest class are allocated individually and make up the large object space.
+     *
+     * Sweeping is lazy: after marking, sweep() only frees large objects and flags every page as unswept.
+     * Pages are swept one at a time when their size class runs out of cells, and the rest by finishSweep()
+     * before the next marking starts. Pages left without live objects go back to a pool shared by all classes.
+     *
+     * Mark bits live in bitmaps beside the objects instead of in them, so several threads can mark at once.
+     * A page only starts with a pointer to its Page record, which holds the bitmap and the allocation state
+     * and is allocated apart from the page. Collections therefore write only to pages whose objects died,
+     * and a forked process keeps sharing the pages of objects that stay alive with its parent. Large objects
+     * are aligned like pages, with the pointer in a header in front.
+     *
+     * Instead of being swept, the pages can be compacted after marking. The live objects of a size class
+     * slide towards its first pages in address order, so the pages behind them become empty. Where an object
+     * goes follows from the number of marked cells before it, which every page keeps per word of its bitmap
+     * while compacting. Pages holding a pinned object stay as they are, large objects never move.
+     *
+     * With compressed references, pages and large objects come from one range of address space reserved up
+     * front, which compressed references address relative to its start.
+     */
+    class Heap {
+    public:
+        Heap();
+        ~Heap();
+
+        Heap(const Heap&) = delete;
+        Heap& operator=(const Heap&) = delete;
+
+        /** Zeroed memory for an object of the given size, header included. */
+        VMObject* allocate(size_t size);
+        bool empty() const;
+        /** Pages of small objects. */
+        size_t pages() const;
+
+        /** Sweeps what is left from the previous collection, so no marks are left over. Spreads the pages over the pool's workers if given one. */
+        void finishSweep(WorkerPool* pool = nullptr);
+        /** Sweeps up to the given number of pages left from the previous collection. True once none are left. */
+        bool sweepSome(size_t pages);
+        /** Called after marking. Frees unmarked large objects and schedules the pages for sweeping. */
+        void sweep();
+
+        /** Memory the pages take and how much of it live objects use. */
+        struct Occupancy {
+            size_t pages = 0;
+            size_t liveBytes = 0;
+
+            /** Share of the pages' memory not taken by live objects. */
+            double fragmentation() const {
+                return pages ? 1 - double(liveBytes) / (pages * pageSize) : 0;
+            }
+        };
+
+        /**
+         * Called after marking. Plans where the marked objects of unpinned pages go and returns true if
+         * compacting would free at least the threshold share of the pages holding live objects. before tells
+         * how fragmented these pages are.
+         */
+        bool planCompaction(double threshold, Occupancy& before);
+        /** Where a marked object is after compact(), given the plan. */
+        VMObject* forwardingAddress(VMObject* obj) const;
+        /** Calls f with every marked object. */
+        template<typename F> void forEachMarked(F f) const;
+        /** Moves the objects as planned and frees the emptied pages. Has to be followed by sweep(). Returns the bytes moved. */
+        size_t compact();
+
+        /** Sets the object's mark bit, true if it was not set yet. Only atomic marking is safe while other threads mark too. */
+        static bool mark(const VMObject* obj, bool atomic) {
+            auto index = markIndex(obj);
+            auto& word = pageOf(obj)->marks[index / 64];
+            auto bit = uint64_t(1) << (index % 64);
+            auto bits = word.load(std::memory_order_relaxed);
+            if (bits & bit) return false;
+            if (atomic) {
+                return !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+            }
+            word.store(bits | bit, std::memory_order_relaxed);
+            return true;
+        }
+
+        static bool isMarked(const VMObject* obj) {
+            auto index = markIndex(obj);
+            return pageOf(obj)->marks[index / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (index % 64));
+        }
+
+        /**
+         * Reserves the address range compressed references reach and sets compressedBase. Every heap, and the
+         * nursery, allocates from the range from then on, so this has to happen before anything is allocated.
+         */
+        static void compressReferences();
+        /** Memory aligned like a page, from the compressed range if there is one. Null if there is none left. */
+        static void* allocateMemory(size_t size);
+        static void freeMemory(void* mem, size_t size);
+
+    public:
+        static const size_t pageSize = 64 * 1024;
+        static const size_t maxCellSize = 4096;
+
+    private:
+        /** A dead cell. Its header reads as an object without type, the link follows the header. */
+        struct FreeCell {
+            FreeCell* next;
+        };
+
+        static const size_t minCellSize = sizeof(VMObject) + sizeof(FreeCell);
+        /** A mark bit for every 8 bytes of a page, so finding an object's bit needs nothing but its address. */
+        static const size_t markWords = pageSize / 8 / 64;
+        /** Cells start this far into a page, a large object this far into its allocation. */
+        static const size_t pageHeaderSize = 16;
+        static const size_t largeHeaderSize = 16;
+
+        /** Kept apart from the page it describes, whose first bytes point to it. */
+        struct Page {
+            /** The page itself, or the allocation of a large object. */
+            char* memory;
+            uint32_t sizeClass;
+            uint32_t cellSize;
+            /** Cycle the page was last swept in. */
+            uint64_t sweepEpoch;
+            char* cells;
+            /** Cells below bump have been handed out at some point. */
+            char* bump;
+            /** End of the cells, for a large object the end of its allocation. */
+            char* end;
+            FreeCell* freeList;
+            std::atomic<uint64_t> marks[markWords];
+            /** Only meaningful while compacting: if the objects move, and how many live cells of the class come before this page and before each mark word. */
+            bool moving;
+            uint64_t liveBefore;
+            uint16_t liveBeforeWord[markWords];
+        };
+
+        struct SizeClass {
+            uint32_t cellSize;
+            std::vector<Page*> pages;
+            Page* current;
+            /** Index of the next page to look at for sweeping. */
+            size_t sweepCursor;
+            /** Pages objects slide through while compacting, in order. */
+            std::vector<Page*> moving;
+        };
+
+        static Page* pageOf(const VMObject* obj) {
+            return *(Page**)(uintptr_t(obj) & ~uintptr_t(pageSize - 1));
+        }
+
+        static size_t markIndex(const VMObject* obj) {
+            return (uintptr_t(obj) & (pageSize - 1)) / 8;
+        }
+
+        Page* newPage(uint32_t sizeClass);
+        /** Frees the page's dead cells. Returns false if nothing is left alive in it. */
+        bool sweepPage(Page* page);
+        /** Makes a page with free cells the class's current one, sweeping or adding pages as needed. */
+        Page* refill(uint32_t sizeClass);
+        void releasePage(Page* page);
+        /** Frees a page or large object together with its record. */
+        static void freePage(Page* page);
+
+    private:
+        std::vector<SizeClass> classes;
+        /** Size class for every size up to maxCellSize, in steps of 8 bytes. */
+        std::vector<uint8_t> classIndex;
+        std::vector<Page*> emptyPages;
+        std::vector<VMObject*> largeObjects;
+        uint64_t epoch = 0;
+    };
+
+    template<typename F> void Heap::forEachMarked(F f) const {
+        for (auto&& cls: classes) {
+            for (auto&& page: cls.pages) {
+                for (auto cell = page->cells; cell < page->bump; cell += page->cellSize) {
+                    auto obj = (VMObject*)cell;
+                    if (obj->typeId && isMarked(obj)) {
+                        f(obj);
+                    }
+                }
+            }
+        }
+        for (auto&& obj: largeObjects) {
+            if (isMarked(obj)) {
+                f(obj);
+            }
+        }
+    }
+}
+
+#endif
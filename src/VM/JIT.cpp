@@ -0,0 +1,1526 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "JIT.h"
+#include "VM.h"
+#include "ByteCodeChunk.h"
+
+#include <cstring>
+#include <cstddef>
+#include <initializer_list>
+
+#ifdef STRELA_JIT
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+namespace Strela {
+#ifdef STRELA_JIT
+    namespace {
+        enum Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R8 = 8, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+        enum Cond { Below = 0x2, AboveEqual = 0x3, Equal = 0x4, NotEqual = 0x5, BelowEqual = 0x6, Above = 0x7, Sign = 0x8, Parity = 0xa, NoParity = 0xb, Less = 0xc, GreaterEqual = 0xd, LessEqual = 0xe, Greater = 0xf, Always = -1 };
+
+        // generated code keeps the value stack pointer, frame pointer, state and budget in callee saved registers
+        const int SP = R12;
+        const int FP = R13;
+        const int ST = RBX;
+        const int BUDGET = R14;
+        const int32_t SLOT = sizeof(VMValue);
+        const int SLOT_BITS = 4;
+
+        const int32_t stateSp = offsetof(JITState, sp);
+        const int32_t stateFp = offsetof(JITState, fp);
+        const int32_t stateIp = offsetof(JITState, ip);
+        const int32_t stateBudget = offsetof(JITState, budget);
+        const int32_t stateStack = offsetof(JITState, stack);
+        const int32_t stateLimit = offsetof(JITState, stackLimit);
+        const int32_t stateEntries = offsetof(JITState, entries);
+        const int32_t stateTraces = offsetof(JITState, traces);
+
+        /** Encoder for the handful of x86-64 instruction forms the templates use. Memory operands are [base + disp32]. */
+        class Assembler {
+        public:
+            std::vector<uint8_t> code;
+
+            size_t size() const { return code.size(); }
+            void byte(uint8_t b) { code.push_back(b); }
+            void bytes(std::initializer_list<uint8_t> bs) { code.insert(code.end(), bs); }
+            void dword(uint32_t v) { for (int i = 0; i < 4; ++i) byte(v >> (8 * i)); }
+            void qword(uint64_t v) { for (int i = 0; i < 8; ++i) byte(v >> (8 * i)); }
+            void patch(size_t pos, size_t target) { int32_t rel = target - (pos + 4); memcpy(&code[pos], &rel, 4); }
+
+            void rex(bool w, int reg, int base) {
+                uint8_t r = 0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+                if (r != 0x40) byte(r);
+            }
+            void mem(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, int reg, int base, int32_t disp) {
+                if (prefix) byte(prefix);
+                rex(w, reg, base);
+                bytes(opcode);
+                byte(0x80 | ((reg & 7) << 3) | (base & 7));
+                if ((base & 7) == RSP) byte(0x24);
+                dword(disp);
+            }
+            void regs(bool w, uint8_t opcode, int reg, int rm) {
+                rex(w, reg, rm);
+                byte(opcode);
+                byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+            }
+
+            void load(int reg, int base, int32_t disp) { mem(0, true, {0x8b}, reg, base, disp); }
+            void load8(int reg, int base, int32_t disp) { mem(0, false, {0x0f, 0xb6}, reg, base, disp); }
+            void load16(int reg, int base, int32_t disp) { mem(0, false, {0x0f, 0xb7}, reg, base, disp); }
+            void load32(int reg, int base, int32_t disp) { mem(0, false, {0x8b}, reg, base, disp); }
+            void store(int base, int32_t disp, int reg) { mem(0, true, {0x89}, reg, base, disp); }
+            void store8(int base, int32_t disp, int reg) { mem(0, false, {0x88}, reg, base, disp); }
+            void store16(int base, int32_t disp, int reg) { mem(0x66, false, {0x89}, reg, base, disp); }
+            void store32(int base, int32_t disp, int reg) { mem(0, false, {0x89}, reg, base, disp); }
+            void storeImm(int base, int32_t disp, int32_t imm) { mem(0, true, {0xc7}, 0, base, disp); dword(imm); }
+            void lea(int reg, int base, int32_t disp) { mem(0, true, {0x8d}, reg, base, disp); }
+            void movImm(int reg, uint64_t imm) { rex(true, 0, reg); byte(0xb8 + (reg & 7)); qword(imm); }
+            void mov(int dst, int src) { regs(true, 0x89, src, dst); }
+            void subReg(int dst, int src) { regs(true, 0x29, src, dst); }
+            void mov32(int dst, int src) { regs(false, 0x89, src, dst); }
+            void shlImm(int reg, uint8_t imm) { regs(true, 0xc1, 4, reg); byte(imm); }
+            void shrImm(int reg, uint8_t imm) { regs(true, 0xc1, 5, reg); byte(imm); }
+            void cmovne(int dst, int src) { rex(true, dst, src); bytes({0x0f, 0x45}); byte(0xc0 | ((dst & 7) << 3) | (src & 7)); }
+            /** lea reg, [base + index * 8], base must not be RBP or R13. */
+            void leaScaled8(int reg, int base, int index) {
+                byte(0x48 | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+                byte(0x8d);
+                byte(0x04 | ((reg & 7) << 3));
+                byte(0xc0 | ((index & 7) << 3) | (base & 7));
+            }
+            void add(int reg, int base, int32_t disp) { mem(0, true, {0x03}, reg, base, disp); }
+            void addTo(int base, int32_t disp, int reg) { mem(0, true, {0x01}, reg, base, disp); }
+            void subFrom(int base, int32_t disp, int reg) { mem(0, true, {0x29}, reg, base, disp); }
+            void sub(int reg, int base, int32_t disp) { mem(0, true, {0x2b}, reg, base, disp); }
+            void imul(int reg, int base, int32_t disp) { mem(0, true, {0x0f, 0xaf}, reg, base, disp); }
+            void cmp(int reg, int base, int32_t disp) { mem(0, true, {0x3b}, reg, base, disp); }
+            void cmp8(int reg, int base, int32_t disp) { mem(0, false, {0x3a}, reg, base, disp); }
+            void cmpByte(int base, int32_t disp, uint8_t imm) { mem(0, false, {0x80}, 7, base, disp); byte(imm); }
+            void cmpDword(int base, int32_t disp, int32_t imm) { mem(0, false, {0x81}, 7, base, disp); dword(imm); }
+            void idiv(int base, int32_t disp) { mem(0, true, {0xf7}, 7, base, disp); }
+            void addImm(int reg, int32_t imm) { regs(true, 0x81, 0, reg); dword(imm); }
+            void subImm(int reg, int32_t imm) { regs(true, 0x81, 5, reg); dword(imm); }
+            void imulImm(int reg, int32_t imm) { regs(true, 0x69, reg, reg); dword(imm); }
+            void addMemImm(int base, int32_t disp, int32_t imm) { mem(0, true, {0x81}, 0, base, disp); dword(imm); }
+            void test(int reg) { regs(true, 0x85, reg, reg); }
+            void testAl() { bytes({0x84, 0xc0}); }
+            void setcc(int cc) { bytes({0x0f, uint8_t(0x90 | cc), 0xc0}); }
+            void setccCl(int cc) { bytes({0x0f, uint8_t(0x90 | cc), 0xc1}); }
+            void andAlCl() { bytes({0x20, 0xc8}); }
+            void orAlCl() { bytes({0x08, 0xc8}); }
+            void movzxAl() { bytes({0x0f, 0xb6, 0xc0}); }
+            void cqo() { bytes({0x48, 0x99}); }
+            void dec(int reg) { regs(true, 0xff, 1, reg); }
+            void push(int reg) { if (reg >= 8) byte(0x41); byte(0x50 + (reg & 7)); }
+            void pop(int reg) { if (reg >= 8) byte(0x41); byte(0x58 + (reg & 7)); }
+            void call(const void* target) { movImm(RAX, (uint64_t)target); bytes({0xff, 0xd0}); }
+            void jmpReg(int reg) { regs(false, 0xff, 4, reg); }
+            void jmpMem(int base, int32_t disp) { mem(0, false, {0xff}, 4, base, disp); }
+            void ret() { byte(0xc3); }
+
+            void movups(int xmm, int base, int32_t disp) { mem(0, false, {0x0f, 0x10}, xmm, base, disp); }
+            void movupsTo(int base, int32_t disp, int xmm) { mem(0, false, {0x0f, 0x11}, xmm, base, disp); }
+            void movsd(int xmm, int base, int32_t disp) { mem(0xf2, false, {0x0f, 0x10}, xmm, base, disp); }
+            void movsdTo(int base, int32_t disp, int xmm) { mem(0xf2, false, {0x0f, 0x11}, xmm, base, disp); }
+            void sse(uint8_t opcode, int xmm, int base, int32_t disp) { mem(0xf2, false, {0x0f, opcode}, xmm, base, disp); }
+            void comisd(int xmm, int base, int32_t disp) { mem(0x66, false, {0x0f, 0x2f}, xmm, base, disp); }
+            void ucomisd(int xmm, int base, int32_t disp) { mem(0x66, false, {0x0f, 0x2e}, xmm, base, disp); }
+            void cvtsi2sd(int xmm, int base, int32_t disp) { mem(0xf2, true, {0x0f, 0x2a}, xmm, base, disp); }
+            void cvttsd2si(int reg, int base, int32_t disp) { mem(0xf2, true, {0x0f, 0x2c}, reg, base, disp); }
+            void pxor0() { bytes({0x66, 0x0f, 0xef, 0xc0}); }
+
+            /** Emits a jump with an empty rel32 and returns the position to patch. */
+            size_t jump(int cc) {
+                if (cc == Always) byte(0xe9);
+                else bytes({0x0f, uint8_t(0x80 | cc)});
+                dword(0);
+                return size() - 4;
+            }
+        };
+
+        void jitStep(JITState* state) {
+            auto& vm = *state->vm;
+            vm.sp = state->sp;
+            vm.bp = state->fp - vm.stack;
+            vm.ip = state->ip;
+            vm.step(1);
+            state->sp = vm.sp;
+            state->fp = vm.stack + vm.bp;
+        }
+
+        /** Writes the frame records of the calls a trace was inside of when it left, fp is the innermost frame. */
+        void jitRestoreFrames(JITState* state, VMValue* const* fps, const uint64_t* ips, uint64_t depth, VMValue* fp) {
+            auto& vm = *state->vm;
+            for (size_t i = 0; i < depth; ++i) {
+                auto callee = i + 1 < depth ? fps[i + 1] : fp;
+                callee[-1] = VM::frameRecord(fps[i] - vm.stack, ips[i]);
+            }
+        }
+
+        enum class Comparison { EQ, NE, LT, GT, LE, GE };
+
+        /**
+         * Code generation shared by function and trace compilation: templates for opcodes that
+         * do not transfer control, side exits and the way back to the interpreter.
+         */
+        class Emitter {
+        public:
+            Emitter(const VM& vm, bool traces): vm(vm), traces(traces) {}
+
+        protected:
+            struct Exit {
+                size_t pos;
+                size_t ip;
+                const uint64_t* frames;
+                size_t depth;
+            };
+
+            void exitIf(int cc, size_t ip) {
+                exits.push_back({ as.jump(cc), ip, frames, depth });
+            }
+
+            /** Emits the exit stubs and the epilogue, then resolves jumps to them. */
+            void finish() {
+                for (auto& exit: exits) {
+                    as.patch(exit.pos, as.size());
+                    if (exit.depth) {
+                        as.mov(RDI, ST);
+                        as.mov(RSI, RSP);
+                        as.movImm(RDX, (uint64_t)exit.frames);
+                        as.movImm(RCX, exit.depth);
+                        as.mov(R8, FP);
+                        as.call((const void*)&jitRestoreFrames);
+                    }
+                    if (frameSpace) {
+                        as.addImm(RSP, frameSpace);
+                    }
+                    as.storeImm(ST, stateIp, exit.ip);
+                    leaveJumps.push_back(as.jump(Always));
+                }
+
+                auto leave = as.size();
+                if (resume) {
+                    // carry on in a compiled function if there is one and budget is left
+                    as.test(BUDGET);
+                    auto noBudget = as.jump(Equal);
+                    as.load(RAX, ST, stateIp);
+                    as.load(RCX, ST, stateEntries);
+                    as.bytes({0x48, 0x8b, 0x0c, 0xc1}); // mov rcx, [rcx + rax * 8]
+                    as.test(RCX);
+                    auto notCompiled = as.jump(Equal);
+                    as.jmpReg(RCX);
+                    as.patch(noBudget, as.size());
+                    as.patch(notCompiled, as.size());
+                }
+
+                // leave generated code, the state tells the interpreter where to continue
+                as.store(ST, stateSp, SP);
+                as.store(ST, stateFp, FP);
+                as.store(ST, stateBudget, BUDGET);
+                as.addImm(RSP, 8);
+                as.pop(R15);
+                as.pop(R14);
+                as.pop(R13);
+                as.pop(R12);
+                as.pop(RBX);
+                as.pop(RBP);
+                as.ret();
+
+                for (auto pos: leaveJumps) {
+                    as.patch(pos, leave);
+                }
+            }
+
+            void pushConstant(const VMValue& value) {
+                uint64_t words[2];
+                memcpy(words, &value, sizeof(words));
+                as.movImm(RAX, words[0]);
+                as.store(SP, 0, RAX);
+                as.movImm(RAX, words[1]);
+                as.store(SP, 8, RAX);
+                as.addImm(SP, SLOT);
+            }
+
+            /**
+             * Copies a value in two words like the templates write them, a 16 byte load of a slot
+             * that was just written in halves would wait for the stores to retire.
+             */
+            void copySlot(int dstBase, int32_t dst, int srcBase, int32_t src) {
+                as.load(RSI, srcBase, src);
+                as.load(RDI, srcBase, src + 8);
+                as.store(dstBase, dst, RSI);
+                as.store(dstBase, dst + 8, RDI);
+            }
+
+            void setType(int base, int32_t disp, VMValue::Type type) {
+                as.storeImm(base, disp + 8, (int32_t)type);
+            }
+
+            /** Stores al as a fresh boolean VMValue. */
+            void storeBoolean(int base, int32_t disp) {
+                as.movzxAl();
+                as.store(base, disp, RAX);
+                setType(base, disp, VMValue::Type::boolean);
+            }
+
+            static bool quickened(Opcode op) {
+                return op >= Opcode::CmpEQIQ && op <= Opcode::CmpGTEBRQ;
+            }
+
+            static bool quickenedRegister(Opcode op) {
+                return op >= Opcode::CmpEQIRQ && op <= Opcode::CmpGTEBRQ;
+            }
+
+            static Comparison comparison(Opcode op) {
+                if (quickened(op)) {
+                    // integer, floating and boolean variants of each generic comparison
+                    static const Comparison generic[] = { Comparison::EQ, Comparison::NE, Comparison::LE, Comparison::GE };
+                    return generic[((int)op - (int)Opcode::CmpEQIQ) / 3 % 4];
+                }
+                switch (op) {
+                    case Opcode::CmpEQ: case Opcode::CmpEQR: case Opcode::CmpEQI: case Opcode::CmpEQF64: case Opcode::CmpEQB: case Opcode::CmpEQRef:
+                    case Opcode::CmpEQIR: case Opcode::CmpEQF64R:
+                        return Comparison::EQ;
+                    case Opcode::CmpNE: case Opcode::CmpNER: case Opcode::CmpNEI: case Opcode::CmpNEF64: case Opcode::CmpNEB: case Opcode::CmpNERef:
+                    case Opcode::CmpNEIR: case Opcode::CmpNEF64R:
+                        return Comparison::NE;
+                    case Opcode::CmpLTI: case Opcode::CmpLTF64: case Opcode::CmpLTIR: case Opcode::CmpLTF64R:
+                        return Comparison::LT;
+                    case Opcode::CmpGTI: case Opcode::CmpGTF64: case Opcode::CmpGTIR: case Opcode::CmpGTF64R:
+                        return Comparison::GT;
+                    case Opcode::CmpLTE: case Opcode::CmpLTER: case Opcode::CmpLTEI: case Opcode::CmpLTEF64: case Opcode::CmpLTEIR: case Opcode::CmpLTEF64R:
+                        return Comparison::LE;
+                    default: return Comparison::GE;
+                }
+            }
+
+            /** Operand type of a typed comparison opcode, references compare like integers. */
+            static VMValue::Type comparedType(Opcode op) {
+                if (quickened(op)) {
+                    static const VMValue::Type types[] = { VMValue::Type::integer, VMValue::Type::floating, VMValue::Type::boolean };
+                    return types[((int)op - (int)Opcode::CmpEQIQ) % 3];
+                }
+                switch (op) {
+                    case Opcode::CmpLTF64: case Opcode::CmpGTF64: case Opcode::CmpEQF64: case Opcode::CmpNEF64: case Opcode::CmpLTEF64: case Opcode::CmpGTEF64:
+                    case Opcode::CmpLTF64R: case Opcode::CmpGTF64R: case Opcode::CmpEQF64R: case Opcode::CmpNEF64R: case Opcode::CmpLTEF64R: case Opcode::CmpGTEF64R:
+                        return VMValue::Type::floating;
+                    case Opcode::CmpEQB: case Opcode::CmpNEB:
+                        return VMValue::Type::boolean;
+                    default:
+                        return VMValue::Type::integer;
+                }
+            }
+
+            /** Leaves l <cmp> r in al, with the semantics of VMValue's comparison operators for values of the given type. */
+            void compare(VMValue::Type type, Comparison cmp, int base, int32_t l, int32_t r) {
+                static const int integer[] = { Equal, NotEqual, Less, Greater, LessEqual, GreaterEqual };
+                static const int unsignedByte[] = { Equal, NotEqual, Below, Above, BelowEqual, AboveEqual };
+                if (type == VMValue::Type::integer) {
+                    as.load(RAX, base, l);
+                    as.cmp(RAX, base, r);
+                    as.setcc(integer[(int)cmp]);
+                }
+                else if (type == VMValue::Type::boolean) {
+                    as.load8(RAX, base, l);
+                    as.cmp8(RAX, base, r);
+                    as.setcc(unsignedByte[(int)cmp]);
+                }
+                else {
+                    // operands are swapped where needed so that unordered values compare false
+                    switch (cmp) {
+                        case Comparison::EQ:
+                            as.movsd(0, base, l);
+                            as.ucomisd(0, base, r);
+                            as.setcc(Equal);
+                            as.setccCl(NoParity);
+                            as.andAlCl();
+                            break;
+                        case Comparison::NE:
+                            as.movsd(0, base, l);
+                            as.ucomisd(0, base, r);
+                            as.setcc(NotEqual);
+                            as.setccCl(Parity);
+                            as.orAlCl();
+                            break;
+                        case Comparison::LT:
+                        case Comparison::LE:
+                            as.movsd(0, base, r);
+                            as.comisd(0, base, l);
+                            as.setcc(cmp == Comparison::LT ? Above : AboveEqual);
+                            break;
+                        case Comparison::GT:
+                        case Comparison::GE:
+                            as.movsd(0, base, l);
+                            as.comisd(0, base, r);
+                            as.setcc(cmp == Comparison::GT ? Above : AboveEqual);
+                            break;
+                    }
+                }
+            }
+
+            /** Integer register op dst = b op c, dst keeps the type of b like the interpreter does. */
+            void registerArith(const Instruction& ins, bool immediate) {
+                as.load(RAX, FP, ins.b * SLOT);
+                if (immediate) {
+                    switch (ins.op) {
+                        case Opcode::AddIRI: as.addImm(RAX, ins.value.value.integer); break;
+                        case Opcode::SubIRI: as.subImm(RAX, ins.value.value.integer); break;
+                        default: as.imulImm(RAX, ins.value.value.integer); break;
+                    }
+                }
+                else {
+                    switch (ins.op) {
+                        case Opcode::AddIR: as.add(RAX, FP, ins.c * SLOT); break;
+                        case Opcode::SubIR: as.sub(RAX, FP, ins.c * SLOT); break;
+                        default: as.imul(RAX, FP, ins.c * SLOT); break;
+                    }
+                }
+                as.load(RCX, FP, ins.b * SLOT + 8);
+                as.store(FP, ins.a * SLOT, RAX);
+                as.store(FP, ins.a * SLOT + 8, RCX);
+            }
+
+            /** Loads size bytes at [base + disp] zero extended into reg. */
+            void loadField(int size, int reg, int base, int32_t disp) {
+                switch (size) {
+                    case 1: as.load8(reg, base, disp); break;
+                    case 2: as.load16(reg, base, disp); break;
+                    case 4: as.load32(reg, base, disp); break;
+                    default: as.load(reg, base, disp); break;
+                }
+            }
+
+            void storeField(int size, int base, int32_t disp, int reg) {
+                switch (size) {
+                    case 1: as.store8(base, disp, reg); break;
+                    case 2: as.store16(base, disp, reg); break;
+                    case 4: as.store32(base, disp, reg); break;
+                    default: as.store(base, disp, reg); break;
+                }
+            }
+
+            static int fieldSize(Opcode op) {
+                switch (op) {
+                    case Opcode::Ptr8: case Opcode::PtrInd8: case Opcode::StorePtr8: case Opcode::StorePtrInd8: case Opcode::PeekStorePtr8: return 1;
+                    case Opcode::Ptr16: case Opcode::PtrInd16: case Opcode::StorePtr16: case Opcode::StorePtrInd16: case Opcode::PeekStorePtr16: return 2;
+                    case Opcode::Ptr32: case Opcode::PtrInd32: case Opcode::StorePtr32: case Opcode::StorePtrInd32: case Opcode::PeekStorePtr32: return 4;
+                    default: return 8;
+                }
+            }
+
+            /** Type tag of the value a field or element load pushes. */
+            static VMValue::Type loadedType(Opcode op) {
+                switch (op) {
+                    case Opcode::ObjPtr64: case Opcode::ObjPtr64Var: case Opcode::ObjPtrInd64: return VMValue::Type::object;
+                    case Opcode::F64Ptr64: case Opcode::F64Ptr64Var: case Opcode::F64PtrInd64: return VMValue::Type::floating;
+                    default: return VMValue::Type::integer;
+                }
+            }
+
+            /** Turns the compressed reference in RAX into a pointer, clobbers RCX. */
+            void decompressRax() {
+                as.movImm(RCX, (uint64_t)compressedBase);
+                as.leaScaled8(RCX, RCX, RAX);
+                as.test(RAX);
+                as.cmovne(RAX, RCX);
+            }
+
+            /** Turns the pointer in RAX into a compressed reference, clobbers RDX and RSI. */
+            void compressRax() {
+                as.mov(RDX, RAX);
+                as.movImm(RSI, (uint64_t)compressedBase);
+                as.subReg(RDX, RSI);
+                as.shrImm(RDX, 3);
+                as.test(RAX);
+                as.cmovne(RAX, RDX);
+            }
+
+            /** Stores that can write a reference run in the interpreter, which has the write barrier for generations and incremental marking. */
+            bool needsBarrier(Opcode op) const {
+                switch (op) {
+                    case Opcode::StorePtr64: case Opcode::StorePtr64Var: case Opcode::StorePtrInd64: case Opcode::PeekStorePtr64:
+                    case Opcode::StorePtrC: case Opcode::StorePtrCVar: case Opcode::StorePtrIndC: case Opcode::PeekStorePtrC:
+                        return vm.gc.generational() || vm.gc.incremental();
+                    default:
+                        return false;
+                }
+            }
+
+            void fallback(size_t i) {
+                as.store(ST, stateSp, SP);
+                as.store(ST, stateFp, FP);
+                as.storeImm(ST, stateIp, i);
+                as.mov(RDI, ST);
+                as.call((const void*)&jitStep);
+                as.load(SP, ST, stateSp);
+                as.load(FP, ST, stateFp);
+            }
+
+            /** Compares like a quickened instruction, values that fail its guard go through the interpreter, which de-quickens it. */
+            void quickenedCompare(size_t i, const Instruction& ins) {
+                auto type = comparedType(ins.op);
+                auto cmp = comparison(ins.op);
+                size_t generic;
+                if (quickenedRegister(ins.op)) {
+                    as.cmpDword(FP, ins.b * SLOT + 8, (int32_t)type);
+                    generic = as.jump(NotEqual);
+                    compare(type, cmp, FP, ins.b * SLOT, ins.c * SLOT);
+                    storeBoolean(FP, ins.a * SLOT);
+                }
+                else {
+                    as.cmpDword(SP, -2 * SLOT + 8, (int32_t)type);
+                    generic = as.jump(NotEqual);
+                    as.subImm(SP, SLOT);
+                    compare(type, cmp, SP, -SLOT, 0);
+                    as.store8(SP, -SLOT, RAX);
+                    setType(SP, -SLOT, VMValue::Type::boolean);
+                }
+                auto done = as.jump(Always);
+                as.patch(generic, as.size());
+                fallback(i);
+                as.patch(done, as.size());
+            }
+
+            /** Compares the callee below the arguments of an indirect call with the address of the instruction at target. */
+            void callTargetGuard(size_t target, int numArgs) {
+                as.load(RAX, SP, -(numArgs + 1) * SLOT);
+                as.movImm(RCX, vm.code[target].address);
+                as.regs(true, 0x39, RCX, RAX);
+            }
+
+            /** Leaves the return value in the frame record's slot and pops the frame, FP still points to it. */
+            void returnValue(const Instruction& ins) {
+                if (ins.op == Opcode::ReturnVoid) {
+                    as.lea(SP, FP, -SLOT);
+                }
+                else {
+                    if (ins.op == Opcode::Return) copySlot(FP, -SLOT, SP, -SLOT);
+                    else copySlot(FP, -SLOT, FP, ins.a * SLOT);
+                    as.mov(SP, FP);
+                }
+            }
+
+            /** Moves the arguments of a tail call over the current frame. */
+            void tailCall(const Instruction& ins) {
+                for (int i = 0; i < ins.a; ++i) {
+                    copySlot(FP, i * SLOT, SP, (i - ins.a) * SLOT);
+                }
+                as.lea(SP, FP, ins.a * SLOT);
+            }
+
+            /** Emits the template for an instruction that continues with the next one. Returns false for control transfers. */
+            bool emitData(size_t i, const Instruction& ins) {
+                switch (ins.op) {
+                    case Opcode::I8:
+                    case Opcode::I16:
+                    case Opcode::I32:
+                    case Opcode::I64:
+                    case Opcode::U8:
+                    case Opcode::U16:
+                    case Opcode::U32:
+                    case Opcode::U64:
+                    case Opcode::F32:
+                    case Opcode::F64:
+                    case Opcode::Const:
+                        pushConstant(ins.value);
+                        break;
+                    case Opcode::Null:
+                        pushConstant(VMValue());
+                        break;
+                    case Opcode::Grow:
+                        as.lea(RAX, SP, ins.a * SLOT);
+                        as.cmp(RAX, ST, stateLimit);
+                        exitIf(Above, i);
+                        as.pxor0();
+                        for (int k = 0; k < ins.a; ++k) {
+                            as.movupsTo(SP, k * SLOT, 0);
+                        }
+                        as.addImm(SP, ins.a * SLOT);
+                        break;
+                    case Opcode::Var:
+                        copySlot(SP, 0, FP, ins.a * SLOT);
+                        as.addImm(SP, SLOT);
+                        break;
+                    case Opcode::StoreVar:
+                        as.subImm(SP, SLOT);
+                        copySlot(FP, ins.a * SLOT, SP, 0);
+                        break;
+                    case Opcode::Peek:
+                        copySlot(SP, 0, SP, -SLOT - ins.a * SLOT);
+                        as.addImm(SP, SLOT);
+                        break;
+                    case Opcode::Repeat:
+                        copySlot(SP, 0, SP, -SLOT);
+                        as.addImm(SP, SLOT);
+                        break;
+                    case Opcode::Pop:
+                        as.subImm(SP, SLOT);
+                        break;
+                    case Opcode::Swap:
+                        as.movups(0, SP, -SLOT);
+                        as.movups(1, SP, -2 * SLOT);
+                        as.movupsTo(SP, -2 * SLOT, 0);
+                        as.movupsTo(SP, -SLOT, 1);
+                        break;
+
+                    case Opcode::AddI:
+                    case Opcode::SubI:
+                        as.subImm(SP, SLOT);
+                        as.load(RAX, SP, 0);
+                        if (ins.op == Opcode::AddI) as.addTo(SP, -SLOT, RAX);
+                        else as.subFrom(SP, -SLOT, RAX);
+                        break;
+                    case Opcode::MulI:
+                        as.subImm(SP, SLOT);
+                        as.load(RAX, SP, -SLOT);
+                        as.imul(RAX, SP, 0);
+                        as.store(SP, -SLOT, RAX);
+                        break;
+                    case Opcode::DivI:
+                    case Opcode::ModI:
+                        as.subImm(SP, SLOT);
+                        as.load(RAX, SP, -SLOT);
+                        as.cqo();
+                        as.idiv(SP, 0);
+                        as.store(SP, -SLOT, ins.op == Opcode::DivI ? RAX : RDX);
+                        break;
+                    case Opcode::AddF64:
+                    case Opcode::SubF64:
+                    case Opcode::MulF64:
+                    case Opcode::DivF64: {
+                        uint8_t opcode = ins.op == Opcode::AddF64 ? 0x58 : ins.op == Opcode::SubF64 ? 0x5c : ins.op == Opcode::MulF64 ? 0x59 : 0x5e;
+                        as.subImm(SP, SLOT);
+                        as.movsd(0, SP, -SLOT);
+                        as.sse(opcode, 0, SP, 0);
+                        as.movsdTo(SP, -SLOT, 0);
+                        break;
+                    }
+                    case Opcode::CmpLTI:
+                    case Opcode::CmpGTI:
+                    case Opcode::CmpLTF64:
+                    case Opcode::CmpGTF64:
+                    case Opcode::CmpEQI: case Opcode::CmpNEI: case Opcode::CmpLTEI: case Opcode::CmpGTEI:
+                    case Opcode::CmpEQF64: case Opcode::CmpNEF64: case Opcode::CmpLTEF64: case Opcode::CmpGTEF64:
+                    case Opcode::CmpEQB: case Opcode::CmpNEB:
+                    case Opcode::CmpEQRef: case Opcode::CmpNERef: {
+                        as.subImm(SP, SLOT);
+                        compare(comparedType(ins.op), comparison(ins.op), SP, -SLOT, 0);
+                        as.store8(SP, -SLOT, RAX);
+                        setType(SP, -SLOT, VMValue::Type::boolean);
+                        break;
+                    }
+                    case Opcode::Not:
+                        as.cmpByte(SP, -SLOT, 0);
+                        as.setcc(Equal);
+                        as.store8(SP, -SLOT, RAX);
+                        break;
+                    case Opcode::I64tF64:
+                        as.cvtsi2sd(0, SP, -SLOT);
+                        as.movsdTo(SP, -SLOT, 0);
+                        setType(SP, -SLOT, VMValue::Type::floating);
+                        break;
+                    case Opcode::F64tI64:
+                        as.cvttsd2si(RAX, SP, -SLOT);
+                        as.store(SP, -SLOT, RAX);
+                        setType(SP, -SLOT, VMValue::Type::integer);
+                        break;
+
+                    case Opcode::VarVar:
+                        copySlot(SP, 0, FP, ins.a * SLOT);
+                        copySlot(SP, SLOT, FP, ins.b * SLOT);
+                        as.addImm(SP, 2 * SLOT);
+                        break;
+                    case Opcode::VarI8:
+                        copySlot(SP, 0, FP, ins.a * SLOT);
+                        as.addImm(SP, SLOT);
+                        pushConstant(ins.value);
+                        break;
+                    case Opcode::AddIVarVar:
+                    case Opcode::AddIVarI8:
+                        as.load(RAX, FP, ins.a * SLOT);
+                        if (ins.op == Opcode::AddIVarVar) as.add(RAX, FP, ins.b * SLOT);
+                        else as.addImm(RAX, ins.value.value.integer);
+                        as.load(RCX, FP, ins.a * SLOT + 8);
+                        as.store(SP, 0, RAX);
+                        as.store(SP, 8, RCX);
+                        as.addImm(SP, SLOT);
+                        break;
+                    case Opcode::IncVar:
+                        as.addMemImm(FP, ins.a * SLOT, ins.value.value.integer);
+                        break;
+
+#ifndef _DEBUG
+                    // field access, debug builds keep the interpreter's bounds checks
+                    case Opcode::Ptr64Var:
+                    case Opcode::ObjPtr64Var:
+                    case Opcode::F64Ptr64Var:
+                        as.load(RAX, FP, ins.a * SLOT);
+                        as.load(RAX, RAX, ins.value.value.integer);
+                        as.store(SP, 0, RAX);
+                        setType(SP, 0, loadedType(ins.op));
+                        as.addImm(SP, SLOT);
+                        break;
+                    case Opcode::StorePtr64Var:
+                        if (needsBarrier(ins.op)) {
+                            fallback(i);
+                            break;
+                        }
+                        as.subImm(SP, SLOT);
+                        as.load(RAX, SP, 0);
+                        as.load(RCX, FP, ins.a * SLOT);
+                        as.store(RCX, ins.value.value.integer, RAX);
+                        break;
+                    case Opcode::Ptr8:
+                    case Opcode::Ptr16:
+                    case Opcode::Ptr32:
+                    case Opcode::Ptr64:
+                    case Opcode::ObjPtr64:
+                    case Opcode::F64Ptr64:
+                        as.load(RAX, SP, -SLOT);
+                        loadField(fieldSize(ins.op), RAX, RAX, ins.value.value.integer);
+                        as.store(SP, -SLOT, RAX);
+                        setType(SP, -SLOT, loadedType(ins.op));
+                        break;
+                    case Opcode::StorePtr8:
+                    case Opcode::StorePtr16:
+                    case Opcode::StorePtr32:
+                    case Opcode::StorePtr64:
+                        if (needsBarrier(ins.op)) {
+                            fallback(i);
+                            break;
+                        }
+                        as.subImm(SP, 2 * SLOT);
+                        as.load(RCX, SP, SLOT);
+                        as.load(RAX, SP, 0);
+                        storeField(fieldSize(ins.op), RCX, ins.value.value.integer, RAX);
+                        break;
+                    case Opcode::PeekStorePtr8:
+                    case Opcode::PeekStorePtr16:
+                    case Opcode::PeekStorePtr32:
+                    case Opcode::PeekStorePtr64:
+                        if (needsBarrier(ins.op)) {
+                            fallback(i);
+                            break;
+                        }
+                        as.subImm(SP, SLOT);
+                        as.load(RCX, SP, -SLOT);
+                        as.load(RAX, SP, 0);
+                        storeField(fieldSize(ins.op), RCX, ins.value.value.integer, RAX);
+                        break;
+                    case Opcode::PtrInd8:
+                    case Opcode::PtrInd16:
+                    case Opcode::PtrInd32:
+                    case Opcode::PtrInd64:
+                    case Opcode::ObjPtrInd64:
+                    case Opcode::F64PtrInd64:
+                        as.subImm(SP, SLOT);
+                        as.load(RCX, SP, 0);
+                        as.add(RCX, SP, -SLOT);
+                        loadField(fieldSize(ins.op), RAX, RCX, ins.value.value.integer);
+                        as.store(SP, -SLOT, RAX);
+                        setType(SP, -SLOT, loadedType(ins.op));
+                        break;
+                    case Opcode::StorePtrInd8:
+                    case Opcode::StorePtrInd16:
+                    case Opcode::StorePtrInd32:
+                    case Opcode::StorePtrInd64:
+                        if (needsBarrier(ins.op)) {
+                            fallback(i);
+                            break;
+                        }
+                        as.subImm(SP, 3 * SLOT);
+                        as.load(RCX, SP, 2 * SLOT);
+                        as.add(RCX, SP, SLOT);
+                        as.load(RAX, SP, 0);
+                        storeField(fieldSize(ins.op), RCX, ins.value.value.integer, RAX);
+                        break;
+                    case Opcode::ObjPtrC:
+                        as.load(RAX, SP, -SLOT);
+                        as.load32(RAX, RAX, ins.value.value.integer);
+                        decompressRax();
+                        as.store(SP, -SLOT, RAX);
+                        setType(SP, -SLOT, VMValue::Type::object);
+                        break;
+                    case Opcode::ObjPtrCVar:
+                        as.load(RAX, FP, ins.a * SLOT);
+                        as.load32(RAX, RAX, ins.value.value.integer);
+                        decompressRax();
+                        as.store(SP, 0, RAX);
+                        setType(SP, 0, VMValue::Type::object);
+                        as.addImm(SP, SLOT);
+                        break;
+                    case Opcode::ObjPtrIndC:
+                        as.subImm(SP, SLOT);
+                        as.load(RCX, SP, 0);
+                        as.add(RCX, SP, -SLOT);
+                        as.load32(RAX, RCX, ins.value.value.integer);
+                        decompressRax();
+                        as.store(SP, -SLOT, RAX);
+                        setType(SP, -SLOT, VMValue::Type::object);
+                        break;
+                    case Opcode::StorePtrC:
+                    case Opcode::PeekStorePtrC:
+                        if (needsBarrier(ins.op)) {
+                            fallback(i);
+                            break;
+                        }
+                        if (ins.op == Opcode::StorePtrC) {
+                            as.subImm(SP, 2 * SLOT);
+                            as.load(RCX, SP, SLOT);
+                        }
+                        else {
+                            as.subImm(SP, SLOT);
+                            as.load(RCX, SP, -SLOT);
+                        }
+                        as.load(RAX, SP, 0);
+                        compressRax();
+                        as.store32(RCX, ins.value.value.integer, RAX);
+                        break;
+                    case Opcode::StorePtrCVar:
+                        if (needsBarrier(ins.op)) {
+                            fallback(i);
+                            break;
+                        }
+                        as.subImm(SP, SLOT);
+                        as.load(RAX, SP, 0);
+                        as.load(RCX, FP, ins.a * SLOT);
+                        compressRax();
+                        as.store32(RCX, ins.value.value.integer, RAX);
+                        break;
+                    case Opcode::StorePtrIndC:
+                        if (needsBarrier(ins.op)) {
+                            fallback(i);
+                            break;
+                        }
+                        as.subImm(SP, 3 * SLOT);
+                        as.load(RCX, SP, 2 * SLOT);
+                        as.add(RCX, SP, SLOT);
+                        as.load(RAX, SP, 0);
+                        compressRax();
+                        as.store32(RCX, ins.value.value.integer, RAX);
+                        break;
+#endif
+
+                    case Opcode::MovR:
+                        copySlot(FP, ins.a * SLOT, FP, ins.b * SLOT);
+                        break;
+                    case Opcode::ConstR: {
+                        uint64_t words[2];
+                        memcpy(words, &ins.value, sizeof(words));
+                        as.movImm(RAX, words[0]);
+                        as.store(FP, ins.a * SLOT, RAX);
+                        as.movImm(RAX, words[1]);
+                        as.store(FP, ins.a * SLOT + 8, RAX);
+                        break;
+                    }
+                    case Opcode::AddIR:
+                    case Opcode::SubIR:
+                    case Opcode::MulIR:
+                        registerArith(ins, false);
+                        break;
+                    case Opcode::AddIRI:
+                    case Opcode::SubIRI:
+                    case Opcode::MulIRI:
+                        registerArith(ins, true);
+                        break;
+                    case Opcode::AddF64R:
+                    case Opcode::SubF64R:
+                    case Opcode::MulF64R:
+                    case Opcode::DivF64R: {
+                        uint8_t opcode = ins.op == Opcode::AddF64R ? 0x58 : ins.op == Opcode::SubF64R ? 0x5c : ins.op == Opcode::MulF64R ? 0x59 : 0x5e;
+                        as.movsd(0, FP, ins.b * SLOT);
+                        as.sse(opcode, 0, FP, ins.c * SLOT);
+                        as.load(RCX, FP, ins.b * SLOT + 8);
+                        as.movsdTo(FP, ins.a * SLOT, 0);
+                        as.store(FP, ins.a * SLOT + 8, RCX);
+                        break;
+                    }
+                    case Opcode::CmpLTIR:
+                    case Opcode::CmpGTIR:
+                    case Opcode::CmpLTF64R:
+                    case Opcode::CmpGTF64R:
+                    case Opcode::CmpEQIR: case Opcode::CmpNEIR: case Opcode::CmpLTEIR: case Opcode::CmpGTEIR:
+                    case Opcode::CmpEQF64R: case Opcode::CmpNEF64R: case Opcode::CmpLTEF64R: case Opcode::CmpGTEF64R: {
+                        compare(comparedType(ins.op), comparison(ins.op), FP, ins.b * SLOT, ins.c * SLOT);
+                        storeBoolean(FP, ins.a * SLOT);
+                        break;
+                    }
+                    case Opcode::CmpEQIRI:
+                    case Opcode::CmpNEIRI:
+                    case Opcode::CmpLTIRI:
+                    case Opcode::CmpGTIRI:
+                    case Opcode::CmpLTEIRI:
+                    case Opcode::CmpGTEIRI: {
+                        static const int cc[] = { Equal, NotEqual, Less, Greater, LessEqual, GreaterEqual };
+                        as.load(RAX, FP, ins.b * SLOT);
+                        as.movImm(RCX, ins.value.value.integer);
+                        as.regs(true, 0x39, RCX, RAX);
+                        as.setcc(cc[(int)ins.op - (int)Opcode::CmpEQIRI]);
+                        storeBoolean(FP, ins.a * SLOT);
+                        break;
+                    }
+
+                    case Opcode::JmpRel:
+                    case Opcode::JmpImm:
+                    case Opcode::JmpIfRel:
+                    case Opcode::JmpIfNotRel:
+                    case Opcode::JmpIfR:
+                    case Opcode::JmpIfNotR:
+                    case Opcode::JmpIfLTI:
+                    case Opcode::JmpIfGEI:
+                    case Opcode::JmpIfGTI:
+                    case Opcode::JmpIfLEI:
+                    case Opcode::Jmp:
+                    case Opcode::JmpIf:
+                    case Opcode::JmpIfNot:
+                    case Opcode::CallImm:
+                    case Opcode::CallInd:
+                    case Opcode::CallIndQ:
+                    case Opcode::TailCallImm:
+                    case Opcode::Return:
+                    case Opcode::ReturnR:
+                    case Opcode::ReturnVoid:
+                    case Opcode::Trap:
+                        return false;
+
+                    default:
+                        if (quickened(ins.op)) {
+                            quickenedCompare(i, ins);
+                            break;
+                        }
+                        fallback(i);
+                        break;
+                }
+                return true;
+            }
+
+        protected:
+            const VM& vm;
+            Assembler as;
+            /** Backward jumps check for a loop trace to enter. */
+            bool traces;
+            /** Leaving continues in a compiled function if possible. */
+            bool resume = false;
+            /** Native stack bytes reserved for the frame pointers of inlined calls. */
+            int32_t frameSpace = 0;
+            /** Return addresses of the inlined calls active at the current instruction. */
+            const uint64_t* frames = nullptr;
+            size_t depth = 0;
+            std::vector<Exit> exits;
+            std::vector<size_t> leaveJumps;
+        };
+
+        /** Translates the instructions [first, last) of one function. */
+        class Translator: public Emitter {
+        public:
+            Translator(const VM& vm, bool traces, size_t first, size_t last): Emitter(vm, traces), labels(last - first), first(first), last(last) {}
+
+            std::vector<uint8_t>& translate() {
+                for (size_t i = first; i < last; ++i) {
+                    labels[i - first] = as.size();
+                    emit(i, vm.code[i]);
+                }
+                finish();
+                for (auto& fixup: fixups) {
+                    as.patch(fixup.first, labels[fixup.second - first]);
+                }
+                return as.code;
+            }
+
+        public:
+            std::vector<size_t> labels;
+
+        private:
+            /** Jumps to another instruction. Backward jumps use up budget so that loops return to the interpreter eventually. */
+            void jumpTo(int cc, size_t i, size_t target) {
+                if (target < first || target >= last) {
+                    exitIf(cc, target);
+                    return;
+                }
+                if (target > i) {
+                    fixups.push_back({ as.jump(cc), target });
+                    return;
+                }
+                size_t skip = 0;
+                if (cc != Always) {
+                    skip = as.jump(cc ^ 1);
+                }
+                as.dec(BUDGET);
+                exitIf(Equal, target);
+                if (traces) {
+                    as.load(RAX, ST, stateTraces);
+                    as.load(RAX, RAX, target * sizeof(void*));
+                    as.test(RAX);
+                    auto noTrace = as.jump(Equal);
+                    as.jmpReg(RAX);
+                    as.patch(noTrace, as.size());
+                }
+                fixups.push_back({ as.jump(Always), target });
+                if (cc != Always) {
+                    as.patch(skip, as.size());
+                }
+            }
+
+            void emit(size_t i, const Instruction& ins) {
+                if (emitData(i, ins)) {
+                    return;
+                }
+
+                auto target = (size_t)ins.value.value.integer;
+                switch (ins.op) {
+                    case Opcode::JmpRel:
+                    case Opcode::JmpImm:
+                        jumpTo(Always, i, target);
+                        break;
+                    case Opcode::JmpIfRel:
+                    case Opcode::JmpIfNotRel:
+                        as.subImm(SP, SLOT);
+                        as.cmpByte(SP, 0, 0);
+                        jumpTo(ins.op == Opcode::JmpIfRel ? NotEqual : Equal, i, target);
+                        break;
+                    case Opcode::JmpIfR:
+                    case Opcode::JmpIfNotR:
+                        as.cmpByte(FP, ins.a * SLOT, 0);
+                        jumpTo(ins.op == Opcode::JmpIfR ? NotEqual : Equal, i, target);
+                        break;
+                    case Opcode::JmpIfLTI:
+                    case Opcode::JmpIfGEI:
+                    case Opcode::JmpIfGTI:
+                    case Opcode::JmpIfLEI: {
+                        int cc = ins.op == Opcode::JmpIfLTI ? Less : ins.op == Opcode::JmpIfGEI ? GreaterEqual : ins.op == Opcode::JmpIfGTI ? Greater : LessEqual;
+                        as.subImm(SP, 2 * SLOT);
+                        as.load(RAX, SP, 0);
+                        as.cmp(RAX, SP, SLOT);
+                        jumpTo(cc, i, target);
+                        break;
+                    }
+
+                    case Opcode::CallIndQ:
+                        // calls to anything but the target the instruction was quickened for go through the interpreter
+                        callTargetGuard(target, ins.a);
+                        exitIf(NotEqual, i);
+                        // fall through
+                    case Opcode::CallImm:
+                        as.dec(BUDGET);
+                        exitIf(Equal, i);
+                        // let the interpreter count calls to functions that are not compiled yet
+                        as.load(RAX, ST, stateEntries);
+                        as.load(RAX, RAX, target * sizeof(void*));
+                        as.test(RAX);
+                        exitIf(Equal, i);
+                        // stack overflow, the interpreter reports it
+                        as.cmp(SP, ST, stateLimit);
+                        exitIf(Above, i);
+                        // the callee's slot becomes the frame record, VM::frameRecord(fp - stack, i + 1)
+                        as.mov(RCX, FP);
+                        as.sub(RCX, ST, stateStack);
+                        as.shlImm(RCX, VM::frameIpBits - SLOT_BITS);
+                        as.addImm(RCX, i + 1);
+                        as.store(SP, -(ins.a + 1) * SLOT, RCX);
+                        setType(SP, -(ins.a + 1) * SLOT, VMValue::Type::integer);
+                        as.lea(FP, SP, -ins.a * SLOT);
+                        as.jmpReg(RAX);
+                        break;
+
+                    case Opcode::TailCallImm:
+                        if (target >= first && target < last) {
+                            tailCall(ins);
+                            jumpTo(Always, i, target);
+                            break;
+                        }
+                        as.dec(BUDGET);
+                        exitIf(Equal, i);
+                        as.load(RAX, ST, stateEntries);
+                        as.load(RAX, RAX, target * sizeof(void*));
+                        as.test(RAX);
+                        exitIf(Equal, i);
+                        tailCall(ins);
+                        as.load(RAX, ST, stateEntries);
+                        as.jmpMem(RAX, target * sizeof(void*));
+                        break;
+
+                    case Opcode::Return:
+                    case Opcode::ReturnR:
+                    case Opcode::ReturnVoid:
+                        // returning from main ends the program, the interpreter handles that
+                        as.mov(RAX, FP);
+                        as.sub(RAX, ST, stateStack);
+                        as.subImm(RAX, VM::mainBp * SLOT);
+                        exitIf(Equal, i);
+                        // the return value goes over the frame record, VM::frameOf reads it first
+                        as.load(RDX, FP, -SLOT);
+                        returnValue(ins);
+                        as.mov(FP, RDX);
+                        as.shrImm(FP, VM::frameIpBits);
+                        as.shlImm(FP, SLOT_BITS);
+                        as.add(FP, ST, stateStack);
+                        as.mov32(RAX, RDX);
+                        // continue in the caller, through the interpreter if it is not compiled
+                        as.store(ST, stateIp, RAX);
+                        as.load(RCX, ST, stateEntries);
+                        as.bytes({0x48, 0x8b, 0x0c, 0xc1}); // mov rcx, [rcx + rax * 8]
+                        as.test(RCX);
+                        leaveJumps.push_back(as.jump(Equal));
+                        as.jmpReg(RCX);
+                        break;
+
+                    default:
+                        exitIf(Always, i);
+                        break;
+                }
+            }
+
+        private:
+            size_t first;
+            size_t last;
+            std::vector<std::pair<size_t, size_t>> fixups;
+        };
+
+        /**
+         * Compiles a recorded loop iteration into a native loop.
+         * Calls are inlined: the caller's frame pointer goes to the native stack, and frame records
+         * are only written when a side exit leaves the trace inside a callee.
+         */
+        class TraceCompiler: public Emitter {
+        public:
+            TraceCompiler(const VM& vm, std::deque<std::vector<uint64_t>>& frameTables): Emitter(vm, true), frameTables(frameTables) {
+                resume = true;
+            }
+
+            std::vector<uint8_t>& translate(size_t header, const std::vector<JIT::TraceStep>& trace) {
+                size_t calls = 0;
+                for (auto& step: trace) {
+                    auto op = vm.code[step.index].op;
+                    if (op == Opcode::CallImm || op == Opcode::CallIndQ || op == Opcode::CallInd) {
+                        calls++;
+                    }
+                }
+                frameSpace = (calls * 8 + 15) / 16 * 16;
+                if (frameSpace) {
+                    as.subImm(RSP, frameSpace);
+                }
+
+                std::vector<uint64_t> returns;
+                auto loop = as.size();
+                for (size_t k = 0; k < trace.size(); ++k) {
+                    auto& step = trace[k];
+                    auto& ins = vm.code[step.index];
+                    // a compare directly consumed by a conditional jump only feeds the jump's guard
+                    auto next = k + 1 < trace.size() ? &trace[k + 1] : nullptr;
+                    if (next && (next->index != step.index + 1 || (vm.code[next->index].op != Opcode::JmpIfRel && vm.code[next->index].op != Opcode::JmpIfNotRel))) {
+                        next = nullptr;
+                    }
+
+                    switch (ins.op) {
+                        case Opcode::CmpEQ:
+                        case Opcode::CmpNE:
+                        case Opcode::CmpLTE:
+                        case Opcode::CmpGTE:
+                        case Opcode::CmpEQIQ: case Opcode::CmpEQF64Q: case Opcode::CmpEQBQ:
+                        case Opcode::CmpNEIQ: case Opcode::CmpNEF64Q: case Opcode::CmpNEBQ:
+                        case Opcode::CmpLTEIQ: case Opcode::CmpLTEF64Q: case Opcode::CmpLTEBQ:
+                        case Opcode::CmpGTEIQ: case Opcode::CmpGTEF64Q: case Opcode::CmpGTEBQ:
+                            // quickened ones too, they may have been quickened for another type since recording
+                            if (!specialized(step.type)) {
+                                emitData(step.index, ins);
+                                break;
+                            }
+                            // VMValue compares by the type of the left operand
+                            as.cmpDword(SP, -2 * SLOT + 8, (int32_t)step.type);
+                            exitIf(NotEqual, step.index);
+                            compareStack(step.type, comparison(ins.op), next);
+                            k += next != nullptr;
+                            break;
+                        case Opcode::CmpLTI:
+                        case Opcode::CmpGTI:
+                        case Opcode::CmpLTF64:
+                        case Opcode::CmpGTF64:
+                        case Opcode::CmpEQI: case Opcode::CmpNEI: case Opcode::CmpLTEI: case Opcode::CmpGTEI:
+                        case Opcode::CmpEQF64: case Opcode::CmpNEF64: case Opcode::CmpLTEF64: case Opcode::CmpGTEF64:
+                        case Opcode::CmpEQB: case Opcode::CmpNEB:
+                        case Opcode::CmpEQRef: case Opcode::CmpNERef:
+                            compareStack(comparedType(ins.op), comparison(ins.op), next);
+                            k += next != nullptr;
+                            break;
+                        case Opcode::CmpEQR:
+                        case Opcode::CmpNER:
+                        case Opcode::CmpLTER:
+                        case Opcode::CmpGTER:
+                        case Opcode::CmpEQIRQ: case Opcode::CmpEQF64RQ: case Opcode::CmpEQBRQ:
+                        case Opcode::CmpNEIRQ: case Opcode::CmpNEF64RQ: case Opcode::CmpNEBRQ:
+                        case Opcode::CmpLTEIRQ: case Opcode::CmpLTEF64RQ: case Opcode::CmpLTEBRQ:
+                        case Opcode::CmpGTEIRQ: case Opcode::CmpGTEF64RQ: case Opcode::CmpGTEBRQ:
+                            if (!specialized(step.type)) {
+                                emitData(step.index, ins);
+                                break;
+                            }
+                            as.cmpDword(FP, ins.b * SLOT + 8, (int32_t)step.type);
+                            exitIf(NotEqual, step.index);
+                            compare(step.type, comparison(ins.op), FP, ins.b * SLOT, ins.c * SLOT);
+                            storeBoolean(FP, ins.a * SLOT);
+                            break;
+
+                        case Opcode::JmpRel:
+                        case Opcode::JmpImm:
+                            break;
+                        case Opcode::JmpIfRel:
+                        case Opcode::JmpIfNotRel:
+                            as.subImm(SP, SLOT);
+                            as.cmpByte(SP, 0, 0);
+                            guard(step, ins.op == Opcode::JmpIfRel ? NotEqual : Equal);
+                            break;
+                        case Opcode::JmpIfR:
+                        case Opcode::JmpIfNotR:
+                            as.cmpByte(FP, ins.a * SLOT, 0);
+                            guard(step, ins.op == Opcode::JmpIfR ? NotEqual : Equal);
+                            break;
+                        case Opcode::JmpIfLTI:
+                        case Opcode::JmpIfGEI:
+                        case Opcode::JmpIfGTI:
+                        case Opcode::JmpIfLEI: {
+                            int cc = ins.op == Opcode::JmpIfLTI ? Less : ins.op == Opcode::JmpIfGEI ? GreaterEqual : ins.op == Opcode::JmpIfGTI ? Greater : LessEqual;
+                            as.subImm(SP, 2 * SLOT);
+                            as.load(RAX, SP, 0);
+                            as.cmp(RAX, SP, SLOT);
+                            guard(step, cc);
+                            break;
+                        }
+
+                        case Opcode::CallIndQ:
+                        case Opcode::CallInd:
+                            // only recorded as CallIndQ, possibly de-quickened since. The recorded callee follows, other targets leave the trace
+                            callTargetGuard(trace[k + 1].index, ins.a);
+                            exitIf(NotEqual, step.index);
+                            // fall through
+                        case Opcode::CallImm:
+                            as.cmp(SP, ST, stateLimit);
+                            exitIf(Above, step.index);
+                            as.store(RSP, returns.size() * 8, FP);
+                            as.lea(FP, SP, -ins.a * SLOT);
+                            returns.push_back(step.index + 1);
+                            setFrames(returns);
+                            break;
+                        case Opcode::TailCallImm:
+                            tailCall(ins);
+                            break;
+                        case Opcode::Return:
+                        case Opcode::ReturnR:
+                        case Opcode::ReturnVoid:
+                            returnValue(ins);
+                            returns.pop_back();
+                            as.load(FP, RSP, returns.size() * 8);
+                            setFrames(returns);
+                            break;
+
+                        default:
+                            if (!emitData(step.index, ins)) {
+                                exitIf(Always, step.index);
+                            }
+                            break;
+                    }
+                }
+
+                as.dec(BUDGET);
+                exitIf(Equal, header);
+                as.patch(as.jump(Always), loop);
+                finish();
+                return as.code;
+            }
+
+        private:
+            static bool specialized(VMValue::Type type) {
+                return type == VMValue::Type::integer || type == VMValue::Type::floating || type == VMValue::Type::boolean;
+            }
+
+
+            /** Compares the two topmost values, either pushing the result or guarding the direction of the jump that follows. */
+            void compareStack(VMValue::Type type, Comparison cmp, const JIT::TraceStep* jump) {
+                compare(type, cmp, SP, -2 * SLOT, -SLOT);
+                if (jump) {
+                    as.subImm(SP, 2 * SLOT);
+                    as.testAl();
+                    guard(*jump, vm.code[jump->index].op == Opcode::JmpIfRel ? NotEqual : Equal);
+                }
+                else {
+                    as.subImm(SP, SLOT);
+                    storeBoolean(SP, -SLOT);
+                }
+            }
+
+            /** Leaves the trace if a conditional jump with condition cc does not go the way it went while recording. */
+            void guard(const JIT::TraceStep& step, int cc) {
+                if (step.taken) {
+                    exitIf(cc ^ 1, step.index + 1);
+                }
+                else {
+                    exitIf(cc, vm.code[step.index].value.value.integer);
+                }
+            }
+
+            void setFrames(const std::vector<uint64_t>& returns) {
+                depth = returns.size();
+                if (returns.empty()) {
+                    frames = nullptr;
+                    return;
+                }
+                frameTables.push_back(returns);
+                frames = frameTables.back().data();
+            }
+
+        private:
+            std::deque<std::vector<uint64_t>>& frameTables;
+        };
+    }
+#endif
+
+    JIT::JIT(VM& vm): vm(vm), native(vm.code.size()), traces(vm.code.size()), calls(vm.code.size()), loops(vm.code.size()), aborts(vm.code.size()) {
+        state.vm = &vm;
+        state.stack = vm.stack;
+        state.stackLimit = vm.stackLimit;
+        state.entries = native.data();
+        state.traces = traces.data();
+        // lets the interpreter enter main right away if it gets compiled
+        state.budget = 0;
+
+#ifdef STRELA_JIT
+        // entered from C++ as void(JITState*, const void* target)
+        Assembler as;
+        as.push(RBP);
+        as.push(RBX);
+        as.push(R12);
+        as.push(R13);
+        as.push(R14);
+        as.push(R15);
+        as.subImm(RSP, 8);
+        as.mov(ST, RDI);
+        as.load(SP, ST, stateSp);
+        as.load(FP, ST, stateFp);
+        as.load(BUDGET, ST, stateBudget);
+        as.jmpReg(RSI);
+        trampoline = (void(*)(JITState*, const void*))install(as.code);
+#endif
+    }
+
+    JIT::~JIT() {
+#ifdef STRELA_JIT
+        for (auto& region: regions) {
+            munmap(region.first, region.second);
+        }
+#endif
+    }
+
+    bool JIT::supported() {
+#ifdef STRELA_JIT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void JIT::compileFunctions(uint32_t threshold) {
+        functions = true;
+        callThreshold = threshold;
+    }
+
+    void JIT::traceLoops(uint32_t threshold) {
+        tracing = true;
+        loopThreshold = threshold;
+    }
+
+    void JIT::countCall(size_t index) {
+        if (!functions) {
+            return;
+        }
+        auto& count = calls[index];
+        if (count == UINT32_MAX) {
+            return;
+        }
+        if (++count > callThreshold) {
+            count = UINT32_MAX;
+            compile(index);
+        }
+    }
+
+    size_t JIT::run(size_t budget) {
+        return run(native[vm.ip], budget);
+    }
+
+    size_t JIT::run(const void* entry, size_t budget) {
+        state.sp = vm.sp;
+        state.fp = vm.stack + vm.bp;
+        state.ip = vm.ip;
+        state.budget = budget;
+        trampoline(&state, entry);
+        vm.sp = state.sp;
+        vm.bp = state.fp - vm.stack;
+        vm.ip = state.ip;
+        return budget - state.budget;
+    }
+
+    size_t JIT::loop(size_t budget) {
+        auto header = vm.ip;
+        if (recording) {
+            return 0;
+        }
+        if (traces[header]) {
+            return run(traces[header], budget);
+        }
+        if (!tracing || aborts[header] >= maxAborts || ++loops[header] <= loopThreshold) {
+            return 0;
+        }
+
+        std::vector<TraceStep> trace;
+        size_t ops = 0;
+        if (record(trace, ops)) {
+            compileTrace(header, trace);
+        }
+        else {
+            // the next iteration may take a path that can be traced
+            loops[header] = 0;
+            aborts[header]++;
+        }
+        return ops;
+    }
+
+    bool JIT::record(std::vector<TraceStep>& trace, size_t& ops) {
+#ifdef STRELA_JIT
+        if (!trampoline) {
+            return false;
+        }
+
+        struct Recording {
+            bool& flag;
+            Recording(bool& flag): flag(flag) { flag = true; }
+            ~Recording() { flag = false; }
+        } guard(recording);
+
+        auto header = vm.ip;
+        size_t depth = 0;
+        while (trace.size() < maxTraceLength) {
+            auto index = vm.ip;
+            auto& ins = vm.code[index];
+            // stepping may quicken or de-quicken the instruction
+            auto op = ins.op;
+            TraceStep step{ index, false, VMValue::Type::null };
+
+            // stop before anything a trace can not follow
+            switch (op) {
+                case Opcode::Trap:
+                case Opcode::Jmp:
+                case Opcode::JmpIf:
+                case Opcode::JmpIfNot:
+                case Opcode::CallInd:
+                    return false;
+                case Opcode::Return:
+                case Opcode::ReturnR:
+                case Opcode::ReturnVoid:
+                    if (depth == 0) {
+                        return false;
+                    }
+                    depth--;
+                    break;
+                case Opcode::CallImm:
+                case Opcode::CallIndQ:
+                    if (depth == maxInlineDepth) {
+                        return false;
+                    }
+                    depth++;
+                    break;
+                case Opcode::CmpEQ:
+                case Opcode::CmpNE:
+                case Opcode::CmpLTE:
+                case Opcode::CmpGTE:
+                case Opcode::CmpEQIQ: case Opcode::CmpEQF64Q: case Opcode::CmpEQBQ:
+                case Opcode::CmpNEIQ: case Opcode::CmpNEF64Q: case Opcode::CmpNEBQ:
+                case Opcode::CmpLTEIQ: case Opcode::CmpLTEF64Q: case Opcode::CmpLTEBQ:
+                case Opcode::CmpGTEIQ: case Opcode::CmpGTEF64Q: case Opcode::CmpGTEBQ:
+                    step.type = vm.sp[-2].type;
+                    break;
+                case Opcode::CmpEQR:
+                case Opcode::CmpNER:
+                case Opcode::CmpLTER:
+                case Opcode::CmpGTER:
+                case Opcode::CmpEQIRQ: case Opcode::CmpEQF64RQ: case Opcode::CmpEQBRQ:
+                case Opcode::CmpNEIRQ: case Opcode::CmpNEF64RQ: case Opcode::CmpNEBRQ:
+                case Opcode::CmpLTEIRQ: case Opcode::CmpLTEF64RQ: case Opcode::CmpLTEBRQ:
+                case Opcode::CmpGTEIRQ: case Opcode::CmpGTEF64RQ: case Opcode::CmpGTEBRQ:
+                    step.type = vm.stack[vm.bp + ins.b].type;
+                    break;
+                default:
+                    break;
+            }
+
+            vm.step(1);
+            ops++;
+            step.taken = vm.ip != index + 1;
+            trace.push_back(step);
+
+            if (vm.ip == header && depth == 0) {
+                return true;
+            }
+
+            // inner loops get traces of their own
+            bool transfer = op == Opcode::CallImm || op == Opcode::CallIndQ || op == Opcode::Return || op == Opcode::ReturnR || op == Opcode::ReturnVoid;
+            if (!transfer && step.taken && vm.ip <= index) {
+                return false;
+            }
+        }
+#endif
+        return false;
+    }
+
+    void JIT::compileTrace(size_t header, const std::vector<TraceStep>& trace) {
+#ifdef STRELA_JIT
+        TraceCompiler compiler(vm, frameTables);
+        traces[header] = install(compiler.translate(header, trace));
+#endif
+    }
+
+    void JIT::compile(size_t index) {
+#ifdef STRELA_JIT
+        if (!trampoline) {
+            return;
+        }
+
+        // a function extends up to the entry point of the next one
+        auto function = vm.chunk.functions.find(vm.addressOf(index));
+        if (function == vm.chunk.functions.end()) {
+            return;
+        }
+        ++function;
+        size_t last = function == vm.chunk.functions.end() ? vm.code.size() - 1 : vm.indexOf(function->first);
+
+        Translator translator(vm, tracing, index, last);
+        auto mem = (uint8_t*)install(translator.translate());
+        if (!mem) {
+            return;
+        }
+        for (size_t i = index; i < last; ++i) {
+            native[i] = mem + translator.labels[i - index];
+        }
+#endif
+    }
+
+    void* JIT::install(const std::vector<uint8_t>& code) {
+#ifdef STRELA_JIT
+        auto page = (size_t)sysconf(_SC_PAGESIZE);
+        auto size = (code.size() + page - 1) / page * page;
+        auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        memcpy(mem, code.data(), code.size());
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+            munmap(mem, size);
+            return nullptr;
+        }
+        regions.push_back({ mem, size });
+        return mem;
+#else
+        return nullptr;
+#endif
+    }
+}
@@ -0,0 +1,123 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_VM_JIT_h
+#define Strela_VM_JIT_h
+
+#include "VMValue.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// The template JIT emits x86-64 code for the System V calling convention and the 16 byte value layout.
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(STRELA_NO_JIT) && !defined(STRELA_NAN_BOXING)
+    #define STRELA_JIT
+#endif
+
+namespace Strela {
+    class VM;
+
+    /**
+     * Interpreter state while generated code runs. Generated code addresses the fields by offset,
+     * so this has to stay a standard layout struct.
+     */
+    struct JITState {
+        VM* vm;
+        VMValue* sp;
+        VMValue* fp;
+        uint64_t ip;
+        uint64_t budget;
+        const VMValue* stack;
+        const VMValue* stackLimit;
+        const void* const* entries;
+        const void* const* traces;
+    };
+
+    /**
+     * Baseline template JIT for x86-64.
+     * Functions entered through CallImm or CallInd more often than the threshold are translated to
+     * machine code with one fixed template per opcode. Value stack slots stay in memory, so the
+     * interpreter and generated code can hand over execution at any instruction boundary.
+     * Opcodes without a template are executed by the interpreter through VM::step(1).
+     *
+     * Loop tracing records the instructions one iteration of a hot loop executes, following
+     * calls and taken branches, and compiles that path into a straight native loop. Branches
+     * become guards, dynamically typed comparisons are specialized for the observed operand type,
+     * and a failing guard leaves the trace for the interpreter.
+     */
+    class JIT {
+    public:
+        JIT(VM& vm);
+        ~JIT();
+
+        /** True if generated code can run on this platform. */
+        static bool supported();
+
+        /** Compiles functions once they were called more than threshold times. */
+        void compileFunctions(uint32_t threshold);
+
+        /** Traces loops once their back edge was taken more than threshold times. */
+        void traceLoops(uint32_t threshold);
+
+        /** Counts a call to the function starting at instruction index, compiles it once it is hot. */
+        void countCall(size_t index);
+
+        /** Runs generated code from vm.ip until it needs the interpreter. Returns the consumed budget. */
+        size_t run(size_t budget);
+
+        /**
+         * Called after a backward jump to vm.ip. Runs the loop's trace, or records one if the loop is hot.
+         * Returns the consumed budget.
+         */
+        size_t loop(size_t budget);
+
+        /** True if generated code ran out of budget, or has not run yet, and can resume at vm.ip. */
+        bool suspended() const { return state.budget == 0 && !recording; }
+
+        /** Native entry point per instruction index, null where the interpreter has to run. */
+        const void* const* entries() const { return native.data(); }
+
+    public:
+        /** One executed instruction of a trace, with the branch direction and the operand type it saw. */
+        struct TraceStep {
+            size_t index;
+            bool taken;
+            VMValue::Type type;
+        };
+
+        /** Longest trace in instructions. */
+        static const size_t maxTraceLength = 1000;
+        /** Deepest call nesting a trace follows. */
+        static const size_t maxInlineDepth = 8;
+        /** Failed recordings before a loop is no longer traced. */
+        static const uint8_t maxAborts = 4;
+
+    private:
+        void compile(size_t index);
+        bool record(std::vector<TraceStep>& trace, size_t& ops);
+        void compileTrace(size_t header, const std::vector<TraceStep>& trace);
+        void* install(const std::vector<uint8_t>& code);
+        size_t run(const void* entry, size_t budget);
+
+    private:
+        VM& vm;
+        bool functions = false;
+        uint32_t callThreshold = 0;
+        bool tracing = false;
+        uint32_t loopThreshold = 0;
+        bool recording = false;
+        JITState state;
+        std::vector<const void*> native;
+        std::vector<const void*> traces;
+        std::vector<uint32_t> calls;
+        std::vector<uint32_t> loops;
+        std::vector<uint8_t> aborts;
+        std::vector<std::pair<void*, size_t>> regions;
+        std::deque<std::vector<uint64_t>> frameTables;
+        void (*trampoline)(JITState*, const void*) = nullptr;
+    };
+}
+
+#endif
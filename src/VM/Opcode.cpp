@@ -10,4 +10,85 @@ namespace Strela {
         OPCODES(AS_INFO)
     };
     #undef AS_INFO
+
+    AddrMode addrMode(Opcode op) {
+        switch (op) {
+        case Opcode::ReturnR:
+            return AddrMode::Reg;
+        case Opcode::MovR:
+        case Opcode::NotR:
+            return AddrMode::RegReg;
+        case Opcode::ConstR:
+            return AddrMode::RegConst;
+        case Opcode::AddIR:
+        case Opcode::SubIR:
+        case Opcode::MulIR:
+        case Opcode::DivIR:
+        case Opcode::ModIR:
+        case Opcode::AddF32R:
+        case Opcode::SubF32R:
+        case Opcode::MulF32R:
+        case Opcode::DivF32R:
+        case Opcode::AddF64R:
+        case Opcode::SubF64R:
+        case Opcode::MulF64R:
+        case Opcode::DivF64R:
+        case Opcode::CmpEQR:
+        case Opcode::CmpNER:
+        case Opcode::CmpLTIR:
+        case Opcode::CmpLTF32R:
+        case Opcode::CmpLTF64R:
+        case Opcode::CmpGTIR:
+        case Opcode::CmpGTF32R:
+        case Opcode::CmpGTF64R:
+        case Opcode::CmpLTER:
+        case Opcode::CmpGTER:
+        case Opcode::CmpEQIR:
+        case Opcode::CmpNEIR:
+        case Opcode::CmpLTEIR:
+        case Opcode::CmpGTEIR:
+        case Opcode::CmpEQF64R:
+        case Opcode::CmpNEF64R:
+        case Opcode::CmpLTEF64R:
+        case Opcode::CmpGTEF64R:
+        case Opcode::CmpEQIRQ:
+        case Opcode::CmpEQF64RQ:
+        case Opcode::CmpEQBRQ:
+        case Opcode::CmpNEIRQ:
+        case Opcode::CmpNEF64RQ:
+        case Opcode::CmpNEBRQ:
+        case Opcode::CmpLTEIRQ:
+        case Opcode::CmpLTEF64RQ:
+        case Opcode::CmpLTEBRQ:
+        case Opcode::CmpGTEIRQ:
+        case Opcode::CmpGTEF64RQ:
+        case Opcode::CmpGTEBRQ:
+            return AddrMode::RegRegReg;
+        case Opcode::AddIRI:
+        case Opcode::SubIRI:
+        case Opcode::MulIRI:
+        case Opcode::CmpEQIRI:
+        case Opcode::CmpNEIRI:
+        case Opcode::CmpLTIRI:
+        case Opcode::CmpGTIRI:
+        case Opcode::CmpLTEIRI:
+        case Opcode::CmpGTEIRI:
+            return AddrMode::RegRegImm;
+        case Opcode::JmpImm:
+            return AddrMode::Target;
+        case Opcode::JmpIfR:
+        case Opcode::JmpIfNotR:
+            return AddrMode::RegTarget;
+        case Opcode::JmpRel:
+        case Opcode::JmpIfRel:
+        case Opcode::JmpIfNotRel:
+        case Opcode::JmpIfLTI:
+        case Opcode::JmpIfGEI:
+        case Opcode::JmpIfGTI:
+        case Opcode::JmpIfLEI:
+            return AddrMode::RelTarget;
+        default:
+            return AddrMode::Stack;
+        }
+    }
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "VMValue.h"
 
 namespace Strela {
+    // the opcodes ending in C read and write references in their compressed form, see compressedBase
     #define OPCODES(X) \
         X(Trap, 0, null) \
         X(ReturnVoid, 0, null) \
@@ -32,11 +33,14 @@ namespace Strela {
         X(Ptr64Var, 2, integer) \
         X(ObjPtr64, 1, integer) \
         X(ObjPtr64Var, 2, integer) \
+        X(F64Ptr64, 1, integer) \
+        X(F64Ptr64Var, 2, integer) \
         X(PtrInd8, 1, integer) \
         X(PtrInd16, 1, integer) \
         X(PtrInd32, 1, integer) \
         X(PtrInd64, 1, integer) \
         X(ObjPtrInd64, 1, integer) \
+        X(F64PtrInd64, 1, integer) \
         X(StorePtr8, 1, integer) \
         X(StorePtr16, 1, integer) \
         X(StorePtr32, 1, integer) \
@@ -46,7 +50,7 @@ namespace Strela {
         X(StorePtrInd16, 1, integer) \
         X(StorePtrInd32, 1, integer) \
         X(StorePtrInd64, 1, integer) \
-        X(Call, 1, integer) \
+        X(CallInd, 2, integer) \
         X(CallImm, 5, integer) \
         X(NativeCall, 0, null) \
 		X(BuiltinCall, 8, integer) \
@@ -104,6 +108,120 @@ namespace Strela {
         X(Mov32, 0, null) \
         X(Mov64, 0, null) \
         X(CmpType, 8, integer) \
+        X(MovR, 2, integer) \
+        X(ConstR, 3, integer) \
+        X(NotR, 2, integer) \
+        X(AddIR, 3, integer) \
+        X(SubIR, 3, integer) \
+        X(MulIR, 3, integer) \
+        X(DivIR, 3, integer) \
+        X(ModIR, 3, integer) \
+        X(AddF32R, 3, integer) \
+        X(SubF32R, 3, integer) \
+        X(MulF32R, 3, integer) \
+        X(DivF32R, 3, integer) \
+        X(AddF64R, 3, integer) \
+        X(SubF64R, 3, integer) \
+        X(MulF64R, 3, integer) \
+        X(DivF64R, 3, integer) \
+        X(CmpEQR, 3, integer) \
+        X(CmpNER, 3, integer) \
+        X(CmpLTIR, 3, integer) \
+        X(CmpLTF32R, 3, integer) \
+        X(CmpLTF64R, 3, integer) \
+        X(CmpGTIR, 3, integer) \
+        X(CmpGTF32R, 3, integer) \
+        X(CmpGTF64R, 3, integer) \
+        X(CmpLTER, 3, integer) \
+        X(CmpGTER, 3, integer) \
+        X(AddIRI, 3, integer) \
+        X(SubIRI, 3, integer) \
+        X(MulIRI, 3, integer) \
+        X(CmpEQIRI, 3, integer) \
+        X(CmpNEIRI, 3, integer) \
+        X(CmpLTIRI, 3, integer) \
+        X(CmpGTIRI, 3, integer) \
+        X(CmpLTEIRI, 3, integer) \
+        X(CmpGTEIRI, 3, integer) \
+        X(JmpImm, 4, integer) \
+        X(JmpIfR, 5, integer) \
+        X(JmpIfNotR, 5, integer) \
+        X(ReturnR, 1, integer) \
+        X(VarVar, 2, integer) \
+        X(VarI8, 2, integer) \
+        X(AddIVarVar, 2, integer) \
+        X(AddIVarI8, 2, integer) \
+        X(IncVar, 2, integer) \
+        X(PeekStorePtr8, 1, integer) \
+        X(PeekStorePtr16, 1, integer) \
+        X(PeekStorePtr32, 1, integer) \
+        X(PeekStorePtr64, 1, integer) \
+        X(InterfaceMethod, 1, integer) \
+        X(JmpRel, 4, integer) \
+        X(JmpIfRel, 4, integer) \
+        X(JmpIfNotRel, 4, integer) \
+        X(JmpIfLTI, 4, integer) \
+        X(JmpIfGEI, 4, integer) \
+        X(JmpIfGTI, 4, integer) \
+        X(JmpIfLEI, 4, integer) \
+        X(CmpEQI, 0, null) \
+        X(CmpEQF32, 0, null) \
+        X(CmpEQF64, 0, null) \
+        X(CmpEQB, 0, null) \
+        X(CmpEQRef, 0, null) \
+        X(CmpNEI, 0, null) \
+        X(CmpNEF32, 0, null) \
+        X(CmpNEF64, 0, null) \
+        X(CmpNEB, 0, null) \
+        X(CmpNERef, 0, null) \
+        X(CmpLTEI, 0, null) \
+        X(CmpLTEF32, 0, null) \
+        X(CmpLTEF64, 0, null) \
+        X(CmpGTEI, 0, null) \
+        X(CmpGTEF32, 0, null) \
+        X(CmpGTEF64, 0, null) \
+        X(CmpEQIR, 3, integer) \
+        X(CmpNEIR, 3, integer) \
+        X(CmpLTEIR, 3, integer) \
+        X(CmpGTEIR, 3, integer) \
+        X(CmpEQF64R, 3, integer) \
+        X(CmpNEF64R, 3, integer) \
+        X(CmpLTEF64R, 3, integer) \
+        X(CmpGTEF64R, 3, integer) \
+        X(CmpEQIQ, 0, null) \
+        X(CmpEQF64Q, 0, null) \
+        X(CmpEQBQ, 0, null) \
+        X(CmpNEIQ, 0, null) \
+        X(CmpNEF64Q, 0, null) \
+        X(CmpNEBQ, 0, null) \
+        X(CmpLTEIQ, 0, null) \
+        X(CmpLTEF64Q, 0, null) \
+        X(CmpLTEBQ, 0, null) \
+        X(CmpGTEIQ, 0, null) \
+        X(CmpGTEF64Q, 0, null) \
+        X(CmpGTEBQ, 0, null) \
+        X(CmpEQIRQ, 3, integer) \
+        X(CmpEQF64RQ, 3, integer) \
+        X(CmpEQBRQ, 3, integer) \
+        X(CmpNEIRQ, 3, integer) \
+        X(CmpNEF64RQ, 3, integer) \
+        X(CmpNEBRQ, 3, integer) \
+        X(CmpLTEIRQ, 3, integer) \
+        X(CmpLTEF64RQ, 3, integer) \
+        X(CmpLTEBRQ, 3, integer) \
+        X(CmpGTEIRQ, 3, integer) \
+        X(CmpGTEF64RQ, 3, integer) \
+        X(CmpGTEBRQ, 3, integer) \
+        X(CallIndQ, 2, integer) \
+        X(TailCallImm, 5, integer) \
+        X(ObjPtrC, 1, integer) \
+        X(ObjPtrCVar, 2, integer) \
+        X(ObjPtrIndC, 1, integer) \
+        X(StorePtrC, 1, integer) \
+        X(StorePtrCVar, 2, integer) \
+        X(StorePtrIndC, 1, integer) \
+        X(PeekStorePtrC, 1, integer) \
+        X(InterfaceMethodC, 1, integer) \
     
     #define AS_ENUM(X, A, T) X,
     enum class Opcode: unsigned char {
@@ -121,12 +239,24 @@ namespace Strela {
         VMValue::Type argType;
     };
 
-    struct AddrMode {
-        int dest: 2;
-        int src1: 3;
-        int src2: 3;
+    /**
+     * Operand layout of an opcode. Stack opcodes take their operands from the value stack,
+     * register opcodes name frame slots relative to bp directly (dst first, one byte each).
+     */
+    enum class AddrMode: unsigned char {
+        Stack,
+        Reg,        // src
+        RegReg,     // dst, src
+        RegConst,   // dst, uint16 constant index
+        RegRegReg,  // dst, src1, src2
+        RegRegImm,  // dst, src, int8 immediate
+        Target,     // uint32 jump address
+        RegTarget,  // condition, uint32 jump address
+        RelTarget,  // int32 jump offset from the opcode's own address
     };
 
+    AddrMode addrMode(Opcode op);
+
     extern OpcodeInfo opcodeInfo[];
 }
 
@@ -0,0 +1,55 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "OpcodeProfile.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+namespace Strela {
+    void OpcodeProfile::record(Opcode op, bool fallthrough) {
+        total++;
+        if (!fallthrough) {
+            length = 0;
+        }
+
+        if (length == maxLength) {
+            std::copy(window + 1, window + maxLength, window);
+            length--;
+        }
+        window[length++] = op;
+
+        // sequences ending at op, packed one opcode per byte
+        uint64_t key = (unsigned char)op;
+        for (size_t n = 2; n <= length; ++n) {
+            key = (key << 8) | (unsigned char)window[length - n];
+            counts[n][key]++;
+        }
+    }
+
+    void OpcodeProfile::print(std::ostream& str, size_t top) const {
+        str << "executed " << total << " instructions\n";
+        for (size_t n = 2; n <= maxLength; ++n) {
+            std::vector<std::pair<uint64_t, uint64_t>> sorted(counts[n].begin(), counts[n].end());
+            std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+                return a.second > b.second;
+            });
+            if (sorted.size() > top) {
+                sorted.resize(top);
+            }
+
+            str << "\n; top " << n << "-grams\n";
+            for (auto& entry: sorted) {
+                str << std::setw(12) << std::right << entry.second << " ";
+                str << std::setw(6) << std::fixed << std::setprecision(2) << (100.0 * entry.second / total) << "%  ";
+                for (size_t i = 0; i < n; ++i) {
+                    // the oldest opcode sits in the lowest byte
+                    auto op = (unsigned char)(entry.first >> (8 * i));
+                    str << (i ? ", " : "") << opcodeInfo[op].name;
+                }
+                str << "\n";
+            }
+        }
+    }
+}
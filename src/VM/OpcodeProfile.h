@@ -0,0 +1,35 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_VM_OpcodeProfile_h
+#define Strela_VM_OpcodeProfile_h
+
+#include "Opcode.h"
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+namespace Strela {
+    /**
+     * Counts how often sequences of 2 to maxLength opcodes are executed back to back.
+     * Only straight-line sequences are counted, a taken jump, call or return starts a new one,
+     * so every reported sequence is a candidate for a superinstruction.
+     */
+    class OpcodeProfile {
+    public:
+        void record(Opcode op, bool fallthrough);
+        void print(std::ostream& str, size_t top = 20) const;
+
+    public:
+        static const size_t maxLength = 5;
+
+    private:
+        uint64_t total = 0;
+        size_t length = 0;
+        Opcode window[maxLength];
+        std::unordered_map<uint64_t, uint64_t> counts[maxLength + 1];
+    };
+}
+
+#endif
@@ -0,0 +1,309 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "Runtime.h"
+#include "VMValue.h"
+#include "VMObject.h"
+#include "VMType.h"
+#include "GC.h"
+
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+
+namespace Strela {
+#ifndef STRELA_NAN_BOXING
+    static_assert(sizeof(StrelaValue) == sizeof(VMValue), "StrelaValue has to match VMValue");
+    static_assert(offsetof(StrelaValue, type) == offsetof(VMValue, type), "StrelaValue has to match VMValue");
+#endif
+
+    const VMType* findType(const std::vector<VMType*>& types, const std::string& name) {
+        for (auto&& type: types) {
+            if (type->name == name) {
+                return type;
+            }
+        }
+        return nullptr;
+    }
+
+    void* newString(GC& gc, const VMType* stringType, const VMType* u8Type, const char* chars, size_t length) {
+        auto string = gc.allocObject(stringType);
+        auto arr = gc.allocArray(u8Type, length + 1);
+
+        memcpy((char*)arr + 8, chars, length);
+        ((char*)arr)[length + 8] = 0;
+
+        storeReference(string, arr);
+        return string;
+    }
+
+    VMValue stringEquals(const VMValue& self, const VMValue& other) {
+        auto arr1 = (const char*)loadReference(self.getObject());
+        auto str1 = arr1 + 8;
+        auto len1 = *(const uint64_t*)arr1;
+
+        auto arr2 = (const char*)loadReference(other.getObject());
+        auto str2 = arr2 + 8;
+        auto len2 = *(const uint64_t*)arr2;
+
+        return VMValue(len1 == len2 && !strcmp(str1, str2));
+    }
+
+    VMValue stringConcat(GC& gc, const VMType* stringType, const VMType* u8Type, const VMValue& self, const VMValue& other) {
+        auto arr1 = (const char*)loadReference(self.getObject());
+        auto str1 = arr1 + 8;
+        auto len1 = *(const uint64_t*)arr1 - 1;
+
+        auto arr2 = (const char*)loadReference(other.getObject());
+        auto str2 = arr2 + 8;
+        auto len2 = *(const uint64_t*)arr2 - 1;
+
+        auto newStr = gc.allocObject(stringType);
+        auto newArr = gc.allocArray(u8Type, len1 + len2 + 1);
+
+        storeReference(newStr, newArr);
+        auto str = (char*)newArr + 8;
+        memcpy(str, str1, len1);
+        memcpy(str + len1, str2, len2);
+
+        return VMValue(newStr);
+    }
+
+    void* nativePointer(const VMValue& arg) {
+        void* aptr = arg.getObject();
+        if (aptr) {
+            auto obj = (VMObject*)aptr - 1;
+            if (obj->type()->name == "String") {
+                aptr = (char*)loadReference(obj + 1) + 8;
+            }
+        }
+        return aptr;
+    }
+
+    void reportErrno(const std::string& name) {
+        if (errno > 0) {
+            auto err = strerror(errno);
+            std::cerr << name << ": " << err << "\n";
+            errno = 0;
+        }
+    }
+
+    void printInteger(int64_t value) {
+        std::cout << value;
+        std::flush(std::cout);
+    }
+
+    void printF32(float value) {
+        std::cout << value;
+        std::flush(std::cout);
+    }
+
+    void printF64(double value) {
+        std::cout << value;
+        std::flush(std::cout);
+    }
+
+    void printString(const void* string) {
+        std::cout << ((char*)loadReference(string) + 8);
+        std::flush(std::cout);
+    }
+
+    void printNull() {
+        std::cout << "(null)";
+        std::flush(std::cout);
+    }
+
+    void printObject() {
+        std::cout << "[object]";
+        std::flush(std::cout);
+    }
+
+    void printBoolean(bool value) {
+        std::cout << (value ? "true" : "false");
+        std::flush(std::cout);
+    }
+
+}
+
+// generated C shares the 16 byte value layout, there is no runtime for it with NaN boxing
+#ifndef STRELA_NAN_BOXING
+namespace Strela {
+    /**
+     * State of a program compiled with --emit-c. The VM keeps the same things in its own members.
+     */
+    namespace {
+        GC gc;
+        std::vector<VMType*> types;
+        const VMType* stringType = nullptr;
+        const VMType* u8Type = nullptr;
+        VMValue* stack = nullptr;
+
+        const size_t stackSize = 1024 * 1024;
+        const size_t stackRedZone = 1024;
+
+        VMValue& value(StrelaValue& v) {
+            return *(VMValue*)&v;
+        }
+
+        const VMValue& value(const StrelaValue& v) {
+            return *(const VMValue*)&v;
+        }
+
+        StrelaValue strela(const VMValue& v) {
+            StrelaValue ret;
+            memcpy(&ret, &v, sizeof(ret));
+            return ret;
+        }
+
+        void collectIfDue(size_t bytes, StrelaValue* top) {
+            if (gc.collectionDue(bytes)) {
+                gc.collect(stack, (VMValue*)top);
+            }
+        }
+    }
+}
+
+using namespace Strela;
+
+extern "C" {
+    StrelaValue* strela_stack_limit = nullptr;
+
+    StrelaValue* strela_start(const StrelaTypeInfo* infos, size_t numTypes, int argc, char** argv) {
+        for (size_t i = 0; i < numTypes; ++i) {
+            auto type = new VMType;
+            type->index = i;
+            types.push_back(type);
+        }
+        for (size_t i = 0; i < numTypes; ++i) {
+            auto& info = infos[i];
+            auto type = types[i];
+            type->name = info.name;
+            type->isObject = info.isObject;
+            type->isArray = info.isArray;
+            type->isEnum = info.isEnum;
+            type->arrayType = info.arrayType < 0 ? nullptr : types[info.arrayType];
+            type->size = info.size;
+            type->alignment = info.alignment;
+            type->objectSize = info.objectSize;
+            type->objectAlignment = info.objectAlignment;
+            for (uint32_t f = 0; f < info.numFields; ++f) {
+                auto& field = info.fields[f];
+                type->fields.push_back({ field.name, field.type < 0 ? nullptr : types[field.type], field.offset });
+            }
+            for (uint32_t u = 0; u < info.numUnionTypes; ++u) {
+                type->unionTypes.push_back(types[info.unionTypes[u]]);
+            }
+        }
+        for (auto&& type: types) {
+            type->buildReferenceMap();
+        }
+        stringType = findType(types, "String");
+        u8Type = findType(types, "u8[]");
+
+        stack = (VMValue*)calloc(stackSize + stackRedZone, sizeof(VMValue));
+        if (!stack) {
+            std::cerr << "Could not allocate value stack of " << stackSize << " slots\n";
+            exit(1);
+        }
+        strela_stack_limit = (StrelaValue*)(stack + stackSize);
+
+        auto arrtype = findType(types, "String[]");
+        auto arr = gc.allocArray(arrtype, argc - 1);
+        auto data = (char*)arr + 8;
+        for (int i = 1; i < argc; ++i) {
+            *(void**)data = newString(gc, stringType, u8Type, argv[i], strlen(argv[i]));
+            data += 8;
+        }
+        stack[0] = VMValue(arr);
+        return (StrelaValue*)stack;
+    }
+
+    int strela_exit(StrelaValue result) {
+        return bool(value(result));
+    }
+
+    void strela_stack_overflow(void) {
+        std::cerr << "Stack overflow (" << std::dec << stackSize << " slots)\n";
+        exit(1);
+    }
+
+    void strela_trap(size_t address) {
+        std::cerr << "Trap at address " << std::hex << address << "\n";
+        exit(1);
+    }
+
+    void strela_invalid_call(int64_t address) {
+        std::cerr << "Call to invalid address " << std::hex << address << "\n";
+        exit(1);
+    }
+
+    StrelaValue strela_string(const char* chars) {
+        auto string = newString(gc, stringType, u8Type, chars, strlen(chars));
+        gc.lock(string);
+        return strela(VMValue(string));
+    }
+
+    StrelaValue strela_new(uint32_t type, StrelaValue* top) {
+        collectIfDue(types[type]->objectSize, top);
+        return strela(VMValue(gc.allocObject(types[type])));
+    }
+
+    StrelaValue strela_array(int64_t type, int64_t length, StrelaValue* top) {
+        collectIfDue(types[type]->arrayType->size * length, top);
+        return strela(VMValue(gc.allocArray(types[type], length)));
+    }
+
+    int strela_is_type(const void* object, uint32_t type) {
+        return ((const VMObject*)object - 1)->typeId == types[type]->id;
+    }
+
+    StrelaValue strela_String_eq_String(const StrelaValue* args) {
+        return strela(stringEquals(value(args[0]), value(args[1])));
+    }
+
+    StrelaValue strela_String_plus_String(const StrelaValue* args) {
+        return strela(stringConcat(gc, stringType, u8Type, value(args[0]), value(args[1])));
+    }
+
+    StrelaValue strela_prefork(const StrelaValue*) {
+        return strela(VMValue(int64_t(0)));
+    }
+
+    void* strela_native_pointer(const StrelaValue* arg) {
+        return nativePointer(value(*arg));
+    }
+
+    void strela_native_errno(const char* name) {
+        reportErrno(name);
+    }
+
+    void strela_print_integer(int64_t value) {
+        printInteger(value);
+    }
+
+    void strela_print_f32(float value) {
+        printF32(value);
+    }
+
+    void strela_print_f64(double value) {
+        printF64(value);
+    }
+
+    void strela_print_string(const void* string) {
+        printString(string);
+    }
+
+    void strela_print_null(void) {
+        printNull();
+    }
+
+    void strela_print_object(void) {
+        printObject();
+    }
+
+    void strela_print_boolean(unsigned char value) {
+        printBoolean(value);
+    }
+}
+#endif
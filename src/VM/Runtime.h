@@ -0,0 +1,187 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_VM_Runtime_h
+#define Strela_VM_Runtime_h
+
+/*
+ * Runtime library shared by the VM and by programs compiled to C with --emit-c.
+ * The C part of this header is everything generated code needs: a value layout matching VMValue,
+ * the type table format, and entry points for allocation, builtins, printing and foreign calls.
+ * Generated code is linked against libstrela.a, which holds the runtime, the GC and VMValue.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    STRELA_NULL,
+    STRELA_INTEGER,
+    STRELA_FLOATING,
+    STRELA_BOOLEAN,
+    STRELA_OBJECT,
+};
+
+/** Same layout as VMValue. */
+typedef struct StrelaValue {
+    union {
+        int64_t integer;
+        float f32;
+        double f64;
+        unsigned char boolean;
+        void* object;
+    } value;
+    int32_t type;
+} StrelaValue;
+
+typedef struct StrelaField {
+    const char* name;
+    int32_t type;
+    uint32_t offset;
+} StrelaField;
+
+/** One entry of the program's type table, VMType without the debug information. Types are referenced by index, -1 for none. */
+typedef struct StrelaTypeInfo {
+    const char* name;
+    unsigned char isObject;
+    unsigned char isArray;
+    unsigned char isEnum;
+    int32_t arrayType;
+    uint32_t size;
+    uint32_t alignment;
+    uint32_t objectSize;
+    uint32_t objectAlignment;
+    uint32_t numFields;
+    const StrelaField* fields;
+    uint32_t numUnionTypes;
+    const int32_t* unionTypes;
+} StrelaTypeInfo;
+
+/** End of the value stack, generated functions check their frame against it. */
+extern StrelaValue* strela_stack_limit;
+
+/** Sets up types, heap and value stack. Returns the stack with the argument array in its first slot. */
+StrelaValue* strela_start(const StrelaTypeInfo* types, size_t numTypes, int argc, char** argv);
+/** Process exit code for main's return value. */
+int strela_exit(StrelaValue result);
+void strela_stack_overflow(void);
+void strela_trap(size_t address);
+void strela_invalid_call(int64_t address);
+
+/** Allocates a String that is never collected, for string constants. */
+StrelaValue strela_string(const char* chars);
+/** Allocates an object. Slots below top are the roots if this triggers a collection. */
+StrelaValue strela_new(uint32_t type, StrelaValue* top);
+StrelaValue strela_array(int64_t type, int64_t length, StrelaValue* top);
+int strela_is_type(const void* object, uint32_t type);
+
+StrelaValue strela_String_eq_String(const StrelaValue* args);
+StrelaValue strela_String_plus_String(const StrelaValue* args);
+/** Compiled programs do not fork workers, they go on alone as worker 0. */
+StrelaValue strela_prefork(const StrelaValue* args);
+
+/** Pointer a foreign function receives for an object or pointer typed argument. */
+void* strela_native_pointer(const StrelaValue* arg);
+/** Reports and clears errno after a foreign function call. */
+void strela_native_errno(const char* name);
+
+void strela_print_integer(int64_t value);
+void strela_print_f32(float value);
+void strela_print_f64(double value);
+void strela_print_string(const void* string);
+void strela_print_null(void);
+void strela_print_object(void);
+void strela_print_boolean(unsigned char value);
+
+static inline StrelaValue strela_value(int64_t bits, int32_t type) {
+    StrelaValue v;
+    v.value.integer = bits;
+    v.type = type;
+    return v;
+}
+
+static inline StrelaValue strela_boolean(int value) {
+    StrelaValue v = strela_value(0, STRELA_BOOLEAN);
+    v.value.boolean = value != 0;
+    return v;
+}
+
+/** VMValue::operator bool */
+static inline int strela_truthy(StrelaValue v) {
+    switch (v.type) {
+        case STRELA_INTEGER: return v.value.integer != 0;
+        case STRELA_FLOATING: return v.value.f64 != 0;
+        case STRELA_BOOLEAN: return v.value.boolean;
+        case STRELA_OBJECT: return v.value.object != 0;
+        default: return 0;
+    }
+}
+
+/* VMValue comparison operators, dispatching on the left operand's type. */
+#define STRELA_COMPARISON(NAME, OP) \
+    static inline StrelaValue NAME(StrelaValue l, StrelaValue r) { \
+        switch (l.type) { \
+            case STRELA_INTEGER: return strela_boolean(l.value.integer OP r.value.integer); \
+            case STRELA_FLOATING: return strela_boolean(l.value.f64 OP r.value.f64); \
+            case STRELA_BOOLEAN: return strela_boolean(l.value.boolean OP r.value.boolean); \
+            default: return strela_value(0, STRELA_NULL); \
+        } \
+    }
+STRELA_COMPARISON(strela_eq, ==)
+STRELA_COMPARISON(strela_ne, !=)
+STRELA_COMPARISON(strela_le, <=)
+STRELA_COMPARISON(strela_ge, >=)
+#undef STRELA_COMPARISON
+
+/** Zero extended load of size bytes, as the Ptr opcodes do. */
+static inline StrelaValue strela_load(const void* address, size_t size, int32_t type) {
+    StrelaValue v = strela_value(0, type);
+    memcpy(&v.value.integer, address, size);
+    return v;
+}
+
+static inline void strela_store(void* address, const StrelaValue* v, size_t size) {
+    memcpy(address, &v->value.integer, size);
+}
+
+/* Binds a foreign function declaration to its C symbol, so its prototype can not clash with a libc header. */
+#define STRELA_STRINGIFY2(x) #x
+#define STRELA_STRINGIFY(x) STRELA_STRINGIFY2(x)
+#define STRELA_SYMBOL(name) __asm__(STRELA_STRINGIFY(__USER_LABEL_PREFIX__) name)
+
+#ifdef __cplusplus
+}
+
+#include <string>
+#include <vector>
+
+namespace Strela {
+    struct VMValue;
+    class VMType;
+    class GC;
+
+    const VMType* findType(const std::vector<VMType*>& types, const std::string& name);
+    /** Allocates a String object and its u8[] character array. */
+    void* newString(GC& gc, const VMType* stringType, const VMType* u8Type, const char* chars, size_t length);
+    VMValue stringEquals(const VMValue& self, const VMValue& other);
+    VMValue stringConcat(GC& gc, const VMType* stringType, const VMType* u8Type, const VMValue& self, const VMValue& other);
+
+    void* nativePointer(const VMValue& arg);
+    void reportErrno(const std::string& name);
+
+    void printInteger(int64_t value);
+    void printF32(float value);
+    void printF64(double value);
+    void printString(const void* string);
+    void printNull();
+    void printObject();
+    void printBoolean(bool value);
+}
+#endif
+
+#endif
@@ -5,6 +5,9 @@
 #include "VMObject.h"
 #include "ByteCodeChunk.h"
 #include "Opcode.h"
+#include "OpcodeProfile.h"
+#include "JIT.h"
+#include "Runtime.h"
 
 #include "../exceptions.h"
 #include "../Ast/InterfaceDecl.h"
@@ -35,6 +38,12 @@
     #include <ffi.h>
 #endif
 
+// GCC and Clang support labels as values, which lets VM::step use direct threaded dispatch.
+// Define STRELA_NO_COMPUTED_GOTO to force the portable switch based interpreter.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(STRELA_NO_COMPUTED_GOTO)
+    #define STRELA_COMPUTED_GOTO
+#endif
+
 namespace Strela {
 
     extern int g_timeout;
@@ -51,6 +60,21 @@ namespace Strela {
         return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     }
 
+    /** The value pushed for the 64 bits a field or element load read, f64 loads keep doubles unboxed when NaN boxed. */
+    VMValue loaded(Opcode op, uint64_t bits) {
+        switch (op) {
+            case Opcode::ObjPtr64: case Opcode::ObjPtr64Var: case Opcode::ObjPtrInd64:
+                return VMValue((void*)bits);
+            case Opcode::F64Ptr64: case Opcode::F64Ptr64Var: case Opcode::F64PtrInd64: {
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                return VMValue(d);
+            }
+            default:
+                return VMValue((int64_t)bits);
+        }
+    }
+
     ffi_type* ffitype(const TypeDecl* t) {
         if (t == &IntType::u8)
             return &ffi_type_uint8;
@@ -77,13 +101,13 @@ namespace Strela {
     }
 
 	void VM::checkRead(const VMValue& val, int64_t offset) {
-		if (val.type != VMValue::Type::object) {
+		if (val.getType() != VMValue::Type::object) {
 			std::cerr << "Accessing non-object as object.\n";
 			std::cerr << printCallStack();
 			exit(1);
 		}
 
-		auto obj = val.value.object;
+		auto obj = val.getObject();
 		if (!obj || (uint64_t)obj < 0xffff) {
 			std::cerr << "Null pointer access\n";
 			std::cerr << printCallStack();
@@ -91,16 +115,16 @@ namespace Strela {
 		}
 
 		auto vmobject = (VMObject*)obj - 1;
-		if (vmobject->type->isArray) {
+		if (vmobject->type()->isArray) {
 			auto length = *(uint64_t*)obj;
-			if (offset < 0 || offset > length * vmobject->type->arrayType->size + 8) {
+			if (offset < 0 || offset > length * vmobject->type()->arrayType->size + 8) {
 				std::cerr << "Array access out of bounds.\n";
 				std::cerr << printCallStack();
 				exit(1);
 			}
 		}
-		else if (vmobject->type->isObject) {
-			auto length = vmobject->type->objectSize;
+		else if (vmobject->type()->isObject) {
+			auto length = vmobject->type()->objectSize;
 			if (offset < 0 || offset > length) {
 				std::cerr << "Object access out of bounds.\n";
 				std::cerr << printCallStack();
@@ -119,7 +143,7 @@ namespace Strela {
 
 	std::ofstream sampleFile;
 
-    VM::VM(ByteCodeChunk& chunk, const std::vector<std::string>& arguments): chunk(chunk), status(RUNNING) {
+    VM::VM(ByteCodeChunk& chunk, const std::vector<std::string>& arguments, size_t stackSize): chunk(chunk), status(RUNNING), stackSize(stackSize) {
 #ifdef _WIN32
 		auto mod = LoadLibrary("msvcrt.dll");
 		auto sockmod = LoadLibrary("ws2_32.dll");
@@ -129,6 +153,10 @@ namespace Strela {
 #endif
 		//sampleFile.open("flamegraph.json", std::ios::binary);
 
+        if (chunk.compressedReferences) {
+            Heap::compressReferences();
+        }
+
 		for (auto& ff: chunk.foreignFunctions) {
             ffi_type* rtype;
             rtype = ffitype(ff.returnType);
@@ -158,72 +186,323 @@ namespace Strela {
 			}
 		}
 
-        VMType* arrtype = nullptr;
-        VMType* strtype = nullptr;
-        VMType* u8type = nullptr;
-        for (auto&& type: chunk.types) {
-            if (type->name == "String") {
-                strtype = type;
-            }
-            else if (type->name == "String[]") {
-                arrtype = type;
-            }
-            else if (type->name == "u8[]") {
-                u8type = type;
-            }
-        }
+        auto strtype = findType(chunk.types, "String");
+        auto u8type = findType(chunk.types, "u8[]");
 
 		// init string constants
 		for (auto& constant: chunk.constants) {
-            if (constant.type == VMValue::Type::object) {
-                auto len = strlen((char*)constant.value.object);
-                auto string = gc.allocObject(strtype);
+            if (constant.getType() == VMValue::Type::object) {
+                auto chars = (const char*)constant.getObject();
+                auto string = newString(gc, strtype, u8type, chars, strlen(chars));
                 gc.lock(string);
-                auto arr = gc.allocArray(u8type, len + 1);
-
-                memcpy((char*)arr + 8, constant.value.object, len);
-                ((char*)arr)[len + 8] = 0;
-
-                *(void**)string = arr;
-
-                constant.value.object = string;
+                constant = VMValue(string);
             }
 		}
 
-        ip = chunk.main;
-        bp = 0;
+        load();
+#ifdef STRELA_NAN_BOXING
+        // constants boxed while loading stay alive for good. Boxes made by the program count towards the next
+        // collection, which the next loop back edge or call runs once it is due
+        VMValue::boxHeap = &gc;
+#endif
+        ip = indices[chunk.main];
+        bp = mainBp;
+
+        // calloc leaves untouched pages uncommitted, zeroed slots read as null values (as 0.0 when NaN boxed)
+        stack = (VMValue*)calloc(stackSize + stackRedZone, sizeof(VMValue));
+        if (!stack) {
+            std::cerr << "Could not allocate value stack of " << stackSize << " slots\n";
+            exit(1);
+        }
+        sp = stack;
+        stackLimit = stack + stackSize;
 
-		auto arr = gc.allocArray(arrtype, arguments.size());
+		auto arr = gc.allocArray(findType(chunk.types, "String[]"), arguments.size());
 		auto data = (char*)arr;
 		data += 8;
-		for (int i = 0; i < arguments.size(); ++i) {
-			auto len = arguments[i].length();
-			auto string = gc.allocObject(strtype);
-			auto arr = gc.allocArray(u8type, len + 1);
+		for (auto& argument: arguments) {
+			storeReference(data, newString(gc, strtype, u8type, argument.c_str(), argument.length()));
+			data += referenceSize();
+		}
+		// main's frame record, returning from main finishes the program instead
+		push(VMValue());
+		push(VMValue(arr));
+    }
 
-			memcpy((char*)arr + 8, arguments[i].c_str(), len);
-			((char*)arr)[len + 8] = 0;
+    VM::~VM() {
+#ifdef STRELA_NAN_BOXING
+        if (VMValue::boxHeap == &gc) {
+            VMValue::boxHeap = nullptr;
+        }
+#endif
+        delete jit;
+        free(stack);
+    }
 
-			*(void**)string = arr;
-			*(void**)data = string;
+    void VM::enableJit(uint32_t threshold) {
+        if (!JIT::supported()) {
+            return;
+        }
+        if (!jit) {
+            jit = new JIT(*this);
+            jitEntries = jit->entries();
+        }
+        jit->compileFunctions(threshold);
+        // entering main counts as its first call
+        jit->countCall(ip);
+    }
 
-			data += 8;
-		}
-		push(VMValue(arr));
+    void VM::enableTracing(uint32_t threshold) {
+        if (!JIT::supported()) {
+            return;
+        }
+        if (!jit) {
+            jit = new JIT(*this);
+            jitEntries = jit->entries();
+        }
+        jit->traceLoops(threshold);
     }
 
-    template<typename T> T VM::read() {
+    template<typename T> inline T operand(const Opcode* pos) {
         T ret;
-        memcpy(&ret, &chunk.opcodes[ip], sizeof(T));
-        ip += sizeof(T);
+        memcpy(&ret, pos, sizeof(T));
         return ret;
     }
 
+    void VM::load() {
+        code.clear();
+        code.reserve(chunk.opcodes.size() / 2);
+        indices.resize(chunk.opcodes.size() + 1);
+
+        size_t address = 0;
+        while (address < chunk.opcodes.size()) {
+            auto op = chunk.opcodes[address];
+            if ((unsigned char)op >= numOpcodes) {
+                std::cerr << "Invalid opcode " << std::dec << (int)op << " at address " << address << "\n";
+                exit(1);
+            }
+
+            auto width = opcodeInfo[(unsigned char)op].argWidth;
+            if (address + 1 + width > chunk.opcodes.size()) {
+                std::cerr << "Truncated opcode " << opcodeInfo[(unsigned char)op].name << " at address " << address << "\n";
+                exit(1);
+            }
+
+            Instruction ins;
+            ins.op = op;
+            ins.address = address;
+            auto arg = &chunk.opcodes[address + 1];
+
+            switch (op) {
+            case Opcode::Const: ins.value = chunk.constants[operand<uint16_t>(arg)]; break;
+            case Opcode::I8: ins.value = VMValue((int64_t)operand<int8_t>(arg)); break;
+            case Opcode::I16: ins.value = VMValue((int64_t)operand<int16_t>(arg)); break;
+            case Opcode::I32: ins.value = VMValue((int64_t)operand<int32_t>(arg)); break;
+            case Opcode::I64: ins.value = VMValue((int64_t)operand<int64_t>(arg)); break;
+            case Opcode::U8: ins.value = VMValue((int64_t)operand<uint8_t>(arg)); break;
+            case Opcode::U16: ins.value = VMValue((int64_t)operand<uint16_t>(arg)); break;
+            case Opcode::U32: ins.value = VMValue((int64_t)operand<uint32_t>(arg)); break;
+            case Opcode::U64: ins.value = VMValue((int64_t)operand<uint64_t>(arg)); break;
+            case Opcode::F32:
+                ins.value = VMValue::fromF32(operand<float>(arg));
+                break;
+            case Opcode::F64: ins.value = VMValue(operand<double>(arg)); break;
+            case Opcode::Grow:
+            case Opcode::Var:
+            case Opcode::StoreVar:
+            case Opcode::Peek:
+            case Opcode::CallInd:
+            case Opcode::CallIndQ:
+                ins.a = operand<uint8_t>(arg);
+                break;
+            case Opcode::CallImm:
+            case Opcode::TailCallImm:
+                // resolved to an instruction index below, once all indices are known
+                ins.value = VMValue((int64_t)operand<uint32_t>(arg));
+                ins.a = operand<uint8_t>(arg + 4);
+                break;
+            case Opcode::BuiltinCall:
+                ins.value = VMValue((void*)operand<uint64_t>(arg));
+                break;
+            case Opcode::New:
+            case Opcode::CmpType: {
+                auto type = op == Opcode::New ? operand<uint16_t>(arg) : operand<uint64_t>(arg);
+                if (type >= chunk.types.size()) {
+                    std::cerr << "Type index out of range at address " << address << "\n";
+                    exit(1);
+                }
+                ins.value = VMValue((void*)chunk.types[type]);
+                break;
+            }
+            case Opcode::Ptr8:
+            case Opcode::Ptr16:
+            case Opcode::Ptr32:
+            case Opcode::Ptr64:
+            case Opcode::ObjPtr64:
+            case Opcode::F64Ptr64:
+            case Opcode::PtrInd8:
+            case Opcode::PtrInd16:
+            case Opcode::PtrInd32:
+            case Opcode::PtrInd64:
+            case Opcode::ObjPtrInd64:
+            case Opcode::F64PtrInd64:
+            case Opcode::StorePtr8:
+            case Opcode::StorePtr16:
+            case Opcode::StorePtr32:
+            case Opcode::StorePtr64:
+            case Opcode::StorePtrInd8:
+            case Opcode::StorePtrInd16:
+            case Opcode::StorePtrInd32:
+            case Opcode::StorePtrInd64:
+            case Opcode::PeekStorePtr8:
+            case Opcode::PeekStorePtr16:
+            case Opcode::PeekStorePtr32:
+            case Opcode::PeekStorePtr64:
+            case Opcode::InterfaceMethod:
+            case Opcode::ObjPtrC:
+            case Opcode::ObjPtrIndC:
+            case Opcode::StorePtrC:
+            case Opcode::StorePtrIndC:
+            case Opcode::PeekStorePtrC:
+            case Opcode::InterfaceMethodC:
+                ins.value = VMValue((int64_t)operand<int8_t>(arg));
+                break;
+            case Opcode::VarVar:
+            case Opcode::AddIVarVar:
+                ins.a = operand<uint8_t>(arg);
+                ins.b = operand<uint8_t>(arg + 1);
+                break;
+            case Opcode::VarI8:
+            case Opcode::AddIVarI8:
+            case Opcode::IncVar:
+                ins.a = operand<uint8_t>(arg);
+                ins.value = VMValue((int64_t)operand<int8_t>(arg + 1));
+                break;
+            case Opcode::Ptr64Var:
+            case Opcode::ObjPtr64Var:
+            case Opcode::F64Ptr64Var:
+            case Opcode::StorePtr64Var:
+            case Opcode::ObjPtrCVar:
+            case Opcode::StorePtrCVar:
+                ins.value = VMValue((int64_t)operand<int8_t>(arg));
+                ins.a = operand<uint8_t>(arg + 1);
+                break;
+            default:
+                switch (addrMode(op)) {
+                case AddrMode::Reg:
+                    ins.a = operand<uint8_t>(arg);
+                    break;
+                case AddrMode::RegReg:
+                    ins.a = operand<uint8_t>(arg);
+                    ins.b = operand<uint8_t>(arg + 1);
+                    break;
+                case AddrMode::RegConst:
+                    ins.a = operand<uint8_t>(arg);
+                    ins.value = chunk.constants[operand<uint16_t>(arg + 1)];
+                    break;
+                case AddrMode::RegRegReg:
+                    ins.a = operand<uint8_t>(arg);
+                    ins.b = operand<uint8_t>(arg + 1);
+                    ins.c = operand<uint8_t>(arg + 2);
+                    break;
+                case AddrMode::RegRegImm:
+                    ins.a = operand<uint8_t>(arg);
+                    ins.b = operand<uint8_t>(arg + 1);
+                    ins.value = VMValue((int64_t)operand<int8_t>(arg + 2));
+                    break;
+                case AddrMode::Target:
+                    // resolved to an instruction index below
+                    ins.value = VMValue((int64_t)operand<uint32_t>(arg));
+                    break;
+                case AddrMode::RegTarget:
+                    ins.a = operand<uint8_t>(arg);
+                    ins.value = VMValue((int64_t)operand<uint32_t>(arg + 1));
+                    break;
+                case AddrMode::RelTarget:
+                    ins.value = VMValue((int64_t)address + operand<int32_t>(arg));
+                    break;
+                default:
+                    break;
+                }
+                break;
+            }
+
+            for (size_t i = 0; i <= width; ++i) {
+                indices[address + i] = code.size();
+            }
+            code.push_back(ins);
+            address += 1 + width;
+        }
+
+        // sentinel, so that the index just past the last instruction still maps to an address
+        Instruction end;
+        end.address = address;
+        indices[address] = code.size();
+        code.push_back(end);
+        dequickens.assign(code.size(), 0);
+
+        // frame records keep the return instruction in their low frameIpBits
+        if (code.size() > (size_t(1) << frameIpBits)) {
+            std::cerr << "Program has " << code.size() << " instructions, frame records hold at most " << (size_t(1) << frameIpBits) << "\n";
+            exit(1);
+        }
+
+        for (auto& ins: code) {
+            auto mode = addrMode(ins.op);
+            if (ins.op == Opcode::CallImm || ins.op == Opcode::TailCallImm || mode == AddrMode::Target || mode == AddrMode::RegTarget || mode == AddrMode::RelTarget) {
+                auto target = ins.value.getInteger();
+                if (target >= chunk.opcodes.size()) {
+                    std::cerr << "Jump target out of range at address " << ins.address << "\n";
+                    exit(1);
+                }
+                ins.value = VMValue(int64_t(indices[target]));
+            }
+        }
+    }
+
+    void VM::patch(size_t index, Opcode op) {
+        code[index].op = op;
+        code[index].handler = handlers ? handlers[(unsigned char)op] : nullptr;
+    }
+
+    void VM::quicken(size_t index, VMValue::Type type, Opcode first) {
+        if (dequickens[index] >= maxDequickens) {
+            return;
+        }
+        switch (type) {
+            case VMValue::Type::integer: patch(index, first); break;
+            case VMValue::Type::floating: patch(index, Opcode((int)first + 1)); break;
+            case VMValue::Type::boolean: patch(index, Opcode((int)first + 2)); break;
+            default: break;
+        }
+    }
+
+    void VM::quickenCall(size_t index, size_t target) {
+        if (dequickens[index] >= maxDequickens) {
+            return;
+        }
+        code[index].value = VMValue((int64_t)target);
+        patch(index, Opcode::CallIndQ);
+    }
+
+    void VM::dequicken(size_t index, Opcode generic) {
+        dequickens[index]++;
+        patch(index, generic);
+    }
+
+    size_t VM::addressOf(size_t index) const {
+        return code[index].address;
+    }
+
+    size_t VM::indexOf(size_t address) const {
+        return indices[address];
+    }
+
     VMValue VM::run() {
         uint64_t start = millis();
 
 		while (status != FINISHED) {
-            step(0xffffff);
+            numOps += step(0xffffff);
 
 			if (g_timeout > 0 && millis() - start > g_timeout) {
 				std::cerr << "Aborted due to timeout.\n";
@@ -234,165 +513,308 @@ namespace Strela {
         return exitCode;
     }
 
-    void VM::step(size_t maxOps) {
+    VMValue VM::run(OpcodeProfile& profile) {
+        uint64_t start = millis();
+
+        bool fallthrough = false;
+        while (status != FINISHED) {
+            auto index = ip;
+            profile.record(code[index].op, fallthrough);
+            numOps += step(1);
+            // a taken jump, call or return starts a new sequence
+            fallthrough = ip == index + 1;
+
+            if (g_timeout > 0 && (numOps & 0xffff) == 0 && millis() - start > g_timeout) {
+                std::cerr << "Aborted due to timeout.\n";
+                return VMValue((int64_t)-1);
+            }
+        }
+
+        return exitCode;
+    }
+
+    size_t VM::step(size_t maxOps) {
+		const auto ops = maxOps;
+		const Instruction* const code = this->code.data();
+		const Instruction* pc = code + ip;
+		const Instruction* ins;
+		// the stack pointer lives in a register while stepping and is written back on exit
+		VMValue* sp = this->sp;
+		// frame pointer, always stack + bp
+		VMValue* fp = stack + bp;
+
+		#define SAVE_IP() (ip = pc - code, this->sp = sp)
+		#define PUSH(v) (*sp = (v), ++sp)
+		#define POP() (*--sp)
+		#define REG(n) fp[n]
+		// continues in generated code if control reached a compiled instruction
+		#define ENTER_JIT() \
+			if (jitEntries && jitEntries[pc - code] && maxOps) { \
+				SAVE_IP(); \
+				maxOps -= jit->run(maxOps); \
+				sp = this->sp; \
+				fp = stack + bp; \
+				pc = code + ip; \
+			}
+		// runs or records a trace after a loop's back edge
+		#define TRACE_LOOP() \
+			if (jit && pc <= ins && maxOps) { \
+				SAVE_IP(); \
+				auto used = jit->loop(maxOps); \
+				maxOps -= used < maxOps ? used : maxOps; \
+				sp = this->sp; \
+				fp = stack + bp; \
+				pc = code + ip; \
+				ENTER_JIT(); \
+			}
+#ifdef STRELA_NAN_BOXING
+		// wide integers are boxed without a chance to collect, loops and calls catch up on a collection that became due
+		#define SAFEPOINT() \
+			if (gc.collectionDue()) { \
+				gc.collect(stack, sp); \
+			}
+#else
+		#define SAFEPOINT()
+#endif
+
+		if (jit && jit->suspended()) {
+			ENTER_JIT();
+		}
+
+#ifdef STRELA_COMPUTED_GOTO
+		// Direct threaded dispatch: every handler jumps straight to the next one.
+		#define AS_LABEL(X, A, T) &&op_##X,
+		static const void* labels[] = {
+			OPCODES(AS_LABEL)
+		};
+		#undef AS_LABEL
+
+		if (handlers != labels) {
+			handlers = labels;
+			for (auto& instruction: this->code) {
+				instruction.handler = labels[(unsigned char)instruction.op];
+			}
+		}
+
+		#define CASE(X) op_##X
+		#define NEXT if (!maxOps--) { SAVE_IP(); return ops; } ins = pc++; goto *ins->handler
+		#define DEFAULT op_invalid
+
+		NEXT;
+		{
+#else
+		#define CASE(X) case Opcode::X
+		#define NEXT break
+		#define DEFAULT default
+
 		while (maxOps--) {
-			op = read<Opcode>();
+			ins = pc++;
 
-			switch (op) {
-			case Opcode::Trap: {
+			switch (ins->op) {
+#endif
+			CASE(Trap): {
 				status = STOPPED;
-				ip--;
-				return;
-				break;
-			}
-			case Opcode::I8:
-				push(VMValue((int64_t)read<int8_t>()));
-				break;
-			case Opcode::I16:
-				push(VMValue((int64_t)read<int16_t>()));
-				break;
-			case Opcode::I32:
-				push(VMValue((int64_t)read<int32_t>()));
-				break;
-			case Opcode::I64:
-				push(VMValue((int64_t)read<int64_t>()));
-				break;
-			case Opcode::U8:
-				push(VMValue((int64_t)read<uint8_t>()));
-				break;
-			case Opcode::U16:
-				push(VMValue((int64_t)read<uint16_t>()));
-				break;
-			case Opcode::U32:
-				push(VMValue((int64_t)read<uint32_t>()));
-				break;
-			case Opcode::U64:
-				push(VMValue((int64_t)read<uint64_t>()));
-				break;
-			case Opcode::F32: {
-				VMValue val;
-				val.value.f32 = read<float>();
-				val.type = VMValue::Type::floating;
-				push(val);
-				break;
-			}
-			case Opcode::F64:
-				push(VMValue((double)read<double>()));
-				break;
-
-			case Opcode::Null:
-				push(VMValue());
-				break;
-
-			case Opcode::Const: {
-				push(chunk.constants[read<uint16_t>()]);
-				break;
-			}
-			case Opcode::Grow: {
-				stack.resize(stack.size() + read<uint8_t>());
-				break;
-			}
-			case Opcode::Var: {
-				push(peek(bp + read<uint8_t>()));
-				break;
-			}
-			case Opcode::StoreVar: {
-				poke(bp + read<uint8_t>(), pop());
-				break;
-			}
-			case Opcode::Peek: {
-				push(peek(stack.size() - 1 - read<uint8_t>()));
-				break;
-			}
-			case Opcode::Call: {
-				auto newip = pop().value.integer;
-				auto numargs = read<uint8_t>();
-				callStack.push_back({ bp, ip });
-				bp = stack.size() - numargs;
-				ip = newip;
-				break;
-			}
-			case Opcode::CallImm: {
-				auto newip = read<uint32_t>();
-				auto numargs = read<uint8_t>();
-				callStack.push_back({ bp, ip });
-				bp = stack.size() - numargs;
-				ip = newip;
-				break;
-			}
-			case Opcode::F32tI64: {
-				auto& back = stack.back();
-				back.value.integer = back.value.f32;
-				back.type = VMValue::Type::integer;
-				break;
-			}
-			case Opcode::F64tI64: {
-				auto& back = stack.back();
-				back.value.integer = back.value.f64;
-				back.type = VMValue::Type::integer;
-				break;
-			}
-			case Opcode::I64tF32: {
-				auto& back = stack.back();
-				back.value.integer = 0;
-				back.value.f32 = back.value.integer;
-				back.type = VMValue::Type::floating;
-				break;
-			}
-			case Opcode::I64tF64: {
-				auto& back = stack.back();
-				back.value.f64 = back.value.integer;
-				back.type = VMValue::Type::floating;
-				break;
-			}
-			case Opcode::F64tF32: {
-				auto& back = stack.back();
-				back.value.integer = 0;
-				back.value.f32 = back.value.f64;
-				break;
-			}
-			case Opcode::F32tF64: {
-				auto& back = stack.back();
-				back.value.f64 = back.value.f32;
-				break;
-			}
-			case Opcode::NativeCall: {
-				auto funcindex = pop();
-				auto& ff = chunk.foreignFunctions[funcindex.value.integer];
-
-				VMValue retVal((int64_t)0);
-				if (ff.returnType->as<FloatType>()) retVal.type = VMValue::Type::floating;
-				else if (ff.returnType->as<IntType>()) retVal.type = VMValue::Type::integer;
-
-				std::vector<VMValue> originalArgs;
+				pc--;
+				SAVE_IP();
+				return ops - maxOps - 1;
+			}
+			CASE(I8):
+				PUSH(ins->value);
+				NEXT;
+			CASE(I16):
+				PUSH(ins->value);
+				NEXT;
+			CASE(I32):
+				PUSH(ins->value);
+				NEXT;
+			CASE(I64):
+				PUSH(ins->value);
+				NEXT;
+			CASE(U8):
+				PUSH(ins->value);
+				NEXT;
+			CASE(U16):
+				PUSH(ins->value);
+				NEXT;
+			CASE(U32):
+				PUSH(ins->value);
+				NEXT;
+			CASE(U64):
+				PUSH(ins->value);
+				NEXT;
+			CASE(F32):
+				PUSH(ins->value);
+				NEXT;
+			CASE(F64):
+				PUSH(ins->value);
+				NEXT;
+
+			CASE(Null):
+				PUSH(VMValue());
+				NEXT;
+
+			CASE(Const): {
+				PUSH(ins->value);
+				NEXT;
+			}
+			CASE(Grow): {
+				if (sp + ins->a > stackLimit) {
+					SAVE_IP();
+					stackOverflow();
+				}
+				for (auto end = sp + ins->a; sp < end; ++sp) *sp = VMValue();
+				NEXT;
+			}
+			CASE(Var): {
+				PUSH(fp[ins->a]);
+				NEXT;
+			}
+			CASE(StoreVar): {
+				fp[ins->a] = POP();
+				NEXT;
+			}
+			CASE(Peek): {
+				PUSH(sp[-1 - ins->a]);
+				NEXT;
+			}
+			CASE(CallInd): {
+				// [callee, arguments], the callee's slot becomes the frame record
+				auto& callee = sp[-1 - ins->a];
+				auto target = indices[callee.getInteger()];
+				if (sp > stackLimit) {
+					SAVE_IP();
+					stackOverflow();
+				}
+				quickenCall(ins - code, target);
+				callee = frameRecord(bp, pc - code);
+				bp = sp - stack - ins->a;
+				fp = stack + bp;
+				pc = code + target;
+				SAFEPOINT();
+				if (jit) {
+					jit->countCall(pc - code);
+					ENTER_JIT();
+				}
+				NEXT;
+			}
+			CASE(CallIndQ): {
+				auto& callee = sp[-1 - ins->a];
+				if (sp > stackLimit) {
+					SAVE_IP();
+					stackOverflow();
+				}
+				auto target = ins->value.getInteger();
+				if (code[target].address != callee.getInteger()) {
+					dequicken(ins - code, Opcode::CallInd);
+					target = indices[callee.getInteger()];
+				}
+				callee = frameRecord(bp, pc - code);
+				bp = sp - stack - ins->a;
+				fp = stack + bp;
+				pc = code + target;
+				SAFEPOINT();
+				if (jit) {
+					jit->countCall(pc - code);
+					ENTER_JIT();
+				}
+				NEXT;
+			}
+			CASE(CallImm): {
+				// the caller reserved the slot below the arguments for the frame record
+				if (sp > stackLimit) {
+					SAVE_IP();
+					stackOverflow();
+				}
+				sp[-1 - ins->a] = frameRecord(bp, pc - code);
+				bp = sp - stack - ins->a;
+				fp = stack + bp;
+				pc = code + ins->value.getInteger();
+				SAFEPOINT();
+				if (jit) {
+					jit->countCall(pc - code);
+					ENTER_JIT();
+				}
+				NEXT;
+			}
+			CASE(TailCallImm): {
+				// the arguments replace the caller's frame, which keeps its frame record
+				auto args = sp - ins->a;
+				for (int i = 0; i < ins->a; ++i) {
+					fp[i] = args[i];
+				}
+				sp = fp + ins->a;
+				pc = code + ins->value.getInteger();
+				SAFEPOINT();
+				if (jit) {
+					jit->countCall(pc - code);
+					TRACE_LOOP();
+					ENTER_JIT();
+				}
+				NEXT;
+			}
+			CASE(F32tI64): {
+				auto& back = sp[-1];
+				back.setInteger(int64_t(back.getF32()));
+				NEXT;
+			}
+			CASE(F64tI64): {
+				auto& back = sp[-1];
+				back.setInteger(int64_t(back.getF64()));
+				NEXT;
+			}
+			CASE(I64tF32): {
+				auto& back = sp[-1];
+				back.setF32(back.getInteger());
+				NEXT;
+			}
+			CASE(I64tF64): {
+				auto& back = sp[-1];
+				back.setF64(double(back.getInteger()));
+				NEXT;
+			}
+			CASE(F64tF32): {
+				auto& back = sp[-1];
+				back.setF32(back.getF64());
+				NEXT;
+			}
+			CASE(F32tF64): {
+				auto& back = sp[-1];
+				back.setF64(back.getF32());
+				NEXT;
+			}
+			CASE(NativeCall): {
+				auto funcindex = POP();
+				auto& ff = chunk.foreignFunctions[funcindex.getInteger()];
+
+				// libffi reads and writes plain payloads, whatever the layout of VMValue is
+				std::vector<uint64_t> originalArgs;
 				originalArgs.resize(ff.argTypes.size());
+				std::vector<bool> isObject(ff.argTypes.size());
+				// native code gets raw pointers, compaction must not move what they point into until it returns
+				std::vector<void*> pinned;
 				for (int i = ff.argTypes.size() - 1; i >= 0; --i) {
-					originalArgs[i] = pop();
+					auto arg = POP();
+					isObject[i] = arg.getType() == VMValue::Type::object;
+					originalArgs[i] = isObject[i] ? (uint64_t)nativePointer(arg) : arg.bits();
+					if (isObject[i] && arg.getObject()) {
+						pinned.push_back(arg.getObject());
+						if (originalArgs[i] != (uint64_t)arg.getObject()) {
+							// a string passes its characters
+							pinned.push_back(loadReference(arg.getObject()));
+						}
+					}
+				}
+				for (auto obj: pinned) {
+					gc.pin(obj);
 				}
 
-				std::vector<VMValue> args;
+				std::vector<uint64_t> args;
 				args.reserve(ff.argTypes.size());
 				std::vector<void*> argPtrs;
 				argPtrs.reserve(ff.argTypes.size());
 				for (size_t i = 0; i < ff.argTypes.size(); ++i) {
-					if (originalArgs[i].type == VMValue::Type::object) {
-						void* aptr = originalArgs[i].value.object;
-                        if (aptr) {
-                            auto obj = (VMObject*)aptr - 1;
-                            if (obj->type->name == "String") {
-                                aptr = *(uint64_t**)(obj + 1) + 1;
-                            }
-                        }
-						VMValue arg((int64_t)0);
-						memcpy(&arg.value.integer, &aptr, sizeof(void*));
-						args.push_back(arg);
-						argPtrs.push_back(&args.back());
-					}
-					else if (ff.argTypes[i] == &PointerType::instance) {
-						void* aptr = &originalArgs[i].value;
-						VMValue arg((int64_t)0);
-						memcpy(&arg.value.integer, &aptr, sizeof(void*));
-						args.push_back(arg);
+					if (!isObject[i] && ff.argTypes[i] == &PointerType::instance) {
+						args.push_back((uint64_t)&originalArgs[i]);
 						argPtrs.push_back(&args.back());
 					}
 					else {
@@ -400,488 +822,1154 @@ namespace Strela {
 					}
 				}
 
-				ffi_call(&ff.cif, ff.ptr, &retVal, ff.argTypes.empty() ? nullptr : &argPtrs[0]);
-				if (errno > 0) {
-					auto err = strerror(errno);
-					std::cerr << ff.name << ": " << err << "\n";
-					errno = 0;
+				uint64_t result = 0;
+				ffi_call(&ff.cif, ff.ptr, &result, ff.argTypes.empty() ? nullptr : &argPtrs[0]);
+				reportErrno(ff.name);
+				for (auto obj: pinned) {
+					gc.unpin(obj);
+				}
+
+				VMValue retVal((int64_t)result);
+				if (ff.returnType == &FloatType::f32) {
+					float f32;
+					memcpy(&f32, &result, sizeof(f32));
+					retVal = VMValue::fromF32(f32);
+				}
+				else if (ff.returnType->as<FloatType>()) {
+					double f64;
+					memcpy(&f64, &result, sizeof(f64));
+					retVal = VMValue(f64);
 				}
 
 				if (ff.returnType != &VoidType::instance) {
-					push(retVal);
+					PUSH(retVal);
 				}
-				break;
+				NEXT;
 			}
-			case Opcode::BuiltinCall: {
-				auto func = (BuiltinFunction)read<uint64_t>();
+			CASE(BuiltinCall): {
+				auto func = (BuiltinFunction)ins->value.getObject();
+				this->sp = sp;
 				func(*this);
-				break;
+				sp = this->sp;
+				NEXT;
 			}
-			case Opcode::Return: {
-				auto retVal = pop();
-				if (callStack.empty()) {
+			CASE(Return): {
+				auto retVal = POP();
+				if (bp == mainBp) {
 					exitCode = retVal;
 					status = FINISHED;
-					maxOps = 0;
-					return;
+					SAVE_IP();
+					return ops - maxOps;
 				}
 
-				stack.resize(bp);
-
-				auto& frame = callStack.back();
-				ip = frame.ip;
+				auto frame = frameOf(fp[-1]);
+				sp = fp - 1;
+				pc = code + frame.ip;
 				bp = frame.bp;
-				callStack.pop_back();
+				fp = stack + bp;
 
-				push(retVal);
-				break;
+				PUSH(retVal);
+				ENTER_JIT();
+				NEXT;
 			}
-			case Opcode::ReturnVoid: {
-				stack.resize(bp);
-
-				auto& frame = callStack.back();
-				ip = frame.ip;
+			CASE(ReturnVoid): {
+				auto frame = frameOf(fp[-1]);
+				sp = fp - 1;
+				pc = code + frame.ip;
 				bp = frame.bp;
-				callStack.pop_back();
-				break;
-			}
-			case Opcode::AddI: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.integer += r.value.integer;
-				break;
-			}
-			case Opcode::AddF32: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f32 += r.value.f32;
-				break;
-			}
-			case Opcode::AddF64: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f64 += r.value.f64;
-				break;
-			}
-			case Opcode::SubI: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.integer -= r.value.integer;
-				break;
-			}
-			case Opcode::SubF32: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f32 -= r.value.f32;
-				break;
-			}
-			case Opcode::SubF64: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f64 -= r.value.f64;
-				break;
-			}
-			case Opcode::MulI: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.integer *= r.value.integer;
-				break;
-			}
-			case Opcode::MulF32: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f32 *= r.value.f32;
-				break;
-			}
-			case Opcode::MulF64: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f64 *= r.value.f64;
-				break;
-			}
-			case Opcode::DivI: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.integer /= r.value.integer;
-				break;
-			}
-			case Opcode::DivF32: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f32 /= r.value.f32;
-				break;
-			}
-			case Opcode::DivF64: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.f64 /= r.value.f64;
-				break;
-			}
-            case Opcode::ModI: {
-                auto r = pop();
-				auto& l = stack.back();
-                l.value.integer %= r.value.integer;
-                break;
+				fp = stack + bp;
+				ENTER_JIT();
+				NEXT;
+			}
+			CASE(AddI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setInteger(l.getInteger() + r.getInteger());
+				NEXT;
+			}
+			CASE(AddF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF32(l.getF32() + r.getF32());
+				NEXT;
+			}
+			CASE(AddF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF64(l.getF64() + r.getF64());
+				NEXT;
+			}
+			CASE(SubI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setInteger(l.getInteger() - r.getInteger());
+				NEXT;
+			}
+			CASE(SubF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF32(l.getF32() - r.getF32());
+				NEXT;
+			}
+			CASE(SubF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF64(l.getF64() - r.getF64());
+				NEXT;
+			}
+			CASE(MulI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setInteger(l.getInteger() * r.getInteger());
+				NEXT;
+			}
+			CASE(MulF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF32(l.getF32() * r.getF32());
+				NEXT;
+			}
+			CASE(MulF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF64(l.getF64() * r.getF64());
+				NEXT;
+			}
+			CASE(DivI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setInteger(l.getInteger() / r.getInteger());
+				NEXT;
+			}
+			CASE(DivF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF32(l.getF32() / r.getF32());
+				NEXT;
+			}
+			CASE(DivF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setF64(l.getF64() / r.getF64());
+				NEXT;
+			}
+            CASE(ModI): {
+                auto r = POP();
+				auto& l = sp[-1];
+                l.setInteger(l.getInteger() % r.getInteger());
+                NEXT;
             }
-			case Opcode::CmpEQ: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = (l == r);
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpNE: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = (l != r);
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpLTI: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.integer < r.value.integer;
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpLTF32: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.f32 < r.value.f32;
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpLTF64: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.f64 < r.value.f64;
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpGTI: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.integer > r.value.integer;
-				l.type = VMValue::Type::boolean;
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpGTF32: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.f32 > r.value.f32;
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpGTF64: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.f64 > r.value.f64;
-				l.type = VMValue::Type::boolean;
-				break;
-			}
-			case Opcode::CmpLTE: {
-				auto r = pop();
-				auto l = pop();
-				push(l <= r);
-				break;
-			}
-			case Opcode::CmpGTE: {
-				auto r = pop();
-				auto l = pop();
-				push(l >= r);
-				break;
-			}
-			case Opcode::AndL: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.boolean && r.value.boolean;
-				break;
-			}
-			case Opcode::OrL: {
-				auto r = pop();
-				auto& l = stack.back();
-				l.value.boolean = l.value.boolean || r.value.boolean;
-				break;
-			}
-			case Opcode::Not: {
-				auto& l = stack.back();
-				l.value.boolean = !l.value.boolean;
-				break;
-			}
-			case Opcode::PrintI: {
-				std::cout << pop().value.integer;
-				std::flush(std::cout);
-				break;
-			}
-			case Opcode::PrintF32: {
-				float f;
-				auto v = pop();
-				memcpy(&f, &v, sizeof(float));
-				std::cout << f;
-				std::flush(std::cout);
-				break;
-			}
-			case Opcode::PrintF64: {
-				std::cout << pop().value.f64;
-				std::flush(std::cout);
-				break;
-			}
-			case Opcode::PrintN: {
-				std::cout << "(null)";
-				std::flush(std::cout);
-				break;
-			}
-			case Opcode::PrintS: {
-				auto val = pop();
-				std::cout << (*(char**)val.value.object + 8);
-				std::flush(std::cout);
-				break;
-			}
-			case Opcode::PrintO: {
-				std::cout << "[object]";
-				std::flush(std::cout);
-				break;
-			}
-			case Opcode::PrintB: {
-				std::cout << (pop().value.boolean ? "true" : "false");
-				std::flush(std::cout);
-				break;
-			}
-			case Opcode::Jmp: {
-				ip = pop().value.integer;
-				break;
-			}
-			case Opcode::JmpIf: {
-				auto newip = pop();
-				auto cond = pop();
+			CASE(CmpEQ): {
+				quicken(ins - code, sp[-2].getType(), Opcode::CmpEQIQ);
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l == r);
+				NEXT;
+			}
+			CASE(CmpNE): {
+				quicken(ins - code, sp[-2].getType(), Opcode::CmpNEIQ);
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l != r);
+				NEXT;
+			}
+			CASE(CmpLTI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getInteger() < r.getInteger());
+				NEXT;
+			}
+			CASE(CmpLTF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF32() < r.getF32());
+				NEXT;
+			}
+			CASE(CmpLTF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF64() < r.getF64());
+				NEXT;
+			}
+			CASE(CmpGTI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getInteger() > r.getInteger());
+				NEXT;
+			}
+			CASE(CmpGTF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF32() > r.getF32());
+				NEXT;
+			}
+			CASE(CmpGTF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF64() > r.getF64());
+				NEXT;
+			}
+			CASE(CmpEQI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getInteger() == r.getInteger());
+				NEXT;
+			}
+			CASE(CmpEQF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF32() == r.getF32());
+				NEXT;
+			}
+			CASE(CmpEQF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF64() == r.getF64());
+				NEXT;
+			}
+			CASE(CmpEQB): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getBoolean() == r.getBoolean());
+				NEXT;
+			}
+			CASE(CmpEQRef): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getObject() == r.getObject());
+				NEXT;
+			}
+			CASE(CmpNEI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getInteger() != r.getInteger());
+				NEXT;
+			}
+			CASE(CmpNEF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF32() != r.getF32());
+				NEXT;
+			}
+			CASE(CmpNEF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF64() != r.getF64());
+				NEXT;
+			}
+			CASE(CmpNEB): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getBoolean() != r.getBoolean());
+				NEXT;
+			}
+			CASE(CmpNERef): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getObject() != r.getObject());
+				NEXT;
+			}
+			CASE(CmpLTEI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getInteger() <= r.getInteger());
+				NEXT;
+			}
+			CASE(CmpLTEF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF32() <= r.getF32());
+				NEXT;
+			}
+			CASE(CmpLTEF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF64() <= r.getF64());
+				NEXT;
+			}
+			CASE(CmpGTEI): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getInteger() >= r.getInteger());
+				NEXT;
+			}
+			CASE(CmpGTEF32): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF32() >= r.getF32());
+				NEXT;
+			}
+			CASE(CmpGTEF64): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getF64() >= r.getF64());
+				NEXT;
+			}
+			CASE(CmpLTE): {
+				quicken(ins - code, sp[-2].getType(), Opcode::CmpLTEIQ);
+				auto r = POP();
+				auto l = POP();
+				PUSH(l <= r);
+				NEXT;
+			}
+			CASE(CmpGTE): {
+				quicken(ins - code, sp[-2].getType(), Opcode::CmpGTEIQ);
+				auto r = POP();
+				auto l = POP();
+				PUSH(l >= r);
+				NEXT;
+			}
+			CASE(AndL): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getBoolean() && r.getBoolean());
+				NEXT;
+			}
+			CASE(OrL): {
+				auto r = POP();
+				auto& l = sp[-1];
+				l.setBoolean(l.getBoolean() || r.getBoolean());
+				NEXT;
+			}
+			CASE(Not): {
+				auto& l = sp[-1];
+				l.setBoolean(!l.getBoolean());
+				NEXT;
+			}
+			CASE(PrintI): {
+				printInteger(POP().getInteger());
+				NEXT;
+			}
+			CASE(PrintF32): {
+				printF32(POP().getF32());
+				NEXT;
+			}
+			CASE(PrintF64): {
+				printF64(POP().getF64());
+				NEXT;
+			}
+			CASE(PrintN): {
+				POP();
+				printNull();
+				NEXT;
+			}
+			CASE(PrintS): {
+				printString(POP().getObject());
+				NEXT;
+			}
+			CASE(PrintO): {
+				POP();
+				printObject();
+				NEXT;
+			}
+			CASE(PrintB): {
+				printBoolean(POP().getBoolean());
+				NEXT;
+			}
+			CASE(Jmp): {
+				pc = code + indices[POP().getInteger()];
+				NEXT;
+			}
+			CASE(JmpIf): {
+				auto newip = POP();
+				auto cond = POP();
 				if (cond) {
-					ip = newip.value.integer;
+					pc = code + indices[newip.getInteger()];
 				}
-				break;
+				NEXT;
 			}
-			case Opcode::JmpIfNot: {
-				auto newip = pop();
-				auto cond = pop();
+			CASE(JmpIfNot): {
+				auto newip = POP();
+				auto cond = POP();
 				if (!cond) {
-					ip = newip.value.integer;
-				}
-				break;
-			}
-			case Opcode::New: {
-				numallocs++;
-				if ((numallocs % 1000) == 0) {
-					gc.collect(stack);
-				}
-				auto type = read<uint16_t>();
-				auto obj = gc.allocObject(chunk.types[type]);
-				auto val = VMValue(obj);
-				val.type = VMValue::Type::object;
-				push(val);
-				break;
-			}
-			case Opcode::Array: {
-				numallocs++;
-				if ((numallocs % 1000) == 0) {
-					gc.collect(stack);
-				}
-				auto length = pop();
-				auto type = pop();
-				auto obj = gc.allocArray(chunk.types[type.value.integer], length.value.integer);
-				auto val = VMValue(obj);
-				val.type = VMValue::Type::object;
-				push(val);
-				break;
-			}
-			case Opcode::Ptr8: {
-			case Opcode::Ptr16:
-			case Opcode::Ptr32:
-			case Opcode::Ptr64:
-			case Opcode::ObjPtr64:
-				auto v = pop();
-				auto obj = v.value.object;
-				auto offset = read<int8_t>();
-				VMValue val((int64_t)0);
+					pc = code + indices[newip.getInteger()];
+				}
+				NEXT;
+			}
+			CASE(JmpRel): {
+				pc = code + ins->value.getInteger();
+				SAFEPOINT();
+				TRACE_LOOP();
+				NEXT;
+			}
+			CASE(JmpIfRel): {
+				if (POP().getBoolean()) {
+					pc = code + ins->value.getInteger();
+				}
+				NEXT;
+			}
+			CASE(JmpIfNotRel): {
+				if (!POP().getBoolean()) {
+					pc = code + ins->value.getInteger();
+				}
+				NEXT;
+			}
+			CASE(JmpIfLTI): {
+				sp -= 2;
+				if (sp[0].getInteger() < sp[1].getInteger()) {
+					pc = code + ins->value.getInteger();
+				}
+				NEXT;
+			}
+			CASE(JmpIfGEI): {
+				sp -= 2;
+				if (sp[0].getInteger() >= sp[1].getInteger()) {
+					pc = code + ins->value.getInteger();
+				}
+				NEXT;
+			}
+			CASE(JmpIfGTI): {
+				sp -= 2;
+				if (sp[0].getInteger() > sp[1].getInteger()) {
+					pc = code + ins->value.getInteger();
+				}
+				NEXT;
+			}
+			CASE(JmpIfLEI): {
+				sp -= 2;
+				if (sp[0].getInteger() <= sp[1].getInteger()) {
+					pc = code + ins->value.getInteger();
+				}
+				NEXT;
+			}
+			CASE(New): {
+				auto type = (const VMType*)ins->value.getObject();
+				if (gc.collectionDue(type->objectSize)) {
+					gc.collect(stack, sp);
+				}
+				auto obj = gc.allocObject(type);
+				PUSH(VMValue(obj));
+				NEXT;
+			}
+			CASE(Array): {
+				auto type = chunk.types[sp[-2].getInteger()];
+				auto length = sp[-1].getInteger();
+				if (gc.collectionDue(type->arrayType->size * length)) {
+					gc.collect(stack, sp);
+				}
+				sp -= 2;
+				auto obj = gc.allocArray(type, length);
+				PUSH(VMValue(obj));
+				NEXT;
+			}
+			CASE(Ptr8): {
+			CASE(Ptr16):
+			CASE(Ptr32):
+			CASE(Ptr64):
+			CASE(ObjPtr64):
+			CASE(F64Ptr64):
+				auto v = POP();
+				auto obj = v.getObject();
+				auto offset = ins->value.getInteger();
+				uint64_t bits = 0;
 #ifdef _DEBUG
+				SAVE_IP();
 				checkRead(v, offset);
 #endif
 
-				switch ((Opcode)op) {
-				case Opcode::Ptr8: memcpy(&val.value.integer, (char*)obj + offset, 1); break;
-				case Opcode::Ptr16: memcpy(&val.value.integer, (char*)obj + offset, 2); break;
-				case Opcode::Ptr32: memcpy(&val.value.integer, (char*)obj + offset, 4); break;
-				case Opcode::Ptr64: memcpy(&val.value.integer, (char*)obj + offset, 8); break;
-				case Opcode::ObjPtr64: memcpy(&val.value.integer, (char*)obj + offset, 8); break;
+				switch (ins->op) {
+				case Opcode::Ptr8: memcpy(&bits, (char*)obj + offset, 1); break;
+				case Opcode::Ptr16: memcpy(&bits, (char*)obj + offset, 2); break;
+				case Opcode::Ptr32: memcpy(&bits, (char*)obj + offset, 4); break;
+				case Opcode::Ptr64: memcpy(&bits, (char*)obj + offset, 8); break;
+				case Opcode::ObjPtr64: memcpy(&bits, (char*)obj + offset, 8); break;
+				case Opcode::F64Ptr64: memcpy(&bits, (char*)obj + offset, 8); break;
 				default: exit(1);
 				}
-				val.type = (op == Opcode::ObjPtr64) ? VMValue::Type::object : VMValue::Type::integer;
-				push(val);
-				break;
+				PUSH(loaded(ins->op, bits));
+				NEXT;
 			}
-			case Opcode::Ptr64Var: {
-			case Opcode::ObjPtr64Var:
-				auto constOffset = read<int8_t>();
-				auto var = read<int8_t>();
-				auto v = peek(bp + var);
-				auto obj = v.value.object;
-				VMValue val((int64_t)0);
+			CASE(Ptr64Var): {
+			CASE(ObjPtr64Var):
+			CASE(F64Ptr64Var):
+				auto constOffset = ins->value.getInteger();
+				auto v = fp[ins->a];
+				auto obj = v.getObject();
+				uint64_t bits = 0;
 
 #ifdef _DEBUG
+				SAVE_IP();
 				checkRead(v, constOffset);
 #endif
 
-				memcpy(&val.value.integer, (char*)obj + constOffset, 8);
-				val.type = (op == Opcode::ObjPtr64Var) ? VMValue::Type::object : VMValue::Type::integer;
-				push(val);
-				break;
-			}
-			case Opcode::PtrInd8: {
-			case Opcode::PtrInd16:
-			case Opcode::PtrInd32:
-			case Opcode::PtrInd64:
-			case Opcode::ObjPtrInd64:
-				auto v = pop();
-				auto obj = v.value.object;
-				auto offset = pop().value.integer;
-				auto constOffset = read<int8_t>();
+				memcpy(&bits, (char*)obj + constOffset, 8);
+				PUSH(loaded(ins->op, bits));
+				NEXT;
+			}
+			CASE(PtrInd8): {
+			CASE(PtrInd16):
+			CASE(PtrInd32):
+			CASE(PtrInd64):
+			CASE(ObjPtrInd64):
+			CASE(F64PtrInd64):
+				auto v = POP();
+				auto obj = v.getObject();
+				auto offset = POP().getInteger();
+				auto constOffset = ins->value.getInteger();
 
 #ifdef _DEBUG
+				SAVE_IP();
 				checkRead(v, offset + constOffset);
 #endif
 
-				VMValue val((int64_t)0);
-				switch ((Opcode)op) {
-				case Opcode::PtrInd8: memcpy(&val.value.integer, (char*)obj + offset + constOffset, 1); break;
-				case Opcode::PtrInd16: memcpy(&val.value.integer, (char*)obj + offset + constOffset, 2); break;
-				case Opcode::PtrInd32: memcpy(&val.value.integer, (char*)obj + offset + constOffset, 4); break;
-				case Opcode::PtrInd64: memcpy(&val.value.integer, (char*)obj + offset + constOffset, 8); break;
-				case Opcode::ObjPtrInd64: memcpy(&val.value.integer, (char*)obj + offset + constOffset, 8); break;
+				uint64_t bits = 0;
+				switch (ins->op) {
+				case Opcode::PtrInd8: memcpy(&bits, (char*)obj + offset + constOffset, 1); break;
+				case Opcode::PtrInd16: memcpy(&bits, (char*)obj + offset + constOffset, 2); break;
+				case Opcode::PtrInd32: memcpy(&bits, (char*)obj + offset + constOffset, 4); break;
+				case Opcode::PtrInd64: memcpy(&bits, (char*)obj + offset + constOffset, 8); break;
+				case Opcode::ObjPtrInd64: memcpy(&bits, (char*)obj + offset + constOffset, 8); break;
+				case Opcode::F64PtrInd64: memcpy(&bits, (char*)obj + offset + constOffset, 8); break;
 				default: exit(1);
 				}
-				val.type = (op == Opcode::ObjPtrInd64) ? VMValue::Type::object : VMValue::Type::integer;
-				push(val);
-				break;
-			}
-			case Opcode::StorePtr8: {
-			case Opcode::StorePtr16:
-			case Opcode::StorePtr32:
-			case Opcode::StorePtr64:
-				auto v = pop();
-				auto obj = v.value.object;
-				auto val = pop();
-				auto offset = read<int8_t>();
+				PUSH(loaded(ins->op, bits));
+				NEXT;
+			}
+			CASE(StorePtr8): {
+			CASE(StorePtr16):
+			CASE(StorePtr32):
+			CASE(StorePtr64):
+				auto v = POP();
+				auto obj = v.getObject();
+				auto val = POP();
+				auto bits = val.bits();
+				auto offset = ins->value.getInteger();
 
 #ifdef _DEBUG
+				SAVE_IP();
 				checkWrite(v, offset);
 #endif
 
-				switch ((Opcode)op) {
-				case Opcode::StorePtr8: memcpy((char*)obj + offset, &val.value.integer, 1); break;
-				case Opcode::StorePtr16: memcpy((char*)obj + offset, &val.value.integer, 2); break;
-				case Opcode::StorePtr32: memcpy((char*)obj + offset, &val.value.integer, 4); break;
-				case Opcode::StorePtr64: memcpy((char*)obj + offset, &val.value.integer, 8); break;
+				switch (ins->op) {
+				case Opcode::StorePtr8: memcpy((char*)obj + offset, &bits, 1); break;
+				case Opcode::StorePtr16: memcpy((char*)obj + offset, &bits, 2); break;
+				case Opcode::StorePtr32: memcpy((char*)obj + offset, &bits, 4); break;
+				case Opcode::StorePtr64: memcpy((char*)obj + offset, &bits, 8); gc.writeBarrier(obj, val); break;
 				default: exit(1);
 				}
-				break;
+				NEXT;
 			}
-			case Opcode::StorePtr64Var: {
-				auto val = pop();
-				auto offset = read<int8_t>();
-				auto var = read<int8_t>();
-				auto v = peek(bp + var);
-				auto obj = v.value.object;
+			CASE(StorePtr64Var): {
+				auto val = POP();
+				auto bits = val.bits();
+				auto offset = ins->value.getInteger();
+				auto v = fp[ins->a];
+				auto obj = v.getObject();
 
 #ifdef _DEBUG
+				SAVE_IP();
 				checkWrite(v, offset);
 #endif
 
-				memcpy((char*)obj + offset, &val, 8);
-				break;
-			}
-			case Opcode::StorePtrInd8: {
-			case Opcode::StorePtrInd16:
-			case Opcode::StorePtrInd32:
-			case Opcode::StorePtrInd64:
-				auto v = pop();
-				auto obj = v.value.object;
-				auto offset = pop().value.integer;
-				auto val = pop();
-				auto constOffset = read<int8_t>();
+				memcpy((char*)obj + offset, &bits, 8);
+				gc.writeBarrier(obj, val);
+				NEXT;
+			}
+			CASE(StorePtrInd8): {
+			CASE(StorePtrInd16):
+			CASE(StorePtrInd32):
+			CASE(StorePtrInd64):
+				auto v = POP();
+				auto obj = v.getObject();
+				auto offset = POP().getInteger();
+				auto val = POP();
+				auto bits = val.bits();
+				auto constOffset = ins->value.getInteger();
 
 #ifdef _DEBUG
+				SAVE_IP();
 				checkWrite(v, offset + constOffset);
 #endif
 
-				switch ((Opcode)op) {
-				case Opcode::StorePtrInd8: memcpy((char*)obj + offset + constOffset, &val.value.integer, 1); break;
-				case Opcode::StorePtrInd16: memcpy((char*)obj + offset + constOffset, &val.value.integer, 2); break;
-				case Opcode::StorePtrInd32: memcpy((char*)obj + offset + constOffset, &val.value.integer, 4); break;
-				case Opcode::StorePtrInd64: memcpy((char*)obj + offset + constOffset, &val.value.integer, 8); break;
+				switch (ins->op) {
+				case Opcode::StorePtrInd8: memcpy((char*)obj + offset + constOffset, &bits, 1); break;
+				case Opcode::StorePtrInd16: memcpy((char*)obj + offset + constOffset, &bits, 2); break;
+				case Opcode::StorePtrInd32: memcpy((char*)obj + offset + constOffset, &bits, 4); break;
+				case Opcode::StorePtrInd64: memcpy((char*)obj + offset + constOffset, &bits, 8); gc.writeBarrier(obj, val); break;
 				default: exit(1);
 				}
-				break;
+				NEXT;
 			}
-			case Opcode::Repeat: {
-				push(stack.back());
-				break;
+			CASE(Repeat): {
+				PUSH(sp[-1]);
+				NEXT;
 			}
-			case Opcode::Pop: {
-				pop();
-				break;
+			CASE(Pop): {
+				POP();
+				NEXT;
 			}
-			case Opcode::Swap: {
-				auto a = pop();
-				auto b = pop();
-				push(a);
-				push(b);
-				break;
+			CASE(Swap): {
+				auto a = POP();
+				auto b = POP();
+				PUSH(a);
+				PUSH(b);
+				NEXT;
 			}
-            case Opcode::CmpType: {
-                auto v = pop();
+            CASE(CmpType): {
+                auto v = POP();
 #ifdef _DEBUG
+                SAVE_IP();
                 checkRead(v, 0);
 #endif
-                auto obj = (VMObject*)v.value.object - 1;
-				auto typeIndex = read<uint64_t>();
+                auto obj = (VMObject*)v.getObject() - 1;
+				PUSH(VMValue(((const VMType*)ins->value.getObject())->id == obj->typeId));
+
+                NEXT;
+            }
+			CASE(VarVar): {
+				PUSH(fp[ins->a]);
+				PUSH(fp[ins->b]);
+				NEXT;
+			}
+			CASE(VarI8): {
+				PUSH(fp[ins->a]);
+				PUSH(ins->value);
+				NEXT;
+			}
+			CASE(AddIVarVar): {
+				auto l = fp[ins->a];
+				l.setInteger(l.getInteger() + fp[ins->b].getInteger());
+				PUSH(l);
+				NEXT;
+			}
+			CASE(AddIVarI8): {
+				auto l = fp[ins->a];
+				l.setInteger(l.getInteger() + ins->value.getInteger());
+				PUSH(l);
+				NEXT;
+			}
+			CASE(IncVar): {
+				fp[ins->a].setInteger(fp[ins->a].getInteger() + ins->value.getInteger());
+				NEXT;
+			}
+			CASE(PeekStorePtr8): {
+			CASE(PeekStorePtr16):
+			CASE(PeekStorePtr32):
+			CASE(PeekStorePtr64):
+				auto val = POP();
+				auto bits = val.bits();
+				auto& v = sp[-1];
+				auto obj = v.getObject();
+				auto offset = ins->value.getInteger();
 
 #ifdef _DEBUG
-				if (typeIndex >= chunk.types.size()) {
-					std::cerr << "Type index out of range.\n";
-					std::cerr << printCallStack();
-					exit(1);
+				SAVE_IP();
+				checkWrite(v, offset);
+#endif
+
+				switch (ins->op) {
+				case Opcode::PeekStorePtr8: memcpy((char*)obj + offset, &bits, 1); break;
+				case Opcode::PeekStorePtr16: memcpy((char*)obj + offset, &bits, 2); break;
+				case Opcode::PeekStorePtr32: memcpy((char*)obj + offset, &bits, 4); break;
+				case Opcode::PeekStorePtr64: memcpy((char*)obj + offset, &bits, 8); gc.writeBarrier(obj, val); break;
+				default: exit(1);
 				}
+				NEXT;
+			}
+			CASE(InterfaceMethod): {
+				// [iface] -> [method, object]
+				auto& v = sp[-1];
+				auto iface = (char*)v.getObject();
+
+#ifdef _DEBUG
+				SAVE_IP();
+				checkRead(v, ins->value.getInteger());
 #endif
-				push(VMValue(chunk.types[typeIndex] == obj->type));
 
-                break;
-            }
-			default:
-				if ((unsigned char)op >= numOpcodes) {
-					std::cerr << "Opcode '" << (unsigned char)op << "' not implemented\n";
-					std::cerr << printCallStack();
-					exit(1);
+				void* object;
+				int64_t method;
+				memcpy(&object, iface, 8);
+				memcpy(&method, iface + ins->value.getInteger(), 8);
+				v = VMValue(method);
+				PUSH(VMValue(object));
+				NEXT;
+			}
+			CASE(ObjPtrC): {
+				auto v = POP();
+				auto offset = ins->value.getInteger();
+#ifdef _DEBUG
+				SAVE_IP();
+				checkRead(v, offset);
+#endif
+				PUSH(VMValue(loadReference((char*)v.getObject() + offset)));
+				NEXT;
+			}
+			CASE(ObjPtrCVar): {
+				auto& v = fp[ins->a];
+				auto offset = ins->value.getInteger();
+#ifdef _DEBUG
+				SAVE_IP();
+				checkRead(v, offset);
+#endif
+				PUSH(VMValue(loadReference((char*)v.getObject() + offset)));
+				NEXT;
+			}
+			CASE(ObjPtrIndC): {
+				auto v = POP();
+				auto offset = POP().getInteger() + ins->value.getInteger();
+#ifdef _DEBUG
+				SAVE_IP();
+				checkRead(v, offset);
+#endif
+				PUSH(VMValue(loadReference((char*)v.getObject() + offset)));
+				NEXT;
+			}
+			CASE(StorePtrC): {
+				auto v = POP();
+				auto obj = v.getObject();
+				auto val = POP();
+				auto offset = ins->value.getInteger();
+#ifdef _DEBUG
+				SAVE_IP();
+				checkWrite(v, offset);
+#endif
+				storeReference((char*)obj + offset, val.getObject());
+				gc.writeBarrier(obj, val);
+				NEXT;
+			}
+			CASE(StorePtrCVar): {
+				auto val = POP();
+				auto& v = fp[ins->a];
+				auto obj = v.getObject();
+				auto offset = ins->value.getInteger();
+#ifdef _DEBUG
+				SAVE_IP();
+				checkWrite(v, offset);
+#endif
+				storeReference((char*)obj + offset, val.getObject());
+				gc.writeBarrier(obj, val);
+				NEXT;
+			}
+			CASE(StorePtrIndC): {
+				auto v = POP();
+				auto obj = v.getObject();
+				auto offset = POP().getInteger() + ins->value.getInteger();
+				auto val = POP();
+#ifdef _DEBUG
+				SAVE_IP();
+				checkWrite(v, offset);
+#endif
+				storeReference((char*)obj + offset, val.getObject());
+				gc.writeBarrier(obj, val);
+				NEXT;
+			}
+			CASE(PeekStorePtrC): {
+				auto val = POP();
+				auto& v = sp[-1];
+				auto obj = v.getObject();
+				auto offset = ins->value.getInteger();
+#ifdef _DEBUG
+				SAVE_IP();
+				checkWrite(v, offset);
+#endif
+				storeReference((char*)obj + offset, val.getObject());
+				gc.writeBarrier(obj, val);
+				NEXT;
+			}
+			CASE(InterfaceMethodC): {
+				// [iface] -> [method, object]
+				auto& v = sp[-1];
+				auto iface = (char*)v.getObject();
+
+#ifdef _DEBUG
+				SAVE_IP();
+				checkRead(v, ins->value.getInteger());
+#endif
+
+				int64_t method;
+				memcpy(&method, iface + ins->value.getInteger(), 8);
+				auto object = loadReference(iface);
+				v = VMValue(method);
+				PUSH(VMValue(object));
+				NEXT;
+			}
+			CASE(MovR): {
+				REG(ins->a) = REG(ins->b);
+				NEXT;
+			}
+			CASE(ConstR): {
+				REG(ins->a) = ins->value;
+				NEXT;
+			}
+			CASE(NotR): {
+				auto l = REG(ins->b);
+				l.setBoolean(!l.getBoolean());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(AddIR): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() + REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(SubIR): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() - REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(MulIR): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() * REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(DivIR): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() / REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(AddF32R): {
+				auto l = REG(ins->b);
+				l.setF32(l.getF32() + REG(ins->c).getF32());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(SubF32R): {
+				auto l = REG(ins->b);
+				l.setF32(l.getF32() - REG(ins->c).getF32());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(MulF32R): {
+				auto l = REG(ins->b);
+				l.setF32(l.getF32() * REG(ins->c).getF32());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(DivF32R): {
+				auto l = REG(ins->b);
+				l.setF32(l.getF32() / REG(ins->c).getF32());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(AddF64R): {
+				auto l = REG(ins->b);
+				l.setF64(l.getF64() + REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(SubF64R): {
+				auto l = REG(ins->b);
+				l.setF64(l.getF64() - REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(MulF64R): {
+				auto l = REG(ins->b);
+				l.setF64(l.getF64() * REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(DivF64R): {
+				auto l = REG(ins->b);
+				l.setF64(l.getF64() / REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(ModIR): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() % REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpEQR): {
+				quicken(ins - code, REG(ins->b).getType(), Opcode::CmpEQIRQ);
+				VMValue l;
+				l.setBoolean((REG(ins->b) == REG(ins->c)));
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpNER): {
+				quicken(ins - code, REG(ins->b).getType(), Opcode::CmpNEIRQ);
+				VMValue l;
+				l.setBoolean((REG(ins->b) != REG(ins->c)));
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpLTIR): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() < REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpLTF32R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF32() < REG(ins->c).getF32());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpLTF64R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF64() < REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpGTIR): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() > REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpGTF32R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF32() > REG(ins->c).getF32());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpGTF64R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF64() > REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpEQIR): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() == REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpNEIR): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() != REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpLTEIR): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() <= REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpGTEIR): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() >= REG(ins->c).getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpEQF64R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF64() == REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpNEF64R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF64() != REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpLTEF64R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF64() <= REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpGTEF64R): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getF64() >= REG(ins->c).getF64());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			// Quickened comparisons guard the type of the left operand. If it changed, the instruction
+			// goes back to its generic form and computes the generic result.
+			#define QUICKENED_CMP(X, TYPE, F, OP, GENERIC, RESULT) \
+			CASE(X): { \
+				auto r = POP(); \
+				auto& l = sp[-1]; \
+				if (l.getType() == VMValue::Type::TYPE) { \
+					l.setBoolean(l.F() OP r.F()); \
+				} \
+				else { \
+					dequicken(ins - code, Opcode::GENERIC); \
+					l = RESULT; \
+				} \
+				NEXT; \
+			}
+			#define QUICKENED_CMP_R(X, TYPE, F, OP, GENERIC, RESULT) \
+			CASE(X): { \
+				auto& l = REG(ins->b); \
+				auto& r = REG(ins->c); \
+				VMValue result; \
+				if (l.getType() == VMValue::Type::TYPE) { \
+					result.setBoolean(l.F() OP r.F()); \
+				} \
+				else { \
+					dequicken(ins - code, Opcode::GENERIC); \
+					result = RESULT; \
+				} \
+				REG(ins->a) = result; \
+				NEXT; \
+			}
+			QUICKENED_CMP(CmpEQIQ, integer, getInteger, ==, CmpEQ, VMValue(bool(l == r)))
+			QUICKENED_CMP(CmpEQF64Q, floating, getF64, ==, CmpEQ, VMValue(bool(l == r)))
+			QUICKENED_CMP(CmpEQBQ, boolean, getBoolean, ==, CmpEQ, VMValue(bool(l == r)))
+			QUICKENED_CMP(CmpNEIQ, integer, getInteger, !=, CmpNE, VMValue(bool(l != r)))
+			QUICKENED_CMP(CmpNEF64Q, floating, getF64, !=, CmpNE, VMValue(bool(l != r)))
+			QUICKENED_CMP(CmpNEBQ, boolean, getBoolean, !=, CmpNE, VMValue(bool(l != r)))
+			QUICKENED_CMP(CmpLTEIQ, integer, getInteger, <=, CmpLTE, (l <= r))
+			QUICKENED_CMP(CmpLTEF64Q, floating, getF64, <=, CmpLTE, (l <= r))
+			QUICKENED_CMP(CmpLTEBQ, boolean, getBoolean, <=, CmpLTE, (l <= r))
+			QUICKENED_CMP(CmpGTEIQ, integer, getInteger, >=, CmpGTE, (l >= r))
+			QUICKENED_CMP(CmpGTEF64Q, floating, getF64, >=, CmpGTE, (l >= r))
+			QUICKENED_CMP(CmpGTEBQ, boolean, getBoolean, >=, CmpGTE, (l >= r))
+			QUICKENED_CMP_R(CmpEQIRQ, integer, getInteger, ==, CmpEQR, VMValue(bool(l == r)))
+			QUICKENED_CMP_R(CmpEQF64RQ, floating, getF64, ==, CmpEQR, VMValue(bool(l == r)))
+			QUICKENED_CMP_R(CmpEQBRQ, boolean, getBoolean, ==, CmpEQR, VMValue(bool(l == r)))
+			QUICKENED_CMP_R(CmpNEIRQ, integer, getInteger, !=, CmpNER, VMValue(bool(l != r)))
+			QUICKENED_CMP_R(CmpNEF64RQ, floating, getF64, !=, CmpNER, VMValue(bool(l != r)))
+			QUICKENED_CMP_R(CmpNEBRQ, boolean, getBoolean, !=, CmpNER, VMValue(bool(l != r)))
+			QUICKENED_CMP_R(CmpLTEIRQ, integer, getInteger, <=, CmpLTER, (l <= r))
+			QUICKENED_CMP_R(CmpLTEF64RQ, floating, getF64, <=, CmpLTER, (l <= r))
+			QUICKENED_CMP_R(CmpLTEBRQ, boolean, getBoolean, <=, CmpLTER, (l <= r))
+			QUICKENED_CMP_R(CmpGTEIRQ, integer, getInteger, >=, CmpGTER, (l >= r))
+			QUICKENED_CMP_R(CmpGTEF64RQ, floating, getF64, >=, CmpGTER, (l >= r))
+			QUICKENED_CMP_R(CmpGTEBRQ, boolean, getBoolean, >=, CmpGTER, (l >= r))
+			#undef QUICKENED_CMP
+			#undef QUICKENED_CMP_R
+			CASE(CmpLTER): {
+				quicken(ins - code, REG(ins->b).getType(), Opcode::CmpLTEIRQ);
+				REG(ins->a) = REG(ins->b) <= REG(ins->c);
+				NEXT;
+			}
+			CASE(CmpGTER): {
+				quicken(ins - code, REG(ins->b).getType(), Opcode::CmpGTEIRQ);
+				REG(ins->a) = REG(ins->b) >= REG(ins->c);
+				NEXT;
+			}
+			CASE(AddIRI): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() + ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(SubIRI): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() - ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(MulIRI): {
+				auto l = REG(ins->b);
+				l.setInteger(l.getInteger() * ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpEQIRI): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() == ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpNEIRI): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() != ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpLTIRI): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() < ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpGTIRI): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() > ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpLTEIRI): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() <= ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(CmpGTEIRI): {
+				VMValue l;
+				l.setBoolean(REG(ins->b).getInteger() >= ins->value.getInteger());
+				REG(ins->a) = l;
+				NEXT;
+			}
+			CASE(JmpImm): {
+				pc = code + ins->value.getInteger();
+				SAFEPOINT();
+				TRACE_LOOP();
+				NEXT;
+			}
+			CASE(JmpIfR): {
+				if (REG(ins->a).getBoolean()) {
+					pc = code + ins->value.getInteger();
+				}
+				NEXT;
+			}
+			CASE(JmpIfNotR): {
+				if (!REG(ins->a).getBoolean()) {
+					pc = code + ins->value.getInteger();
 				}
-				else {
-					std::cerr << "Opcode '" << opcodeInfo[(unsigned char)op].name << "' not implemented\n";
-					std::cerr << printCallStack();
-					exit(1);
+				NEXT;
+			}
+			CASE(ReturnR): {
+				auto retVal = REG(ins->a);
+				if (bp == mainBp) {
+					exitCode = retVal;
+					status = FINISHED;
+					SAVE_IP();
+					return ops - maxOps;
 				}
+
+				auto frame = frameOf(fp[-1]);
+				sp = fp - 1;
+				pc = code + frame.ip;
+				bp = frame.bp;
+				fp = stack + bp;
+
+				PUSH(retVal);
+				ENTER_JIT();
+				NEXT;
+			}
+			CASE(Mov8):
+			CASE(Mov16):
+			CASE(Mov32):
+			CASE(Mov64):
+			DEFAULT:
+				std::cerr << "Opcode '" << opcodeInfo[(unsigned char)ins->op].name << "' not implemented\n";
+				SAVE_IP();
+				std::cerr << printCallStack();
+				exit(1);
+#ifdef STRELA_COMPUTED_GOTO
+		}
+#else
 			}
 		}
+#endif
+		SAVE_IP();
+		return ops;
+
+		#undef CASE
+		#undef NEXT
+		#undef DEFAULT
+		#undef SAVE_IP
+		#undef PUSH
+		#undef POP
+		#undef REG
+		#undef ENTER_JIT
+		#undef TRACE_LOOP
+		#undef SAFEPOINT
     }
 	
     void VM::push(const VMValue& val) {
-        stack.push_back(val);
+        *sp++ = val;
     }
 
     VMValue VM::pop() {
-        auto val = stack.back();
-        stack.pop_back();
-        return val;
+        return *--sp;
     }
 
     void VM::pop(size_t num) {
-        stack.resize(stack.size() - num);
+        sp -= num;
     }
 
 	VMValue VM::peek(size_t idx) {
@@ -892,9 +1980,24 @@ namespace Strela {
 		stack[idx] = val;
 	}
 
+	void VM::stackOverflow() {
+		std::cerr << "Stack overflow (" << std::dec << stackSize << " slots, " << callStack().size() << " frames)\n";
+		std::cerr << printCallStack();
+		exit(1);
+	}
+
+	std::vector<Frame> VM::callStack() const {
+        std::vector<Frame> frames;
+        for (auto frameBp = bp; frameBp != mainBp; frameBp = frames.back().bp) {
+            frames.push_back(frameOf(stack[frameBp - 1]));
+        }
+        return std::vector<Frame>(frames.rbegin(), frames.rend());
+    }
+
 	std::string VM::printCallStack() {
         std::stringstream sstr;
-        Frame cur{bp, ip};
+        auto callStack = this->callStack();
+        Frame cur{bp, addressOf(ip)};
         int i = callStack.size();
 		sstr << std::dec << (i+1) << "\n";
         while (i >= 0) {
@@ -922,14 +2025,15 @@ namespace Strela {
 
             --i;
             if (i < 0 || callStack.empty()) break;
-            cur = callStack[i];
+            cur = { callStack[i].bp, addressOf(callStack[i].ip) };
         }
         return sstr.str();
     }
 
 	void VM::writeSample() {
 
-		Frame cur{ bp, ip };
+		auto callStack = this->callStack();
+		Frame cur{ bp, addressOf(ip) };
 		int i = callStack.size();
 		sampleFile << "[\n";
 		while (i >= 0) {
@@ -947,7 +2051,7 @@ namespace Strela {
 
 			--i;
 			if (i < 0 || callStack.empty()) break;
-			cur = callStack[i];
+			cur = { callStack[i].bp, addressOf(callStack[i].ip) };
 		}
 		sampleFile << "],\n";
 	}
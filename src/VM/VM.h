@@ -19,29 +19,98 @@ struct Frame {
 
 namespace Strela {
     class ByteCodeChunk;
+    class OpcodeProfile;
+    class JIT;
+
+    /**
+     * Fixed width, pre-decoded form of one opcode in ByteCodeChunk::opcodes.
+     * Operands are resolved at load time: immediates and constants are stored
+     * as ready-to-push values, call targets as instruction indices and type
+     * indices as VMType pointers. Register operands go to a, b and c.
+     */
+    struct Instruction {
+        const void* handler = nullptr;
+        Opcode op = Opcode::Trap;
+        uint8_t a = 0;
+        uint8_t b = 0;
+        uint8_t c = 0;
+        uint32_t address = 0;
+        VMValue value;
+    };
 
     class VM {
     public:
-        VM(ByteCodeChunk& chunk, const std::vector<std::string>& arguments);
+        VM(ByteCodeChunk& chunk, const std::vector<std::string>& arguments, size_t stackSize = defaultStackSize);
+        ~VM();
         VMValue run();
-        void step(size_t maxOps);
+        /** Runs the program one instruction at a time, recording opcode sequences. */
+        VMValue run(OpcodeProfile& profile);
+        size_t step(size_t maxOps);
+        /** Compiles functions called more than threshold times to machine code. */
+        void enableJit(uint32_t threshold);
+        /** Compiles traces of loops that iterated more than threshold times. */
+        void enableTracing(uint32_t threshold);
 
         std::string printCallStack();
+        /** Frames of the active calls, outermost first, read from the frame records on the value stack. */
+        std::vector<Frame> callStack() const;
+
+        /** Frame record kept in the slot below a callee's frame: the caller's bp and the instruction to return to. */
+        static VMValue frameRecord(size_t bp, size_t ip) {
+            return VMValue(int64_t(uint64_t(bp) << frameIpBits | ip));
+        }
+
+        static Frame frameOf(const VMValue& record) {
+            auto bits = record.bits();
+            return { size_t(bits >> frameIpBits), size_t(bits & ((uint64_t(1) << frameIpBits) - 1)) };
+        }
+
+        void patch(size_t index, Opcode op);
+        /**
+         * Rewrites a generic comparison to its quickened variant for the type of the left operand,
+         * which is what VMValue's comparison operators dispatch on. first is the integer variant,
+         * the floating and boolean variants follow it.
+         */
+        void quicken(size_t index, VMValue::Type type, Opcode first);
+        /** Rewrites an indirect call to CallIndQ, which expects the same target next time. */
+        void quickenCall(size_t index, size_t target);
+        /** Turns a quickened instruction whose guard failed back into its generic form. */
+        void dequicken(size_t index, Opcode generic);
+        size_t addressOf(size_t index) const;
+        size_t indexOf(size_t address) const;
 
         void push(const VMValue& val);
         VMValue pop();
         void pop(size_t num);
 		VMValue peek(size_t idx);
 		void poke(size_t idx, const VMValue& val);
-
-        template<typename T> T read();
+		size_t stackDepth() const { return sp - stack; }
 
 		void checkRead(const VMValue& val, int64_t offset);
 		void checkWrite(const VMValue& val, int64_t offset);
 
 		void writeSample();
 
+    private:
+        void load();
+        void stackOverflow();
+
     public:
+        /** Default maximum number of value stack slots. */
+        static const size_t defaultStackSize = 1024 * 1024;
+        /** Slots kept free above the checked limit for expression temporaries. */
+        static const size_t stackRedZone = 1024;
+        /** bp of main, whose frame record in slot 0 ends the program when it returns. */
+        static const size_t mainBp = 1;
+        /** Instructions that failed their guard this often stay generic. */
+        static const uint8_t maxDequickens = 4;
+#ifdef STRELA_NAN_BOXING
+        /** Keeps frame records of stacks below 8M slots and programs below 16M instructions inside an unboxed integer. */
+        static const int frameIpBits = 24;
+#else
+        static const int frameIpBits = 32;
+#endif
+
 		enum {
 			RUNNING,
 			STOPPED,
@@ -50,14 +119,26 @@ namespace Strela {
 
         bool halt = false;
         VMValue exitCode;
-        int numallocs = 0;
+        uint64_t numOps = 0;
         ByteCodeChunk& chunk;
-        Opcode op;
         GC gc;
+        std::vector<Instruction> code;
+        std::vector<uint32_t> indices;
+        /** Number of times each instruction was de-quickened. */
+        std::vector<uint8_t> dequickens;
+        const void* const* handlers = nullptr;
         size_t ip;
         size_t bp;
-        std::vector<VMValue> stack;
-        std::vector<Frame> callStack;
+        size_t stackSize;
+        VMValue* stack = nullptr;
+        VMValue* sp = nullptr;
+        VMValue* stackLimit = nullptr;
+        JIT* jit = nullptr;
+        const void* const* jitEntries = nullptr;
+        /** Worker processes prefork() forks, 0 to let the program go on alone. */
+        size_t preforkWorkers = 0;
+        /** Number of this worker process, -1 if prefork() did not fork. */
+        int64_t worker = -1;
     };
 }
 
@@ -5,17 +5,83 @@
 #define Strela_VM_VMObject_h
 
 #include "VMValue.h"
+#include "VMType.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
 namespace Strela {
-    class VMType;
-
+    /** Header in front of every object, 8 bytes. Objects are allocated zeroed, which makes every field start out false or 0. */
     struct VMObject {
-        bool marked = false;
-        const VMType* type;
+        /** The type's id, 0 for a free heap cell. */
+        uint32_t typeId;
+        /** Locks and native calls holding on to the object, compaction leaves it where it is while there are any. */
+        uint16_t pins;
+        /** Minor collections the object survived in the nursery. */
+        uint8_t age;
+        /** Not allocated by the GC, like constants that exist before the VM runs. Never marked or freed. */
+        bool permanent: 1;
+        /** In the GC's remembered set, because the object is old and may point into the nursery. */
+        bool remembered: 1;
+        /** Moved out of the nursery, forward() points to the copy. */
+        bool forwarded: 1;
         char data[];
+
+        const VMType* type() const {
+            return VMType::byId(typeId);
+        }
+
+        /** Where a forwarded object went. Kept in place of the data, nursery objects all have room for it. */
+        VMObject*& forward() {
+            return *(VMObject**)data;
+        }
     };
+
+    static_assert(sizeof(VMObject) == 8, "Object headers have to stay 8 bytes");
+
+    /**
+     * Start of the address range the heap allocates from when references are compressed, null if they are not.
+     * Compressed references in object fields and array elements take 4 bytes: the distance from here in units
+     * of 8 bytes, which reaches 32 GB. No object starts at the base itself, so null stays 0.
+     */
+    extern char* compressedBase;
+
+    /** Bytes a reference takes in an object field or array element. */
+    inline size_t referenceSize() {
+        return compressedBase ? 4 : 8;
+    }
+
+    inline uint32_t compressReference(const void* ref) {
+        return ref ? uint32_t(((const char*)ref - compressedBase) >> 3) : 0;
+    }
+
+    inline void* decompressReference(uint32_t ref) {
+        return ref ? compressedBase + (uint64_t(ref) << 3) : nullptr;
+    }
+
+    /** Reads the reference in an object field or array element. */
+    inline void* loadReference(const void* slot) {
+        if (compressedBase) {
+            uint32_t ref;
+            memcpy(&ref, slot, sizeof(ref));
+            return decompressReference(ref);
+        }
+        void* ref;
+        memcpy(&ref, slot, sizeof(ref));
+        return ref;
+    }
+
+    inline void storeReference(void* slot, const void* ref) {
+        if (compressedBase) {
+            auto compressed = compressReference(ref);
+            memcpy(slot, &compressed, sizeof(compressed));
+        }
+        else {
+            memcpy(slot, &ref, sizeof(ref));
+        }
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,34 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "VMType.h"
+
+#include <cstdlib>
+#include <iostream>
+
+namespace Strela {
+    const VMType** VMType::table = nullptr;
+    uint32_t VMType::count = 0;
+
+    VMType::VMType() {
+        // ids start at 1, a header without a type is a free heap cell
+        if (count == 0) {
+            count = 1;
+        }
+        // grows by doubling, so the table is reallocated whenever count reaches a power of two
+        if ((count & (count - 1)) == 0) {
+            table = (const VMType**)realloc(table, 2 * count * sizeof(VMType*));
+            if (!table) {
+                std::cerr << "Out of memory registering types\n";
+                exit(1);
+            }
+            table[0] = nullptr;
+        }
+        id = count++;
+        table[id] = this;
+    }
+
+    VMType::~VMType() {
+        table[id] = nullptr;
+    }
+}
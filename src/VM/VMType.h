@@ -4,6 +4,7 @@
 #ifndef Strela_VM_VMType_h
 #define Strela_VM_VMType_h
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -19,11 +20,29 @@ namespace Strela {
 
     class VMType {
     public:
+        VMType();
+        ~VMType();
+
+        VMType(const VMType&) = delete;
+        VMType& operator=(const VMType&) = delete;
+
+        /** The type with the given id, null for 0, which no type has. */
+        static const VMType* byId(uint32_t id) {
+            return table[id];
+        }
+
         size_t index;
+        /**
+         * Position among all types, object headers hold it instead of a pointer. Types get it in the order
+         * they are created, so the program's types have it in the order of ByteCodeChunk::types.
+         */
+        uint32_t id;
         std::string name;
         bool isObject = false;
         bool isArray = false;
         bool isEnum = false;
+        /** Set for f64, whose loads push floating values. */
+        bool isF64 = false;
         VMType* arrayType = nullptr;
         size_t size = 0;
         size_t alignment = 0;
@@ -32,6 +51,61 @@ namespace Strela {
         std::vector<VMField> fields;
         std::vector<std::string> enumValues;
         std::vector<VMType*> unionTypes;
+
+        /** Set if objects of the type never hold references, like scalar arrays and classes of numbers only. */
+        bool noReferences = true;
+        /**
+         * Bit n is set if the n-th reference sized slot of an object holds a reference, at offset 8 * n or at 4 * n
+         * with compressed references. Objects too big for that list the offsets of their reference fields instead.
+         */
+        uint64_t referenceBits = 0;
+        std::vector<uint32_t> referenceOffsets;
+        /** For unions, bit n is set if tag n selects a reference. Tags from 64 on have to look at unionTypes. */
+        uint64_t referenceTags = 0;
+
+        /** True if values of the type are references to heap objects. */
+        bool isReference() const {
+            return isObject || isArray;
+        }
+
+        /** Works out where objects of the type hold references, once the fields or element and union types are known. */
+        void buildReferenceMap() {
+            referenceBits = 0;
+            referenceOffsets.clear();
+            referenceTags = 0;
+            noReferences = true;
+            if (isArray) {
+                noReferences = !arrayType->isReference();
+            }
+            else if (!unionTypes.empty()) {
+                for (size_t tag = 0; tag < unionTypes.size(); ++tag) {
+                    if (!unionTypes[tag]->isReference()) continue;
+                    if (tag < 64) {
+                        referenceTags |= uint64_t(1) << tag;
+                    }
+                    noReferences = false;
+                }
+            }
+            else if (isObject) {
+                for (auto&& field: fields) {
+                    if (field.type && field.type->isReference()) {
+                        auto slot = field.type->size;
+                        if (objectSize <= 64 * slot) {
+                            referenceBits |= uint64_t(1) << (field.offset / slot);
+                        }
+                        else {
+                            referenceOffsets.push_back(field.offset);
+                        }
+                    }
+                }
+                noReferences = !referenceBits && referenceOffsets.empty();
+            }
+        }
+
+    private:
+        /** Every type by id. Plain data, so types created during static initialization find it ready. */
+        static const VMType** table;
+        static uint32_t count;
     };
 }
 
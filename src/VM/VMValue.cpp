@@ -3,27 +3,59 @@
 
 #include "VMValue.h"
 #include "VMObject.h"
+#include "VMType.h"
+#include "GC.h"
 
 #include <string>
+#include <cstdlib>
 
 namespace Strela {
     #define VMVALUE_OP(OP) \
-    if (type == Type::integer) return VMValue(int64_t(value.integer OP other.value.integer)); \
-    else if (type == Type::floating) return VMValue(double(value.f64 OP other.value.f64)); \
-    else if (type == Type::boolean) return VMValue(bool(value.boolean OP other.value.boolean)); \
+    auto type = getType(); \
+    if (type == Type::integer) return VMValue(int64_t(getInteger() OP other.getInteger())); \
+    else if (type == Type::floating) return VMValue(double(getF64() OP other.getF64())); \
+    else if (type == Type::boolean) return VMValue(bool(getBoolean() OP other.getBoolean())); \
     else return VMValue();
 
     #define VMVALUE_OP_LOG(OP) \
-    if (type == Type::integer) return VMValue(bool(value.integer OP other.value.integer)); \
-    else if (type == Type::floating) return VMValue(bool(value.f64 OP other.value.f64)); \
-    else if (type == Type::boolean) return VMValue(bool(value.boolean OP other.value.boolean)); \
+    auto type = getType(); \
+    if (type == Type::integer) return VMValue(bool(getInteger() OP other.getInteger())); \
+    else if (type == Type::floating) return VMValue(bool(getF64() OP other.getF64())); \
+    else if (type == Type::boolean) return VMValue(bool(getBoolean() OP other.getBoolean())); \
     else return VMValue();
 
-    VMValue::VMValue(): type(Type::null) { value.integer = 0; }
-	VMValue::VMValue(int64_t val) : type(Type::integer) { value.integer = val; }
-	VMValue::VMValue(double val) : type(Type::floating) { value.f64 = val; }
-	VMValue::VMValue(bool val) : type(Type::boolean) { value.boolean = val; }
-	VMValue::VMValue(void* val) : type(Type::object) { value.object = val; }
+#ifdef STRELA_NAN_BOXING
+    GC* VMValue::boxHeap = nullptr;
+
+    namespace {
+        /** Type of the heap cells holding integers too wide for a NaN payload. */
+        const VMType* boxType() {
+            static VMType type;
+            type.name = "int";
+            type.size = 8;
+            type.alignment = 8;
+            type.objectSize = 8;
+            type.objectAlignment = 8;
+            return &type;
+        }
+        const VMType* integerBox = boxType();
+    }
+
+    void* VMValue::boxInteger(int64_t val) {
+        void* box;
+        if (boxHeap) {
+            box = boxHeap->allocObject(integerBox);
+        }
+        else {
+            auto obj = (VMObject*)calloc(sizeof(VMObject) + sizeof(val), 1);
+            obj->permanent = true;
+            obj->typeId = integerBox->id;
+            box = obj + 1;
+        }
+        memcpy(box, &val, sizeof(val));
+        return box;
+    }
+#endif
 
     VMValue VMValue::operator==(const VMValue& other) const {
         VMVALUE_OP_LOG(==);
@@ -79,64 +111,70 @@ namespace Strela {
     }
 
 	VMValue::operator bool() const {
-		if (type == Type::integer) return value.integer != 0;
-		else if (type == Type::floating) return value.f64 != 0;
-		else if (type == Type::boolean) return value.boolean;
+        auto type = getType();
+		if (type == Type::integer) return getInteger() != 0;
+		else if (type == Type::floating) return getF64() != 0;
+		else if (type == Type::boolean) return getBoolean();
         else if (type == Type::null) return false;
-        else if (type == Type::object) return value.object != nullptr;
+        else if (type == Type::object) return getObject() != nullptr;
 		else return false;
 	}
 
     bool VMValue::equals(const VMValue& other) const {
-        if (type != other.type) return false;
+        auto type = getType();
+        if (type != other.getType()) return false;
 
-		if (type == Type::integer) return value.integer == other.value.integer;
-		else if (type == Type::floating) return value.f64 == other.value.f64;
-		else if (type == Type::boolean) return value.boolean == other.value.boolean;
+		if (type == Type::integer) return getInteger() == other.getInteger();
+		else if (type == Type::floating) return getF64() == other.getF64();
+		else if (type == Type::boolean) return getBoolean() == other.getBoolean();
         else if (type == Type::null) return true;
-        else if (type == Type::object) return value.object == other.value.object;
+        else if (type == Type::object) return getObject() == other.getObject();
 		else return false;
     }
 
     std::string VMValue::dump() const {
-        switch (type) {
-            case Type::boolean: return std::string("bool: ") + (value.boolean ? "true" : "false");
-            case Type::integer: return "int: " + std::to_string(value.integer);
-            case Type::floating: return "float: " + std::to_string(value.f64);
+        switch (getType()) {
+            case Type::boolean: return std::string("bool: ") + (getBoolean() ? "true" : "false");
+            case Type::integer: return "int: " + std::to_string(getInteger());
+            case Type::floating: return "float: " + std::to_string(getF64());
             case Type::null: return "null";
             case Type::object: return "[object]";
         }
     }
 
     struct StringConst {
-        bool marked;
-        VMType* type;
+        /** Laid out like a VMObject's header. */
+        uint64_t header;
         uint64_t* str;
         uint64_t len;
         char chars[];
     };
 
     std::ostream& operator<<(std::ostream& str, const VMValue& v) {
-        if (v.type == VMValue::Type::integer) {
+        auto type = v.getType();
+        if (type == VMValue::Type::integer) {
+            auto integer = v.getInteger();
             str.write("i", 1);
-            str.write((const char*)&v.value.integer, 8);
+            str.write((const char*)&integer, 8);
         }
-        else if (v.type == VMValue::Type::floating) {
+        else if (type == VMValue::Type::floating) {
+            auto f64 = v.getF64();
             str.write("d", 1);
-            str.write((const char*)&v.value.f64, 8);
+            str.write((const char*)&f64, 8);
         }
-        else if (v.type == VMValue::Type::boolean) {
+        else if (type == VMValue::Type::boolean) {
+            bool boolean = v.getBoolean();
             str.write("b", 1);
-            str.write((const char*)&v.value.boolean, 1);
+            str.write((const char*)&boolean, 1);
         }
-        else if (v.type == VMValue::Type::object) {
+        else if (type == VMValue::Type::object) {
             str.write("s", 1);
             /*StringConst* string = v.value.object;
             uint64_t len = strlen(v.value.string);
             str.write((const char*)&len, 8);
             str.write(v.value.string, len);*/
         }
-        else if (v.type == VMValue::Type::null) {
+        else if (type == VMValue::Type::null) {
             str.write("n", 1);
         }
 
@@ -148,24 +186,26 @@ namespace Strela {
         str.read(&t, 1);
 
         if (t == 'i') {
-            v.type = VMValue::Type::integer;
-            str.read((char*)&v.value.integer, 8);
+            int64_t integer;
+            str.read((char*)&integer, 8);
+            v = VMValue(integer);
         }
         else if (t == 'd') {
-            v.type = VMValue::Type::floating;
-            str.read((char*)&v.value.f64, 8);
+            double f64;
+            str.read((char*)&f64, 8);
+            v = VMValue(f64);
         }
         else if (t == 'b') {
-            v.type = VMValue::Type::boolean;
-            str.read((char*)&v.value.boolean, 1);
+            bool boolean;
+            str.read((char*)&boolean, 1);
+            v = VMValue(boolean);
         }
         else if (t == 's') {
             uint64_t len;
             str.read((char*)&len, 8);
 
             struct StringConst {
-                bool marked;
-                VMType* type;
+                uint64_t header;
                 uint64_t* str;
                 uint64_t len;
                 char chars[];
@@ -175,15 +215,13 @@ namespace Strela {
             
             str.read(string->chars, len);
             string->chars[len] = 0;
-            string->marked = true;
-            string->type = nullptr;
+            ((VMObject*)string)->permanent = true;
             string->str = &string->len;
 
-            v.type = VMValue::Type::object;
-            v.value.object = string;
+            v = VMValue((void*)string);
         }
         else if (t == 'n') {
-            v.type = VMValue::Type::null;
+            v = VMValue();
         }
 		
 		return str;
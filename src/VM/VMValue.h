@@ -5,17 +5,34 @@
 #define Strela_VM_VMValue_h
 
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 
+/*
+ * Building with STRELA_NAN_BOXING packs a value into 8 bytes instead of 16: doubles are stored as they are
+ * and everything else lives in the payload of a negative quiet NaN. Integers that do not fit into 48 bits
+ * are boxed on the heap. The JITs and --emit-c address the 16 byte layout directly and are left out then.
+ */
+
 namespace Strela {
+    class GC;
     struct VMObject;
-    
+
     struct VMValue {
+        enum class Type {
+            null,
+            integer,
+            floating,
+            boolean,
+            object
+        };
+
         VMValue();
         explicit VMValue(int64_t val);
         explicit VMValue(double val);
         explicit VMValue(bool val);
         explicit VMValue(void* val);
+        static VMValue fromF32(float val);
 
         VMValue operator==(const VMValue& other) const;
         VMValue operator!=(const VMValue& other) const;
@@ -25,7 +42,7 @@ namespace Strela {
         VMValue operator>=(const VMValue& other) const;
         VMValue operator&&(const VMValue& other) const;
         VMValue operator||(const VMValue& other) const;
-        
+
         VMValue operator+(const VMValue& other) const;
         VMValue operator-(const VMValue& other) const;
         VMValue operator*(const VMValue& other) const;
@@ -37,6 +54,54 @@ namespace Strela {
         bool equals(const VMValue& other) const;
         std::string dump() const;
 
+        /*
+         * The getters reinterpret the 64 payload bits whatever the type is, like reading another member of the
+         * union would. Ptr64 loads a double field as an integer, for example, and AddF64 still reads it as f64.
+         */
+        Type getType() const;
+        /** The payload: the integer, the bits of a double, a zero extended f32 or boolean, or a pointer. */
+        uint64_t bits() const;
+        int64_t getInteger() const { return bits(); }
+        double getF64() const;
+        float getF32() const;
+        bool getBoolean() const { return (bits() & 0xff) != 0; }
+        void* getObject() const { return (void*)bits(); }
+        /** Heap memory the value keeps alive, null if none. */
+        void* getReference() const;
+        /** Points the value at ref, where the collector moved the memory getReference() returned. */
+        void setReference(void* ref);
+
+        void setInteger(int64_t val) { *this = VMValue(val); }
+        void setF64(double val) { *this = VMValue(val); }
+        void setF32(float val) { *this = fromF32(val); }
+        void setBoolean(bool val) { *this = VMValue(val); }
+
+#ifdef STRELA_NAN_BOXING
+        /** Collector that boxes integers belong to. Boxes made while it is null are never freed. */
+        static GC* boxHeap;
+
+    private:
+        static const uint64_t tagShift = 48;
+        static const uint64_t payloadMask = (uint64_t(1) << tagShift) - 1;
+        // doubles never reach these, every NaN is stored as the canonical positive one
+        static const uint64_t nullTag = 0xfff9;
+        static const uint64_t booleanTag = 0xfffa;
+        static const uint64_t integerTag = 0xfffb;
+        static const uint64_t objectTag = 0xfffc;
+        static const uint64_t boxTag = 0xfffd;
+        static const uint64_t f32Tag = 0xfffe;
+
+        static VMValue tagged(uint64_t tag, uint64_t payload) {
+            VMValue v;
+            v.raw = tag << tagShift | (payload & payloadMask);
+            return v;
+        }
+
+        uint64_t tag() const { return raw >> tagShift; }
+        static void* boxInteger(int64_t val);
+
+        uint64_t raw;
+#else
         union {
             int64_t integer;
             float f32;
@@ -45,18 +110,113 @@ namespace Strela {
             void* object;
         } value;
 
-        enum class Type {
-            null,
-            integer,
-            floating,
-            boolean,
-            object
-        } type;
+        Type type;
+#endif
     };
 
+#ifdef STRELA_NAN_BOXING
+    inline VMValue::VMValue(): raw(nullTag << tagShift) {}
+
+	inline VMValue::VMValue(int64_t val) {
+        if (((val << 16) >> 16) == val) {
+            raw = integerTag << tagShift | (uint64_t(val) & payloadMask);
+        }
+        else {
+            raw = boxTag << tagShift | uint64_t(boxInteger(val));
+        }
+    }
+
+	inline VMValue::VMValue(double val) {
+        if (val != val) {
+            raw = 0x7ff8000000000000;
+        }
+        else {
+            memcpy(&raw, &val, sizeof(raw));
+        }
+    }
+
+	inline VMValue::VMValue(bool val): raw(booleanTag << tagShift | val) {}
+	inline VMValue::VMValue(void* val): raw(objectTag << tagShift | uint64_t(val)) {}
+
+    inline VMValue VMValue::fromF32(float val) {
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof(bits));
+        return tagged(f32Tag, bits);
+    }
+
+    inline VMValue::Type VMValue::getType() const {
+        switch (tag()) {
+            case nullTag: return Type::null;
+            case booleanTag: return Type::boolean;
+            case integerTag: case boxTag: return Type::integer;
+            case objectTag: return Type::object;
+            default: return Type::floating;
+        }
+    }
+
+    inline uint64_t VMValue::bits() const {
+        if (tag() == integerTag) {
+            return int64_t(raw << 16) >> 16;
+        }
+        switch (tag()) {
+            case nullTag: return 0;
+            case boxTag: return *(const int64_t*)(raw & payloadMask);
+            case booleanTag: case objectTag: case f32Tag: return raw & payloadMask;
+            default: return raw;
+        }
+    }
+
+    inline double VMValue::getF64() const {
+        double d;
+        if (tag() < nullTag) {
+            memcpy(&d, &raw, sizeof(d));
+        }
+        else {
+            auto b = bits();
+            memcpy(&d, &b, sizeof(d));
+        }
+        return d;
+    }
+
+    inline float VMValue::getF32() const {
+        auto b = uint32_t(bits());
+        float f;
+        memcpy(&f, &b, sizeof(f));
+        return f;
+    }
+
+    inline void* VMValue::getReference() const {
+        return tag() == objectTag || tag() == boxTag ? (void*)(raw & payloadMask) : nullptr;
+    }
+
+    inline void VMValue::setReference(void* ref) {
+        raw = (raw & ~payloadMask) | uint64_t(ref);
+    }
+#else
+    inline VMValue::VMValue(): type(Type::null) { value.integer = 0; }
+	inline VMValue::VMValue(int64_t val) : type(Type::integer) { value.integer = val; }
+	inline VMValue::VMValue(double val) : type(Type::floating) { value.f64 = val; }
+	inline VMValue::VMValue(bool val) : type(Type::boolean) { value.integer = 0; value.boolean = val; }
+	inline VMValue::VMValue(void* val) : type(Type::object) { value.object = val; }
+
+    inline VMValue VMValue::fromF32(float val) {
+        VMValue v;
+        v.value.f32 = val;
+        v.type = Type::floating;
+        return v;
+    }
+
+    inline VMValue::Type VMValue::getType() const { return type; }
+    inline uint64_t VMValue::bits() const { return value.integer; }
+    inline double VMValue::getF64() const { return value.f64; }
+    inline float VMValue::getF32() const { return value.f32; }
+    inline void* VMValue::getReference() const { return type == Type::object ? value.object : nullptr; }
+    inline void VMValue::setReference(void* ref) { value.object = ref; }
+#endif
+
     std::ostream& operator<<(std::ostream& str, const VMValue&);
     std::istream& operator>>(std::istream& str, VMValue&);
 
 }
 
-#endif
\ No newline at end of file
+#endif
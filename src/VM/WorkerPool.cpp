@@ -0,0 +1,58 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#include "WorkerPool.h"
+
+namespace Strela {
+    WorkerPool::WorkerPool(size_t count): count(count ? count : 1) {
+        for (size_t i = 1; i < this->count; ++i) {
+            threads.emplace_back(&WorkerPool::work, this, i);
+        }
+    }
+
+    WorkerPool::~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto&& thread: threads) {
+            thread.join();
+        }
+    }
+
+    void WorkerPool::run(const std::function<void(size_t worker)>& job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->job = &job;
+            running = threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+
+        job(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return running == 0; });
+        this->job = nullptr;
+    }
+
+    void WorkerPool::work(size_t worker) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this, seen] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            auto current = job;
+
+            lock.unlock();
+            (*current)(worker);
+            lock.lock();
+
+            if (--running == 0) {
+                done.notify_one();
+            }
+        }
+    }
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2018 Stephan Unverwerth
+// This code is licensed under MIT license (See LICENSE for details)
+
+#ifndef Strela_VM_WorkerPool_h
+#define Strela_VM_WorkerPool_h
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Strela {
+    /**
+     * Threads the GC spreads its work over. run() calls a job once on every worker and returns when all
+     * of them are done. The calling thread is worker 0, the others wait for the next job in between.
+     */
+    class WorkerPool {
+    public:
+        explicit WorkerPool(size_t count);
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        size_t size() const { return count; }
+        void run(const std::function<void(size_t worker)>& job);
+
+    private:
+        void work(size_t worker);
+
+    private:
+        size_t count;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(size_t)>* job = nullptr;
+        /** Counts the jobs started, so a waking worker can tell a new job from a spurious wakeup. */
+        uint64_t generation = 0;
+        size_t running = 0;
+        bool stopping = false;
+    };
+}
+
+#endif
@@ -9,18 +9,26 @@
 #include "NameResolver.h"
 #include "TypeChecker.h"
 #include "ByteCodeCompiler.h"
+#include "RegisterCompiler.h"
 #include "Scope.h"
 #include "VM/VM.h"
+#include "VM/JIT.h"
 #include "VM/ByteCodeChunk.h"
+#include "VM/OpcodeProfile.h"
 #include "Decompiler.h"
+#include "CEmitter.h"
 #include "SourceFile.h"
 #include "VM/Debugger.h"
+#include "VM/Builtins.h"
 
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
 #include <algorithm>
 #include <cstring>
+#include <chrono>
+#include <memory>
 
 using namespace Strela;
 
@@ -55,65 +63,26 @@ void help() {
     std::cout << "    --timeout <sec>    kills the running program after <sec> seconds.\n";
     std::cout << "    --search <path>    sets additional search path <path> for imports.\n";
     std::cout << "    --write-bytecode <file>    writes compiled bytecode to <file> and exits.\n";
-}
-
-template<typename T> T& objectField(void* obj, size_t offset) {
-	return *(T*)((char*)obj + offset);
-}
-
-void String_eq_String(Strela::VM& vm) {
-	auto other = vm.pop();
-	auto self = vm.pop();
-
-	auto str1 = objectField<const char*>(self.value.object, 0) + 8;
-	auto len1 = *objectField<uint64_t*>(self.value.object, 0);
-
-	auto str2 = objectField<const char*>(other.value.object, 0) + 8;
-	auto len2 = *objectField<uint64_t*>(other.value.object, 0);
-
-	vm.push(VMValue(len1 == len2 && !strcmp(str1, str2)));
-}
-
-VMType* stringType = nullptr;
-VMType* u8Type = nullptr;
-
-void String_plus_String(Strela::VM& vm) {
-	auto other = vm.pop();
-	auto self = vm.pop();
-
-	auto str1 = objectField<const char*>(self.value.object, 0) + 8;
-	auto len1 = *objectField<uint64_t*>(self.value.object, 0) - 1;
-
-	auto str2 = objectField<const char*>(other.value.object, 0) + 8;
-	auto len2 = *objectField<uint64_t*>(other.value.object, 0) - 1;
-
-	if (!stringType) {
-		for (auto& type : vm.chunk.types) {
-			if (type->name == "String") {
-				stringType = type;
-				break;
-			}
-		}
-	}
-
-	if (!u8Type) {
-		for (auto& type : vm.chunk.types) {
-			if (type->name == "u8[]") {
-				u8Type = type;
-				break;
-			}
-		}
-	}
-
-	auto newStr = vm.gc.allocObject(stringType);
-	auto newArr = vm.gc.allocArray(u8Type, len1 + len2 + 1);
-
-	objectField<void*>(newStr, 0) = newArr;
-	auto str = &objectField<char>(newArr, 8);
-	memcpy(str, str1, len1);
-	memcpy(str + len1, str2, len2);
-
-	vm.push(VMValue(newStr));
+    std::cout << "    --emit-c <file>    translates the program to C source linked against libstrela.a and exits.\n";
+    std::cout << "    --stats            prints executed instruction count and timing to stderr on exit.\n";
+    std::cout << "    --stack-size <n>   sets the maximum number of value stack slots (default 1048576).\n";
+    std::cout << "    --registers        compiles arithmetic on locals to the register based instruction set.\n";
+    std::cout << "    --opcode-pairs     runs the program and prints the most frequently executed opcode sequences to stderr.\n";
+    std::cout << "    --jit              compiles frequently called functions to machine code (x86-64 only).\n";
+    std::cout << "    --jit-threshold <n>    number of calls before a function is compiled (default 100).\n";
+    std::cout << "    --jit-trace        compiles traces of hot loops to machine code (x86-64 only).\n";
+    std::cout << "    --jit-trace-threshold <n>    number of iterations before a loop is traced (default 50).\n";
+    std::cout << "    --gc-generational  allocates new objects in a nursery that is collected separately.\n";
+    std::cout << "    --gc-nursery <bytes>    sets the nursery size and enables --gc-generational (default 4194304).\n";
+    std::cout << "    --gc-min-heap <bytes>   heap size below which no full collection happens (default 1048576).\n";
+    std::cout << "    --gc-growth <factor>    lets the heap grow to <factor> times the live bytes before the next full collection (default 2).\n";
+    std::cout << "    --gc-max-heap <bytes>   stops the program when more than <bytes> stay alive (default unlimited).\n";
+    std::cout << "    --gc-threads <n>   marks the heap with <n> threads (default 1).\n";
+    std::cout << "    --gc-max-pause-us <us>  collects the heap in steps of at most <us> microseconds while the program runs.\n";
+    std::cout << "    --gc-compact       slides live objects together when full collections leave the heap fragmented.\n";
+    std::cout << "    --prefork <n>      lets prefork() fork <n> worker processes that share the heap built up to the call.\n";
+    std::cout << "    --compressed-refs  stores references in objects and arrays as 32 bit offsets into a heap of at most 32 GB.\n";
+    std::cout << "    --gc-stats         prints collection counts, pause times and heap sizes to stderr on exit.\n";
 }
 
 Scope* makeGlobalScope() {
@@ -189,9 +158,33 @@ Scope* makeGlobalScope() {
 	auto plus = ClassDecl::String->getMethods("+")[0]->as<FuncDecl>();
 	plus->builtin = String_plus_String;
 
+    for (auto& fun: module->functions) {
+        if (fun->name == "prefork") {
+            fun->builtin = prefork;
+        }
+    }
+
 	return globals;
 }
 
+/** With --gc-stats, workers tell how much of their memory they still share with the parent, where Linux reports it. */
+void printSharing(std::ostream& out, int64_t worker) {
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    if (!smaps.good()) return;
+    size_t rss = 0, shared = 0, priv = 0;
+    std::string line;
+    while (std::getline(smaps, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        size_t kb = 0;
+        fields >> key >> kb;
+        if (key == "Rss:") rss = kb;
+        else if (key == "Shared_Clean:" || key == "Shared_Dirty:") shared += kb;
+        else if (key == "Private_Clean:" || key == "Private_Dirty:") priv += kb;
+    }
+    out << "worker " << worker << ": " << rss << " kB resident, " << shared << " kB shared, " << priv << " kB private\n";
+}
+
 std::string normalizePath(const std::string& path) {
     if (path.empty()) return "./";
     if (path.back() != '/' && path.back() != '\\') {
@@ -266,16 +259,100 @@ int main(int argc, char** argv) {
 
     std::string fileName;
     std::string byteCodePath;
+    std::string cPath;
     std::vector<std::string> arguments;
     
     bool dump = false;
     bool pretty = false;
+    bool stats = false;
+    bool registers = false;
+    bool opcodePairs = false;
+    bool jit = false;
+    uint32_t jitThreshold = 100;
+    bool jitTrace = false;
+    uint32_t jitTraceThreshold = 50;
+    size_t stackSize = VM::defaultStackSize;
+    bool generational = false;
+    size_t nurserySize = GC::defaultNurserySize;
+    size_t minHeap = GC::defaultMinHeap;
+    double heapGrowth = 2.0;
+    size_t maxHeap = 0;
+    size_t gcThreads = 1;
+    size_t maxPauseUs = 0;
+    bool compaction = false;
+    bool gcStats = false;
+    size_t preforkWorkers = 0;
+    bool compressedRefs = false;
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "--dump")) dump = true;
         else if (!strcmp(argv[i], "--pretty")) pretty = true;
+        else if (!strcmp(argv[i], "--stats")) stats = true;
+        else if (!strcmp(argv[i], "--registers")) registers = true;
+        else if (!strcmp(argv[i], "--opcode-pairs")) opcodePairs = true;
+        else if (!strcmp(argv[i], "--jit")) jit = true;
+        else if (!strcmp(argv[i], "--jit-threshold")) {
+            jitThreshold = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--jit-trace")) jitTrace = true;
+        else if (!strcmp(argv[i], "--jit-trace-threshold")) {
+            jitTraceThreshold = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--gc-generational")) generational = true;
+        else if (!strcmp(argv[i], "--gc-nursery")) {
+            generational = true;
+            nurserySize = std::strtoull(argv[++i], nullptr, 10);
+            if (nurserySize < 64 * 1024) {
+                error("--gc-nursery must be at least 65536 bytes.");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--gc-min-heap")) {
+            minHeap = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--gc-growth")) {
+            heapGrowth = std::strtod(argv[++i], nullptr);
+            if (heapGrowth < 1) {
+                error("--gc-growth must be at least 1.");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--gc-max-heap")) {
+            maxHeap = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--gc-threads")) {
+            gcThreads = std::strtoull(argv[++i], nullptr, 10);
+            if (gcThreads == 0) {
+                error("--gc-threads must be at least 1.");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--gc-max-pause-us")) {
+            maxPauseUs = std::strtoull(argv[++i], nullptr, 10);
+            if (maxPauseUs == 0) {
+                error("--gc-max-pause-us must be at least 1.");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--gc-compact")) compaction = true;
+        else if (!strcmp(argv[i], "--gc-stats")) gcStats = true;
+        else if (!strcmp(argv[i], "--compressed-refs")) compressedRefs = true;
+        else if (!strcmp(argv[i], "--prefork")) {
+            preforkWorkers = std::strtoull(argv[++i], nullptr, 10);
+            if (preforkWorkers == 0) {
+                error("--prefork must be at least 1.");
+                return 1;
+            }
+        }
         else if (!strcmp(argv[i], "--timeout")) {
             g_timeout = std::strtol(argv[++i], nullptr, 10) * 1000;
         }
+        else if (!strcmp(argv[i], "--stack-size")) {
+            stackSize = std::strtoull(argv[++i], nullptr, 10);
+            if (stackSize == 0) {
+                error("--stack-size must be a positive number of slots.");
+                return 1;
+            }
+        }
         else if (!strcmp(argv[i], "--search")) {
             g_searchPath = argv[++i];
             g_searchPath = normalizePath(g_searchPath);
@@ -283,6 +360,9 @@ int main(int argc, char** argv) {
         else if (!strcmp(argv[i], "--write-bytecode")) {
             byteCodePath = argv[++i];
         }
+        else if (!strcmp(argv[i], "--emit-c")) {
+            cPath = argv[++i];
+        }
         else if (!strcmp(argv[i], "--debug")) {
             g_debugPort = std::strtoul(argv[++i], nullptr, 10);
         }
@@ -295,6 +375,27 @@ int main(int argc, char** argv) {
         }
     }
     
+    if (generational && maxPauseUs) {
+        error("--gc-max-pause-us does not work with --gc-generational.");
+        return 1;
+    }
+    if (compaction && maxPauseUs) {
+        error("--gc-max-pause-us does not work with --gc-compact.");
+        return 1;
+    }
+#ifdef STRELA_NAN_BOXING
+    // a frame record keeps bp above frameIpBits bits, it has to stay within the payload of an unboxed integer
+    size_t maxStackSize = (size_t(1) << (47 - VM::frameIpBits)) - VM::stackRedZone;
+    if (stackSize > maxStackSize) {
+        error("--stack-size must be at most " + std::to_string(maxStackSize) + " slots in builds with NaN boxed values.");
+        return 1;
+    }
+#endif
+    if ((jit || jitTrace) && !JIT::supported()) {
+        error("--jit and --jit-trace need an x86-64 build for Linux or macOS with 16 byte values, this build only interprets.");
+        return 1;
+    }
+
     if (fileName.empty()) {
         error("Expected file name as last cmd line argument.");
         help();
@@ -310,6 +411,7 @@ int main(int argc, char** argv) {
         }
 
         ByteCodeChunk chunk;
+        chunk.compressedReferences = compressedRefs;
 
         // treat as bytecode
         bool isSourcecode = fileName.rfind(".strela") != std::string::npos;
@@ -414,9 +516,9 @@ int main(int argc, char** argv) {
             if (errors) bail();
 
             //std::cout << "Compiling bytecode...\n";
-            ByteCodeCompiler compiler(chunk);
-            compiler.compile(*module);
-            if (compiler.hadErrors()) bail();
+            std::unique_ptr<ByteCodeCompiler> compiler(registers ? new RegisterCompiler(chunk) : new ByteCodeCompiler(chunk));
+            compiler->compile(*module);
+            if (compiler->hadErrors()) bail();
 
             if (!byteCodePath.empty()) {
                 std::ofstream outbin(byteCodePath, std::ios::binary);
@@ -438,13 +540,68 @@ int main(int argc, char** argv) {
             return 0;
         }
 
-		VM vm(chunk, arguments);
+        if (!cPath.empty()) {
+            if (!isSourcecode) {
+                error("--emit-c needs a source file, bytecode files do not carry type information.");
+                return 1;
+            }
+#ifdef STRELA_NAN_BOXING
+            error("--emit-c is not available in builds with NaN boxed values.");
+            return 1;
+#endif
+            if (compressedRefs) {
+                error("--emit-c does not work with --compressed-refs.");
+                return 1;
+            }
+            std::ofstream outc(cPath, std::ios::binary);
+            CEmitter(chunk).emit(outc);
+            return 0;
+        }
+
+		VM vm(chunk, arguments, stackSize);
         if (g_debugPort > 0) {
             Debugger dbg(g_debugPort, vm);
 			return dbg.run();
         }
 		else {
-			return vm.run();
+			vm.gc.minHeap = minHeap;
+			vm.gc.growth = heapGrowth;
+			vm.gc.maxHeap = maxHeap;
+			vm.gc.setThreads(gcThreads);
+			vm.gc.maxPauseUs = maxPauseUs;
+			vm.gc.compaction = compaction;
+			vm.preforkWorkers = preforkWorkers;
+			if (gcStats) {
+				vm.gc.log = &std::cerr;
+			}
+			if (generational) {
+				vm.gc.enableGenerations(nurserySize);
+			}
+			if (jit) {
+				vm.enableJit(jitThreshold);
+			}
+			if (jitTrace) {
+				vm.enableTracing(jitTraceThreshold);
+			}
+			auto start = std::chrono::steady_clock::now();
+			OpcodeProfile profile;
+			auto exitCode = opcodePairs ? vm.run(profile) : vm.run();
+			if (opcodePairs) {
+				profile.print(std::cerr);
+			}
+			if (stats) {
+				auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+				std::cerr << "executed " << vm.numOps << " instructions in " << ms << " ms";
+				if (ms > 0) std::cerr << " (" << (vm.numOps / ms / 1000) << " MIPS)";
+				std::cerr << "\n";
+			}
+			if (gcStats) {
+				vm.gc.stats().print(std::cerr);
+				if (vm.worker >= 0) {
+					printSharing(std::cerr, vm.worker);
+				}
+			}
+			return exitCode;
 		}
     }
     catch (const Exception& e) {
@@ -1,6 +1,6 @@
 #!/bin/bash
 
-STRELA=Release/strela
+STRELA=${STRELA:-Release/strela}
 if [ $# -gt 0 ]; then
     if [ -d $1 ]; then
         DIR=$1
@@ -39,7 +39,30 @@ else
     MODNAME=`basename $1 .strela`
     DIRNAME=`dirname $1`
     printf "$1 "
-    if output=$($STRELA --search ./ --timeout 5 $1); then
+    if [ "$STRELA_CC" ]; then
+        # compile to C and run the native executable instead of the VM
+        TMP=`mktemp -d`
+        RUN="timeout 5 $TMP/$MODNAME"
+        if ! $STRELA --search ./ $STRELA_FLAGS --emit-c $TMP/$MODNAME.c $1 ||
+           ! $STRELA_CC -O2 -w -I src/VM $TMP/$MODNAME.c `dirname $STRELA`/libstrela.a -lstdc++ -lm -pthread -o $TMP/$MODNAME; then
+            rm -rf $TMP
+            echo -e "\033[31mError\033[0m"
+            exit -1
+        fi
+    else
+        # a "// flags:" line adds options the test is about, unless this build or STRELA_FLAGS rule them out
+        TEST_FLAGS=`sed -n 's#^// flags: *##p' $1`
+        if [ "$TEST_FLAGS" ] && ! $STRELA $STRELA_FLAGS $TEST_FLAGS 2>&1 | grep -q "Expected file name"; then
+            TEST_FLAGS=""
+        fi
+        RUN="$STRELA --search ./ --timeout 5 $STRELA_FLAGS $TEST_FLAGS $1"
+    fi
+    output=$($RUN)
+    status=$?
+    if [ "$TMP" ]; then
+        rm -rf $TMP
+    fi
+    if [ $status == 0 ]; then
         echo "$output" | diff -u --strip-trailing-cr $DIRNAME/$MODNAME.out - # &>/dev/null
         if [ $? == 0 ]; then
             echo -e "\033[32mOK\033[0m"